@@ -0,0 +1,70 @@
+//
+//  compaction.c
+//  Wonder
+//
+//  Checks that compaction archives only superseded and removed facts, including when
+//  facts on different items and attributes share a factId. Not part of the app target;
+//  build it from "ItemStore - C" with
+//
+//      cc -O2 -I. -o compaction Benchmarks/compaction.c istypes.c itemstore.c sldrive.c factcodec.c storetrace.c storealloc.c -lsqlite3 -lz -lm -lpthread
+//
+//  and run ./compaction; it exits 1 if any check fails.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sldrive.h"
+
+static int failures = 0;
+
+static void expectValue(CSLDatabase *db, const char *itemId, const char *attribute, const char *value) {
+    CFactsCollection *facts = csl_fetchFacts(db, itemId, attribute, NULL);
+    bool found = facts != NULL && facts->count == 1 && strcmp(facts->facts[0].value, value) == 0;
+
+    if (!found) {
+        fprintf(stderr, "FAIL %s.%s: expected only \"%s\", found %d facts\n", itemId, attribute, value, facts != NULL ? facts->count : -1);
+        failures++;
+    }
+
+    if (facts != NULL)
+        freeFactsCollection(facts);
+}
+
+int main(void) {
+    // openDatabase narrates to stdout
+    freopen("/dev/null", "w", stdout);
+
+    CSLDatabase *db = openDatabaseWithProfile("compaction", true, CSL_PROFILE_BALANCED);
+
+    // One factId, three live facts on different items and attributes
+    csl_insertFact(db, "shared", "item1", "title", "first", 0, "string", 0, "2020-01-01T00:00:00Z");
+    csl_insertFact(db, "shared", "item2", "title", "second", 0, "string", 0, "2020-01-02T00:00:00Z");
+    csl_insertFact(db, "shared", "item1", "color", "red", 0, "string", 0, "2020-01-03T00:00:00Z");
+
+    // A fact updated once, so its first row is superseded
+    csl_insertFact(db, "updated", "item3", "title", "old", 0, "string", 0, "2020-01-01T00:00:00Z");
+    csl_insertFact(db, "updated", "item3", "title", "new", 0, "string", 0, "2020-01-02T00:00:00Z");
+
+    CRetentionPolicy policy;
+    initRetentionPolicy(&policy);
+
+    long long archived = csl_compact(db, &policy);
+
+    if (archived != 1) {
+        fprintf(stderr, "FAIL archived %lld facts, expected 1\n", archived);
+        failures++;
+    }
+
+    expectValue(db, "item1", "title", "first");
+    expectValue(db, "item2", "title", "second");
+    expectValue(db, "item1", "color", "red");
+    expectValue(db, "item3", "title", "new");
+
+    closeDatabase(db);
+
+    fprintf(stderr, failures == 0 ? "compaction: ok\n" : "compaction: %d failed\n", failures);
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+//
+//  profiles.c
+//  Wonder
+//
+//  Times each drive profile over the same workloads, on fresh on-disk drives.
+//  Not part of the app target; build it from "ItemStore - C" with
+//
+//      cc -O2 -I. -o profiles Benchmarks/profiles.c istypes.c itemstore.c sldrive.c factcodec.c storetrace.c storealloc.c -lsqlite3 -lz -lm -lpthread
+//
+//  and run ./profiles [directory] (the drives are created there, default /tmp).
+//  Results are recorded in notes.md.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sldrive.h"
+
+#define SINGLE_INSERTS 1000
+#define BULK_FACTS 50000
+#define ITEMS 5000
+#define POINT_READS 2000
+#define SEARCHES 200
+#define REOPENS 50
+
+static double secondsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *titleWords[] = { "garden", "notes", "meeting", "recipe", "travel", "invoice", "project", "reading" };
+
+static void fillFact(CFact *fact, char *factId, char *itemId, char *value, char *timestamp, int i) {
+    sprintf(factId, "fact-%d", i);
+    sprintf(itemId, "item-%d", i % ITEMS);
+    sprintf(value, "%s %s %d", titleWords[i % 8], titleWords[(i / 8) % 8], i);
+    sprintf(timestamp, "2024-01-%02d %02d:%02d:%02d.000", 1 + i / 86400 % 28, i / 3600 % 24, i / 60 % 60, i % 60);
+
+    initFact(fact);
+    fact->factId = factId;
+    fact->itemId = itemId;
+    fact->attribute = (i % 3 == 0) ? "type" : "title";
+    fact->value = value;
+    fact->type = "string";
+    fact->timestamp = timestamp;
+}
+
+static void benchmarkProfile(FILE *table, const char *directory, CSLDriveProfile profile) {
+    const CSLProfileSettings *settings = csl_profileSettings(profile);
+    char path[512];
+    char file[600];
+
+    snprintf(path, sizeof(path), "%s/profile-bench-%s", directory, settings->name);
+
+    const char *suffixes[] = { ".sqlite", ".sqlite-wal", ".sqlite-shm", ".sqlite-journal" };
+
+    for (int i = 0; i < 4; i++) {
+        snprintf(file, sizeof(file), "%s%s", path, suffixes[i]);
+        remove(file);
+    }
+
+    CSLDatabase *db = openDatabaseWithProfile(path, false, profile);
+
+    if (db == NULL) {
+        fprintf(stderr, "Couldn't open %s\n", path);
+        return;
+    }
+
+    char factId[32], itemId[32], value[64], timestamp[32];
+    CFact fact;
+
+    // One transaction per fact, as the app inserts while editing
+    double startedAt = secondsNow();
+
+    for (int i = 0; i < SINGLE_INSERTS; i++) {
+        fillFact(&fact, factId, itemId, value, timestamp, BULK_FACTS + i);
+        csl_insertFact(db, fact.factId, fact.itemId, fact.attribute, fact.value, 0, fact.type, 0, fact.timestamp);
+    }
+
+    double singleInsert = (secondsNow() - startedAt) / SINGLE_INSERTS * 1e6;
+
+    // A provider's first import
+    CFact *facts = malloc(BULK_FACTS * sizeof(CFact));
+    char (*strings)[4][64] = malloc(BULK_FACTS * sizeof(*strings));
+
+    for (int i = 0; i < BULK_FACTS; i++) {
+        fillFact(&facts[i], strings[i][0], strings[i][1], strings[i][2], strings[i][3], i);
+    }
+
+    startedAt = secondsNow();
+
+    csl_beginBulkLoad(db);
+    csl_bulkInsertFacts(db, facts, BULK_FACTS);
+    csl_endBulkLoad(db);
+
+    double bulkLoad = BULK_FACTS / (secondsNow() - startedAt);
+
+    free(facts);
+    free(strings);
+
+    startedAt = secondsNow();
+
+    for (int i = 0; i < POINT_READS; i++) {
+        sprintf(itemId, "item-%d", (i * 7919) % ITEMS);
+        freeFactsCollection(csl_fetchFacts(db, itemId, NULL, NULL));
+    }
+
+    double pointRead = (secondsNow() - startedAt) / POINT_READS * 1e6;
+
+    startedAt = secondsNow();
+
+    for (int i = 0; i < SEARCHES; i++) {
+        freeSearchResults(csl_searchText(db, titleWords[i % 8], true, 20));
+    }
+
+    double search = (secondsNow() - startedAt) / SEARCHES * 1e6;
+
+    closeDatabase(db);
+
+    startedAt = secondsNow();
+
+    for (int i = 0; i < REOPENS; i++) {
+        closeDatabase(openDatabaseWithProfile(path, false, profile));
+    }
+
+    double reopen = (secondsNow() - startedAt) / REOPENS * 1e6;
+
+    fprintf(table, "| %-9s | %13.1f | %14.0f | %13.1f | %12.1f | %13.1f |\n", settings->name, singleInsert, bulkLoad, pointRead, search, reopen);
+    fflush(table);
+}
+
+int main(int argc, char **argv) {
+    const char *directory = argc > 1 ? argv[1] : "/tmp";
+
+    // openDatabase narrates to stdout; keep it out of the table
+    FILE *table = fdopen(dup(fileno(stdout)), "w");
+    freopen("/dev/null", "w", stdout);
+
+    fprintf(table, "| profile   | insert (us/f) | bulk (facts/s) | point read us | search us/q  | reopen us     |\n");
+    fprintf(table, "|-----------|---------------|----------------|---------------|--------------|---------------|\n");
+    fflush(table);
+
+    for (int profile = 0; profile < CSL_PROFILE_COUNT; profile++) {
+        benchmarkProfile(table, directory, profile);
+    }
+
+    return 0;
+}
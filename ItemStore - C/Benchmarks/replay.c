@@ -0,0 +1,270 @@
+//
+//  replay.c
+//  Wonder
+//
+//  Re-runs a workload trace (see startRecording) against the item store and compares
+//  each call type's latencies with the recording's. Not part of the app target; build it
+//  from "ItemStore - C" with
+//
+//      cc -O2 -I. -o replay Benchmarks/replay.c istypes.c itemstore.c sldrive.c factcodec.c storetrace.c storealloc.c -lsqlite3 -lz -lm -lpthread
+//
+//  and run ./replay [-paced] [-memory] [-leaks] [-drives directory] trace
+//
+//      -paced    start each call at its recorded offset, rather than as soon as the last returns
+//      -memory   replay against fresh in-memory drives
+//      -leaks    with the store built with -DSTORE_ALLOC_STATS, fail (exit 2) if any call leaves
+//                allocations behind once its result is freed; runs with the query cache off,
+//                since cached results are meant to outlive the call
+//      -drives   open userDrive and systemDrive in directory (default the current one): a copy
+//                of the drives the trace was recorded against, or an empty directory for fresh ones
+//
+//  Replay writes to the drives, so point it at a copy. Result counts that differ from the
+//  recording's are counted as mismatches; a fresh drive only matches a trace that starts empty.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "itemstore.h"
+#include "storetrace.h"
+
+typedef struct {
+    uint64_t *recorded;
+    uint64_t *replayed;
+    int count;
+    int capacity;
+    int mismatches;
+    int cached; // answered by the query cache while recording
+    long long leaked; // allocations left behind (-leaks)
+    int leakingCalls;
+} CallTimings;
+
+static void sleepUntil(uint64_t nanoseconds) {
+    uint64_t now = storeTraceNanoseconds();
+
+    if (nanoseconds <= now) {
+        return;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = (nanoseconds - now) / 1000000000ull;
+    ts.tv_nsec = (nanoseconds - now) % 1000000000ull;
+    nanosleep(&ts, NULL);
+}
+
+static void addTiming(CallTimings *timings, uint64_t recorded, uint64_t replayed) {
+    if (timings->count == timings->capacity) {
+        timings->capacity = timings->capacity > 0 ? timings->capacity * 2 : 256;
+        timings->recorded = realloc(timings->recorded, timings->capacity * sizeof(uint64_t));
+        timings->replayed = realloc(timings->replayed, timings->capacity * sizeof(uint64_t));
+    }
+
+    timings->recorded[timings->count] = recorded;
+    timings->replayed[timings->count] = replayed;
+    timings->count++;
+}
+
+/// @brief Runs one recorded call, returning the size of its result.
+static uint64_t replayCall(const StoreTraceRecord *record) {
+    uint64_t resultCount = 0;
+
+    switch (record->call) {
+        case STORE_TRACE_INSERT_FACT:
+            insertFact(record->drives == ITEM_STORE_SYSTEM_DRIVE ? itemStore.systemDrive : itemStore.userDrive,
+                       record->factId, record->itemId, record->attribute, record->value,
+                       record->numericalValue, record->type, record->flags, record->timestamp);
+            break;
+        case STORE_TRACE_FETCH_FACTS: {
+            CFactsQuery query = {
+                .itemId = record->itemId, .attribute = record->attribute, .value = record->value,
+                .hasValueRange = record->hasValueRange,
+                .valueAtOrAbove = record->valueAtOrAbove, .valueAtOrBelow = record->valueAtOrBelow,
+                .drives = record->drives
+            };
+            CFactsCollection *facts = fetchFacts(query);
+            resultCount = facts != NULL ? facts->count : 0;
+            freeFactsCollection(facts);
+            break;
+        }
+        case STORE_TRACE_FETCH_FACTS_BY_DATE: {
+            CFactsCollection *facts = fetchFactsByDate(record->createdAtOrAfter, record->createdAtOrBefore);
+            resultCount = facts != NULL ? facts->count : 0;
+            freeFactsCollection(facts);
+            break;
+        }
+        case STORE_TRACE_FETCH_ITEM_AS_OF: {
+            CFactsCollection *facts = fetchItemAsOf(record->itemId, record->timestamp);
+            resultCount = facts != NULL ? facts->count : 0;
+            freeFactsCollection(facts);
+            break;
+        }
+        case STORE_TRACE_SEARCH_ITEMS: {
+            CSearchResults *results = searchItems(record->value, record->prefix, record->limit);
+            resultCount = results->count;
+            freeSearchResults(results);
+            break;
+        }
+        default:
+            break;
+    }
+
+    return resultCount;
+}
+
+static int compareDurations(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/// @brief The percentile of sorted durations, in microseconds.
+static double percentile(const uint64_t *durations, int count, int percent) {
+    return durations[(long)(count - 1) * percent / 100] / 1e3;
+}
+
+int main(int argc, char **argv) {
+    bool paced = false;
+    bool inMemory = false;
+    bool leaks = false;
+    const char *directory = NULL;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-paced") == 0) {
+            paced = true;
+        }
+        else if (strcmp(argv[i], "-memory") == 0) {
+            inMemory = true;
+        }
+        else if (strcmp(argv[i], "-leaks") == 0) {
+            leaks = true;
+        }
+        else if (strcmp(argv[i], "-drives") == 0 && i + 1 < argc) {
+            directory = argv[++i];
+        }
+        else {
+            path = argv[i];
+        }
+    }
+
+    if (path == NULL) {
+        fprintf(stderr, "usage: replay [-paced] [-memory] [-leaks] [-drives directory] trace\n");
+        return 1;
+    }
+
+    if (leaks && !storeAllocStatsEnabled()) {
+        fprintf(stderr, "-leaks needs the store built with -DSTORE_ALLOC_STATS\n");
+        return 1;
+    }
+
+    FILE *in = fopen(path, "rb");
+    StoreTraceReader reader;
+
+    if (in == NULL || !initStoreTraceReader(&reader, in)) {
+        fprintf(stderr, "Couldn't read a trace from %s\n", path);
+        return 1;
+    }
+
+    if (directory != NULL && chdir(directory) != 0) {
+        fprintf(stderr, "Couldn't open %s\n", directory);
+        return 1;
+    }
+
+    // openDatabase narrates to stdout; keep it out of the table
+    FILE *table = fdopen(dup(fileno(stdout)), "w");
+    freopen("/dev/null", "w", stdout);
+
+    initItemStore(inMemory);
+
+    if (leaks) {
+        setQueryCacheCapacity(0);
+    }
+
+    CallTimings timings[STORE_TRACE_CALL_COUNT] = { 0 };
+    StoreTraceRecord record;
+    int status;
+    uint64_t replayStartedAt = storeTraceNanoseconds();
+
+    while ((status = readStoreTraceRecord(&reader, &record)) == 1) {
+        if (paced) {
+            sleepUntil(replayStartedAt + record.startedAt);
+        }
+
+        CStoreAllocStats before, after;
+        snapshotStoreAllocStats(&before);
+
+        uint64_t startedAt = storeTraceNanoseconds();
+        uint64_t resultCount = replayCall(&record);
+        uint64_t duration = storeTraceNanoseconds() - startedAt;
+
+        snapshotStoreAllocStats(&after);
+
+        CallTimings *call = &timings[record.call];
+        addTiming(call, record.duration, duration);
+
+        if (leaks && after.liveAllocations > before.liveAllocations) {
+            call->leaked += after.liveAllocations - before.liveAllocations;
+            call->leakingCalls++;
+        }
+
+        if (resultCount != record.resultCount) {
+            call->mismatches++;
+        }
+
+        if (record.cached) {
+            call->cached++;
+        }
+    }
+
+    double elapsed = (storeTraceNanoseconds() - replayStartedAt) / 1e9;
+
+    freeItemStore();
+    freeStoreTraceReader(&reader);
+    fclose(in);
+
+    if (status < 0) {
+        fprintf(stderr, "The trace ends early; replayed the calls before that\n");
+    }
+
+    fprintf(table, "%s, %s, %.2f s\n\n", paced ? "paced" : "full speed", inMemory ? "in memory" : "on disk", elapsed);
+
+    bool leaked = false;
+    fprintf(table, "| call             | calls  | cached | recorded p50/p90/p99 us  | replayed p50/p90/p99 us  | max us    | mismatches |\n");
+    fprintf(table, "|------------------|--------|--------|--------------------------|--------------------------|-----------|------------|\n");
+
+    for (int c = STORE_TRACE_INSERT_FACT; c < STORE_TRACE_CALL_COUNT; c++) {
+        CallTimings *call = &timings[c];
+
+        if (call->count == 0) {
+            continue;
+        }
+
+        qsort(call->recorded, call->count, sizeof(uint64_t), compareDurations);
+        qsort(call->replayed, call->count, sizeof(uint64_t), compareDurations);
+
+        fprintf(table, "| %-16s | %6d | %6d | %7.1f %7.1f %8.1f | %7.1f %7.1f %8.1f | %9.1f | %10d |\n",
+                storeTraceCallName(c), call->count, call->cached,
+                percentile(call->recorded, call->count, 50), percentile(call->recorded, call->count, 90), percentile(call->recorded, call->count, 99),
+                percentile(call->replayed, call->count, 50), percentile(call->replayed, call->count, 90), percentile(call->replayed, call->count, 99),
+                call->replayed[call->count - 1] / 1e3, call->mismatches);
+
+        if (call->leakingCalls > 0) {
+            fprintf(stderr, "%s: %d of %d calls left %lld allocations behind\n", storeTraceCallName(c), call->leakingCalls, call->count, call->leaked);
+            leaked = true;
+        }
+
+        free(call->recorded);
+        free(call->replayed);
+    }
+
+    fclose(table);
+
+    if (leaked) {
+        return 2;
+    }
+
+    return status < 0 ? 1 : 0;
+}
@@ -0,0 +1,669 @@
+//
+//  factcodec.c
+//  Wonder
+//
+//  Versioned binary encoding for streams of facts, used by export/import and sync.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "factcodec.h"
+#include "storealloc.h"
+
+#define HEADER_FACT_ID_SHIFT 0
+#define HEADER_ITEM_ID_SHIFT 2
+#define HEADER_TIMESTAMP_SHIFT 4
+#define HEADER_HAS_NUMERICAL 0x80
+
+#define ID_FORM_STRING 0
+#define ID_FORM_UUID_LOWER 1
+#define ID_FORM_UUID_UPPER 2
+#define ID_FORM_PREVIOUS 3
+
+// Timestamp formats that round-trip exactly; anything else is written as text
+#define TIMESTAMP_RAW 0
+#define TIMESTAMP_SQLITE 1 // "YYYY-MM-DD HH:MM:SS"
+#define TIMESTAMP_SQLITE_MILLIS 2 // "YYYY-MM-DD HH:MM:SS.SSS"
+#define TIMESTAMP_ISO8601 3 // "YYYY-MM-DDTHH:MM:SSZ"
+#define TIMESTAMP_ISO8601_MILLIS 4 // "YYYY-MM-DDTHH:MM:SS.SSSZ"
+
+// MARK: - Primitives
+
+void writeFactCodecVarint(FILE* out, uint64_t value) {
+    uint8_t bytes[10];
+    int count = 0;
+
+    do {
+        bytes[count] = value & 0x7f;
+        value >>= 7;
+
+        if (value != 0) {
+            bytes[count] |= 0x80;
+        }
+
+        count++;
+    } while (value != 0);
+
+    fwrite(bytes, 1, count, out);
+}
+
+bool readFactCodecVarint(FILE* in, uint64_t* value) {
+    uint64_t result = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(in);
+
+        if (byte == EOF) {
+            return false;
+        }
+
+        result |= (uint64_t)(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int varintSize(uint64_t value) {
+    int size = 1;
+
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+
+    return size;
+}
+
+static void writeBytes(FactEncoder* encoder, const char* bytes, size_t length) {
+    writeFactCodecVarint(encoder->out, length);
+    fwrite(bytes, 1, length, encoder->out);
+    encoder->byteCount += varintSize(length) + length;
+}
+
+static void writeVarint(FactEncoder* encoder, uint64_t value) {
+    writeFactCodecVarint(encoder->out, value);
+    encoder->byteCount += varintSize(value);
+}
+
+static bool readBytes(FILE* in, FactCodecBuffer* buffer) {
+    uint64_t length;
+
+    if (!readFactCodecVarint(in, &length) || length > (1u << 30)) {
+        return false;
+    }
+
+    if (length + 1 > buffer->capacity) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity : 64;
+
+        while (capacity < length + 1) {
+            capacity *= 2;
+        }
+
+        char* bytes = realloc(buffer->bytes, capacity);
+        if (bytes == NULL) {
+            return false;
+        }
+
+        buffer->bytes = bytes;
+        buffer->capacity = capacity;
+    }
+
+    if (fread(buffer->bytes, 1, length, in) != length) {
+        return false;
+    }
+
+    buffer->bytes[length] = '\0';
+    return true;
+}
+
+static void ensureBuffer(FactCodecBuffer* buffer, size_t size) {
+    if (buffer->capacity < size) {
+        buffer->bytes = realloc(buffer->bytes, size);
+        buffer->capacity = size;
+    }
+}
+
+// MARK: - UUIDs
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/// @brief Parses a canonical 36-character UUID in a single case.
+/// @return The ID_FORM_UUID_* form, or ID_FORM_STRING if it isn't one.
+static int parseUUID(const char* text, uint8_t bytes[16]) {
+    if (strlen(text) != 36) {
+        return ID_FORM_STRING;
+    }
+
+    bool hasLower = false, hasUpper = false;
+    int byte = 0;
+
+    for (int i = 0; i < 36; ) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (text[i] != '-') return ID_FORM_STRING;
+            i++;
+            continue;
+        }
+
+        int high = hexValue(text[i]), low = hexValue(text[i + 1]);
+        if (high < 0 || low < 0) return ID_FORM_STRING;
+
+        for (int j = 0; j < 2; j++) {
+            hasLower |= text[i + j] >= 'a' && text[i + j] <= 'f';
+            hasUpper |= text[i + j] >= 'A' && text[i + j] <= 'F';
+        }
+
+        bytes[byte++] = (uint8_t)(high << 4 | low);
+        i += 2;
+    }
+
+    if (hasLower && hasUpper) {
+        return ID_FORM_STRING;
+    }
+
+    return hasUpper ? ID_FORM_UUID_UPPER : ID_FORM_UUID_LOWER;
+}
+
+static void formatUUID(const uint8_t bytes[16], bool upper, char text[37]) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    int position = 0;
+
+    for (int i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            text[position++] = '-';
+        }
+
+        text[position++] = digits[bytes[i] >> 4];
+        text[position++] = digits[bytes[i] & 0xf];
+    }
+
+    text[36] = '\0';
+}
+
+// MARK: - Timestamps
+
+static int64_t daysFromCivil(int64_t year, int month, int day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t yearOfEra = year - era * 400;
+    int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+
+    return era * 146097 + dayOfEra - 719468;
+}
+
+static void civilFromDays(int64_t days, int64_t* year, int* month, int* day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t dayOfEra = days - era * 146097;
+    int64_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int64_t monthPart = (5 * dayOfYear + 2) / 153;
+
+    *day = (int)(dayOfYear - (153 * monthPart + 2) / 5 + 1);
+    *month = (int)(monthPart < 10 ? monthPart + 3 : monthPart - 9);
+    *year = yearOfEra + era * 400 + (*month <= 2);
+}
+
+static void formatTimestamp(int64_t milliseconds, int format, char text[32]) {
+    int64_t seconds = milliseconds >= 0 ? milliseconds / 1000 : (milliseconds - 999) / 1000;
+    int millis = (int)(milliseconds - seconds * 1000);
+    int64_t days = seconds >= 0 ? seconds / 86400 : (seconds - 86399) / 86400;
+    int secondOfDay = (int)(seconds - days * 86400);
+
+    int64_t year;
+    int month, day;
+    civilFromDays(days, &year, &month, &day);
+
+    char separator = (format == TIMESTAMP_ISO8601 || format == TIMESTAMP_ISO8601_MILLIS) ? 'T' : ' ';
+    int length = snprintf(text, 32, "%04lld-%02d-%02d%c%02d:%02d:%02d", (long long)year, month, day, separator,
+                          secondOfDay / 3600, secondOfDay / 60 % 60, secondOfDay % 60);
+
+    if (format == TIMESTAMP_SQLITE_MILLIS || format == TIMESTAMP_ISO8601_MILLIS) {
+        length += snprintf(text + length, 32 - length, ".%03d", millis);
+    }
+
+    if (format == TIMESTAMP_ISO8601 || format == TIMESTAMP_ISO8601_MILLIS) {
+        snprintf(text + length, 32 - length, "Z");
+    }
+}
+
+static bool readDigits(const char* text, int count, int* value) {
+    *value = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (text[i] < '0' || text[i] > '9') return false;
+        *value = *value * 10 + (text[i] - '0');
+    }
+
+    return true;
+}
+
+/// @brief Parses the timestamp formats the stores write.
+/// @return The TIMESTAMP_* format, or TIMESTAMP_RAW if it can't be reproduced exactly.
+static int parseTimestamp(const char* text, int64_t* milliseconds) {
+    size_t length = strlen(text);
+
+    if (length < 19 || length > 24) {
+        return TIMESTAMP_RAW;
+    }
+
+    int year, month, day, hour, minute, second, millis = 0;
+
+    if (!readDigits(text, 4, &year) || text[4] != '-' || !readDigits(text + 5, 2, &month) || text[7] != '-' ||
+        !readDigits(text + 8, 2, &day) || !readDigits(text + 11, 2, &hour) || text[13] != ':' ||
+        !readDigits(text + 14, 2, &minute) || text[16] != ':' || !readDigits(text + 17, 2, &second)) {
+        return TIMESTAMP_RAW;
+    }
+
+    bool iso = text[10] == 'T';
+    bool hasMillis = length >= 23 && text[19] == '.' && readDigits(text + 20, 3, &millis);
+    int format = iso ? (hasMillis ? TIMESTAMP_ISO8601_MILLIS : TIMESTAMP_ISO8601) : (hasMillis ? TIMESTAMP_SQLITE_MILLIS : TIMESTAMP_SQLITE);
+
+    *milliseconds = ((daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second) * 1000) + millis;
+
+    // Only claim the format if it reproduces the text byte for byte
+    char check[32];
+    formatTimestamp(*milliseconds, format, check);
+
+    return strcmp(check, text) == 0 ? format : TIMESTAMP_RAW;
+}
+
+// MARK: - Dictionaries
+
+static uint32_t hashString(const char* text) {
+    uint32_t hash = 2166136261u;
+
+    for (; *text != '\0'; text++) {
+        hash ^= (uint8_t)*text;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void initDictionary(FactCodecDictionary* dictionary) {
+    dictionary->strings = NULL;
+    dictionary->count = 0;
+    dictionary->capacity = 0;
+    dictionary->slots = NULL;
+    dictionary->slotCount = 0;
+}
+
+static void freeDictionary(FactCodecDictionary* dictionary) {
+    for (int i = 0; i < dictionary->count; i++) {
+        free(dictionary->strings[i]);
+    }
+
+    free(dictionary->strings);
+    free(dictionary->slots);
+    initDictionary(dictionary);
+}
+
+static int appendToDictionary(FactCodecDictionary* dictionary, char* text) {
+    if (dictionary->count == dictionary->capacity) {
+        dictionary->capacity = dictionary->capacity > 0 ? dictionary->capacity * 2 : 16;
+        dictionary->strings = realloc(dictionary->strings, dictionary->capacity * sizeof(char*));
+    }
+
+    dictionary->strings[dictionary->count] = text;
+    return dictionary->count++;
+}
+
+static void rehashDictionary(FactCodecDictionary* dictionary) {
+    free(dictionary->slots);
+    dictionary->slotCount = dictionary->slotCount > 0 ? dictionary->slotCount * 2 : 64;
+    dictionary->slots = calloc(dictionary->slotCount, sizeof(int));
+
+    for (int i = 0; i < dictionary->count; i++) {
+        uint32_t slot = hashString(dictionary->strings[i]) & (dictionary->slotCount - 1);
+
+        while (dictionary->slots[slot] != 0) {
+            slot = (slot + 1) & (dictionary->slotCount - 1);
+        }
+
+        dictionary->slots[slot] = i + 1;
+    }
+}
+
+/// @brief Finds a string's index, adding it if it's new.
+/// @return The index; `added` is set when the string was new and needs defining in the stream.
+static int dictionaryIndex(FactCodecDictionary* dictionary, const char* text, bool* added) {
+    if ((dictionary->count + 1) * 2 > dictionary->slotCount) {
+        rehashDictionary(dictionary);
+    }
+
+    uint32_t slot = hashString(text) & (dictionary->slotCount - 1);
+
+    while (dictionary->slots[slot] != 0) {
+        int index = dictionary->slots[slot] - 1;
+
+        if (strcmp(dictionary->strings[index], text) == 0) {
+            *added = false;
+            return index;
+        }
+
+        slot = (slot + 1) & (dictionary->slotCount - 1);
+    }
+
+    int index = appendToDictionary(dictionary, strdup(text));
+    dictionary->slots[slot] = index + 1;
+    *added = true;
+
+    return index;
+}
+
+// MARK: - Encoder
+
+void initFactEncoder(FactEncoder* encoder, FILE* out) {
+    encoder->out = out;
+    initDictionary(&encoder->attributes);
+    initDictionary(&encoder->types);
+    encoder->previousItemId = NULL;
+    encoder->previousMilliseconds = 0;
+    encoder->factCount = 0;
+    encoder->byteCount = 0;
+
+    fwrite(FACT_CODEC_MAGIC, 1, 4, out);
+    encoder->byteCount += 4;
+    writeVarint(encoder, FACT_CODEC_VERSION);
+}
+
+static int encodeDictionaryEntry(FactEncoder* encoder, FactCodecDictionary* dictionary, int op, const char* text) {
+    bool added;
+    int index = dictionaryIndex(dictionary, text, &added);
+
+    if (added) {
+        writeVarint(encoder, op);
+        writeBytes(encoder, text, strlen(text));
+    }
+
+    return index;
+}
+
+void encodeFact(FactEncoder* encoder,
+                const char* factId,
+                const char* itemId,
+                const char* attribute,
+                const char* value,
+                double numericalValue,
+                const char* type,
+                int flags,
+                const char* timestamp) {
+    int attributeIndex = encodeDictionaryEntry(encoder, &encoder->attributes, FACT_CODEC_OP_ATTRIBUTE, attribute);
+    int typeIndex = encodeDictionaryEntry(encoder, &encoder->types, FACT_CODEC_OP_TYPE, type != NULL ? type : "string");
+
+    uint8_t factIdBytes[16], itemIdBytes[16];
+    int factIdForm = parseUUID(factId, factIdBytes);
+    int itemIdForm = ID_FORM_PREVIOUS;
+
+    if (encoder->previousItemId == NULL || strcmp(encoder->previousItemId, itemId) != 0) {
+        itemIdForm = parseUUID(itemId, itemIdBytes);
+        free(encoder->previousItemId);
+        encoder->previousItemId = strdup(itemId);
+    }
+
+    int64_t milliseconds = 0;
+    int timestampFormat = parseTimestamp(timestamp, &milliseconds);
+
+    uint8_t header = (uint8_t)(factIdForm << HEADER_FACT_ID_SHIFT | itemIdForm << HEADER_ITEM_ID_SHIFT | timestampFormat << HEADER_TIMESTAMP_SHIFT);
+
+    // Compare bits rather than values so -0.0 survives the round trip
+    uint64_t bits;
+    memcpy(&bits, &numericalValue, sizeof(bits));
+
+    if (bits != 0) {
+        header |= HEADER_HAS_NUMERICAL;
+    }
+
+    writeVarint(encoder, FACT_CODEC_OP_FACT);
+    fputc(header, encoder->out);
+    encoder->byteCount++;
+
+    if (factIdForm == ID_FORM_STRING) {
+        writeBytes(encoder, factId, strlen(factId));
+    }
+    else {
+        fwrite(factIdBytes, 1, 16, encoder->out);
+        encoder->byteCount += 16;
+    }
+
+    if (itemIdForm == ID_FORM_STRING) {
+        writeBytes(encoder, itemId, strlen(itemId));
+    }
+    else if (itemIdForm != ID_FORM_PREVIOUS) {
+        fwrite(itemIdBytes, 1, 16, encoder->out);
+        encoder->byteCount += 16;
+    }
+
+    writeVarint(encoder, attributeIndex);
+    writeVarint(encoder, typeIndex);
+    writeBytes(encoder, value, strlen(value));
+
+    if (bits != 0) {
+        uint8_t bytes[8];
+
+        for (int i = 0; i < 8; i++) {
+            bytes[i] = (uint8_t)(bits >> (8 * i));
+        }
+
+        fwrite(bytes, 1, 8, encoder->out);
+        encoder->byteCount += 8;
+    }
+
+    writeVarint(encoder, (uint64_t)(uint32_t)flags);
+
+    if (timestampFormat == TIMESTAMP_RAW) {
+        writeBytes(encoder, timestamp, strlen(timestamp));
+    }
+    else {
+        // Facts are usually written in time order, so deltas stay small
+        int64_t delta = milliseconds - encoder->previousMilliseconds;
+        writeVarint(encoder, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        encoder->previousMilliseconds = milliseconds;
+    }
+
+    encoder->factCount++;
+}
+
+void finishFactEncoder(FactEncoder* encoder) {
+    writeVarint(encoder, FACT_CODEC_OP_END);
+    fflush(encoder->out);
+}
+
+void freeFactEncoder(FactEncoder* encoder) {
+    freeDictionary(&encoder->attributes);
+    freeDictionary(&encoder->types);
+    free(encoder->previousItemId);
+    encoder->previousItemId = NULL;
+}
+
+// MARK: - Decoder
+
+bool initFactDecoder(FactDecoder* decoder, FILE* in) {
+    decoder->in = in;
+    initDictionary(&decoder->attributes);
+    initDictionary(&decoder->types);
+    decoder->factId = (FactCodecBuffer){ NULL, 0 };
+    decoder->itemId = (FactCodecBuffer){ NULL, 0 };
+    decoder->value = (FactCodecBuffer){ NULL, 0 };
+    decoder->timestamp = (FactCodecBuffer){ NULL, 0 };
+    decoder->previousMilliseconds = 0;
+    decoder->failed = false;
+
+    char magic[4];
+    uint64_t version;
+
+    if (fread(magic, 1, 4, in) != 4 || memcmp(magic, FACT_CODEC_MAGIC, 4) != 0 ||
+        !readFactCodecVarint(in, &version) || version != FACT_CODEC_VERSION) {
+        decoder->failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+static bool readId(FactDecoder* decoder, int form, FactCodecBuffer* buffer) {
+    if (form == ID_FORM_STRING) {
+        return readBytes(decoder->in, buffer);
+    }
+
+    uint8_t bytes[16];
+
+    if (fread(bytes, 1, 16, decoder->in) != 16) {
+        return false;
+    }
+
+    ensureBuffer(buffer, 37);
+    formatUUID(bytes, form == ID_FORM_UUID_UPPER, buffer->bytes);
+
+    return true;
+}
+
+static bool readDictionaryIndex(FactDecoder* decoder, FactCodecDictionary* dictionary, char** text) {
+    uint64_t index;
+
+    if (!readFactCodecVarint(decoder->in, &index) || index >= (uint64_t)dictionary->count) {
+        return false;
+    }
+
+    *text = dictionary->strings[index];
+    return true;
+}
+
+static int decodeFact(FactDecoder* decoder, CFact* fact) {
+    int header = fgetc(decoder->in);
+    if (header == EOF) {
+        return -1;
+    }
+
+    int factIdForm = (header >> HEADER_FACT_ID_SHIFT) & 3;
+    int itemIdForm = (header >> HEADER_ITEM_ID_SHIFT) & 3;
+    int timestampFormat = (header >> HEADER_TIMESTAMP_SHIFT) & 7;
+
+    if (factIdForm == ID_FORM_PREVIOUS || timestampFormat > TIMESTAMP_ISO8601_MILLIS) {
+        return -1;
+    }
+
+    if (!readId(decoder, factIdForm, &decoder->factId)) {
+        return -1;
+    }
+
+    if (itemIdForm == ID_FORM_PREVIOUS) {
+        if (decoder->itemId.bytes == NULL) return -1;
+    }
+    else if (!readId(decoder, itemIdForm, &decoder->itemId)) {
+        return -1;
+    }
+
+    if (!readDictionaryIndex(decoder, &decoder->attributes, &fact->attribute) ||
+        !readDictionaryIndex(decoder, &decoder->types, &fact->type) ||
+        !readBytes(decoder->in, &decoder->value)) {
+        return -1;
+    }
+
+    fact->numericalValue = 0;
+
+    if (header & HEADER_HAS_NUMERICAL) {
+        uint8_t bytes[8];
+        uint64_t bits = 0;
+
+        if (fread(bytes, 1, 8, decoder->in) != 8) {
+            return -1;
+        }
+
+        for (int i = 0; i < 8; i++) {
+            bits |= (uint64_t)bytes[i] << (8 * i);
+        }
+
+        memcpy(&fact->numericalValue, &bits, sizeof(bits));
+    }
+
+    uint64_t flags;
+
+    if (!readFactCodecVarint(decoder->in, &flags)) {
+        return -1;
+    }
+
+    if (timestampFormat == TIMESTAMP_RAW) {
+        if (!readBytes(decoder->in, &decoder->timestamp)) return -1;
+    }
+    else {
+        uint64_t zigzag;
+
+        if (!readFactCodecVarint(decoder->in, &zigzag)) {
+            return -1;
+        }
+
+        decoder->previousMilliseconds += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+        ensureBuffer(&decoder->timestamp, 32);
+        formatTimestamp(decoder->previousMilliseconds, timestampFormat, decoder->timestamp.bytes);
+    }
+
+    fact->uid = -1;
+    fact->factId = decoder->factId.bytes;
+    fact->itemId = decoder->itemId.bytes;
+    fact->value = decoder->value.bytes;
+    fact->flags = (int)flags;
+    fact->timestamp = decoder->timestamp.bytes;
+
+    return 1;
+}
+
+int decodeNextFact(FactDecoder* decoder, CFact* fact) {
+    while (!decoder->failed) {
+        uint64_t op;
+
+        if (!readFactCodecVarint(decoder->in, &op)) {
+            break;
+        }
+
+        if (op == FACT_CODEC_OP_END) {
+            return 0;
+        }
+        else if (op == FACT_CODEC_OP_ATTRIBUTE || op == FACT_CODEC_OP_TYPE) {
+            FactCodecBuffer text = { NULL, 0 };
+
+            if (!readBytes(decoder->in, &text)) {
+                free(text.bytes);
+                break;
+            }
+
+            appendToDictionary(op == FACT_CODEC_OP_ATTRIBUTE ? &decoder->attributes : &decoder->types, text.bytes);
+        }
+        else if (op == FACT_CODEC_OP_FACT) {
+            int result = decodeFact(decoder, fact);
+
+            if (result < 0) {
+                break;
+            }
+
+            return result;
+        }
+        else {
+            break;
+        }
+    }
+
+    decoder->failed = true;
+    return -1;
+}
+
+void freeFactDecoder(FactDecoder* decoder) {
+    freeDictionary(&decoder->attributes);
+    freeDictionary(&decoder->types);
+    free(decoder->factId.bytes);
+    free(decoder->itemId.bytes);
+    free(decoder->value.bytes);
+    free(decoder->timestamp.bytes);
+}
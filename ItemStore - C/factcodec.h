@@ -0,0 +1,97 @@
+//
+//  factcodec.h
+//  Wonder
+//
+//  Versioned binary encoding for streams of facts, used by export/import and sync.
+//
+
+#ifndef factcodec_h
+#define factcodec_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "istypes.h"
+
+// Stream: "WFCS", version varint, then records, each led by an opcode varint:
+//   FACT_CODEC_OP_ATTRIBUTE / _TYPE: varint length + bytes, appended to that dictionary
+//   FACT_CODEC_OP_FACT: a header byte, then
+//     factId      16 bytes if a UUID, else varint length + bytes
+//     itemId      omitted if the same as the previous fact's, 16 bytes if a UUID, else varint length + bytes
+//     attribute   varint dictionary index
+//     type        varint dictionary index
+//     value       varint length + bytes
+//     numerical   8 bytes (little-endian IEEE 754), only if not +0.0
+//     flags       varint
+//     timestamp   zigzag varint of milliseconds since the previous fact's, or varint length + bytes if unparsed
+//   FACT_CODEC_OP_END
+// The header byte holds the factId and itemId forms, the timestamp format and whether numerical is present.
+#define FACT_CODEC_MAGIC "WFCS"
+#define FACT_CODEC_VERSION 1
+
+#define FACT_CODEC_OP_END 0
+#define FACT_CODEC_OP_ATTRIBUTE 1
+#define FACT_CODEC_OP_TYPE 2
+#define FACT_CODEC_OP_FACT 3
+
+typedef struct {
+    char **strings;
+    int count;
+    int capacity;
+    int *slots; // open-addressed hash of indexes + 1 (encoder only)
+    int slotCount;
+} FactCodecDictionary;
+
+typedef struct {
+    FILE *out;
+    FactCodecDictionary attributes;
+    FactCodecDictionary types;
+    char *previousItemId;
+    int64_t previousMilliseconds;
+    uint64_t factCount;
+    uint64_t byteCount;
+} FactEncoder;
+
+typedef struct {
+    char *bytes;
+    size_t capacity;
+} FactCodecBuffer;
+
+typedef struct {
+    FILE *in;
+    FactCodecDictionary attributes;
+    FactCodecDictionary types;
+    FactCodecBuffer factId;
+    FactCodecBuffer itemId;
+    FactCodecBuffer value;
+    FactCodecBuffer timestamp;
+    int64_t previousMilliseconds;
+    bool failed;
+} FactDecoder;
+
+// Encoding: writes the stream header on init and the end record on finish
+void initFactEncoder(FactEncoder* encoder, FILE* out);
+void encodeFact(FactEncoder* encoder,
+                const char* factId,
+                const char* itemId,
+                const char* attribute,
+                const char* value,
+                double numericalValue,
+                const char* type,
+                int flags,
+                const char* timestamp);
+void finishFactEncoder(FactEncoder* encoder);
+void freeFactEncoder(FactEncoder* encoder);
+
+// Decoding: facts are views into the decoder's buffers, valid until the next decodeNextFact.
+// Returns 1 for a fact, 0 at the end record, -1 on a malformed or truncated stream.
+bool initFactDecoder(FactDecoder* decoder, FILE* in);
+int decodeNextFact(FactDecoder* decoder, CFact* fact);
+void freeFactDecoder(FactDecoder* decoder);
+
+// Shared by the stream formats built on top of the codec
+void writeFactCodecVarint(FILE* out, uint64_t value);
+bool readFactCodecVarint(FILE* in, uint64_t* value);
+
+#endif /* factcodec_h */
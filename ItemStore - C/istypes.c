@@ -9,6 +9,7 @@
 #include <string.h>
 
 #include "istypes.h"
+#include "storealloc.h"
 
 void initFact(CFact* fact) {
     fact->uid = -1;
@@ -20,9 +21,11 @@ void initFact(CFact* fact) {
     fact->type = NULL;
     fact->flags = -1;
     fact->timestamp = NULL;
+    fact->typed.kind = CFACT_VALUE_NULL;
 }
 
 void freeFact(CFact* fact) {
+    free(fact->factId);
     free(fact->itemId);
     free(fact->attribute);
     free(fact->value);
@@ -30,10 +33,84 @@ void freeFact(CFact* fact) {
     free(fact->timestamp);
 }
 
+CFactValueKind factValueKind(const char* type) {
+    if (type == NULL || strcmp(type, "string") == 0) return CFACT_VALUE_TEXT;
+    if (strcmp(type, "number") == 0) return CFACT_VALUE_NUMBER;
+    if (strcmp(type, "timestamp") == 0) return CFACT_VALUE_TIMESTAMP;
+    if (strcmp(type, "itemId") == 0) return CFACT_VALUE_ITEM_ID;
+    if (strcmp(type, "boolean") == 0) return CFACT_VALUE_BOOLEAN;
+    if (strcmp(type, "integer") == 0) return CFACT_VALUE_INTEGER;
+    if (strcmp(type, "blob") == 0) return CFACT_VALUE_BLOB;
+    if (strcmp(type, "null") == 0) return CFACT_VALUE_NULL;
+    
+    return CFACT_VALUE_TEXT;
+}
+
+static int valueClass(CFactValueKind kind) {
+    switch (kind) {
+        case CFACT_VALUE_NULL: return 0;
+        case CFACT_VALUE_INTEGER:
+        case CFACT_VALUE_NUMBER:
+        case CFACT_VALUE_BOOLEAN:
+        case CFACT_VALUE_TIMESTAMP: return 1;
+        case CFACT_VALUE_TEXT:
+        case CFACT_VALUE_ITEM_ID: return 2;
+        case CFACT_VALUE_BLOB: return 3;
+    }
+    
+    return 0;
+}
+
+int compareFactValues(const CFactValue* a, const CFactValue* b) {
+    int classA = valueClass(a->kind), classB = valueClass(b->kind);
+    
+    if (classA != classB) {
+        return classA < classB ? -1 : 1;
+    }
+    
+    switch (classA) {
+        case 1: {
+            // Integers compare exactly with each other; anything else compares as doubles
+            if (a->kind == CFACT_VALUE_INTEGER && b->kind == CFACT_VALUE_INTEGER) {
+                return (a->integer > b->integer) - (a->integer < b->integer);
+            }
+            
+            double x = a->kind == CFACT_VALUE_INTEGER ? (double)a->integer : a->kind == CFACT_VALUE_BOOLEAN ? a->boolean : a->number;
+            double y = b->kind == CFACT_VALUE_INTEGER ? (double)b->integer : b->kind == CFACT_VALUE_BOOLEAN ? b->boolean : b->number;
+            
+            return (x > y) - (x < y);
+        }
+        case 2: {
+            int order = strcmp(a->text, b->text);
+            return (order > 0) - (order < 0);
+        }
+        case 3: {
+            int length = a->blob.length < b->blob.length ? a->blob.length : b->blob.length;
+            int order = memcmp(a->blob.bytes, b->blob.bytes, length);
+            
+            if (order != 0) {
+                return order < 0 ? -1 : 1;
+            }
+            
+            return (a->blob.length > b->blob.length) - (a->blob.length < b->blob.length);
+        }
+    }
+    
+    return 0;
+}
 
 void initFactsCollection(CFactsCollection* collection) {
     collection->facts = NULL;
     collection->count = 0;
+    collection->refCount = 1;
+}
+
+CFactsCollection* retainFactsCollection(CFactsCollection* collection) {
+    if (collection != NULL) {
+        collection->refCount++;
+    }
+    
+    return collection;
 }
 
 void freeFactsCollection(CFactsCollection* collection) {
@@ -41,6 +118,11 @@ void freeFactsCollection(CFactsCollection* collection) {
         return;
     }
     
+    // Shared collections are only freed once the last reference is released
+    if (--collection->refCount > 0) {
+        return;
+    }
+    
     // Free the facts array
     if (collection->facts != NULL) {
         for (int i = 0; i < collection->count; i++) {
@@ -55,7 +137,74 @@ void freeFactsCollection(CFactsCollection* collection) {
     free(collection);
 }
 
+static char* copyText(const char* text) {
+    if (text == NULL) {
+        return NULL;
+    }
+    
+    size_t length = strlen(text) + 1;
+    char* copy = malloc(length);
+    memcpy(copy, text, length);
+    
+    return copy;
+}
+
+/// @brief Copies a fact's value buffer, which holds a blob's bytes (and so may contain NULs) for blob values.
+static char* copyValue(const CFact* fact) {
+    if (fact->typed.kind != CFACT_VALUE_BLOB || fact->value == NULL) {
+        return copyText(fact->value);
+    }
+    
+    char* copy = malloc((size_t)fact->typed.blob.length + 1);
+    memcpy(copy, fact->value, fact->typed.blob.length);
+    copy[fact->typed.blob.length] = '\0';
+    
+    return copy;
+}
+
+/// @brief Moves (or, if the collection is shared, copies) the facts of `from` onto the end of `into`, then releases `from`.
+static void appendFactsCollection(CFactsCollection* into, CFactsCollection* from) {
+    CFact* destination = into->facts + into->count;
+    
+    if (from->refCount == 1) {
+        memcpy(destination, from->facts, from->count * sizeof(CFact));
+        into->count += from->count;
+        
+        // The strings now belong to `into`; only free the containers
+        free(from->facts);
+        free(from);
+        return;
+    }
+    
+    for (int i = 0; i < from->count; i++) {
+        CFact* source = &from->facts[i];
+        
+        destination[i] = *source;
+        destination[i].factId = copyText(source->factId);
+        destination[i].itemId = copyText(source->itemId);
+        destination[i].attribute = copyText(source->attribute);
+        destination[i].value = copyValue(source);
+        destination[i].type = copyText(source->type);
+        destination[i].timestamp = copyText(source->timestamp);
+        
+        if (source->typed.kind == CFACT_VALUE_TEXT || source->typed.kind == CFACT_VALUE_ITEM_ID)
+            destination[i].typed.text = destination[i].value;
+        else if (source->typed.kind == CFACT_VALUE_BLOB)
+            destination[i].typed.blob.bytes = destination[i].value;
+    }
+    
+    into->count += from->count;
+    freeFactsCollection(from);
+}
+
 CFactsCollection* combineFactsCollections(CFactsCollection* a, CFactsCollection* b) {
+    if (a == NULL) {
+        return b;
+    }
+    else if (b == NULL) {
+        return a;
+    }
+    
     if (a->count == 0 && b->count == 0) {
         freeFactsCollection(b);
         return a;
@@ -70,16 +219,264 @@ CFactsCollection* combineFactsCollections(CFactsCollection* a, CFactsCollection*
     }
     
     CFactsCollection* result = malloc(sizeof(CFactsCollection));
-    result->count = a->count + b->count;
-    result->facts = realloc(result->facts, result->count * sizeof(CFact));
+    initFactsCollection(result);
+    result->facts = malloc((a->count + b->count) * sizeof(CFact));
     
-    memcpy(result->facts, a->facts, a->count * sizeof(CFact));
-    memcpy(result->facts + a->count, b->facts, b->count * sizeof(CFact));
+    appendFactsCollection(result, a);
+    appendFactsCollection(result, b);
     
     // TODO: Sort by created date desc
     
-    freeFactsCollection(a);
-    freeFactsCollection(b);
+    return result;
+}
+
+void initFactsQuery(CFactsQuery* query) {
+    query->itemId = NULL;
+    query->attribute = NULL;
+    query->value = NULL;
+    
+    query->hasValueRange = false;
+    query->valueAtOrAbove = 0;
+    query->valueAtOrBelow = 0;
+    
+    query->drives = 0;
+}
+
+void initRetentionPolicy(CRetentionPolicy* policy) {
+    policy->keepVersions = 1;
+    policy->keepAfter = NULL;
+    policy->archivePath = NULL;
+    policy->itemsPerBatch = 64;
+}
+
+void freeSearchResults(CSearchResults* results) {
+    if (results == NULL) {
+        return;
+    }
+    
+    for (int i = 0; i < results->count; i++) {
+        free(results->hits[i].itemId);
+        free(results->hits[i].attribute);
+    }
+    
+    free(results->hits);
+    free(results);
+}
+
+void freeLocationResults(CLocationResults* results) {
+    if (results == NULL) {
+        return;
+    }
+    
+    for (int i = 0; i < results->count; i++) {
+        free(results->hits[i].itemId);
+    }
+    
+    free(results->hits);
+    free(results);
+}
+
+static void freeActivityItem(CActivityItem* item) {
+    for (int i = 0; i < item->attributeCount; i++) {
+        free(item->attributes[i].attribute);
+    }
+    
+    free(item->attributes);
+    free(item->itemId);
+    free(item->itemType);
+    free(item->firstTimestamp);
+}
+
+void initAggregateQuery(CAggregateQuery* query) {
+    query->itemId = NULL;
+    query->attribute = NULL;
+    query->value = NULL;
+    query->type = NULL;
+    query->groupBy = CAGGREGATE_GROUP_NONE;
+    query->drives = 0;
+}
+
+void freeAggregates(CAggregates* aggregates) {
+    if (aggregates == NULL) {
+        return;
+    }
+    
+    for (int i = 0; i < aggregates->count; i++) {
+        free(aggregates->rows[i].key);
+    }
+    
+    free(aggregates->rows);
+    free(aggregates);
+}
+
+void initGraphQuery(CGraphQuery* query) {
+    query->relationshipType = NULL;
+    query->maxDepth = 0;
+    query->maxItems = 0;
+    query->direction = CGRAPH_OUTGOING;
+    query->order = CGRAPH_BREADTH_FIRST;
+}
+
+void freeGraph(CGraph* graph) {
+    if (graph == NULL) {
+        return;
+    }
+    
+    for (int i = 0; i < graph->itemCount; i++) {
+        free(graph->items[i].itemId);
+    }
+    
+    for (int i = 0; i < graph->edgeCount; i++) {
+        free(graph->edges[i].relationshipId);
+        free(graph->edges[i].fromItemId);
+        free(graph->edges[i].toItemId);
+        free(graph->edges[i].relationshipType);
+    }
+    
+    free(graph->items);
+    free(graph->edges);
+    free(graph);
+}
+
+void freeActivityBuckets(CActivityBuckets* buckets) {
+    if (buckets == NULL) {
+        return;
+    }
+    
+    for (int i = 0; i < buckets->count; i++) {
+        CActivityBucket* bucket = &buckets->buckets[i];
+        
+        for (int j = 0; j < bucket->itemCount; j++) {
+            freeActivityItem(&bucket->items[j]);
+        }
+        
+        free(bucket->items);
+        free(bucket->bucket);
+    }
+    
+    free(buckets->buckets);
+    free(buckets);
+}
+
+/// @brief Orders ISO8601 ("...T...Z") and SQLite ("... ...") timestamps together.
+int compareTimestamps(const char* a, const char* b) {
+    for (; *a != '\0' && *b != '\0'; a++, b++) {
+        char ca = *a == 'T' ? ' ' : *a;
+        char cb = *b == 'T' ? ' ' : *b;
+        
+        if (ca != cb) {
+            return (unsigned char)ca - (unsigned char)cb;
+        }
+    }
+    
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+static int compareActivityItems(const void* a, const void* b) {
+    return compareTimestamps(((const CActivityItem*)a)->firstTimestamp, ((const CActivityItem*)b)->firstTimestamp);
+}
+
+/// @brief Folds `from` into `into`, which takes ownership of (or frees) everything in it.
+static void mergeActivityItem(CActivityItem* into, CActivityItem* from) {
+    into->factCount += from->factCount;
+    
+    if (compareTimestamps(from->firstTimestamp, into->firstTimestamp) < 0) {
+        free(into->firstTimestamp);
+        into->firstTimestamp = from->firstTimestamp;
+        from->firstTimestamp = NULL;
+    }
+    
+    if (into->itemType == NULL) {
+        into->itemType = from->itemType;
+        from->itemType = NULL;
+    }
+    
+    for (int i = 0; i < from->attributeCount; i++) {
+        CAttributeCount* attribute = &from->attributes[i];
+        int existing = -1;
+        
+        for (int j = 0; j < into->attributeCount; j++) {
+            if (strcmp(into->attributes[j].attribute, attribute->attribute) == 0) {
+                existing = j;
+                break;
+            }
+        }
+        
+        if (existing >= 0) {
+            into->attributes[existing].count += attribute->count;
+        }
+        else {
+            into->attributes = realloc(into->attributes, (into->attributeCount + 1) * sizeof(CAttributeCount));
+            into->attributes[into->attributeCount++] = *attribute;
+            attribute->attribute = NULL;
+        }
+    }
+    
+    freeActivityItem(from);
+}
+
+static void mergeActivityBucket(CActivityBucket* into, CActivityBucket* from) {
+    into->factCount += from->factCount;
+    into->items = realloc(into->items, (into->itemCount + from->itemCount) * sizeof(CActivityItem));
+    
+    int ownCount = into->itemCount;
+    
+    for (int i = 0; i < from->itemCount; i++) {
+        int existing = -1;
+        
+        for (int j = 0; j < ownCount; j++) {
+            if (strcmp(into->items[j].itemId, from->items[i].itemId) == 0) {
+                existing = j;
+                break;
+            }
+        }
+        
+        if (existing >= 0)
+            mergeActivityItem(&into->items[existing], &from->items[i]);
+        else
+            into->items[into->itemCount++] = from->items[i];
+    }
+    
+    qsort(into->items, into->itemCount, sizeof(CActivityItem), compareActivityItems);
+    
+    free(from->items);
+    free(from->bucket);
+}
+
+CActivityBuckets* combineActivityBuckets(CActivityBuckets* a, CActivityBuckets* b) {
+    if (a == NULL) {
+        return b;
+    }
+    else if (b == NULL) {
+        return a;
+    }
+    
+    CActivityBuckets* result = malloc(sizeof(CActivityBuckets));
+    result->buckets = malloc((a->count + b->count + 1) * sizeof(CActivityBucket));
+    result->count = 0;
+    
+    // Both are ordered by bucket, so merge them in one pass
+    int i = 0, j = 0;
+    
+    while (i < a->count || j < b->count) {
+        int order = i == a->count ? 1 : j == b->count ? -1 : strcmp(a->buckets[i].bucket, b->buckets[j].bucket);
+        
+        if (order < 0) {
+            result->buckets[result->count++] = a->buckets[i++];
+        }
+        else if (order > 0) {
+            result->buckets[result->count++] = b->buckets[j++];
+        }
+        else {
+            mergeActivityBucket(&a->buckets[i], &b->buckets[j++]);
+            result->buckets[result->count++] = a->buckets[i++];
+        }
+    }
+    
+    free(a->buckets);
+    free(a);
+    free(b->buckets);
+    free(b);
     
     return result;
 }
@@ -8,6 +8,35 @@
 #ifndef istypes_h
 #define istypes_h
 
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    CFACT_VALUE_NULL,
+    CFACT_VALUE_TEXT,
+    CFACT_VALUE_ITEM_ID,
+    CFACT_VALUE_INTEGER,
+    CFACT_VALUE_NUMBER,
+    CFACT_VALUE_BOOLEAN,
+    CFACT_VALUE_TIMESTAMP,
+    CFACT_VALUE_BLOB
+} CFactValueKind;
+
+// A fact's value in its own type. Text, item ids and blobs point into the fact's value buffer.
+typedef struct {
+    CFactValueKind kind;
+    union {
+        const char *text;
+        int64_t integer;
+        double number; // also timestamps, in seconds since 1970
+        bool boolean;
+        struct {
+            const void *bytes;
+            int length;
+        } blob;
+    };
+} CFactValue;
+
 typedef struct {
     int uid;
     char *factId;
@@ -18,20 +47,205 @@ typedef struct {
     char *type;
     int flags;
     char *timestamp;
+    CFactValue typed; // value and numericalValue remain as the text and numeric forms
 } CFact;
 
 typedef struct {
     CFact *facts;
     int count;
+    int refCount; // collections may be shared (e.g. by the query cache); treat shared ones as read-only
 } CFactsCollection;
 
+typedef struct {
+    const char *itemId;
+    const char *attribute;
+    const char *value;
+    
+    bool hasValueRange;
+    double valueAtOrAbove;
+    double valueAtOrBelow;
+    
+    int drives; // mask of ItemStoreDrive; 0 for all drives
+} CFactsQuery;
+
+// The fields a prepared query binds each time it runs; the others are unconstrained.
+typedef enum {
+    CFACTS_QUERY_ITEM_ID = 1 << 0,
+    CFACTS_QUERY_ATTRIBUTE = 1 << 1,
+    CFACTS_QUERY_VALUE = 1 << 2,
+    CFACTS_QUERY_VALUE_RANGE = 1 << 3 // not with CFACTS_QUERY_VALUE
+} CFactsQueryField;
+
+// Partial indexes over the facts of one attribute (see csl_createAttributeIndex)
+// There's no unique-per-item kind: facts keep each item's past values as rows, so an item can
+// have many facts for one attribute and a UNIQUE index would refuse them. ITEMS serves the
+// "which items have it" lookups instead.
+typedef enum {
+    CATTRIBUTE_INDEX_VALUE = 1 << 0, // equality on the value
+    CATTRIBUTE_INDEX_TYPED_VALUE = 1 << 1, // ranges over the typed value
+    CATTRIBUTE_INDEX_ITEMS = 1 << 2 // all of the attribute's facts, newest first (e.g. every item that has it)
+} CAttributeIndexKind;
+
+typedef struct {
+    char *itemId;
+    char *attribute; // the attribute whose value matched best
+    double score; // FTS5 rank (bm25); lower is a better match
+} CSearchHit;
+
+typedef struct {
+    CSearchHit *hits;
+    int count;
+} CSearchResults;
+
+typedef struct {
+    char *itemId;
+    double latitude;
+    double longitude;
+    double distanceKm; // from the query point; 0 for bounding-box queries
+} CLocationHit;
+
+typedef struct {
+    CLocationHit *hits;
+    int count;
+} CLocationResults;
+
+typedef enum {
+    CACTIVITY_BUCKET_SECOND,
+    CACTIVITY_BUCKET_MINUTE,
+    CACTIVITY_BUCKET_HOUR,
+    CACTIVITY_BUCKET_DAY
+} CActivityBucketSize;
+
+typedef struct {
+    char *attribute;
+    int count;
+} CAttributeCount;
+
+typedef struct {
+    char *itemId;
+    char *itemType; // the item's latest "type" value, if any
+    char *firstTimestamp; // of the item's earliest fact in the bucket
+    int factCount;
+    CAttributeCount *attributes;
+    int attributeCount;
+} CActivityItem;
+
+typedef struct {
+    char *bucket; // timestamp truncated to the bucket size, e.g. "2024-02-02 14:05"
+    int factCount;
+    CActivityItem *items; // in order of first activity
+    int itemCount;
+} CActivityBucket;
+
+typedef struct {
+    CActivityBucket *buckets; // oldest first
+    int count;
+} CActivityBuckets;
+
+typedef struct {
+    int keepVersions; // live values kept per attribute as of keepAfter, including the latest (default 1)
+    const char *keepAfter; // facts newer than this timestamp are kept as is; NULL compacts everything
+    const char *archivePath; // archive into this SQLite file instead of the facts_archive table
+    int itemsPerBatch; // items compacted per transaction (default 64)
+} CRetentionPolicy;
+
+typedef enum {
+    CGRAPH_OUTGOING, // from fromItemId to toItemId
+    CGRAPH_INCOMING,
+    CGRAPH_BOTH
+} CGraphDirection;
+
+typedef enum {
+    CGRAPH_BREADTH_FIRST,
+    CGRAPH_DEPTH_FIRST
+} CGraphOrder;
+
+typedef struct {
+    const char *relationshipType; // NULL follows every relationship
+    int maxDepth; // in edges from the root; 0 for no limit
+    int maxItems; // 0 for no limit
+    CGraphDirection direction;
+    CGraphOrder order;
+} CGraphQuery;
+
+// A relationship item, seen as an edge: its current fromItemId and toItemId facts
+typedef struct {
+    char *relationshipId;
+    char *fromItemId;
+    char *toItemId;
+    char *relationshipType; // referenceType (or relationshipType); "" if it has neither
+} CGraphEdge;
+
+typedef struct {
+    char *itemId;
+    int depth; // edges from the root
+} CGraphItem;
+
+typedef struct {
+    CGraphItem *items; // in visit order, the root first
+    int itemCount;
+    CGraphEdge *edges; // every edge followed or found between visited items, once each
+    int edgeCount;
+} CGraph;
+
+typedef enum {
+    CAGGREGATE_GROUP_NONE,
+    CAGGREGATE_GROUP_ATTRIBUTE,
+    CAGGREGATE_GROUP_TYPE,
+    CAGGREGATE_GROUP_VALUE
+} CAggregateGroup;
+
+typedef struct {
+    const char *itemId; // each filter NULL for any
+    const char *attribute;
+    const char *value;
+    const char *type;
+    CAggregateGroup groupBy;
+    int drives; // mask of ItemStoreDrive; 0 for all drives
+} CAggregateQuery;
+
+typedef struct {
+    char *key; // the group's attribute, type or value; NULL when ungrouped
+    long long count; // fact rows, as fetchFacts would return them
+    long long distinctItems;
+    long long numberCount; // rows with a numeric value (number, integer, timestamp); sum, min and max are over these
+    double sum;
+    double min;
+    double max;
+} CAggregateRow;
+
+typedef struct {
+    CAggregateRow *rows; // ordered by key
+    int count;
+} CAggregates;
+
 typedef void (*UpdateFunction)(void);
 
 void initFact(CFact* fact);
 void freeFact(CFact* fact);
 
+CFactValueKind factValueKind(const char* type); // from a fact's type string; unknown types are text
+int compareFactValues(const CFactValue* a, const CFactValue* b); // SQLite's order: null, numbers, text, blobs
+int compareTimestamps(const char* a, const char* b); // ISO8601 ("...T...Z") and SQLite ("... ...") forms together
+
 void initFactsCollection(CFactsCollection* collection);
-void freeFactsCollection(CFactsCollection* collection);
+CFactsCollection* retainFactsCollection(CFactsCollection* collection);
+void freeFactsCollection(CFactsCollection* collection); // releases one reference
 CFactsCollection* combineFactsCollections(CFactsCollection* a, CFactsCollection* b);
 
+void initFactsQuery(CFactsQuery* query);
+void initRetentionPolicy(CRetentionPolicy* policy);
+
+void freeSearchResults(CSearchResults* results);
+void freeLocationResults(CLocationResults* results);
+
+void initAggregateQuery(CAggregateQuery* query);
+void freeAggregates(CAggregates* aggregates);
+
+void initGraphQuery(CGraphQuery* query);
+void freeGraph(CGraph* graph);
+
+void freeActivityBuckets(CActivityBuckets* buckets);
+CActivityBuckets* combineActivityBuckets(CActivityBuckets* a, CActivityBuckets* b);
+
 #endif /* istypes_h */
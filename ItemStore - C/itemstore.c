@@ -5,75 +5,1103 @@
 //  Created by Alexander Obenauer on 12/29/23.
 //
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "itemstore.h"
 #include "sldrive.h"
+#include "storetrace.h"
+#include "storealloc.h"
 
 ItemStore itemStore;
 
+// MARK: Query cache
+//  Results are cached per query shape and handed out as shared collections.
+//  Each entry remembers the version of the narrowest (striped) key its result
+//  depends on; inserts bump those versions, so stale entries are detected on
+//  lookup without scanning the cache.
+
+#define QUERY_CACHE_DEFAULT_CAPACITY 256
+#define QUERY_CACHE_BUCKETS 1024
+#define QUERY_CACHE_VERSION_SLOTS 4096
+
+typedef enum {
+    DEPENDS_ON_ALL,
+    DEPENDS_ON_ITEM,
+    DEPENDS_ON_ATTRIBUTE,
+    DEPENDS_ON_ITEM_ATTRIBUTE,
+    DEPENDS_ON_ATTRIBUTE_VALUE,
+    DEPENDENCY_KIND_COUNT
+} QueryDependencyKind;
+
+typedef struct QueryCacheEntry {
+    char* key;
+    uint64_t hash;
+    CFactsCollection* result;
+    
+    QueryDependencyKind dependency;
+    uint32_t dependencySlot;
+    uint32_t dependencyVersion;
+    
+    struct QueryCacheEntry* chain; // next entry in the same bucket
+    struct QueryCacheEntry* newer; // LRU order
+    struct QueryCacheEntry* older;
+} QueryCacheEntry;
+
+static struct {
+    QueryCacheEntry* buckets[QUERY_CACHE_BUCKETS];
+    QueryCacheEntry* newest;
+    QueryCacheEntry* oldest;
+    int count;
+    int capacity;
+    
+    uint32_t versions[DEPENDENCY_KIND_COUNT][QUERY_CACHE_VERSION_SLOTS];
+} queryCache = { .capacity = QUERY_CACHE_DEFAULT_CAPACITY };
+
+static uint64_t hashBytes(uint64_t hash, const char* text) {
+    // FNV-1a; NULL hashes differently from "" so the two don't collide
+    if (text == NULL) {
+        return (hash ^ 0xff) * 0x100000001b3ull;
+    }
+    
+    for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+        hash = (hash ^ *c) * 0x100000001b3ull;
+    }
+    
+    return (hash ^ 0x1f) * 0x100000001b3ull;
+}
+
+static uint32_t dependencySlot(const char* a, const char* b) {
+    uint64_t hash = hashBytes(hashBytes(0xcbf29ce484222325ull, a), b);
+    return (uint32_t)(hash % QUERY_CACHE_VERSION_SLOTS);
+}
+
+static void noteFactInserted(const char* itemId, const char* attribute, const char* value) {
+    queryCache.versions[DEPENDS_ON_ALL][0]++;
+    queryCache.versions[DEPENDS_ON_ITEM][dependencySlot(itemId, NULL)]++;
+    queryCache.versions[DEPENDS_ON_ATTRIBUTE][dependencySlot(attribute, NULL)]++;
+    queryCache.versions[DEPENDS_ON_ITEM_ATTRIBUTE][dependencySlot(itemId, attribute)]++;
+    queryCache.versions[DEPENDS_ON_ATTRIBUTE_VALUE][dependencySlot(attribute, value)]++;
+}
+
+/// @brief Picks the narrowest version counter that changes whenever this query's results could.
+static void queryDependency(const CFactsQuery* query, QueryDependencyKind* kind, uint32_t* slot) {
+    if (query->itemId != NULL && query->attribute != NULL) {
+        *kind = DEPENDS_ON_ITEM_ATTRIBUTE;
+        *slot = dependencySlot(query->itemId, query->attribute);
+    }
+    else if (query->itemId != NULL) {
+        *kind = DEPENDS_ON_ITEM;
+        *slot = dependencySlot(query->itemId, NULL);
+    }
+    else if (query->attribute != NULL && query->value != NULL && !query->hasValueRange) {
+        *kind = DEPENDS_ON_ATTRIBUTE_VALUE;
+        *slot = dependencySlot(query->attribute, query->value);
+    }
+    else if (query->attribute != NULL) {
+        *kind = DEPENDS_ON_ATTRIBUTE;
+        *slot = dependencySlot(query->attribute, NULL);
+    }
+    else {
+        *kind = DEPENDS_ON_ALL;
+        *slot = 0;
+    }
+}
+
+static char* queryCacheKey(const CFactsQuery* query, int drives) {
+    char range[64] = "";
+    
+    if (query->hasValueRange) {
+        snprintf(range, sizeof(range), "%.17g:%.17g", query->valueAtOrAbove, query->valueAtOrBelow);
+    }
+    
+    const char* parts[] = { query->itemId, query->attribute, query->value };
+    size_t length = 16 + strlen(range);
+    
+    for (int i = 0; i < 3; i++) {
+        length += (parts[i] != NULL ? strlen(parts[i]) : 0) + 2;
+    }
+    
+    char* key = malloc(length);
+    char* cursor = key + sprintf(key, "%d\x1f%s", drives, range);
+    
+    for (int i = 0; i < 3; i++) {
+        // \x1e marks a NULL field, \x1f separates fields
+        cursor += sprintf(cursor, "\x1f%s", parts[i] != NULL ? parts[i] : "\x1e");
+    }
+    
+    return key;
+}
+
+static void unlinkQueryCacheEntry(QueryCacheEntry* entry) {
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else queryCache.newest = entry->older;
+    
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else queryCache.oldest = entry->newer;
+    
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+static void pushNewestQueryCacheEntry(QueryCacheEntry* entry) {
+    entry->older = queryCache.newest;
+    entry->newer = NULL;
+    
+    if (queryCache.newest != NULL) queryCache.newest->newer = entry;
+    queryCache.newest = entry;
+    
+    if (queryCache.oldest == NULL) queryCache.oldest = entry;
+}
+
+static void removeQueryCacheEntry(QueryCacheEntry* entry) {
+    QueryCacheEntry** link = &queryCache.buckets[entry->hash % QUERY_CACHE_BUCKETS];
+    
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+    
+    *link = entry->chain;
+    
+    unlinkQueryCacheEntry(entry);
+    freeFactsCollection(entry->result);
+    free(entry->key);
+    free(entry);
+    
+    queryCache.count--;
+}
+
+/// @return A retained, shared result, or NULL if there is no fresh entry for the key.
+static CFactsCollection* lookupQueryCache(const char* key, uint64_t hash) {
+    QueryCacheEntry* entry = queryCache.buckets[hash % QUERY_CACHE_BUCKETS];
+    
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+        entry = entry->chain;
+    }
+    
+    if (entry == NULL) {
+        return NULL;
+    }
+    
+    if (queryCache.versions[entry->dependency][entry->dependencySlot] != entry->dependencyVersion) {
+        removeQueryCacheEntry(entry);
+        return NULL;
+    }
+    
+    unlinkQueryCacheEntry(entry);
+    pushNewestQueryCacheEntry(entry);
+    
+    return retainFactsCollection(entry->result);
+}
+
+static void storeQueryCache(char* key, uint64_t hash, const CFactsQuery* query, CFactsCollection* result) {
+    while (queryCache.count >= queryCache.capacity && queryCache.oldest != NULL) {
+        removeQueryCacheEntry(queryCache.oldest);
+    }
+    
+    QueryCacheEntry* entry = malloc(sizeof(QueryCacheEntry));
+    entry->key = key;
+    entry->hash = hash;
+    entry->result = retainFactsCollection(result);
+    
+    queryDependency(query, &entry->dependency, &entry->dependencySlot);
+    entry->dependencyVersion = queryCache.versions[entry->dependency][entry->dependencySlot];
+    
+    uint64_t bucket = hash % QUERY_CACHE_BUCKETS;
+    entry->chain = queryCache.buckets[bucket];
+    queryCache.buckets[bucket] = entry;
+    
+    pushNewestQueryCacheEntry(entry);
+    queryCache.count++;
+}
+
+void clearQueryCache(void) {
+    while (queryCache.oldest != NULL) {
+        removeQueryCacheEntry(queryCache.oldest);
+    }
+}
+
+void setQueryCacheCapacity(int capacity) {
+    queryCache.capacity = capacity < 0 ? 0 : capacity;
+    
+    while (queryCache.count > queryCache.capacity && queryCache.oldest != NULL) {
+        removeQueryCacheEntry(queryCache.oldest);
+    }
+}
+
+// MARK: Recording
+//  While a recording is open, each traced call appends a record (storetrace.h)
+//  as it returns; otherwise the only cost is the check on recorder.out.
+
+static struct {
+    FILE* out;
+    StoreTraceWriter writer;
+    uint64_t startedAt;
+} recorder;
+
+bool startRecording(const char* path) {
+    if (recorder.out != NULL) {
+        return false;
+    }
+    
+    recorder.out = fopen(path, "wb");
+    
+    if (recorder.out == NULL) {
+        fprintf(stderr, "Recording error: can't open %s\n", path);
+        return false;
+    }
+    
+    initStoreTraceWriter(&recorder.writer, recorder.out);
+    recorder.startedAt = storeTraceNanoseconds();
+    
+    return true;
+}
+
+long long stopRecording(void) {
+    if (recorder.out == NULL) {
+        return -1;
+    }
+    
+    finishStoreTraceWriter(&recorder.writer);
+    fclose(recorder.out);
+    recorder.out = NULL;
+    
+    return (long long)recorder.writer.recordCount;
+}
+
+/// @brief When a traced call started, or 0 when not recording.
+static uint64_t traceCallStarted(void) {
+    return recorder.out != NULL ? storeTraceNanoseconds() : 0;
+}
+
+static void recordCall(StoreTraceRecord* record, uint64_t startedAt) {
+    if (recorder.out == NULL || startedAt == 0) {
+        return;
+    }
+    
+    record->duration = storeTraceNanoseconds() - startedAt;
+    record->startedAt = startedAt - recorder.startedAt;
+    
+    writeStoreTraceRecord(&recorder.writer, record);
+}
+
+// MARK: Item store
+
+static void applyAttributeIndexRegistry(void) {
+    CSLDatabase* registry = itemStore.systemDrive;
+    
+    for (int i = 0; i < registry->attributeIndexCount; i++) {
+        const CSLAttributeIndex* index = &registry->attributeIndexes[i];
+        
+        if ((csl_attributeIndexKinds(itemStore.userDrive, index->attribute) & index->kinds) != index->kinds) {
+            csl_createAttributeIndex(itemStore.userDrive, index->attribute, index->kinds);
+        }
+    }
+}
+
 void initItemStore(bool inMemory) {
-    itemStore.userDrive = openDatabase("userDrive", inMemory);
-    itemStore.systemDrive = openDatabase("systemDrive", inMemory);
+    itemStore.userDrive = openDatabaseWithProfile("userDrive", inMemory, CSL_PROFILE_BALANCED);
+    itemStore.systemDrive = openDatabaseWithProfile("systemDrive", inMemory, CSL_PROFILE_BALANCED);
     
     itemStore.update = NULL;
+    
+    applyAttributeIndexRegistry();
 }
 
 void freeItemStore(void) {
+    stopRecording();
+    clearQueryCache();
+    
     closeDatabase(itemStore.userDrive);
     closeDatabase(itemStore.systemDrive);
 }
 
+bool beginRead(int drives) {
+    drives = drives != 0 ? drives : ITEM_STORE_ALL_DRIVES;
+    
+    if ((drives & ITEM_STORE_USER_DRIVE) && !csl_beginRead(itemStore.userDrive)) {
+        return false;
+    }
+    
+    if ((drives & ITEM_STORE_SYSTEM_DRIVE) && !csl_beginRead(itemStore.systemDrive)) {
+        if (drives & ITEM_STORE_USER_DRIVE) {
+            csl_endRead(itemStore.userDrive);
+        }
+        
+        return false;
+    }
+    
+    return true;
+}
+
+void endRead(int drives) {
+    drives = drives != 0 ? drives : ITEM_STORE_ALL_DRIVES;
+    
+    if (drives & ITEM_STORE_SYSTEM_DRIVE) {
+        csl_endRead(itemStore.systemDrive);
+    }
+    
+    if (drives & ITEM_STORE_USER_DRIVE) {
+        csl_endRead(itemStore.userDrive);
+    }
+}
+
 //void insertFact(CFact* fact);
 //void insertFacts(CFactsCollection* facts);
 //
 //char* createItem(char* type, CSLDatabase* drive);
 //char* createReference(char* fromItemId, char* toItemId, char* referenceType, CSLDatabase* drive);
 
-void insertFact(void* drive, const char *factId, const char *itemId, const char *attribute, const char *value, double numericalValue, const char *type, int flags, const char *timestamp) {
-    csl_insertFact(drive, factId, itemId, attribute, value, numericalValue, type, flags, timestamp);
+bool insertFact(void* drive, const char *factId, const char *itemId, const char *attribute, const char *value, double numericalValue, const char *type, int flags, const char *timestamp) {
+    STORE_ALLOC_BEGIN();
+    uint64_t startedAt = traceCallStarted();
+    
+    bool inserted = csl_insertFact(drive, factId, itemId, attribute, value, numericalValue, type, flags, timestamp);
+    
+    noteFactInserted(itemId, attribute, value);
     
-    if (itemStore.update != NULL) {
+    if (startedAt != 0) {
+        StoreTraceRecord record = {
+            .call = STORE_TRACE_INSERT_FACT,
+            .drives = drive == itemStore.systemDrive ? ITEM_STORE_SYSTEM_DRIVE : ITEM_STORE_USER_DRIVE,
+            .factId = factId, .itemId = itemId, .attribute = attribute, .value = value,
+            .numericalValue = numericalValue, .type = type, .flags = flags, .timestamp = timestamp
+        };
+        
+        recordCall(&record, startedAt);
+    }
+    
+    STORE_ALLOC_END("insertFact");
+    
+    if (inserted && itemStore.update != NULL) {
         itemStore.update();
     }
+    
+    return inserted;
+}
+
+static CFactsCollection* fetchFactsFromDrive(CSLDatabase* drive, const CFactsQuery* query) {
+    // Most items live in only one drive; skip the ones that definitely don't hold this one
+    if (query->itemId != NULL && !csl_mayContainItem(drive, query->itemId)) {
+        CFactsCollection* empty = malloc(sizeof(CFactsCollection));
+        initFactsCollection(empty);
+        
+        return empty;
+    }
+    
+    if (query->hasValueRange) {
+        return csl_fetchFactsByValueRange(drive, query->itemId, query->attribute, query->valueAtOrAbove, query->valueAtOrBelow);
+    }
+    
+    return csl_fetchFacts(drive, query->itemId, query->attribute, query->value);
+}
+
+static CFactsCollection* fetchFactsThroughCache(CFactsQuery query, bool* cached) {
+    int drives = query.drives != 0 ? query.drives : ITEM_STORE_ALL_DRIVES;
+    
+    char* key = NULL;
+    uint64_t hash = 0;
+    
+    if (queryCache.capacity > 0) {
+        key = queryCacheKey(&query, drives);
+        hash = hashBytes(0xcbf29ce484222325ull, key);
+        
+        CFactsCollection* hit = lookupQueryCache(key, hash);
+        
+        if (hit != NULL) {
+            free(key);
+            *cached = true;
+            return hit;
+        }
+    }
+    
+    CFactsCollection* results = NULL;
+    
+    if (drives & ITEM_STORE_USER_DRIVE) {
+        results = combineFactsCollections(results, fetchFactsFromDrive(itemStore.userDrive, &query));
+    }
+    
+    if (drives & ITEM_STORE_SYSTEM_DRIVE) {
+        results = combineFactsCollections(results, fetchFactsFromDrive(itemStore.systemDrive, &query));
+    }
+    
+    if (key != NULL) {
+        if (results != NULL) {
+            storeQueryCache(key, hash, &query, results);
+        }
+        else {
+            free(key);
+        }
+    }
+    
+    return results;
+}
+
+CFactsCollection* fetchFacts(CFactsQuery query) {
+    STORE_ALLOC_BEGIN();
+    uint64_t startedAt = traceCallStarted();
+    bool cached = false;
+    
+    CFactsCollection* results = fetchFactsThroughCache(query, &cached);
+    
+    if (startedAt != 0) {
+        StoreTraceRecord record = {
+            .call = STORE_TRACE_FETCH_FACTS,
+            .resultCount = results != NULL ? (uint64_t)results->count : 0,
+            .drives = query.drives, .itemId = query.itemId, .attribute = query.attribute, .value = query.value,
+            .hasValueRange = query.hasValueRange, .valueAtOrAbove = query.valueAtOrAbove, .valueAtOrBelow = query.valueAtOrBelow,
+            .cached = cached
+        };
+        
+        recordCall(&record, startedAt);
+    }
+    
+    STORE_ALLOC_END("fetchFacts");
+    
+    return results;
+}
+
+// MARK: Prepared queries
+
+struct CPreparedFactsQuery {
+    CSLPreparedQuery* userDrive;
+    CSLPreparedQuery* systemDrive;
+};
+
+CPreparedFactsQuery* prepareFactsQuery(int fields, int drives) {
+    drives = drives != 0 ? drives : ITEM_STORE_ALL_DRIVES;
+    
+    CPreparedFactsQuery* prepared = malloc(sizeof(CPreparedFactsQuery));
+    prepared->userDrive = NULL;
+    prepared->systemDrive = NULL;
+    
+    bool failed = false;
+    
+    if (drives & ITEM_STORE_USER_DRIVE) {
+        prepared->userDrive = csl_prepareQuery(itemStore.userDrive, fields);
+        failed |= prepared->userDrive == NULL;
+    }
+    
+    if (drives & ITEM_STORE_SYSTEM_DRIVE) {
+        prepared->systemDrive = csl_prepareQuery(itemStore.systemDrive, fields);
+        failed |= prepared->systemDrive == NULL;
+    }
+    
+    if (failed) {
+        freePreparedFactsQuery(prepared);
+        return NULL;
+    }
+    
+    return prepared;
+}
+
+static CFactsCollection* runPreparedOnDrive(CSLPreparedQuery* query, const CFactsQuery* values) {
+    if (query == NULL) {
+        return NULL;
+    }
+    
+    CFactValue low = { .kind = CFACT_VALUE_NUMBER, .number = values->valueAtOrAbove };
+    CFactValue high = { .kind = CFACT_VALUE_NUMBER, .number = values->valueAtOrBelow };
+    
+    return csl_runPreparedQuery(query, values->itemId, values->attribute, values->value, &low, &high);
 }
 
-CFactsCollection* fetchFacts(const char* itemId,
-                             const char* attribute,
-                             const char* value) {
-    CFactsCollection* res1 = csl_fetchFacts(itemStore.userDrive, itemId, attribute, value);
-    CFactsCollection* res2 = csl_fetchFacts(itemStore.systemDrive, itemId, attribute, value);
+CFactsCollection* runPreparedFactsQuery(CPreparedFactsQuery* prepared, CFactsQuery values) {
+    STORE_ALLOC_BEGIN();
+    
+    CFactsCollection* results = runPreparedOnDrive(prepared->userDrive, &values);
+    results = combineFactsCollections(results, runPreparedOnDrive(prepared->systemDrive, &values));
     
-    return combineFactsCollections(res1, res2);
+    STORE_ALLOC_END("runPreparedFactsQuery");
+    
+    return results;
+}
+
+void freePreparedFactsQuery(CPreparedFactsQuery* prepared) {
+    if (prepared == NULL) {
+        return;
+    }
+    
+    csl_freePreparedQuery(prepared->userDrive);
+    csl_freePreparedQuery(prepared->systemDrive);
+    free(prepared);
 }
 
 CFactsCollection* fetchFactsByDate(const char* createdAtOrAfter,
                                    const char* createdAtOrBefore) {
+    STORE_ALLOC_BEGIN();
+    uint64_t startedAt = traceCallStarted();
+    
     CFactsCollection* res1 = csl_fetchFactsByDate(itemStore.userDrive, createdAtOrAfter, createdAtOrBefore);
     CFactsCollection* res2 = csl_fetchFactsByDate(itemStore.systemDrive, createdAtOrAfter, createdAtOrBefore);
+    CFactsCollection* results = combineFactsCollections(res1, res2);
+    
+    if (startedAt != 0) {
+        StoreTraceRecord record = {
+            .call = STORE_TRACE_FETCH_FACTS_BY_DATE,
+            .resultCount = results != NULL ? (uint64_t)results->count : 0,
+            .createdAtOrAfter = createdAtOrAfter, .createdAtOrBefore = createdAtOrBefore
+        };
+        
+        recordCall(&record, startedAt);
+    }
+    
+    STORE_ALLOC_END("fetchFactsByDate");
+    
+    return results;
+}
+
+CFactsCollection* fetchItemAsOf(const char* itemId, const char* asOf) {
+    STORE_ALLOC_BEGIN();
+    uint64_t startedAt = traceCallStarted();
+    
+    CFactsCollection* res1 = csl_fetchItemAsOf(itemStore.userDrive, itemId, asOf);
+    CFactsCollection* res2 = csl_fetchItemAsOf(itemStore.systemDrive, itemId, asOf);
+    CFactsCollection* results = combineFactsCollections(res1, res2);
+    
+    if (startedAt != 0) {
+        StoreTraceRecord record = {
+            .call = STORE_TRACE_FETCH_ITEM_AS_OF,
+            .resultCount = results != NULL ? (uint64_t)results->count : 0,
+            .itemId = itemId, .timestamp = asOf
+        };
+        
+        recordCall(&record, startedAt);
+    }
+    
+    STORE_ALLOC_END("fetchItemAsOf");
+    
+    return results;
+}
+
+CFactsCollection* fetchItemsAsOf(const char** itemIds, int count, const char* asOf) {
+    STORE_ALLOC_BEGIN();
+    
+    CFactsCollection* res1 = csl_fetchItemsAsOf(itemStore.userDrive, itemIds, count, asOf);
+    CFactsCollection* res2 = csl_fetchItemsAsOf(itemStore.systemDrive, itemIds, count, asOf);
+    CFactsCollection* results = combineFactsCollections(res1, res2);
+    
+    STORE_ALLOC_END("fetchItemsAsOf");
+    
+    return results;
+}
+
+CActivityBuckets* fetchActivityBuckets(const char* createdAtOrAfter,
+                                       const char* createdAtOrBefore,
+                                       CActivityBucketSize size) {
+    CActivityBuckets* res1 = csl_fetchActivityBuckets(itemStore.userDrive, createdAtOrAfter, createdAtOrBefore, size);
+    CActivityBuckets* res2 = csl_fetchActivityBuckets(itemStore.systemDrive, createdAtOrAfter, createdAtOrBefore, size);
+    
+    return combineActivityBuckets(res1, res2);
+}
+
+// MARK: Aggregates
+
+static int compareAggregateKeys(const char* a, const char* b) {
+    if (a == NULL || b == NULL) {
+        return (a != NULL) - (b != NULL);
+    }
     
-    return combineFactsCollections(res1, res2);
+    return strcmp(a, b);
+}
+
+/// @brief Counts the items in a group that both drives counted, so a merged distinct count counts them once.
+/// Lists the group's items on one drive and probes the other for each, which the item filter mostly answers.
+static long long countItemsInBothDrives(void* drive, void* otherDrive, const CAggregateQuery* query, const char* key) {
+    CAggregateQuery probe = *query;
+    probe.groupBy = CAGGREGATE_GROUP_NONE;
+    
+    switch (query->groupBy) {
+        case CAGGREGATE_GROUP_ATTRIBUTE: probe.attribute = key; break;
+        case CAGGREGATE_GROUP_TYPE: probe.type = key; break;
+        case CAGGREGATE_GROUP_VALUE: probe.value = key; break;
+        case CAGGREGATE_GROUP_NONE: break;
+    }
+    
+    int count;
+    char** itemIds = csl_fetchDistinctItemIds(drive, query, key, &count);
+    long long overlap = 0;
+    
+    for (int i = 0; i < count; i++) {
+        probe.itemId = itemIds[i];
+        
+        CAggregates* other = csl_aggregateFacts(otherDrive, &probe);
+        
+        if (other != NULL && other->count > 0 && other->rows[0].count > 0) {
+            overlap++;
+        }
+        
+        freeAggregates(other);
+        free(itemIds[i]);
+    }
+    
+    free(itemIds);
+    
+    return overlap;
+}
+
+static void mergeAggregateRow(CAggregateRow* into, const CAggregateRow* row) {
+    if (row->numberCount > 0) {
+        into->min = into->numberCount > 0 && into->min < row->min ? into->min : row->min;
+        into->max = into->numberCount > 0 && into->max > row->max ? into->max : row->max;
+    }
+    
+    into->count += row->count;
+    into->distinctItems += row->distinctItems;
+    into->numberCount += row->numberCount;
+    into->sum += row->sum;
+}
+
+CAggregates* aggregateFacts(const CAggregateQuery* query) {
+    int drives = query->drives != 0 ? query->drives : ITEM_STORE_ALL_DRIVES;
+    
+    CAggregates* res1 = (drives & ITEM_STORE_USER_DRIVE) ? csl_aggregateFacts(itemStore.userDrive, query) : NULL;
+    CAggregates* res2 = (drives & ITEM_STORE_SYSTEM_DRIVE) ? csl_aggregateFacts(itemStore.systemDrive, query) : NULL;
+    
+    if (res1 == NULL || res2 == NULL) {
+        return res1 != NULL ? res1 : res2;
+    }
+    
+    // Both drives' rows are ordered by key, so merge them in order, taking ownership of the keys
+    CAggregates* results = malloc(sizeof(CAggregates));
+    results->rows = malloc((res1->count + res2->count + 1) * sizeof(CAggregateRow));
+    results->count = 0;
+    
+    int i = 0, j = 0;
+    
+    while (i < res1->count || j < res2->count) {
+        int order = i == res1->count ? 1 : j == res2->count ? -1 : compareAggregateKeys(res1->rows[i].key, res2->rows[j].key);
+        
+        if (order < 0) {
+            results->rows[results->count++] = res1->rows[i++];
+        }
+        else if (order > 0) {
+            results->rows[results->count++] = res2->rows[j++];
+        }
+        else {
+            CAggregateRow row = res1->rows[i++];
+            CAggregateRow other = res2->rows[j++];
+            
+            long long overlap = 0;
+            
+            if (row.distinctItems > 0 && other.distinctItems > 0) {
+                overlap = row.distinctItems <= other.distinctItems
+                ? countItemsInBothDrives(itemStore.userDrive, itemStore.systemDrive, query, row.key)
+                : countItemsInBothDrives(itemStore.systemDrive, itemStore.userDrive, query, row.key);
+            }
+            
+            mergeAggregateRow(&row, &other);
+            row.distinctItems -= overlap;
+            free(other.key);
+            
+            results->rows[results->count++] = row;
+        }
+    }
+    
+    free(res1->rows);
+    free(res1);
+    free(res2->rows);
+    free(res2);
+    
+    return results;
+}
+
+// MARK: Search
+
+static int compareSearchHits(const void* a, const void* b) {
+    double scoreA = ((const CSearchHit*)a)->score;
+    double scoreB = ((const CSearchHit*)b)->score;
+    
+    return (scoreA > scoreB) - (scoreA < scoreB);
+}
+
+CSearchResults* searchItems(const char* text, bool prefix, int limit) {
+    STORE_ALLOC_BEGIN();
+    uint64_t startedAt = traceCallStarted();
+    
+    CSearchResults* res1 = csl_searchText(itemStore.userDrive, text, prefix, limit);
+    CSearchResults* res2 = csl_searchText(itemStore.systemDrive, text, prefix, limit);
+    
+    CSearchResults* results = malloc(sizeof(CSearchResults));
+    results->count = 0;
+    results->hits = malloc((res1->count + res2->count + 1) * sizeof(CSearchHit));
+    
+    // Take ownership of the hits, keeping only the best-scoring hit per item
+    CSearchResults* sources[] = { res1, res2 };
+    
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < sources[s]->count; i++) {
+            CSearchHit hit = sources[s]->hits[i];
+            int existing = -1;
+            
+            for (int j = 0; j < results->count && s > 0; j++) {
+                if (strcmp(results->hits[j].itemId, hit.itemId) == 0) {
+                    existing = j;
+                    break;
+                }
+            }
+            
+            if (existing < 0) {
+                results->hits[results->count++] = hit;
+            }
+            else if (hit.score < results->hits[existing].score) {
+                free(results->hits[existing].itemId);
+                free(results->hits[existing].attribute);
+                results->hits[existing] = hit;
+            }
+            else {
+                free(hit.itemId);
+                free(hit.attribute);
+            }
+        }
+        
+        free(sources[s]->hits);
+        free(sources[s]);
+    }
+    
+    qsort(results->hits, results->count, sizeof(CSearchHit), compareSearchHits);
+    
+    if (limit > 0 && results->count > limit) {
+        for (int i = limit; i < results->count; i++) {
+            free(results->hits[i].itemId);
+            free(results->hits[i].attribute);
+        }
+        
+        results->count = limit;
+    }
+    
+    if (startedAt != 0) {
+        StoreTraceRecord record = {
+            .call = STORE_TRACE_SEARCH_ITEMS,
+            .resultCount = (uint64_t)results->count,
+            .value = text, .prefix = prefix, .limit = limit
+        };
+        
+        recordCall(&record, startedAt);
+    }
+    
+    STORE_ALLOC_END("searchItems");
+    
+    return results;
+}
+
+// MARK: Location
+
+static int compareLocationHits(const void *a, const void *b) {
+    double distanceA = ((const CLocationHit *)a)->distanceKm;
+    double distanceB = ((const CLocationHit *)b)->distanceKm;
+    
+    return (distanceA > distanceB) - (distanceA < distanceB);
+}
+
+/// @brief Takes ownership of both drives' results, keeping the user drive's hit when an item is located in both.
+static CLocationResults* mergeLocationResults(CLocationResults* res1, CLocationResults* res2, bool sortByDistance, int limit) {
+    CLocationResults* results = malloc(sizeof(CLocationResults));
+    results->count = 0;
+    results->hits = malloc((res1->count + res2->count + 1) * sizeof(CLocationHit));
+    
+    CLocationResults* sources[] = { res1, res2 };
+    int userDriveCount = res1->count;
+    
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < sources[s]->count; i++) {
+            CLocationHit hit = sources[s]->hits[i];
+            bool duplicate = false;
+            
+            for (int j = 0; j < userDriveCount && s > 0; j++) {
+                if (strcmp(results->hits[j].itemId, hit.itemId) == 0) {
+                    duplicate = true;
+                    break;
+                }
+            }
+            
+            if (duplicate)
+                free(hit.itemId);
+            else
+                results->hits[results->count++] = hit;
+        }
+        
+        free(sources[s]->hits);
+        free(sources[s]);
+    }
+    
+    if (sortByDistance) {
+        qsort(results->hits, results->count, sizeof(CLocationHit), compareLocationHits);
+    }
+    
+    if (limit > 0 && results->count > limit) {
+        for (int i = limit; i < results->count; i++) {
+            free(results->hits[i].itemId);
+        }
+        
+        results->count = limit;
+    }
+    
+    return results;
+}
+
+CLocationResults* fetchItemsInBox(double minLatitude, double maxLatitude, double minLongitude, double maxLongitude, int limit) {
+    CLocationResults* res1 = csl_fetchItemsInBox(itemStore.userDrive, minLatitude, maxLatitude, minLongitude, maxLongitude, limit);
+    CLocationResults* res2 = csl_fetchItemsInBox(itemStore.systemDrive, minLatitude, maxLatitude, minLongitude, maxLongitude, limit);
+    
+    return mergeLocationResults(res1, res2, false, limit);
+}
+
+CLocationResults* fetchNearestItems(double latitude, double longitude, int k, double maxDistanceKm) {
+    CLocationResults* res1 = csl_fetchNearestItems(itemStore.userDrive, latitude, longitude, k, maxDistanceKm);
+    CLocationResults* res2 = csl_fetchNearestItems(itemStore.systemDrive, latitude, longitude, k, maxDistanceKm);
+    
+    return mergeLocationResults(res1, res2, true, k);
+}
+
+// MARK: Attribute indexes
+
+bool declareAttributeIndex(const char* attribute, int kinds) {
+    // The registry first, so a failure on the user drive is retried at the next start
+    return csl_createAttributeIndex(itemStore.systemDrive, attribute, kinds) &&
+    csl_createAttributeIndex(itemStore.userDrive, attribute, kinds);
+}
+
+bool dropAttributeIndex(const char* attribute, int kinds) {
+    bool dropped = csl_dropAttributeIndex(itemStore.systemDrive, attribute, kinds);
+    
+    return csl_dropAttributeIndex(itemStore.userDrive, attribute, kinds) || dropped;
+}
+
+// MARK: Graph
+
+// Open-addressed set of borrowed strings, for the items and edges a walk has seen.
+// They're borrowed from the graph's own edges and items, which outlive the walk.
+typedef struct {
+    const char** slots;
+    int capacity; // a power of two
+    int count;
+} StringSet;
+
+static bool insertIntoStringSet(StringSet* set, const char* string) {
+    if ((set->count + 1) * 2 > set->capacity) {
+        StringSet grown = { calloc(set->capacity * 2, sizeof(char*)), set->capacity * 2, 0 };
+        
+        for (int i = 0; i < set->capacity; i++) {
+            if (set->slots[i] != NULL) {
+                insertIntoStringSet(&grown, set->slots[i]);
+            }
+        }
+        
+        free(set->slots);
+        *set = grown;
+    }
+    
+    uint32_t slot = (uint32_t)hashBytes(0xcbf29ce484222325ull, string) & (set->capacity - 1);
+    
+    while (set->slots[slot] != NULL) {
+        if (strcmp(set->slots[slot], string) == 0) {
+            return false;
+        }
+        
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+    
+    set->slots[slot] = string;
+    set->count++;
+    
+    return true;
+}
+
+/// @brief Appends the edges at an item in every drive, dropping any already in the graph.
+static void collectEdges(CGraph* graph, StringSet* seenEdges, const char* itemId, const CGraphQuery* query) {
+    void* drives[] = { itemStore.userDrive, itemStore.systemDrive };
+    
+    for (int d = 0; d < 2; d++) {
+        for (int incoming = 0; incoming < 2; incoming++) {
+            if ((incoming && query->direction == CGRAPH_OUTGOING) || (!incoming && query->direction == CGRAPH_INCOMING)) {
+                continue;
+            }
+            
+            int first = graph->edgeCount;
+            csl_fetchEdges(drives[d], itemId, query->relationshipType, incoming, graph);
+            
+            int kept = first;
+            
+            for (int i = first; i < graph->edgeCount; i++) {
+                CGraphEdge edge = graph->edges[i];
+                
+                if (insertIntoStringSet(seenEdges, edge.relationshipId)) {
+                    graph->edges[kept++] = edge;
+                }
+                else {
+                    free(edge.relationshipId);
+                    free(edge.fromItemId);
+                    free(edge.toItemId);
+                    free(edge.relationshipType);
+                }
+            }
+            
+            graph->edgeCount = kept;
+        }
+    }
+}
+
+CGraph* traverseGraph(const char* rootItemId, const CGraphQuery* query) {
+    STORE_ALLOC_BEGIN();
+    
+    CGraph* graph = calloc(1, sizeof(CGraph));
+    
+    StringSet visited = { calloc(64, sizeof(char*)), 64, 0 };
+    StringSet seenEdges = { calloc(64, sizeof(char*)), 64, 0 };
+    
+    // Items reached but not yet expanded: a queue for breadth-first, a stack for depth-first.
+    // Items are marked visited when reached, so each is pending at most once.
+    CGraphItem* pending = malloc(sizeof(CGraphItem));
+    int pendingCapacity = 1;
+    int head = 0;
+    int tail = 0;
+    
+    pending[tail++] = (CGraphItem){ strdup(rootItemId), 0 };
+    insertIntoStringSet(&visited, pending[0].itemId);
+    
+    while (head < tail && (query->maxItems <= 0 || graph->itemCount < query->maxItems)) {
+        CGraphItem item = query->order == CGRAPH_DEPTH_FIRST ? pending[--tail] : pending[head++];
+        
+        graph->items = realloc(graph->items, (graph->itemCount + 1) * sizeof(CGraphItem));
+        graph->items[graph->itemCount++] = item;
+        
+        if (query->maxDepth > 0 && item.depth >= query->maxDepth) {
+            continue;
+        }
+        
+        int firstEdge = graph->edgeCount;
+        collectEdges(graph, &seenEdges, item.itemId, query);
+        
+        int firstPending = tail;
+        
+        for (int i = firstEdge; i < graph->edgeCount; i++) {
+            const CGraphEdge* edge = &graph->edges[i];
+            const char* next = strcmp(edge->fromItemId, item.itemId) == 0 ? edge->toItemId : edge->fromItemId;
+            
+            if (!insertIntoStringSet(&visited, next)) {
+                continue;
+            }
+            
+            if (tail == pendingCapacity) {
+                pendingCapacity *= 2;
+                pending = realloc(pending, pendingCapacity * sizeof(CGraphItem));
+            }
+            
+            pending[tail++] = (CGraphItem){ strdup(next), item.depth + 1 };
+        }
+        
+        // Depth-first visits an item's edges in order, so the first one goes on top
+        if (query->order == CGRAPH_DEPTH_FIRST) {
+            for (int a = firstPending, b = tail - 1; a < b; a++, b--) {
+                CGraphItem swap = pending[a];
+                pending[a] = pending[b];
+                pending[b] = swap;
+            }
+        }
+    }
+    
+    // Left pending when maxItems cut the walk short
+    for (int i = query->order == CGRAPH_DEPTH_FIRST ? 0 : head; i < tail; i++) {
+        free(pending[i].itemId);
+    }
+    
+    free(pending);
+    free(visited.slots);
+    free(seenEdges.slots);
+    
+    STORE_ALLOC_END("traverseGraph");
+    
+    return graph;
+}
+
+// MARK: Sync
+
+int applySyncBatch(void* drive, FILE* in) {
+    STORE_ALLOC_BEGIN();
+    
+    int applied = csl_applySyncBatch(drive, in);
+    
+    // Applied facts bypass insertFact, so nothing cached can be trusted
+    if (applied > 0) {
+        clearQueryCache();
+    }
+    
+    STORE_ALLOC_END("applySyncBatch");
+    
+    return applied;
+}
+
+long long importFacts(void* drive, FILE* in) {
+    STORE_ALLOC_BEGIN();
+    
+    long long imported = csl_importFacts(drive, in);
+    
+    if (imported > 0) {
+        clearQueryCache();
+    }
+    
+    STORE_ALLOC_END("importFacts");
+    
+    return imported;
+}
+
+// MARK: Compaction
+
+long long compactItemStore(const CRetentionPolicy* policy) {
+    STORE_ALLOC_BEGIN();
+    
+    long long archived = csl_compact(itemStore.userDrive, policy) + csl_compact(itemStore.systemDrive, policy);
+    
+    // Cached results may include history that's now archived
+    clearQueryCache();
+    
+    STORE_ALLOC_END("compactItemStore");
+    
+    return archived;
+}
+
+// MARK: Stats
+
+void printItemStoreStats(void) {
+    csl_printStatementStats(itemStore.userDrive, "userDrive", stdout);
+    csl_printStatementStats(itemStore.systemDrive, "systemDrive", stdout);
+    printStoreAllocStats(stdout);
+}
+
+void resetItemStoreStats(void) {
+    csl_resetStatementStats(itemStore.userDrive);
+    csl_resetStatementStats(itemStore.systemDrive);
+    resetStoreAllocStats();
 }
 
 // MARK: Helpers
 
 /// @brief Generates the timestamp string formatted for use in the item store's SQLite db
-/// @return ISO8601 strings ("YYYY-MM-DD HH:MM:SS.SSS").
-char* getCurrentDateTime(void) {
+/// @param buffer Room for CURRENT_DATE_TIME_LENGTH characters.
+/// @return buffer, holding an ISO8601 string ("YYYY-MM-DD HH:MM:SS").
+char* formatCurrentDateTime(char* buffer) {
     time_t rawTime;
-    struct tm* timeInfo;
-    char* dateTimeString = malloc(24 * sizeof(char)); // Allocate memory for the string
+    struct tm timeInfo;
+    
+    time(&rawTime);                     // Get the current time
+    localtime_r(&rawTime, &timeInfo);   // Convert the time to local time (sharded drives insert from several threads)
+    
+    strftime(buffer, CURRENT_DATE_TIME_LENGTH, "%Y-%m-%d %H:%M:%S", &timeInfo); // Format the time string
+    
+    return buffer;
+}
+
+/// @brief As formatCurrentDateTime, in a buffer the caller frees.
+char* getCurrentDateTime(void) {
+    char* dateTimeString = malloc(CURRENT_DATE_TIME_LENGTH * sizeof(char)); // Allocate memory for the string
     if (dateTimeString == NULL) {
         fprintf(stderr, "Failed to allocate memory\n");
         exit(1);
     }
     
-    time(&rawTime);                     // Get the current time
-    timeInfo = localtime(&rawTime);     // Convert the time to local time
-    
-    strftime(dateTimeString, 24, "%Y-%m-%d %H:%M:%S", timeInfo); // Format the time string
-    
-    return dateTimeString;
+    return formatCurrentDateTime(dateTimeString);
 }
@@ -9,11 +9,20 @@
 #define itemstore_h
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <sqlite3.h>
 
 #include "istypes.h"
 
 // #define STORE_LOG // enable to see logs from the item store in c
+// #define STORE_STATS // enable to record per-statement counters and latency histograms in sldrive
+// #define STORE_ALLOC_STATS // enable to count the store's allocations, overall and per call (storealloc.h)
+
+typedef enum {
+    ITEM_STORE_USER_DRIVE = 1 << 0,
+    ITEM_STORE_SYSTEM_DRIVE = 1 << 1,
+    ITEM_STORE_ALL_DRIVES = ITEM_STORE_USER_DRIVE | ITEM_STORE_SYSTEM_DRIVE
+} ItemStoreDrive;
 
 typedef struct {
     void* userDrive;
@@ -28,9 +37,10 @@ extern ItemStore itemStore;
 void initItemStore(bool inMemory);
 void freeItemStore(void);
 
-void insertFact(void* drive,
-                const char *itemId,
+// false if the drive didn't store the fact (see csl_insertFact)
+bool insertFact(void* drive,
                 const char *factId,
+                const char *itemId,
                 const char *attribute,
                 const char *value,
                 double numericalValue,
@@ -38,12 +48,109 @@ void insertFact(void* drive,
                 int flags,
                 const char *timestamp);
 
-CFactsCollection* fetchFacts(const char* itemId,
-                             const char* attribute,
-                             const char* value);
+// Never NULL: an item no drive holds gives an empty collection. Results may be
+// shared with the query cache: treat them as read-only and release them with
+// freeFactsCollection. Only inserts made through insertFact invalidate cached results.
+CFactsCollection* fetchFacts(CFactsQuery query);
+
+// A read session (see csl_beginRead) on each drive in the mask (0 for all), so the fetches that
+// render an item see one state of the store rather than interleaving with writes. Pair each
+// beginRead that returns true with an endRead for the same drives.
+bool beginRead(int drives);
+void endRead(int drives);
+
+// A query shape (mask of CFactsQueryField) prepared once on each drive and run many times,
+// taking its values from a CFactsQuery. Runs skip the query cache.
+typedef struct CPreparedFactsQuery CPreparedFactsQuery;
+CPreparedFactsQuery* prepareFactsQuery(int fields, int drives); // drives 0 for all
+CFactsCollection* runPreparedFactsQuery(CPreparedFactsQuery* prepared, CFactsQuery values);
+void freePreparedFactsQuery(CPreparedFactsQuery* prepared);
+
+// Counts, distinct items and numeric sum/min/max over the facts matching a query, computed
+// in SQLite on each drive and merged, without fetching the facts (see csl_aggregateFacts).
+// Items with facts on both drives are counted once. Release with freeAggregates.
+CAggregates* aggregateFacts(const CAggregateQuery* query);
 
 CFactsCollection* fetchFactsByDate(const char* createdAtOrAfter,
-                                   const char* createdAtOrBefore);
+                                   const char* createdAtOrBefore); // either may be NULL, but not both
+
+// Each attribute's latest live fact as of a timestamp, across all drives.
+CFactsCollection* fetchItemAsOf(const char* itemId, const char* asOf);
+CFactsCollection* fetchItemsAsOf(const char** itemIds, int count, const char* asOf);
+
+// Per-bucket activity across all drives, e.g. for the Timeline; either bound may be NULL.
+CActivityBuckets* fetchActivityBuckets(const char* createdAtOrAfter,
+                                       const char* createdAtOrBefore,
+                                       CActivityBucketSize size);
+
+// Ranked full-text search over item string values across all drives, one hit per item, best first.
+CSearchResults* searchItems(const char* text, bool prefix, int limit);
+
+// Located items (numeric latitude and longitude attributes) across all drives.
+// A box with minLongitude > maxLongitude wraps across the antimeridian.
+CLocationResults* fetchItemsInBox(double minLatitude, double maxLatitude, double minLongitude, double maxLongitude, int limit);
+CLocationResults* fetchNearestItems(double latitude, double longitude, int k, double maxDistanceKm); // nearest first
+
+// The items reachable from a root over relationship items, across all drives, with the edges
+// between them, in one call (see csl_fetchEdges). Each item is visited once, so cycles end.
+CGraph* traverseGraph(const char* rootItemId, const CGraphQuery* query);
+
+// Declares partial indexes (mask of CAttributeIndexKind) for an attribute on every drive
+// (see csl_createAttributeIndex). The system drive holds the registry: declarations made
+// there are applied to the user drive when the item store starts.
+bool declareAttributeIndex(const char* attribute, int kinds);
+bool dropAttributeIndex(const char* attribute, int kinds);
+
+// Applies a sync batch (see csl_applySyncBatch) to one of the item store's drives.
+int applySyncBatch(void* drive, FILE* in);
+// Imports a fact dump (see csl_importFacts) into one of the item store's drives.
+long long importFacts(void* drive, FILE* in);
+
+// Compacts every drive under the policy (see csl_compact); returns the number of facts archived.
+long long compactItemStore(const CRetentionPolicy* policy);
+
+void setQueryCacheCapacity(int capacity); // 0 disables the cache
+void clearQueryCache(void);
+
+void printItemStoreStats(void);
+void resetItemStoreStats(void);
+
+// Ownership: whatever a store call returns belongs to the caller and goes back through its
+// free function (freeFactsCollection, freeSearchResults, freeGraph, ...); strings passed in
+// are only borrowed for the call. With STORE_ALLOC_STATS, every allocation made by the store's
+// C files is counted, and insertFact, the fetches, runPreparedFactsQuery, searchItems,
+// traverseGraph, applySyncBatch, importFacts and compactItemStore note their allocations, and
+// those still live when they return (results included), per call. Sizes are as the allocator
+// rounds them; calls made concurrently on other threads blur the per-call figures.
+// Benchmarks/replay.c -leaks fails any call that leaves allocations behind once its result is freed.
+typedef struct {
+    long long liveBytes;
+    long long liveAllocations;
+    long long peakBytes; // since the last reset
+    long long allocations; // since the last reset
+    long long frees; // since the last reset
+} CStoreAllocStats;
+
+typedef struct {
+    const char* call;
+    long long calls;
+    long long allocations;
+    long long bytes;
+    long long netAllocations; // still live when the calls returned, results included
+} CStoreAllocCallStats;
+
+bool storeAllocStatsEnabled(void);
+void snapshotStoreAllocStats(CStoreAllocStats* out);
+int snapshotStoreAllocCallStats(CStoreAllocCallStats* out, int capacity); // returns the number filled
+void resetStoreAllocStats(void); // live counts carry over
+void printStoreAllocStats(FILE* out);
+
+// Records insertFact, fetchFacts, fetchFactsByDate, fetchItemAsOf and searchItems calls, with their
+// arguments, durations and result sizes, to a trace file (storetrace.h) until stopRecording or
+// freeItemStore. stopRecording returns the number of calls recorded (-1 if not recording).
+// Benchmarks/replay.c re-runs a trace.
+bool startRecording(const char* path);
+long long stopRecording(void);
 
 //void insertFact(CFact* fact);
 //void insertFacts(CFactsCollection* facts);
@@ -53,6 +160,11 @@ CFactsCollection* fetchFactsByDate(const char* createdAtOrAfter,
 
 void freeFact(CFact* fact);
 void freeFactsCollection(CFactsCollection* collection);
-char* getCurrentDateTime(void);
+
+#define CURRENT_DATE_TIME_LENGTH 24 // with the terminator
+
+// "YYYY-MM-DD HH:MM:SS" in local time, written into a buffer of CURRENT_DATE_TIME_LENGTH
+char* formatCurrentDateTime(char* buffer);
+char* getCurrentDateTime(void); // the same, malloc'd; free it
 
 #endif /* itemstore_h */
@@ -5,10 +5,16 @@
 //  Created by Alexander Obenauer on 6/20/23.
 //
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
 
+#include "factcodec.h"
 #include "sldrive.h"
+#include "storealloc.h"
 
 // MARK: - SQLite Setup
 
@@ -18,36 +24,174 @@ void setUpdateFn(UpdateFnPtr newUpdateFn) {
     updateFn = newUpdateFn;
 }
 
-CSLDatabase *currentDatabase = NULL;
+// Per thread, so a sharded drive's shards can be worked on at once
+_Thread_local CSLDatabase *currentDatabase = NULL;
 
-CSLDatabase* openDatabase(const char *sourceId, bool inMemory) {
-    CSLDatabase *dbInfo = malloc(sizeof(CSLDatabase));
-    if (!dbInfo) {
-        fprintf(stderr, "Memory allocation error\n");
-        return NULL;
+// Bounds for open-ended timestamp ranges: timestamps compare bytewise, and no
+// UTF-8 text sorts above U+10FFFF
+#define TIMESTAMP_LOWEST ""
+#define TIMESTAMP_HIGHEST "\xF4\x8F\xBF\xBF"
+
+static CFactsCollection* emptyFactsCollection(void);
+static bool migrateDerivedIndexes(CSLDatabase *dbInfo);
+static bool migrateSync(CSLDatabase *dbInfo);
+static bool prepareDeletedItems(CSLDatabase *dbInfo);
+static bool prepareTextIndex(CSLDatabase *dbInfo);
+static bool prepareLocationIndex(CSLDatabase *dbInfo);
+static bool prepareRelationshipEdges(CSLDatabase *dbInfo);
+static bool prepareCheckpoints(CSLDatabase *dbInfo);
+static bool prepareSync(CSLDatabase *dbInfo);
+static bool execIndexSQL(CSLDatabase *dbInfo, const char *sql);
+static uint64_t monotonicNanoseconds(void);
+static void indexFact(CSLDatabase *dbInfo, sqlite3_int64 rowId, const char *itemId, const char *attribute, const char *type, int flags, double numericalValue);
+static void loadItemFilter(CSLDatabase *dbInfo);
+static void finishBulkLoad(CSLDatabase *dbInfo);
+static bool prepareTypedValues(CSLDatabase *dbInfo);
+static bool prepareAttributeIndexes(CSLDatabase *dbInfo);
+static void finalizeFactsQueries(CSLDatabase *dbInfo);
+static void freeAttributeIndexes(CSLDatabase *dbInfo);
+static void noteBulkRow(CSLDatabase *dbInfo, const char *itemId);
+static void saveItemFilter(CSLDatabase *dbInfo);
+static void addToItemFilter(CSLItemFilter *filter, const char *itemId);
+static bool outsideReadSession(CSLDatabase *dbInfo, const char *operation);
+static bool unshardedDrive(CSLDatabase *dbInfo, const char *operation);
+static bool prepareIndexStatement(CSLDatabase *dbInfo, const char *sql, sqlite3_stmt **stmt);
+static void stepIndexStatement(CSLDatabase *dbInfo, sqlite3_stmt *stmt);
+static bool tableExists(CSLDatabase *dbInfo, const char *name);
+static bool prepareValueBlobs(CSLDatabase *dbInfo);
+static bool migrateValueBlobs(CSLDatabase *dbInfo);
+static bool registerValueFunctions(CSLDatabase *dbInfo);
+static bool endBulkLoad(CSLDatabase *dbInfo);
+static int pragmaValue(CSLDatabase *dbInfo, const char *sql);
+static void closeShards(CSLDatabase *sharded);
+static bool insertShardFact(CSLDatabase *sharded, const char *factId, const char *itemId, const char *attribute, const char *value, double numericalValue, const char *type, int flags, const char *timestamp);
+static CFactsCollection* queryShardFacts(CSLDatabase *sharded, const CSLFactsQuery *query);
+static long long bulkInsertShardFacts(CSLDatabase *sharded, const CFact *facts, int count);
+static bool beginShardBulkLoad(CSLDatabase *sharded);
+static void endShardBulkLoad(CSLDatabase *shard, int index, void *context);
+static void forEachShard(CSLDatabase *sharded, void (*work)(CSLDatabase *shard, int index, void *context), void *context);
+static bool beginShardRead(CSLDatabase *sharded);
+static bool endShardRead(CSLDatabase *sharded);
+static bool checkpointShards(CSLDatabase *sharded);
+static int shardIndex(CSLDatabase *sharded, const char *itemId);
+
+// Bump when the schema changes: drives opened with a lower user_version run the
+// migration (every CREATE below is idempotent), and then record this version.
+#define CSL_SCHEMA_VERSION 3
+
+// Statements are prepared a group at a time, on first use (see needStatements)
+#define STATEMENTS_CORE (1 << 0)
+#define STATEMENTS_DELETED_ITEMS (1 << 1)
+#define STATEMENTS_TEXT (1 << 2)
+#define STATEMENTS_LOCATION (1 << 3)
+#define STATEMENTS_EDGES (1 << 4)
+#define STATEMENTS_CHECKPOINTS (1 << 5)
+#define STATEMENTS_SYNC (1 << 6)
+#define STATEMENTS_VALUE_BLOBS (1 << 7)
+#define STATEMENTS_GROUP_COUNT 8
+
+// What indexing an inserted fact touches
+#define STATEMENTS_DERIVED (STATEMENTS_DELETED_ITEMS | STATEMENTS_TEXT | STATEMENTS_LOCATION | STATEMENTS_EDGES | STATEMENTS_CHECKPOINTS)
+
+static bool prepareCoreStatements(CSLDatabase *dbInfo) {
+    const char *insert_data_sql = "INSERT INTO facts (factId, itemId, attribute, value, numericalValue, type, flags, timestamp, typedValue) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);";
+    int rc = sqlite3_prepare_v2(dbInfo->db, insert_data_sql, -1, &dbInfo->stmt_insert_fact, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+        return false;
     }
     
-    currentDatabase = dbInfo;
+    // Buckets are timestamp prefixes (see activityBucketLength); 'T' is folded so ISO8601 and SQLite timestamps share buckets
+    const char *fetch_activity_buckets_sql =
+    "SELECT bucket, itemId, attribute, count, first, "
+    "(SELECT t.value FROM facts t WHERE t.itemId = g.itemId AND t.attribute = 'type' ORDER BY t.timestamp DESC LIMIT 1) "
+    "FROM (SELECT replace(substr(timestamp, 1, ?3), 'T', ' ') AS bucket, itemId, attribute, COUNT(*) AS count, MIN(timestamp) AS first "
+    "FROM facts WHERE timestamp BETWEEN ?1 AND ?2 GROUP BY bucket, itemId, attribute) g "
+    "ORDER BY bucket, MIN(first) OVER (PARTITION BY bucket, itemId), itemId, attribute;";
+    rc = sqlite3_prepare_v2(dbInfo->db, fetch_activity_buckets_sql, -1, &dbInfo->stmt_fetch_activity_buckets, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+        return false;
+    }
     
-    char filename[255];
+    const char *fetch_most_recent_fact_sql = "SELECT * FROM facts WHERE itemId = ? AND attribute = ?;";
+    rc = sqlite3_prepare_v2(dbInfo->db, fetch_most_recent_fact_sql, -1, &dbInfo->stmt_fetch_most_recent_fact, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+        return false;
+    }
     
-    if (inMemory || sourceId == NULL) {
-        printf("Opening in-memory database\n");
-        strcpy(filename, ":memory:");
+    return true;
+}
+
+/// @brief Prepares the groups of statements in the mask that aren't yet. Cheap once they are.
+static bool needStatements(CSLDatabase *dbInfo, int groups) {
+    int missing = groups & ~dbInfo->preparedStatements;
+    
+    if (missing == 0) {
+        return true;
     }
-    else {
-        strcpy(filename, sourceId);
-        strcat(filename, ".sqlite");
-        printf("Opening on-disk database: %s\n", filename);
+    
+    uint64_t startedAt = monotonicNanoseconds();
+    bool prepared = true;
+    
+    for (int group = 0; group < STATEMENTS_GROUP_COUNT && prepared; group++) {
+        if (!(missing & (1 << group))) {
+            continue;
+        }
+        
+        switch (1 << group) {
+            case STATEMENTS_CORE: prepared = prepareCoreStatements(dbInfo); break;
+            case STATEMENTS_DELETED_ITEMS: prepared = prepareDeletedItems(dbInfo); break;
+            case STATEMENTS_TEXT: prepared = prepareTextIndex(dbInfo); break;
+            case STATEMENTS_LOCATION: prepared = prepareLocationIndex(dbInfo); break;
+            case STATEMENTS_EDGES: prepared = prepareRelationshipEdges(dbInfo); break;
+            case STATEMENTS_CHECKPOINTS: prepared = prepareCheckpoints(dbInfo); break;
+            case STATEMENTS_SYNC: prepared = prepareSync(dbInfo); break;
+            case STATEMENTS_VALUE_BLOBS: prepared = prepareValueBlobs(dbInfo); break;
+        }
+        
+        if (prepared) {
+            dbInfo->preparedStatements |= 1 << group;
+            dbInfo->openTimings.lazyPrepares++;
+        }
     }
     
-    int rc = sqlite3_open(filename, &currentDatabase->db);
-    if (rc) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+    dbInfo->openTimings.lazyPrepareNanoseconds += monotonicNanoseconds() - startedAt;
+    
+    return prepared;
+}
+
+static int schemaVersion(CSLDatabase *dbInfo) {
+    sqlite3_stmt *stmt;
+    int version = 0;
+    
+    if (sqlite3_prepare_v2(dbInfo->db, "PRAGMA user_version;", -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            version = sqlite3_column_int(stmt, 0);
+        
+        sqlite3_finalize(stmt);
     }
     
-    char *create_table_sql = "CREATE TABLE IF NOT EXISTS facts ("
+    return version;
+}
+
+/// @brief Creates (or brings up to date) the tables and indexes, unless the drive's schema version says they're current.
+static bool migrateSchema(CSLDatabase *dbInfo) {
+    int version = schemaVersion(dbInfo);
+    dbInfo->openTimings.schemaVersion = version;
+    
+    if (version >= CSL_SCHEMA_VERSION) {
+        if (version > CSL_SCHEMA_VERSION)
+            fprintf(stderr, "Drive schema version %d is newer than this build's (%d)\n", version, CSL_SCHEMA_VERSION);
+        
+        return true;
+    }
+    
+    // Lets compaction hand freed pages back incrementally; only takes effect on a new database
+    sqlite3_exec(dbInfo->db, "PRAGMA auto_vacuum = INCREMENTAL;", 0, 0, NULL);
+    
+    const char *create_table_sql = "CREATE TABLE IF NOT EXISTS facts ("
     "id INTEGER PRIMARY KEY AUTOINCREMENT,"
     "factId TEXT NOT NULL,"
     "itemId TEXT NOT NULL,"
@@ -56,137 +200,196 @@ CSLDatabase* openDatabase(const char *sourceId, bool inMemory) {
     "numericalValue REAL NOT NULL,"
     "type TEXT NOT NULL,"
     "flags INTEGER NOT NULL," // bit 0 = 1 for "removed"; none others used atm.
-    "timestamp TEXT NOT NULL" // ISO8601 strings ("YYYY-MM-DD HH:MM:SS.SSS")
+    "timestamp TEXT NOT NULL," // ISO8601 strings ("YYYY-MM-DD HH:MM:SS.SSS")
+    "typedValue" // no affinity; see Typed values
     ");";
     
-    rc = sqlite3_exec(currentDatabase->db, create_table_sql, 0, 0, &currentDatabase->error_message);
+    const char *create_indexes_sql =
+    "CREATE INDEX IF NOT EXISTS idx_timestamp ON facts (timestamp DESC);"
+    "CREATE INDEX IF NOT EXISTS idx_item_attr_timestamp ON facts (itemId, attribute, timestamp DESC);"
+    "CREATE INDEX IF NOT EXISTS idx_item_id ON facts (itemId);";
     
-    if (rc) {
-        fprintf(stderr, "SQL error: %s\n", currentDatabase->error_message);
-        sqlite3_free(currentDatabase->error_message);
-        return NULL;
-    }
+    const char *create_item_filter_sql = "CREATE TABLE IF NOT EXISTS item_filter ("
+    "id INTEGER PRIMARY KEY CHECK (id = 1),"
+    "lastFactId INTEGER NOT NULL,"
+    "hashCount INTEGER NOT NULL,"
+    "itemCount INTEGER NOT NULL,"
+    "bits BLOB NOT NULL"
+    ");";
     
-    // Create the indexes
+    bool migrated =
+    execIndexSQL(dbInfo, create_table_sql) &&
+    prepareTypedValues(dbInfo) &&
+    execIndexSQL(dbInfo, create_indexes_sql) &&
+    migrateDerivedIndexes(dbInfo) &&
+    migrateSync(dbInfo) &&
+    migrateValueBlobs(dbInfo) &&
+    execIndexSQL(dbInfo, "CREATE TABLE IF NOT EXISTS attribute_indexes (attribute TEXT PRIMARY KEY, kinds INTEGER NOT NULL) WITHOUT ROWID;") &&
+    (dbInfo->inMemory || execIndexSQL(dbInfo, create_item_filter_sql));
     
-    char *create_index_sql_1 = "CREATE INDEX IF NOT EXISTS idx_timestamp ON facts (timestamp DESC);";
+    if (!migrated) {
+        return false;
+    }
     
-    rc = sqlite3_exec(currentDatabase->db, create_index_sql_1, 0, 0, &currentDatabase->error_message);
+    // Only once every step has run, so an interrupted migration runs again
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA user_version = %d;", CSL_SCHEMA_VERSION);
     
-    if (rc) {
-        fprintf(stderr, "SQL error: %s\n", currentDatabase->error_message);
-        sqlite3_free(currentDatabase->error_message);
-        return NULL;
-    }
+    dbInfo->openTimings.migrated = true;
     
-    char *create_index_sql_2 = "CREATE INDEX IF NOT EXISTS idx_item_attr_timestamp ON facts (itemId, attribute, timestamp DESC);";
+    return execIndexSQL(dbInfo, sql);
+}
+
+/// @brief Releases a drive that failed to open.
+static CSLDatabase* abandonDatabase(CSLDatabase *dbInfo) {
+    freeAttributeIndexes(dbInfo);
+    finalizeFactsQueries(dbInfo);
     
-    rc = sqlite3_exec(currentDatabase->db, create_index_sql_2, 0, 0, &currentDatabase->error_message);
+    sqlite3_stmt *stmt;
     
-    if (rc) {
-        fprintf(stderr, "SQL error: %s\n", currentDatabase->error_message);
-        sqlite3_free(currentDatabase->error_message);
-        return NULL;
+    while ((stmt = sqlite3_next_stmt(dbInfo->db, NULL)) != NULL) {
+        sqlite3_finalize(stmt);
     }
     
-    char *create_index_sql_3 = "CREATE INDEX IF NOT EXISTS idx_item_id ON facts (itemId);";
+    sqlite3_close(dbInfo->db);
+    
+    free(dbInfo->itemFilter.bits);
+    free(dbInfo->driveId);
+    free(dbInfo);
     
-    rc = sqlite3_exec(currentDatabase->db, create_index_sql_3, 0, 0, &currentDatabase->error_message);
+    currentDatabase = NULL;
     
-    if (rc) {
-        fprintf(stderr, "SQL error: %s\n", currentDatabase->error_message);
-        sqlite3_free(currentDatabase->error_message);
-        return NULL;
+    return NULL;
+}
+
+// Measured by Benchmarks/profiles.c; see notes.md
+static const CSLProfileSettings profileSettings[CSL_PROFILE_COUNT] = {
+    [CSL_PROFILE_DURABLE] = { "durable", "DELETE", 2, 4096, -2000, 0, 0, 1000 },
+    [CSL_PROFILE_BALANCED] = { "balanced", "WAL", 1, 4096, -16384, 256ll << 20, 2, 1000 },
+    [CSL_PROFILE_EPHEMERAL] = { "ephemeral", "MEMORY", 0, 4096, -8192, 0, 2, 1000 },
+    [CSL_PROFILE_BULK] = { "bulk", "WAL", 0, 8192, -65536, 256ll << 20, 2, 0 },
+};
+
+const CSLProfileSettings* csl_profileSettings(CSLDriveProfile profile) {
+    return &profileSettings[profile < CSL_PROFILE_COUNT ? profile : CSL_PROFILE_DURABLE];
+}
+
+bool csl_profileNamed(const char *name, CSLDriveProfile *profile) {
+    for (int i = 0; i < CSL_PROFILE_COUNT; i++) {
+        if (strcmp(profileSettings[i].name, name) == 0) {
+            *profile = i;
+            return true;
+        }
     }
     
-    // TODO: Add an index for attribute + value?
+    return false;
+}
+
+/// @brief Sets the profile's pragmas; before the schema, so a new drive gets its page size.
+static void applyProfile(CSLDatabase *dbInfo, CSLDriveProfile profile) {
+    const CSLProfileSettings *settings = csl_profileSettings(profile);
     
-    // Prepare the statements
+    // In-memory drives keep their journal in memory whatever the profile says
+    char *sql = sqlite3_mprintf("PRAGMA page_size = %d; PRAGMA journal_mode = %s; PRAGMA synchronous = %d; PRAGMA cache_size = %d; "
+                                "PRAGMA mmap_size = %lld; PRAGMA temp_store = %d; PRAGMA wal_autocheckpoint = %d;",
+                                settings->pageSize, dbInfo->inMemory ? "MEMORY" : settings->journalMode, settings->synchronous,
+                                settings->cacheSize, settings->mmapSize, settings->tempStore, settings->walAutocheckpoint);
     
-    const char *insert_data_sql = "INSERT INTO facts (factId, itemId, attribute, value, numericalValue, type, flags, timestamp) VALUES (?, ?, ?, ?, ?, ?, ?, ?);";
-    rc = sqlite3_prepare_v2(currentDatabase->db, insert_data_sql, -1, &currentDatabase->stmt_insert_fact, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
-    }
+    // Not fatal: the drive still works on SQLite's defaults
+    execIndexSQL(dbInfo, sql);
+    sqlite3_free(sql);
     
-    const char *fetch_by_date_range_sql = "SELECT * FROM facts WHERE timestamp BETWEEN ? AND ?;";
-    rc = sqlite3_prepare_v2(currentDatabase->db, fetch_by_date_range_sql, -1, &currentDatabase->stmt_fetch_facts_by_date_range, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+    dbInfo->profile = profile;
+}
+
+bool csl_checkpoint(CSLDatabase *db) {
+    if (db->shardCount > 0) {
+        return checkpointShards(db);
     }
     
-    const char *fetch_by_item_id_sql = "SELECT * FROM facts WHERE itemId = ? ORDER BY timestamp DESC;";
-    rc = sqlite3_prepare_v2(currentDatabase->db, fetch_by_item_id_sql, -1, &currentDatabase->stmt_fetch_facts_by_item_id, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
-    }
+    int rc = sqlite3_wal_checkpoint_v2(db->db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
     
-    const char *fetch_by_attribute_sql = "SELECT * FROM facts WHERE attribute = ? ORDER BY timestamp DESC;";
-    rc = sqlite3_prepare_v2(currentDatabase->db, fetch_by_attribute_sql, -1, &currentDatabase->stmt_fetch_facts_by_attribute, NULL);
     if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db->db));
+        return false;
     }
     
-    const char *fetch_by_value_sql = "SELECT * FROM facts WHERE value = ? ORDER BY timestamp DESC;";
-    rc = sqlite3_prepare_v2(currentDatabase->db, fetch_by_value_sql, -1, &currentDatabase->stmt_fetch_facts_by_value, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+    return true;
+}
+
+CSLDatabase* openDatabase(const char *sourceId, bool inMemory) {
+    return openDatabaseWithProfile(sourceId, inMemory, CSL_PROFILE_DURABLE);
+}
+
+CSLDatabase* openDatabaseWithProfile(const char *sourceId, bool inMemory, CSLDriveProfile profile) {
+    // Zeroed, so statements not yet prepared are NULL
+    CSLDatabase *dbInfo = calloc(1, sizeof(CSLDatabase));
+    if (!dbInfo) {
+        fprintf(stderr, "Memory allocation error\n");
         return NULL;
     }
     
-    const char *fetch_by_item_id_attribute_sql = "SELECT * FROM facts WHERE itemId = ? AND attribute = ? ORDER BY timestamp DESC;";
-    rc = sqlite3_prepare_v2(currentDatabase->db, fetch_by_item_id_attribute_sql, -1, &currentDatabase->stmt_fetch_facts_by_item_id_attribute, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
-    }
+    currentDatabase = dbInfo;
+    dbInfo->inMemory = inMemory || sourceId == NULL;
     
-    const char *fetch_by_attribute_value_sql = "SELECT * FROM facts WHERE attribute = ? AND value = ? ORDER BY timestamp DESC;";
-    rc = sqlite3_prepare_v2(currentDatabase->db, fetch_by_attribute_value_sql, -1, &currentDatabase->stmt_fetch_facts_by_attribute_value, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
-    }
+    CSLOpenTimings *timings = &dbInfo->openTimings;
+    uint64_t openedAt = monotonicNanoseconds();
     
-    const char *fetch_by_item_id_attribute_value_sql = "SELECT * FROM facts WHERE itemId = ? AND attribute = ? AND value = ? ORDER BY timestamp DESC;";
-    rc = sqlite3_prepare_v2(currentDatabase->db, fetch_by_item_id_attribute_value_sql, -1, &currentDatabase->stmt_fetch_facts_by_item_id_attribute_value, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+    char filename[255];
+    
+    if (inMemory || sourceId == NULL) {
+        printf("Opening in-memory database\n");
+        strcpy(filename, ":memory:");
+    }
+    else {
+        strcpy(filename, sourceId);
+        strcat(filename, ".sqlite");
+        printf("Opening on-disk database: %s\n", filename);
     }
     
-    const char *fetch_by_value_range_sql = "SELECT * FROM facts WHERE numericalValue >= ? AND numericalValue <= ? ORDER BY timestamp DESC;";
-    rc = sqlite3_prepare_v2(currentDatabase->db, fetch_by_value_range_sql, -1, &currentDatabase->stmt_fetch_facts_by_value_range, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+    int rc = sqlite3_open(filename, &currentDatabase->db);
+    if (rc) {
+        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(currentDatabase->db));
+        return abandonDatabase(dbInfo);
     }
     
-    const char *fetch_by_attribute_value_range_sql = "SELECT * FROM facts WHERE attribute = ? AND numericalValue >= ? AND numericalValue <= ? ORDER BY timestamp DESC;";
-    rc = sqlite3_prepare_v2(currentDatabase->db, fetch_by_attribute_value_range_sql, -1, &currentDatabase->stmt_fetch_facts_by_attribute_value_range, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+    if (!registerValueFunctions(dbInfo)) {
+        return abandonDatabase(dbInfo);
     }
     
-    const char *fetch_by_item_id_attribute_value_range_sql = "SELECT * FROM facts WHERE itemId = ? AND attribute = ? AND numericalValue >= ? AND numericalValue <= ? ORDER BY timestamp DESC;";
-    rc = sqlite3_prepare_v2(currentDatabase->db, fetch_by_item_id_attribute_value_range_sql, -1, &currentDatabase->stmt_fetch_facts_by_item_id_attribute_value_range, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+    uint64_t phaseStartedAt = monotonicNanoseconds();
+    timings->openNanoseconds = phaseStartedAt - openedAt;
+    
+    applyProfile(dbInfo, profile);
+    
+    timings->profileNanoseconds = monotonicNanoseconds() - phaseStartedAt;
+    phaseStartedAt += timings->profileNanoseconds;
+    
+    if (!migrateSchema(dbInfo)) {
+        return abandonDatabase(dbInfo);
     }
     
-    const char *fetch_most_recent_fact_sql = "SELECT * FROM facts WHERE itemId = ? AND attribute = ?;";
-    rc = sqlite3_prepare_v2(currentDatabase->db, fetch_most_recent_fact_sql, -1, &currentDatabase->stmt_fetch_most_recent_fact, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+    timings->schemaNanoseconds = monotonicNanoseconds() - phaseStartedAt;
+    phaseStartedAt += timings->schemaNanoseconds;
+    
+    // Completes a bulk load the process didn't get to end
+    finishBulkLoad(currentDatabase);
+    
+    timings->bulkLoadRecoveryNanoseconds = monotonicNanoseconds() - phaseStartedAt;
+    phaseStartedAt += timings->bulkLoadRecoveryNanoseconds;
+    
+    if (!prepareAttributeIndexes(currentDatabase)) {
+        return abandonDatabase(dbInfo);
     }
     
+    timings->attributeIndexesNanoseconds = monotonicNanoseconds() - phaseStartedAt;
+    phaseStartedAt += timings->attributeIndexesNanoseconds;
+    
+    loadItemFilter(dbInfo);
+    
+    timings->itemFilterNanoseconds = monotonicNanoseconds() - phaseStartedAt;
+    timings->totalNanoseconds = monotonicNanoseconds() - openedAt;
+    
     if (updateFn != NULL) {
         updateFn();
     }
@@ -194,25 +397,82 @@ CSLDatabase* openDatabase(const char *sourceId, bool inMemory) {
     return dbInfo;
 }
 
+void csl_openTimings(CSLDatabase *db, CSLOpenTimings *out) {
+    *out = db->openTimings;
+}
+
 void closeDatabase(CSLDatabase *dbInfo) {
+    if (dbInfo->shardCount > 0) {
+        closeShards(dbInfo);
+        return;
+    }
+    
+    // Commits anything inserted during an unfinished read session
+    if (dbInfo->readSessionDepth > 0) {
+        dbInfo->readSessionDepth = 1;
+        csl_endRead(dbInfo);
+    }
+    
+    csl_endBulkLoad(dbInfo);
+    saveItemFilter(dbInfo);
+    free(dbInfo->itemFilter.bits);
+    sqlite3_finalize(dbInfo->itemFilter.stmt_data_version);
+    
+    freeAttributeIndexes(dbInfo);
+    
+    // Prepared queries outlive the drive, but not their statements
+    for (CSLPreparedQuery *query = dbInfo->preparedQueries; query != NULL; query = query->next) {
+        sqlite3_finalize(query->stmt);
+        query->stmt = NULL;
+        query->db = NULL;
+    }
+    
     // Finalize prepared statements
+    finalizeFactsQueries(dbInfo);
     sqlite3_finalize(dbInfo->stmt_insert_fact);
-    sqlite3_finalize(dbInfo->stmt_fetch_facts_by_date_range);
-    sqlite3_finalize(dbInfo->stmt_fetch_facts_by_item_id);
-    sqlite3_finalize(dbInfo->stmt_fetch_facts_by_attribute);
-    sqlite3_finalize(dbInfo->stmt_fetch_facts_by_value);
-    sqlite3_finalize(dbInfo->stmt_fetch_facts_by_item_id_attribute);
-    sqlite3_finalize(dbInfo->stmt_fetch_facts_by_attribute_value);
-    sqlite3_finalize(dbInfo->stmt_fetch_facts_by_item_id_attribute_value);
-    sqlite3_finalize(dbInfo->stmt_fetch_facts_by_value_range);
-    sqlite3_finalize(dbInfo->stmt_fetch_facts_by_attribute_value_range);
-    sqlite3_finalize(dbInfo->stmt_fetch_facts_by_item_id_attribute_value_range);
+    sqlite3_finalize(dbInfo->stmt_fetch_activity_buckets);
     sqlite3_finalize(dbInfo->stmt_fetch_most_recent_fact);
+    sqlite3_finalize(dbInfo->stmt_latest_live_fact);
+    sqlite3_finalize(dbInfo->stmt_deleted_item_insert);
+    sqlite3_finalize(dbInfo->stmt_deleted_item_delete);
+    sqlite3_finalize(dbInfo->stmt_text_current);
+    sqlite3_finalize(dbInfo->stmt_text_current_upsert);
+    sqlite3_finalize(dbInfo->stmt_text_current_delete);
+    sqlite3_finalize(dbInfo->stmt_text_index_insert);
+    sqlite3_finalize(dbInfo->stmt_text_index_delete);
+    sqlite3_finalize(dbInfo->stmt_search_text);
+    sqlite3_finalize(dbInfo->stmt_location_item_set_latitude);
+    sqlite3_finalize(dbInfo->stmt_location_item_set_longitude);
+    sqlite3_finalize(dbInfo->stmt_location_item);
+    sqlite3_finalize(dbInfo->stmt_location_index_upsert);
+    sqlite3_finalize(dbInfo->stmt_location_index_delete);
+    sqlite3_finalize(dbInfo->stmt_fetch_items_in_box);
+    sqlite3_finalize(dbInfo->stmt_edge_delete);
+    sqlite3_finalize(dbInfo->stmt_edge_upsert);
+    sqlite3_finalize(dbInfo->stmt_edges_from);
+    sqlite3_finalize(dbInfo->stmt_edges_to);
+    sqlite3_finalize(dbInfo->stmt_checkpoint_for_time);
+    sqlite3_finalize(dbInfo->stmt_checkpoint_facts);
+    sqlite3_finalize(dbInfo->stmt_facts_since_checkpoint);
+    sqlite3_finalize(dbInfo->stmt_attribute_as_of);
+    sqlite3_finalize(dbInfo->stmt_count_since_checkpoint);
+    sqlite3_finalize(dbInfo->stmt_item_latest);
+    sqlite3_finalize(dbInfo->stmt_checkpoint_insert);
+    sqlite3_finalize(dbInfo->stmt_checkpoint_fact_insert);
+    sqlite3_finalize(dbInfo->stmt_sync_fact_exists);
+    sqlite3_finalize(dbInfo->stmt_sync_origin_insert);
+    sqlite3_finalize(dbInfo->stmt_sync_watermark);
+    sqlite3_finalize(dbInfo->stmt_sync_watermark_upsert);
+    sqlite3_finalize(dbInfo->stmt_sync_facts_after);
+    sqlite3_finalize(dbInfo->valueBlobs.stmt_lookup);
+    sqlite3_finalize(dbInfo->valueBlobs.stmt_store);
     
     // Close the database
     sqlite3_close(dbInfo->db);
     
     // Free allocated memory
+    free(dbInfo->driveId);
+    free(dbInfo->valueBlobs.scratch);
     free(dbInfo);
 }
 
@@ -225,437 +485,4986 @@ static void switchDatabase(CSLDatabase *dbInfo) {
     currentDatabase = dbInfo;
 }
 
-// MARK: - SQLite Queries
+// MARK: - Statistics
 
-void runQuery(sqlite3_stmt *stmt, CFactsCollection *collection) {
-    int rc;
-    
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        CFact fact;
-        
-        fact.uid = sqlite3_column_int(stmt, 0);
-        
-        const char* factIdText = (const char*)sqlite3_column_text(stmt, 1);
-        fact.factId = malloc(strlen(factIdText) + 1);
-        strcpy(fact.factId, factIdText);
-        
-        const char* itemIdText = (const char*)sqlite3_column_text(stmt, 2);
-        fact.itemId = malloc(strlen(itemIdText) + 1);
-        strcpy(fact.itemId, itemIdText);
-        
-        const char* attributeText = (const char*)sqlite3_column_text(stmt, 3);
-        fact.attribute = malloc(strlen(attributeText) + 1);
-        strcpy(fact.attribute, attributeText);
-        
-        const char* valueText = (const char*)sqlite3_column_text(stmt, 4);
-        fact.value = malloc(strlen(valueText) + 1);
-        strcpy(fact.value, valueText);
-        
-        fact.numericalValue = sqlite3_column_double(stmt, 5);
-        
-        const char* typeText = (const char*)sqlite3_column_text(stmt, 6);
-        fact.type = malloc(strlen(typeText) + 1);
-        strcpy(fact.type, typeText);
-        
-        fact.flags = sqlite3_column_int(stmt, 7);
-        
-        const char* timestampText = (const char*)sqlite3_column_text(stmt, 8);
-        fact.timestamp = malloc(strlen(timestampText) + 1);
-        strcpy(fact.timestamp, timestampText);
-        
-        collection->facts = realloc(collection->facts, (collection->count + 1) * sizeof(CFact));
-        collection->facts[collection->count++] = fact;
+static uint64_t monotonicNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#ifdef STORE_STATS
+
+static int histogramBucketIndex(uint64_t value) {
+    if (value < CSL_HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
     }
     
-#ifdef STORE_LOG
-    printf("Fetched %d facts\n", collection->count);
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - CSL_HISTOGRAM_SUB_BUCKET_BITS;
+    int magnitude = shift + 1;
     
-    for (int x = 0; x < collection->count; x++) {
-        printf("  %s %s %s %f\n", collection->facts[x].itemId, collection->facts[x].attribute, collection->facts[x].value, collection->facts[x].numericalValue);
+    if (magnitude >= CSL_HISTOGRAM_MAGNITUDES) {
+        return CSL_HISTOGRAM_BUCKETS - 1;
     }
-#endif
     
-    if (rc != SQLITE_DONE)
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+    int subBucket = (int)((value >> shift) & (CSL_HISTOGRAM_SUB_BUCKETS - 1));
+    
+    return magnitude * CSL_HISTOGRAM_SUB_BUCKETS + subBucket;
 }
 
-CFactsCollection* fetchFactsByDateRange(const char *startDate, const char *endDate) {
-    int rc = sqlite3_reset(currentDatabase->stmt_fetch_facts_by_date_range);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
-    }
-    
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_date_range, 1, startDate, -1, SQLITE_STATIC);
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_date_range, 2, endDate, -1, SQLITE_STATIC);
+static void recordStatement(CSLDatabase *db, CSLStatementKind kind, uint64_t rows, uint64_t bytes, uint64_t startedAt) {
+    uint64_t elapsed = monotonicNanoseconds() - startedAt;
+    CSLStatementStats *stats = &db->stats[kind];
     
-    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
-    collection->count = 0;
-    collection->facts = NULL;
+    stats->calls++;
+    stats->rows += rows;
+    stats->bytes += bytes;
+    stats->totalNanoseconds += elapsed;
     
-    runQuery(currentDatabase->stmt_fetch_facts_by_date_range, collection);
+    if (elapsed > stats->maxNanoseconds)
+        stats->maxNanoseconds = elapsed;
     
-    return collection;
+    stats->latencyBuckets[histogramBucketIndex(elapsed)]++;
 }
+#endif
 
-CFactsCollection* fetchFactsByItemId(const char *itemId) {
-    int rc = sqlite3_reset(currentDatabase->stmt_fetch_facts_by_item_id);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+/// @brief The highest value that lands in the given histogram bucket.
+static uint64_t histogramBucketHighestValue(int index) {
+    if (index < CSL_HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)index;
     }
     
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_item_id, 1, itemId, -1, SQLITE_STATIC);
+    int magnitude = index / CSL_HISTOGRAM_SUB_BUCKETS;
+    uint64_t subBucket = (uint64_t)(index % CSL_HISTOGRAM_SUB_BUCKETS);
+    uint64_t lowest = (CSL_HISTOGRAM_SUB_BUCKETS + subBucket) << (magnitude - 1);
     
-    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
-    collection->count = 0;
-    collection->facts = NULL;
-    
-    runQuery(currentDatabase->stmt_fetch_facts_by_item_id, collection);
-    
-    return collection;
+    return lowest + (1ull << (magnitude - 1)) - 1;
 }
 
-CFactsCollection* fetchFactsByAttribute(const char *attribute) {
-    int rc = sqlite3_reset(currentDatabase->stmt_fetch_facts_by_attribute);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+bool csl_statsEnabled(void) {
+#ifdef STORE_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+const char* csl_statementName(CSLStatementKind kind) {
+    switch (kind) {
+        case CSL_STMT_INSERT_FACT: return "insert_fact";
+        case CSL_STMT_FETCH_FACTS_BY_DATE_RANGE: return "fetch_facts_by_date_range";
+        case CSL_STMT_FETCH_FACTS_BY_ITEM_ID: return "fetch_facts_by_item_id";
+        case CSL_STMT_FETCH_FACTS_BY_ATTRIBUTE: return "fetch_facts_by_attribute";
+        case CSL_STMT_FETCH_FACTS_BY_VALUE: return "fetch_facts_by_value";
+        case CSL_STMT_FETCH_FACTS_BY_ITEM_ID_ATTRIBUTE: return "fetch_facts_by_item_id_attribute";
+        case CSL_STMT_FETCH_FACTS_BY_ATTRIBUTE_VALUE: return "fetch_facts_by_attribute_value";
+        case CSL_STMT_FETCH_FACTS_BY_ITEM_ID_ATTRIBUTE_VALUE: return "fetch_facts_by_item_id_attribute_value";
+        case CSL_STMT_FETCH_FACTS_BY_VALUE_RANGE: return "fetch_facts_by_value_range";
+        case CSL_STMT_FETCH_FACTS_BY_ATTRIBUTE_VALUE_RANGE: return "fetch_facts_by_attribute_value_range";
+        case CSL_STMT_FETCH_FACTS_BY_ITEM_ID_ATTRIBUTE_VALUE_RANGE: return "fetch_facts_by_item_id_attribute_value_range";
+        case CSL_STMT_FETCH_MOST_RECENT_FACT: return "fetch_most_recent_fact";
+        case CSL_STMT_FETCH_ACTIVITY_BUCKETS: return "fetch_activity_buckets";
+        case CSL_STMT_SEARCH_TEXT: return "search_text";
+        case CSL_STMT_FETCH_ITEMS_IN_BOX: return "fetch_items_in_box";
+        case CSL_STMT_FETCH_EDGES: return "fetch_edges";
+        case CSL_STMT_FETCH_CHECKPOINT_FACTS: return "fetch_checkpoint_facts";
+        case CSL_STMT_FETCH_FACTS_SINCE_CHECKPOINT: return "fetch_facts_since_checkpoint";
+        case CSL_STMT_FETCH_ATTRIBUTE_AS_OF: return "fetch_attribute_as_of";
+        case CSL_STMT_PREPARED_QUERY: return "prepared_query";
+        case CSL_STMT_FETCH_BY_ATTRIBUTE_INDEX: return "fetch_by_attribute_index";
+        case CSL_STMT_AGGREGATE: return "aggregate";
+        case CSL_STMT_FETCH_FACTS_BY_QUERY: return "fetch_facts_by_query";
+        case CSL_STMT_ADHOC: return "adhoc";
+        default: return "unknown";
+    }
+}
+
+void csl_snapshotStatementStats(CSLDatabase* db, CSLStatementStats* out) {
+#ifdef STORE_STATS
+    memcpy(out, db->stats, sizeof(db->stats));
+#else
+    (void)db;
+    memset(out, 0, CSL_STMT_COUNT * sizeof(CSLStatementStats));
+#endif
+}
+
+void csl_resetStatementStats(CSLDatabase* db) {
+#ifdef STORE_STATS
+    memset(db->stats, 0, sizeof(db->stats));
+#else
+    (void)db;
+#endif
+}
+
+uint64_t csl_statsValueAtPercentile(const CSLStatementStats* stats, double percentile) {
+    if (stats->calls == 0) {
+        return 0;
     }
     
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_attribute, 1, attribute, -1, SQLITE_STATIC);
+    uint64_t target = (uint64_t)((percentile / 100.0) * (double)stats->calls + 0.5);
     
-    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
-    collection->count = 0;
-    collection->facts = NULL;
+    if (target < 1)
+        target = 1;
     
-    runQuery(currentDatabase->stmt_fetch_facts_by_attribute, collection);
+    uint64_t seen = 0;
     
-    return collection;
+    for (int i = 0; i < CSL_HISTOGRAM_BUCKETS; i++) {
+        seen += stats->latencyBuckets[i];
+        
+        if (seen >= target) {
+            uint64_t value = histogramBucketHighestValue(i);
+            return value < stats->maxNanoseconds ? value : stats->maxNanoseconds;
+        }
+    }
+    
+    return stats->maxNanoseconds;
 }
 
-CFactsCollection* fetchFactsByValue(const char *value) {
-    int rc = sqlite3_reset(currentDatabase->stmt_fetch_facts_by_value);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+void csl_printStatementStats(CSLDatabase* db, const char* label, FILE* out) {
+    if (!csl_statsEnabled()) {
+        fprintf(out, "Store stats are disabled; define STORE_STATS to record them.\n");
+        return;
     }
     
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_value, 1, value, -1, SQLITE_STATIC);
+    CSLStatementStats stats[CSL_STMT_COUNT];
+    csl_snapshotStatementStats(db, stats);
     
-    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
-    collection->count = 0;
-    collection->facts = NULL;
-    
-    runQuery(currentDatabase->stmt_fetch_facts_by_value, collection);
+    fprintf(out, "Statement stats for %s\n", label != NULL ? label : "drive");
+    fprintf(out, "  %-46s %9s %10s %12s %10s %10s %10s %10s %10s\n", "statement", "calls", "rows", "bytes", "mean us", "p50 us", "p90 us", "p99 us", "max us");
     
-    return collection;
+    for (int kind = 0; kind < CSL_STMT_COUNT; kind++) {
+        const CSLStatementStats *s = &stats[kind];
+        
+        if (s->calls == 0)
+            continue;
+        
+        fprintf(out, "  %-46s %9llu %10llu %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                csl_statementName(kind),
+                (unsigned long long)s->calls,
+                (unsigned long long)s->rows,
+                (unsigned long long)s->bytes,
+                (double)s->totalNanoseconds / (double)s->calls / 1000.0,
+                (double)csl_statsValueAtPercentile(s, 50) / 1000.0,
+                (double)csl_statsValueAtPercentile(s, 90) / 1000.0,
+                (double)csl_statsValueAtPercentile(s, 99) / 1000.0,
+                (double)s->maxNanoseconds / 1000.0);
+    }
 }
 
-CFactsCollection* fetchFactsByItemIdAttribute(const char *itemId, const char *attribute) {
-    int rc = sqlite3_reset(currentDatabase->stmt_fetch_facts_by_item_id_attribute);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+// MARK: - Typed values
+//  Alongside the text form in `value`, typedValue holds each non-text value in
+//  its own SQLite storage class, so comparisons and range predicates are exact
+//  and indexed by (attribute, typedValue):
+//    integer             INTEGER
+//    number, timestamp   INTEGER when integral (and exactly representable), else REAL
+//    boolean             INTEGER 0 or 1
+//    blob                BLOB (value holds '')
+//  Text types (string, itemId, anything unrecognised) and null leave typedValue
+//  NULL. numericalValue is only stored for text types; for typed rows it's read
+//  back from typedValue.
+
+#define MAX_EXACT_DOUBLE_INTEGER 9007199254740992.0 // 2^53
+
+static bool isTypedKind(CFactValueKind kind) {
+    return kind == CFACT_VALUE_INTEGER || kind == CFACT_VALUE_NUMBER || kind == CFACT_VALUE_BOOLEAN ||
+    kind == CFACT_VALUE_TIMESTAMP || kind == CFACT_VALUE_BLOB;
+}
+
+static void bindNumber(sqlite3_stmt *stmt, int index, double number) {
+    if (number == (double)(int64_t)number && fabs(number) < MAX_EXACT_DOUBLE_INTEGER)
+        sqlite3_bind_int64(stmt, index, (int64_t)number);
+    else
+        sqlite3_bind_double(stmt, index, number);
+}
+
+/// @brief Binds a fact's value, numericalValue and typedValue parameters for its type.
+static void bindTypedValue(sqlite3_stmt *stmt, int valueIndex, int numericalIndex, int typedIndex,
+                           const char *type, const char *value, double numericalValue) {
+    CFactValueKind kind = factValueKind(type);
+    
+    if (value == NULL) {
+        value = "";
     }
     
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_item_id_attribute, 1, itemId, -1, SQLITE_STATIC);
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_item_id_attribute, 2, attribute, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, valueIndex, kind == CFACT_VALUE_BLOB ? "" : value, -1, SQLITE_STATIC);
+    sqlite3_bind_double(stmt, numericalIndex, isTypedKind(kind) ? 0 : numericalValue);
     
-    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
-    collection->count = 0;
-    collection->facts = NULL;
+    switch (kind) {
+        case CFACT_VALUE_INTEGER: {
+            char *end;
+            long long integer = strtoll(value, &end, 10);
+            
+            // The text is exact; numericalValue may have lost precision
+            if (*value != '\0' && *end == '\0')
+                sqlite3_bind_int64(stmt, typedIndex, integer);
+            else
+                sqlite3_bind_int64(stmt, typedIndex, (sqlite3_int64)numericalValue);
+            break;
+        }
+        case CFACT_VALUE_NUMBER:
+        case CFACT_VALUE_TIMESTAMP:
+            bindNumber(stmt, typedIndex, numericalValue);
+            break;
+        case CFACT_VALUE_BOOLEAN:
+            sqlite3_bind_int(stmt, typedIndex, strcmp(value, "true") == 0 || (*value == '\0' && numericalValue != 0));
+            break;
+        case CFACT_VALUE_BLOB:
+            sqlite3_bind_blob(stmt, typedIndex, value, (int)strlen(value), SQLITE_STATIC);
+            break;
+        default:
+            sqlite3_bind_null(stmt, typedIndex);
+            break;
+    }
+}
+
+/// @brief Binds a typed value as a comparison bound, in the storage class typedValue would hold it in.
+static void bindFactValue(sqlite3_stmt *stmt, int index, const CFactValue *value) {
+    switch (value->kind) {
+        case CFACT_VALUE_INTEGER: sqlite3_bind_int64(stmt, index, value->integer); break;
+        case CFACT_VALUE_NUMBER:
+        case CFACT_VALUE_TIMESTAMP: bindNumber(stmt, index, value->number); break;
+        case CFACT_VALUE_BOOLEAN: sqlite3_bind_int(stmt, index, value->boolean); break;
+        case CFACT_VALUE_TEXT:
+        case CFACT_VALUE_ITEM_ID: sqlite3_bind_text(stmt, index, value->text, -1, SQLITE_STATIC); break;
+        case CFACT_VALUE_BLOB: sqlite3_bind_blob(stmt, index, value->blob.bytes, value->blob.length, SQLITE_STATIC); break;
+        case CFACT_VALUE_NULL: sqlite3_bind_null(stmt, index); break;
+    }
+}
+
+/// @brief Binds whether a range's bounds are booleans. Booleans are stored as 0 and 1 in typedValue,
+/// so range SQL also matches on (type = 'boolean') to keep them and numbers apart (as aggregates do).
+static void bindBooleanRange(sqlite3_stmt *stmt, int index, const CFactValue *low, const CFactValue *high) {
+    const CFactValue *bound = low != NULL ? low : high;
+    sqlite3_bind_int(stmt, index, bound != NULL && bound->kind == CFACT_VALUE_BOOLEAN);
+}
+
+// These read a row in the facts table's column order (SELECT * or f.*)
+
+static double storedNumericalValue(sqlite3_stmt *stmt) {
+    int storage = sqlite3_column_type(stmt, 9);
     
-    runQuery(currentDatabase->stmt_fetch_facts_by_item_id_attribute, collection);
+    if ((storage == SQLITE_INTEGER || storage == SQLITE_FLOAT) && factValueKind((const char *)sqlite3_column_text(stmt, 6)) != CFACT_VALUE_BOOLEAN) {
+        return sqlite3_column_double(stmt, 9);
+    }
     
-    return collection;
+    return sqlite3_column_double(stmt, 5);
 }
 
-CFactsCollection* fetchFactsByAttributeAndValue(const char *attribute, const char *value) {
-    int rc = sqlite3_reset(currentDatabase->stmt_fetch_facts_by_attribute_value);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
-    }
+/// @brief Adds typedValue to a facts table (or archive) from before it existed, moving typed values into it.
+static bool addTypedValueColumn(CSLDatabase *dbInfo, const char *table) {
+    sqlite3_stmt *stmt;
+    char *sql = sqlite3_mprintf("SELECT typedValue FROM %s LIMIT 0;", table);
+    bool exists = sqlite3_prepare_v2(dbInfo->db, sql, -1, &stmt, NULL) == SQLITE_OK;
     
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_attribute_value, 1, attribute, -1, SQLITE_STATIC);
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_attribute_value, 2, value, -1, SQLITE_STATIC);
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
     
-    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
-    collection->count = 0;
-    collection->facts = NULL;
+    if (exists) {
+        return true;
+    }
     
-    runQuery(currentDatabase->stmt_fetch_facts_by_attribute_value, collection);
+    sql = sqlite3_mprintf("BEGIN IMMEDIATE;"
+                          "ALTER TABLE %s ADD COLUMN typedValue;"
+                          "UPDATE %s SET "
+                          "typedValue = CASE type "
+                          "WHEN 'integer' THEN CAST(value AS INTEGER) "
+                          "WHEN 'boolean' THEN (value = 'true') "
+                          "WHEN 'blob' THEN CAST(value AS BLOB) "
+                          "ELSE (CASE WHEN numericalValue = CAST(numericalValue AS INTEGER) AND abs(numericalValue) < %.1f "
+                          "THEN CAST(numericalValue AS INTEGER) ELSE numericalValue END) END, "
+                          "value = CASE type WHEN 'blob' THEN '' ELSE value END, "
+                          "numericalValue = 0 "
+                          "WHERE type IN ('integer', 'number', 'timestamp', 'boolean', 'blob');"
+                          "COMMIT;", table, table, MAX_EXACT_DOUBLE_INTEGER);
     
-    return collection;
+    int rc = sqlite3_exec(dbInfo->db, sql, 0, 0, &dbInfo->error_message);
+    sqlite3_free(sql);
+    
+    if (rc) {
+        fprintf(stderr, "SQL error: %s\n", dbInfo->error_message);
+        sqlite3_free(dbInfo->error_message);
+        sqlite3_exec(dbInfo->db, "ROLLBACK;", 0, 0, NULL);
+        return false;
+    }
+    
+    return true;
 }
 
-CFactsCollection* fetchFactsByItemIdAttributeAndValue(const char *itemId, const char *attribute, const char *value) {
-    int rc = sqlite3_reset(currentDatabase->stmt_fetch_facts_by_item_id_attribute_value);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+static bool prepareTypedValues(CSLDatabase *dbInfo) {
+    if (!addTypedValueColumn(dbInfo, "main.facts")) {
+        return false;
     }
     
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_item_id_attribute_value, 1, itemId, -1, SQLITE_STATIC);
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_item_id_attribute_value, 2, attribute, -1, SQLITE_STATIC);
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_item_id_attribute_value, 3, value, -1, SQLITE_STATIC);
+    int rc = sqlite3_exec(dbInfo->db, "CREATE INDEX IF NOT EXISTS idx_attribute_typed_value ON facts (attribute, typedValue) WHERE typedValue IS NOT NULL;", 0, 0, &dbInfo->error_message);
     
-    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
-    collection->count = 0;
-    collection->facts = NULL;
+    if (rc) {
+        fprintf(stderr, "SQL error: %s\n", dbInfo->error_message);
+        sqlite3_free(dbInfo->error_message);
+        return false;
+    }
     
-    runQuery(currentDatabase->stmt_fetch_facts_by_item_id_attribute_value, collection);
+    return true;
+}
+
+// MARK: - Value blobs
+//  Values of at least the drive's threshold (recorded in drive_info as
+//  'valueBlobThreshold') live in value_blobs, keyed by a 128-bit hash of the
+//  text: edits that write an identical value again share one copy, and long
+//  notes don't widen every facts row a scan has to step over. facts.value
+//  holds the hash as a BLOB, which no text value compares equal to, so
+//  equality binds the hash of a long value instead of its text. The text is
+//  deflated when that saves at least an eighth; it's only inflated when a fact
+//  is read (readFact, or fact_value() in SQL, as the text index uses).
+//  Triggers keep each blob's count of facts rows and drop it at zero.
+//  Blob-stored values sort after every text value, so ranges and value
+//  groupings over long values order them by hash.
+
+#define VALUE_BLOB_HASH_BYTES 16
+#define VALUE_BLOB_STORED 0
+#define VALUE_BLOB_DEFLATED 1
+
+static uint64_t mixHash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
     
-    return collection;
+    return hash;
 }
 
-CFactsCollection* fetchFactsByValueRange(double startValue, double endValue) {
-    int rc = sqlite3_reset(currentDatabase->stmt_fetch_facts_by_value_range);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+/// @brief Two FNV-1a lanes from different bases, each finished with a 64-bit mixer.
+static void valueHash(const char *value, size_t length, uint8_t hash[VALUE_BLOB_HASH_BYTES]) {
+    uint64_t lanes[2] = { 0xcbf29ce484222325ull, 0x84222325cbf29ce4ull ^ length };
+    
+    for (size_t i = 0; i < length; i++) {
+        lanes[0] = (lanes[0] ^ (unsigned char)value[i]) * 0x100000001b3ull;
+        lanes[1] = (lanes[1] ^ (unsigned char)value[i]) * 0x100000001b3ull;
     }
     
-    sqlite3_bind_double(currentDatabase->stmt_fetch_facts_by_value_range, 1, startValue);
-    sqlite3_bind_double(currentDatabase->stmt_fetch_facts_by_value_range, 2, endValue);
+    for (int lane = 0; lane < 2; lane++) {
+        uint64_t mixed = mixHash(lanes[lane] + length);
+        
+        for (int i = 0; i < 8; i++) {
+            hash[lane * 8 + i] = (uint8_t)(mixed >> (i * 8));
+        }
+    }
+}
+
+static bool prepareValueBlobs(CSLDatabase *dbInfo) {
+    CSLValueBlobs *blobs = &dbInfo->valueBlobs;
+    sqlite3_stmt *stmt;
     
-    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
-    collection->count = 0;
-    collection->facts = NULL;
+    if (!prepareIndexStatement(dbInfo, "SELECT value FROM drive_info WHERE key = 'valueBlobThreshold';", &stmt)) {
+        return false;
+    }
     
-    runQuery(currentDatabase->stmt_fetch_facts_by_value_range, collection);
+    // Drives from before value blobs are migrated first, so they all have one
+    blobs->threshold = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : CSL_VALUE_BLOB_THRESHOLD;
+    sqlite3_finalize(stmt);
     
-    return collection;
+    return
+    prepareIndexStatement(dbInfo, "SELECT encoding, length, bytes FROM value_blobs WHERE hash = ?;", &blobs->stmt_lookup) &&
+    prepareIndexStatement(dbInfo, "INSERT INTO value_blobs (hash, length, encoding, bytes, refs) VALUES (?, ?, ?, ?, 0);", &blobs->stmt_store);
 }
 
-CFactsCollection* fetchFactsByAttributeAndValueRange(const char *attribute, double startValue, double endValue) {
-    int rc = sqlite3_reset(currentDatabase->stmt_fetch_facts_by_attribute_value_range);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+/// @brief Whether a value is stored as a blob on this drive (typed blobs are already out of `value`).
+static bool isBlobStoredValue(CSLDatabase *dbInfo, const char *type, const char *value, size_t *length) {
+    if (value == NULL || (type != NULL && factValueKind(type) == CFACT_VALUE_BLOB)) {
+        return false;
     }
     
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_attribute_value_range, 1, attribute, -1, SQLITE_STATIC);
-    sqlite3_bind_double(currentDatabase->stmt_fetch_facts_by_attribute_value_range, 2, startValue);
-    sqlite3_bind_double(currentDatabase->stmt_fetch_facts_by_attribute_value_range, 3, endValue);
-    
-    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
-    collection->count = 0;
-    collection->facts = NULL;
-    
-    runQuery(currentDatabase->stmt_fetch_facts_by_attribute_value_range, collection);
+    *length = strlen(value);
     
-    return collection;
+    return *length >= (size_t)dbInfo->valueBlobs.threshold && dbInfo->valueBlobs.threshold > 0;
 }
 
-CFactsCollection* fetchFactsByItemIdAttributeAndValueRange(const char *itemId, const char *attribute, double startValue, double endValue) {
-    int rc = sqlite3_reset(currentDatabase->stmt_fetch_facts_by_item_id_attribute_value_range);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+/// @brief The text of the blob with this hash, or NULL (with an error) if there's no such blob.
+static char* loadValueBlob(CSLDatabase *dbInfo, const void *hash, int hashLength, uint64_t *bytes) {
+    if (!needStatements(dbInfo, STATEMENTS_VALUE_BLOBS)) {
         return NULL;
     }
     
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_item_id_attribute_value_range, 1, itemId, -1, SQLITE_STATIC);
-    sqlite3_bind_text(currentDatabase->stmt_fetch_facts_by_item_id_attribute_value_range, 2, attribute, -1, SQLITE_STATIC);
-    sqlite3_bind_double(currentDatabase->stmt_fetch_facts_by_item_id_attribute_value_range, 3, startValue);
-    sqlite3_bind_double(currentDatabase->stmt_fetch_facts_by_item_id_attribute_value_range, 4, endValue);
+    sqlite3_stmt *stmt = dbInfo->valueBlobs.stmt_lookup;
+    char *value = NULL;
     
-    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
-    collection->count = 0;
-    collection->facts = NULL;
+    sqlite3_bind_blob(stmt, 1, hash, hashLength, SQLITE_STATIC);
+    
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        int encoding = sqlite3_column_int(stmt, 0);
+        uLongf length = (uLongf)sqlite3_column_int64(stmt, 1);
+        const Bytef *stored = sqlite3_column_blob(stmt, 2);
+        uLong storedLength = (uLong)sqlite3_column_bytes(stmt, 2);
+        
+        value = malloc(length + 1);
+        
+        if (encoding == VALUE_BLOB_DEFLATED) {
+            if (uncompress((Bytef *)value, &length, stored, storedLength) != Z_OK) {
+                fprintf(stderr, "Value blob error: can't inflate a value\n");
+                length = 0;
+            }
+        }
+        else {
+            memcpy(value, stored, storedLength < length ? storedLength : length);
+        }
+        
+        value[length] = '\0';
+        
+        if (bytes != NULL)
+            *bytes += length;
+    }
+    else {
+        fprintf(stderr, "Value blob error: missing value blob\n");
+    }
     
-    runQuery(currentDatabase->stmt_fetch_facts_by_item_id_attribute_value_range, collection);
+    sqlite3_reset(stmt);
     
-    return collection;
+    return value;
 }
 
-CFact* fetchMostRecentFact(const char *itemId, const char *attribute) {
-    int rc = sqlite3_reset(currentDatabase->stmt_fetch_most_recent_fact);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
-        return NULL;
+/// @brief Stores a long value if the drive doesn't already hold it, filling in its hash.
+/// @return Whether the value is in value_blobs under the hash: false only if a different value already has it.
+static bool storeValueBlob(CSLDatabase *dbInfo, const char *value, size_t length, uint8_t hash[VALUE_BLOB_HASH_BYTES]) {
+    if (!needStatements(dbInfo, STATEMENTS_VALUE_BLOBS)) {
+        return false;
     }
     
-    sqlite3_bind_text(currentDatabase->stmt_fetch_most_recent_fact, 1, itemId, -1, SQLITE_STATIC);
-    sqlite3_bind_text(currentDatabase->stmt_fetch_most_recent_fact, 2, attribute, -1, SQLITE_STATIC);
+    valueHash(value, length, hash);
     
-    CFact* fact = NULL;
+    sqlite3_stmt *stmt = dbInfo->valueBlobs.stmt_lookup;
+    sqlite3_bind_blob(stmt, 1, hash, VALUE_BLOB_HASH_BYTES, SQLITE_STATIC);
+    bool exists = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_reset(stmt);
     
-    if (sqlite3_step(currentDatabase->stmt_fetch_most_recent_fact) == SQLITE_ROW) {
-        fact = malloc(sizeof(CFact));
-        
-        fact->uid = sqlite3_column_int(currentDatabase->stmt_fetch_most_recent_fact, 0);
-        
-        const char* factIdText = (const char*)sqlite3_column_text(currentDatabase->stmt_fetch_most_recent_fact, 1);
-        fact->factId = malloc(strlen(factIdText) + 1);
-        strcpy(fact->factId, factIdText);
-        
-        const char* itemIdText = (const char*)sqlite3_column_text(currentDatabase->stmt_fetch_most_recent_fact, 2);
-        fact->itemId = malloc(strlen(itemIdText) + 1);
-        strcpy(fact->itemId, itemIdText);
-        
-        const char* attributeText = (const char*)sqlite3_column_text(currentDatabase->stmt_fetch_most_recent_fact, 3);
-        fact->attribute = malloc(strlen(attributeText) + 1);
-        strcpy(fact->attribute, attributeText);
-        
-        const char* valueText = (const char*)sqlite3_column_text(currentDatabase->stmt_fetch_most_recent_fact, 4);
-        fact->value = malloc(strlen(valueText) + 1);
-        strcpy(fact->value, valueText);
-        
-        fact->numericalValue = sqlite3_column_double(currentDatabase->stmt_fetch_most_recent_fact, 5);
-        
-        const char* typeText = (const char*)sqlite3_column_text(currentDatabase->stmt_fetch_most_recent_fact, 6);
-        fact->type = malloc(strlen(typeText) + 1);
-        strcpy(fact->type, typeText);
+    if (exists) {
+        // A collision would hand another value back on read
+        char *stored = loadValueBlob(dbInfo, hash, VALUE_BLOB_HASH_BYTES, NULL);
+        bool same = stored != NULL && strlen(stored) == length && memcmp(stored, value, length) == 0;
+        free(stored);
         
-        fact->flags = sqlite3_column_int(currentDatabase->stmt_fetch_most_recent_fact, 7);
+        if (!same)
+            fprintf(stderr, "Value blob error: another value has this value's hash\n");
         
-        const char* timestampText = (const char*)sqlite3_column_text(currentDatabase->stmt_fetch_most_recent_fact, 8);
-        fact->timestamp = malloc(strlen(timestampText) + 1);
-        strcpy(fact->timestamp, timestampText);
+        return same;
     }
     
-    return fact;
+    uLongf deflatedLength = compressBound((uLong)length);
+    Bytef *deflated = malloc(deflatedLength);
+    bool deflates = compress2(deflated, &deflatedLength, (const Bytef *)value, (uLong)length, Z_DEFAULT_COMPRESSION) == Z_OK &&
+    deflatedLength < length - length / 8;
+    
+    stmt = dbInfo->valueBlobs.stmt_store;
+    sqlite3_bind_blob(stmt, 1, hash, VALUE_BLOB_HASH_BYTES, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)length);
+    sqlite3_bind_int(stmt, 3, deflates ? VALUE_BLOB_DEFLATED : VALUE_BLOB_STORED);
+    
+    if (deflates)
+        sqlite3_bind_blob(stmt, 4, deflated, (int)deflatedLength, SQLITE_STATIC);
+    else
+        sqlite3_bind_blob(stmt, 4, value, (int)length, SQLITE_STATIC);
+    
+    bool stored = sqlite3_step(stmt) == SQLITE_DONE;
+    
+    if (!stored)
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+    
+    sqlite3_reset(stmt);
+    free(deflated);
+    
+    return stored;
 }
 
-// MARK: - Insert
+/// @brief Rebinds a fact's value parameter to its blob's hash, if it's long enough to be stored as one.
+/// @return false if it couldn't be stored. Lookups bind a long value's hash (see bindValueText), so it
+/// mustn't be stored inline instead.
+static bool bindStoredValue(CSLDatabase *dbInfo, sqlite3_stmt *stmt, int index, const char *type, const char *value) {
+    size_t length;
+    uint8_t hash[VALUE_BLOB_HASH_BYTES];
+    
+    if (!isBlobStoredValue(dbInfo, type, value, &length)) {
+        return true;
+    }
+    
+    if (!storeValueBlob(dbInfo, value, length, hash)) {
+        return false;
+    }
+    
+    sqlite3_bind_blob(stmt, index, hash, VALUE_BLOB_HASH_BYTES, SQLITE_TRANSIENT);
+    
+    return true;
+}
 
-void csl_insertFact(CSLDatabase *db,
-                    const char *factId,
-                    const char *itemId,
-                    const char *attribute,
-                    const char *value,
-                    double numericalValue,
-                    const char *type,
-                    int flags,
-                    const char *timestamp) {
-    switchDatabase(db);
+/// @brief Binds a value to compare with facts.value: long values as the hash they're stored under.
+static void bindValueText(CSLDatabase *dbInfo, sqlite3_stmt *stmt, int index, const char *value) {
+    size_t length;
     
-    int rc = sqlite3_reset(currentDatabase->stmt_insert_fact);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+    if (needStatements(dbInfo, STATEMENTS_VALUE_BLOBS) && isBlobStoredValue(dbInfo, NULL, value, &length)) {
+        uint8_t hash[VALUE_BLOB_HASH_BYTES];
+        valueHash(value, length, hash);
+        sqlite3_bind_blob(stmt, index, hash, VALUE_BLOB_HASH_BYTES, SQLITE_TRANSIENT);
+    }
+    else {
+        sqlite3_bind_text(stmt, index, value, -1, SQLITE_STATIC);
+    }
+}
+
+/// @brief fact_value(value): the text of a facts.value, whether inline or a blob's hash.
+static void factValueFunction(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
         return;
     }
     
-#ifdef STORE_LOG
-    printf("Insert fact %s %s %s %f\n", itemId, attribute, value, numericalValue);
-#endif
+    char *value = loadValueBlob(sqlite3_user_data(context), sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]), NULL);
     
-    sqlite3_bind_text(currentDatabase->stmt_insert_fact, 1, factId, -1, SQLITE_STATIC);
-    sqlite3_bind_text(currentDatabase->stmt_insert_fact, 2, itemId, -1, SQLITE_STATIC);
-    sqlite3_bind_text(currentDatabase->stmt_insert_fact, 3, attribute, -1, SQLITE_STATIC);
-    sqlite3_bind_text(currentDatabase->stmt_insert_fact, 4, value, -1, SQLITE_STATIC);
-    sqlite3_bind_double(currentDatabase->stmt_insert_fact, 5, numericalValue);
+    if (value != NULL)
+        sqlite3_result_text(context, value, -1, free);
+    else
+        sqlite3_result_error(context, "missing value blob", -1);
+}
+
+/// @brief store_value_blob(value, type): stores a long value as a blob, returning the hash to put in facts.value (or the value, if it stays inline).
+/// Fails the statement if a long value can't be stored, as an insert would.
+static void storeValueBlobFunction(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    CSLDatabase *dbInfo = sqlite3_user_data(context);
+    const char *value = (const char *)sqlite3_value_text(argv[0]);
+    size_t length;
+    uint8_t hash[VALUE_BLOB_HASH_BYTES];
     
-    if (type != NULL)
-        sqlite3_bind_text(currentDatabase->stmt_insert_fact, 6, type, -1, SQLITE_STATIC);
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT || !isBlobStoredValue(dbInfo, (const char *)sqlite3_value_text(argv[1]), value, &length))
+        sqlite3_result_value(context, argv[0]);
+    else if (storeValueBlob(dbInfo, value, length, hash))
+        sqlite3_result_blob(context, hash, VALUE_BLOB_HASH_BYTES, SQLITE_TRANSIENT);
     else
-        sqlite3_bind_text(currentDatabase->stmt_insert_fact, 6, "string", -1, SQLITE_STATIC);
+        sqlite3_result_error(context, "can't store a value blob", -1);
+}
+
+static bool registerValueFunctions(CSLDatabase *dbInfo) {
+    int rc = sqlite3_create_function(dbInfo->db, "fact_value", 1, SQLITE_UTF8, dbInfo, factValueFunction, NULL, NULL);
     
-    sqlite3_bind_int(currentDatabase->stmt_insert_fact, 7, flags);
+    if (rc == SQLITE_OK)
+        rc = sqlite3_create_function(dbInfo->db, "store_value_blob", 2, SQLITE_UTF8, dbInfo, storeValueBlobFunction, NULL, NULL);
     
-    if (timestamp != NULL)
-        sqlite3_bind_text(currentDatabase->stmt_insert_fact, 8, timestamp, -1, SQLITE_STATIC);
-    else {
-        char *currentDateTime = getCurrentDateTime();
-        sqlite3_bind_text(currentDatabase->stmt_insert_fact, 8, currentDateTime, -1, SQLITE_TRANSIENT);
-        free(currentDateTime);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+        return false;
     }
     
-    rc = sqlite3_step(currentDatabase->stmt_insert_fact);
-    if (rc != SQLITE_DONE)
-        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+    return true;
+}
+
+static bool migrateValueBlobs(CSLDatabase *dbInfo) {
+    bool exists = tableExists(dbInfo, "value_blobs");
     
-    if (updateFn != NULL) {
-        updateFn();
+    char *create_sql = sqlite3_mprintf(
+    "CREATE TABLE IF NOT EXISTS value_blobs ("
+    "hash BLOB PRIMARY KEY,"
+    "length INTEGER NOT NULL," // of the text, in bytes
+    "encoding INTEGER NOT NULL," // 0 stored, 1 deflated (zlib)
+    "bytes BLOB NOT NULL,"
+    "refs INTEGER NOT NULL" // facts rows holding the hash
+    ");"
+    "CREATE TRIGGER IF NOT EXISTS value_blob_insert AFTER INSERT ON facts WHEN typeof(new.value) = 'blob' BEGIN "
+    "UPDATE value_blobs SET refs = refs + 1 WHERE hash = new.value; END;"
+    "CREATE TRIGGER IF NOT EXISTS value_blob_delete AFTER DELETE ON facts WHEN typeof(old.value) = 'blob' BEGIN "
+    "UPDATE value_blobs SET refs = refs - 1 WHERE hash = old.value; "
+    "DELETE FROM value_blobs WHERE hash = old.value AND refs <= 0; END;"
+    "CREATE TRIGGER IF NOT EXISTS value_blob_update AFTER UPDATE OF value ON facts BEGIN "
+    "UPDATE value_blobs SET refs = refs + 1 WHERE typeof(new.value) = 'blob' AND hash = new.value; "
+    "UPDATE value_blobs SET refs = refs - 1 WHERE typeof(old.value) = 'blob' AND hash = old.value; "
+    "DELETE FROM value_blobs WHERE typeof(old.value) = 'blob' AND hash = old.value AND refs <= 0; END;"
+    "INSERT OR IGNORE INTO drive_info (key, value) VALUES ('valueBlobThreshold', %d);", CSL_VALUE_BLOB_THRESHOLD);
+    
+    bool created = execIndexSQL(dbInfo, create_sql);
+    sqlite3_free(create_sql);
+    
+    if (!created) {
+        return false;
+    }
+    
+    if (!exists) {
+        if (!needStatements(dbInfo, STATEMENTS_VALUE_BLOBS)) {
+            return false;
+        }
+        
+        // Existing long values move out in one statement; the update trigger counts their rows
+        char *sql = sqlite3_mprintf("UPDATE facts SET value = store_value_blob(value, type) "
+                                    "WHERE typeof(value) = 'text' AND length(CAST(value AS BLOB)) >= %d AND type <> 'blob';",
+                                    dbInfo->valueBlobs.threshold);
+        bool backfilled = dbInfo->valueBlobs.threshold <= 0 || execIndexSQL(dbInfo, sql);
+        sqlite3_free(sql);
+        
+        return backfilled;
     }
+    
+    return true;
 }
 
+/// @brief A row's value text, in the facts table's column order, resolving a blob into the drive's scratch buffer, valid until the next call.
+static const char* storedValueText(CSLDatabase *dbInfo, sqlite3_stmt *stmt) {
+    if (sqlite3_column_type(stmt, 4) != SQLITE_BLOB) {
+        return (const char *)sqlite3_column_text(stmt, sqlite3_column_type(stmt, 9) == SQLITE_BLOB ? 9 : 4);
+    }
+    
+    CSLValueBlobs *blobs = &dbInfo->valueBlobs;
+    char *value = loadValueBlob(dbInfo, sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4), NULL);
+    
+    free(blobs->scratch);
+    blobs->scratch = value;
+    
+    return value != NULL ? value : "";
+}
 
-// MARK: - Fetch
+// MARK: - SQLite Queries
 
-CFactsCollection* csl_fetchFacts(CSLDatabase* db,
-                                 const char* itemId,
-                                 const char* attribute,
-                                 const char* value) {
-    switchDatabase(db);
+static char* copyColumnText(sqlite3_stmt *stmt, int column, uint64_t *bytes) {
+    const char* text = (const char*)sqlite3_column_text(stmt, column);
+    size_t length = (size_t)sqlite3_column_bytes(stmt, column);
     
-    CFactsCollection* results = NULL;
+    char* copy = malloc(length + 1);
+    memcpy(copy, text != NULL ? text : "", length);
+    copy[length] = '\0';
     
-    if (itemId != NULL && attribute != NULL && value != NULL) {
-        results = fetchFactsByItemIdAttributeAndValue(itemId, attribute, value);
-    }
-    else if (itemId != NULL && attribute != NULL) {
-        results = fetchFactsByItemIdAttribute(itemId, attribute);
+    *bytes += length + 1;
+    
+    return copy;
+}
+
+static void readFact(CSLDatabase *dbInfo, sqlite3_stmt *stmt, CFact *fact, uint64_t *bytes) {
+    fact->uid = sqlite3_column_int(stmt, 0);
+    fact->factId = copyColumnText(stmt, 1, bytes);
+    fact->itemId = copyColumnText(stmt, 2, bytes);
+    fact->attribute = copyColumnText(stmt, 3, bytes);
+    fact->type = copyColumnText(stmt, 6, bytes);
+    fact->flags = sqlite3_column_int(stmt, 7);
+    fact->timestamp = copyColumnText(stmt, 8, bytes);
+    
+    CFactValue *typed = &fact->typed;
+    typed->kind = factValueKind(fact->type);
+    
+    // Blobs are stored only in typedValue; long values are their value blob's hash
+    if (sqlite3_column_type(stmt, 4) == SQLITE_BLOB) {
+        fact->value = loadValueBlob(dbInfo, sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4), bytes);
+        
+        if (fact->value == NULL)
+            fact->value = calloc(1, 1);
     }
-    else if (itemId != NULL && value != NULL) {
-        printf("sldrive does not currently support getting item id and value"); // TODO
-        exit(EXIT_FAILURE);
+    else
+        fact->value = copyColumnText(stmt, typed->kind == CFACT_VALUE_BLOB ? 9 : 4, bytes);
+    fact->numericalValue = storedNumericalValue(stmt);
+    
+    switch (typed->kind) {
+        case CFACT_VALUE_TEXT:
+        case CFACT_VALUE_ITEM_ID: typed->text = fact->value; break;
+        case CFACT_VALUE_INTEGER: typed->integer = sqlite3_column_int64(stmt, 9); break;
+        case CFACT_VALUE_NUMBER:
+        case CFACT_VALUE_TIMESTAMP: typed->number = sqlite3_column_double(stmt, 9); break;
+        case CFACT_VALUE_BOOLEAN: typed->boolean = sqlite3_column_int(stmt, 9) != 0; break;
+        case CFACT_VALUE_BLOB:
+            typed->blob.bytes = fact->value;
+            typed->blob.length = sqlite3_column_bytes(stmt, 9);
+            break;
+        case CFACT_VALUE_NULL: break;
     }
-    else if (attribute != NULL && value != NULL) {
-        results = fetchFactsByAttributeAndValue(attribute, value);
+}
+
+void runQuery(sqlite3_stmt *stmt, CSLStatementKind kind, CFactsCollection *collection) {
+    int rc;
+    uint64_t bytes = 0;
+    
+#ifdef STORE_STATS
+    uint64_t startedAt = monotonicNanoseconds();
+#else
+    (void)kind;
+#endif
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        CFact fact;
+        readFact(currentDatabase, stmt, &fact, &bytes);
+        
+        collection->facts = realloc(collection->facts, (collection->count + 1) * sizeof(CFact));
+        collection->facts[collection->count++] = fact;
     }
-    else if (itemId != NULL) {
-        results = fetchFactsByItemId(itemId);
+    
+#ifdef STORE_STATS
+    recordStatement(currentDatabase, kind, (uint64_t)collection->count, bytes, startedAt);
+#endif
+    
+#ifdef STORE_LOG
+    printf("Fetched %d facts\n", collection->count);
+    
+    for (int x = 0; x < collection->count; x++) {
+        printf("  %s %s %s %f\n", collection->facts[x].itemId, collection->facts[x].attribute, collection->facts[x].value, collection->facts[x].numericalValue);
     }
-    else if (attribute != NULL) {
-        results = fetchFactsByAttribute(attribute);
+#endif
+    
+    if (rc != SQLITE_DONE)
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+}
+
+// MARK: - Fact queries
+//  csl_queryFacts builds its SQL from the query's shape: which constraints are
+//  set, and the order. Parameters keep fixed numbers whatever the shape, so
+//  binding needn't know it: ?1 itemId, ?2 attribute, ?3 value, ?4/?5 typedValue
+//  bounds, ?6/?7 timestamp bounds, ?8 limit, ?9 whether the typedValue bounds are
+//  booleans. Each drive caches the statements it compiles, keyed by shape.
+
+#define FACTS_SHAPE_ITEM_ID (1 << 0)
+#define FACTS_SHAPE_ATTRIBUTE (1 << 1)
+#define FACTS_SHAPE_VALUE (1 << 2)
+#define FACTS_SHAPE_VALUE_MIN (1 << 3)
+#define FACTS_SHAPE_VALUE_MAX (1 << 4)
+#define FACTS_SHAPE_CREATED_AFTER (1 << 5)
+#define FACTS_SHAPE_CREATED_BEFORE (1 << 6)
+#define FACTS_SHAPE_LIMIT (1 << 7)
+#define FACTS_SHAPE_ORDER_SHIFT 8
+
+#define FACTS_SHAPE_VALUE_RANGE (FACTS_SHAPE_VALUE_MIN | FACTS_SHAPE_VALUE_MAX)
+#define FACTS_SHAPE_DATE_RANGE (FACTS_SHAPE_CREATED_AFTER | FACTS_SHAPE_CREATED_BEFORE | (CSL_FACTS_UNORDERED << FACTS_SHAPE_ORDER_SHIFT))
+
+// The shapes the drive used to prepare up front: compiled on first use, then never evicted
+static const int pinnedFactsShapes[] = {
+    FACTS_SHAPE_ITEM_ID,
+    FACTS_SHAPE_ATTRIBUTE,
+    FACTS_SHAPE_VALUE,
+    FACTS_SHAPE_ITEM_ID | FACTS_SHAPE_ATTRIBUTE,
+    FACTS_SHAPE_ATTRIBUTE | FACTS_SHAPE_VALUE,
+    FACTS_SHAPE_ITEM_ID | FACTS_SHAPE_ATTRIBUTE | FACTS_SHAPE_VALUE,
+    FACTS_SHAPE_VALUE_RANGE,
+    FACTS_SHAPE_ATTRIBUTE | FACTS_SHAPE_VALUE_RANGE,
+    FACTS_SHAPE_ITEM_ID | FACTS_SHAPE_ATTRIBUTE | FACTS_SHAPE_VALUE_RANGE,
+    FACTS_SHAPE_DATE_RANGE,
+};
+
+static int factsQueryShape(const CSLFactsQuery *query) {
+    return (query->itemId != NULL ? FACTS_SHAPE_ITEM_ID : 0) |
+    (query->attribute != NULL ? FACTS_SHAPE_ATTRIBUTE : 0) |
+    (query->value != NULL ? FACTS_SHAPE_VALUE : 0) |
+    (query->valueAtOrAbove != NULL ? FACTS_SHAPE_VALUE_MIN : 0) |
+    (query->valueAtOrBelow != NULL ? FACTS_SHAPE_VALUE_MAX : 0) |
+    (query->createdAtOrAfter != NULL ? FACTS_SHAPE_CREATED_AFTER : 0) |
+    (query->createdAtOrBefore != NULL ? FACTS_SHAPE_CREATED_BEFORE : 0) |
+    (query->limit > 0 ? FACTS_SHAPE_LIMIT : 0) |
+    ((int)query->order << FACTS_SHAPE_ORDER_SHIFT);
+}
+
+/// @brief The statistics kind for a shape: the fixed statements' kinds where a shape replaces one.
+static CSLStatementKind factsQueryKind(int shape) {
+    switch (shape) {
+        case FACTS_SHAPE_ITEM_ID: return CSL_STMT_FETCH_FACTS_BY_ITEM_ID;
+        case FACTS_SHAPE_ATTRIBUTE: return CSL_STMT_FETCH_FACTS_BY_ATTRIBUTE;
+        case FACTS_SHAPE_VALUE: return CSL_STMT_FETCH_FACTS_BY_VALUE;
+        case FACTS_SHAPE_ITEM_ID | FACTS_SHAPE_ATTRIBUTE: return CSL_STMT_FETCH_FACTS_BY_ITEM_ID_ATTRIBUTE;
+        case FACTS_SHAPE_ATTRIBUTE | FACTS_SHAPE_VALUE: return CSL_STMT_FETCH_FACTS_BY_ATTRIBUTE_VALUE;
+        case FACTS_SHAPE_ITEM_ID | FACTS_SHAPE_ATTRIBUTE | FACTS_SHAPE_VALUE: return CSL_STMT_FETCH_FACTS_BY_ITEM_ID_ATTRIBUTE_VALUE;
+        case FACTS_SHAPE_VALUE_RANGE: return CSL_STMT_FETCH_FACTS_BY_VALUE_RANGE;
+        case FACTS_SHAPE_ATTRIBUTE | FACTS_SHAPE_VALUE_RANGE: return CSL_STMT_FETCH_FACTS_BY_ATTRIBUTE_VALUE_RANGE;
+        case FACTS_SHAPE_ITEM_ID | FACTS_SHAPE_ATTRIBUTE | FACTS_SHAPE_VALUE_RANGE: return CSL_STMT_FETCH_FACTS_BY_ITEM_ID_ATTRIBUTE_VALUE_RANGE;
+        case FACTS_SHAPE_DATE_RANGE: return CSL_STMT_FETCH_FACTS_BY_DATE_RANGE;
     }
-    else if (value != NULL) {
-        results = fetchFactsByValue(value);
+    
+    return CSL_STMT_FETCH_FACTS_BY_QUERY;
+}
+
+static void factsQuerySQL(int shape, char *sql) {
+    strcpy(sql, "SELECT * FROM facts WHERE 1");
+    
+    if (shape & FACTS_SHAPE_ITEM_ID) strcat(sql, " AND itemId = ?1");
+    if (shape & FACTS_SHAPE_ATTRIBUTE) strcat(sql, " AND attribute = ?2");
+    if (shape & FACTS_SHAPE_VALUE) strcat(sql, " AND value = ?3");
+    if (shape & FACTS_SHAPE_VALUE_MIN) strcat(sql, " AND typedValue >= ?4");
+    if (shape & FACTS_SHAPE_VALUE_MAX) strcat(sql, " AND typedValue <= ?5");
+    if (shape & FACTS_SHAPE_VALUE_RANGE) strcat(sql, " AND (type = 'boolean') = ?9");
+    if (shape & FACTS_SHAPE_CREATED_AFTER) strcat(sql, " AND timestamp >= ?6");
+    if (shape & FACTS_SHAPE_CREATED_BEFORE) strcat(sql, " AND timestamp <= ?7");
+    
+    switch ((CSLFactsOrder)(shape >> FACTS_SHAPE_ORDER_SHIFT)) {
+        case CSL_FACTS_NEWEST_FIRST: strcat(sql, " ORDER BY timestamp DESC"); break;
+        case CSL_FACTS_OLDEST_FIRST: strcat(sql, " ORDER BY timestamp ASC"); break;
+        case CSL_FACTS_LAST_INSERTED_FIRST: strcat(sql, " ORDER BY id DESC"); break;
+        case CSL_FACTS_UNORDERED: break;
     }
-    else {
-        results = __csl_getAllFacts();
+    
+    if (shape & FACTS_SHAPE_LIMIT) strcat(sql, " LIMIT ?8");
+    
+    strcat(sql, ";");
+}
+
+static sqlite3_stmt* prepareFactsQueryShape(CSLDatabase *dbInfo, int shape) {
+    char sql[320];
+    sqlite3_stmt *stmt;
+    
+    factsQuerySQL(shape, sql);
+    
+    if (sqlite3_prepare_v3(dbInfo->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+        return NULL;
     }
     
-    return results;
+    return stmt;
 }
 
-CFactsCollection* csl_fetchFactsByValueRange(CSLDatabase* db,
-                                             const char* itemId,
-                                             const char* attribute,
-                                             double valueAtOrAbove,
-                                             double valueAtOrBelow) {
-    switchDatabase(db);
+static bool isPinnedFactsShape(int shape) {
+    for (size_t i = 0; i < sizeof(pinnedFactsShapes) / sizeof(pinnedFactsShapes[0]); i++) {
+        if (pinnedFactsShapes[i] == shape) {
+            return true;
+        }
+    }
     
-    CFactsCollection* results = NULL;
+    return false;
+}
+
+/// @brief The shape's statement, compiling it into the cache (over the least recently used unpinned entry) on a miss.
+static sqlite3_stmt* cachedFactsQuery(CSLDatabase *dbInfo, int shape) {
+    CSLStatementCache *cache = &dbInfo->factsQueries;
+    CSLCachedStatement *victim = NULL;
     
-    if (itemId != NULL && attribute != NULL) {
-        results = fetchFactsByItemIdAttributeAndValueRange(itemId, attribute, valueAtOrAbove, valueAtOrBelow);
+    for (int i = 0; i < cache->count; i++) {
+        CSLCachedStatement *entry = &cache->entries[i];
+        
+        if (entry->shape == shape) {
+            entry->lastUsed = ++cache->clock;
+            cache->hits++;
+            return entry->stmt;
+        }
+        
+        if (!entry->pinned && (victim == NULL || entry->lastUsed < victim->lastUsed)) {
+            victim = entry;
+        }
     }
-    else if (itemId != NULL) {
-        printf("sldrive does not currently support getting item id and value in range"); // TODO
-        exit(EXIT_FAILURE);
+    
+    sqlite3_stmt *stmt = prepareFactsQueryShape(dbInfo, shape);
+    
+    if (stmt == NULL) {
+        return NULL;
     }
-    else if (attribute != NULL) {
-        results = fetchFactsByAttributeAndValueRange(attribute, valueAtOrAbove, valueAtOrBelow);
+    
+    cache->misses++;
+    
+    if (cache->count < CSL_STATEMENT_CACHE_CAPACITY) {
+        victim = &cache->entries[cache->count++];
     }
     else {
-        results = fetchFactsByValueRange(valueAtOrAbove, valueAtOrBelow);
+        sqlite3_finalize(victim->stmt);
     }
     
-    return results;
+    victim->shape = shape;
+    victim->stmt = stmt;
+    victim->lastUsed = ++cache->clock;
+    victim->pinned = isPinnedFactsShape(shape);
+    
+    return stmt;
 }
 
-CFactsCollection* csl_fetchFactsByDate(CSLDatabase *db,
-                                       const char* createdAtOrAfter,
-                                       const char* createdAtOrBefore) {
-    switchDatabase(db);
+static void finalizeFactsQueries(CSLDatabase *dbInfo) {
+    for (int i = 0; i < dbInfo->factsQueries.count; i++) {
+        sqlite3_finalize(dbInfo->factsQueries.entries[i].stmt);
+    }
+    
+    dbInfo->factsQueries.count = 0;
+}
+
+static void bindFactsQuery(sqlite3_stmt *stmt, const CSLFactsQuery *query) {
+    if (query->itemId != NULL) sqlite3_bind_text(stmt, 1, query->itemId, -1, SQLITE_STATIC);
+    if (query->attribute != NULL) sqlite3_bind_text(stmt, 2, query->attribute, -1, SQLITE_STATIC);
+    if (query->value != NULL) bindValueText(currentDatabase, stmt, 3, query->value);
+    if (query->valueAtOrAbove != NULL) bindFactValue(stmt, 4, query->valueAtOrAbove);
+    if (query->valueAtOrBelow != NULL) bindFactValue(stmt, 5, query->valueAtOrBelow);
+    if (query->valueAtOrAbove != NULL || query->valueAtOrBelow != NULL) bindBooleanRange(stmt, 9, query->valueAtOrAbove, query->valueAtOrBelow);
+    if (query->createdAtOrAfter != NULL) sqlite3_bind_text(stmt, 6, query->createdAtOrAfter, -1, SQLITE_STATIC);
+    if (query->createdAtOrBefore != NULL) sqlite3_bind_text(stmt, 7, query->createdAtOrBefore, -1, SQLITE_STATIC);
+    if (query->limit > 0) sqlite3_bind_int(stmt, 8, query->limit);
+}
+
+CFact* fetchMostRecentFact(const char *itemId, const char *attribute) {
+    if (!needStatements(currentDatabase, STATEMENTS_CORE)) {
+        return NULL;
+    }
+    
+    int rc = sqlite3_reset(currentDatabase->stmt_fetch_most_recent_fact);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+        return NULL;
+    }
     
-    CFactsCollection* results = NULL;
+    sqlite3_bind_text(currentDatabase->stmt_fetch_most_recent_fact, 1, itemId, -1, SQLITE_STATIC);
+    sqlite3_bind_text(currentDatabase->stmt_fetch_most_recent_fact, 2, attribute, -1, SQLITE_STATIC);
+    
+    CFact* fact = NULL;
+    uint64_t bytes = 0;
     
-    if (createdAtOrAfter != NULL && createdAtOrBefore != NULL) {
-        results = fetchFactsByDateRange(createdAtOrAfter, createdAtOrBefore);
+#ifdef STORE_STATS
+    uint64_t startedAt = monotonicNanoseconds();
+#endif
+    
+    if (sqlite3_step(currentDatabase->stmt_fetch_most_recent_fact) == SQLITE_ROW) {
+        fact = malloc(sizeof(CFact));
+        readFact(currentDatabase, currentDatabase->stmt_fetch_most_recent_fact, fact, &bytes);
     }
-    else if (createdAtOrAfter != NULL) {
-        printf("Currently unsupported date query."); // TODO
+    
+#ifdef STORE_STATS
+    recordStatement(currentDatabase, CSL_STMT_FETCH_MOST_RECENT_FACT, fact != NULL ? 1 : 0, bytes, startedAt);
+#endif
+    
+    return fact;
+}
+
+// MARK: - Item filter
+
+#define ITEM_FILTER_MIN_BITS (1u << 16)
+#define ITEM_FILTER_BITS_PER_ITEM 10 // ~1% false positives with 7 hashes
+#define ITEM_FILTER_HASH_COUNT 7
+
+static void itemFilterHashes(const char *itemId, uint64_t *h1, uint64_t *h2) {
+    uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a
+    
+    for (const unsigned char *c = (const unsigned char *)itemId; *c; c++) {
+        hash = (hash ^ *c) * 0x100000001b3ull;
     }
-    else if (createdAtOrBefore != NULL) {
-        printf("Currently unsupported date query."); // TODO
+    
+    *h1 = hash;
+    *h2 = ((hash >> 33) ^ (hash * 0xff51afd7ed558ccdull)) | 1; // odd, so probes cycle through every bit
+}
+
+static void addToItemFilter(CSLItemFilter *filter, const char *itemId) {
+    uint64_t h1, h2;
+    itemFilterHashes(itemId, &h1, &h2);
+    
+    bool added = false;
+    
+    for (uint32_t i = 0; i < filter->hashCount; i++) {
+        uint32_t bit = (uint32_t)((h1 + i * h2) & (filter->bitCount - 1));
+        uint8_t mask = (uint8_t)(1 << (bit & 7));
+        
+        if ((filter->bits[bit >> 3] & mask) == 0) {
+            filter->bits[bit >> 3] |= mask;
+            added = true;
+        }
     }
     
-    return results;
+    if (added) {
+        filter->itemCount++;
+    }
+}
+
+static bool itemFilterMayContain(const CSLItemFilter *filter, const char *itemId) {
+    if (filter->bits == NULL) {
+        return true;
+    }
+    
+    uint64_t h1, h2;
+    itemFilterHashes(itemId, &h1, &h2);
+    
+    for (uint32_t i = 0; i < filter->hashCount; i++) {
+        uint32_t bit = (uint32_t)((h1 + i * h2) & (filter->bitCount - 1));
+        
+        if ((filter->bits[bit >> 3] & (1 << (bit & 7))) == 0) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+static sqlite3_int64 lastFactRowId(CSLDatabase *dbInfo) {
+    sqlite3_stmt *stmt;
+    sqlite3_int64 lastId = 0;
+    
+    if (sqlite3_prepare_v2(dbInfo->db, "SELECT MAX(id) FROM facts;", -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            lastId = sqlite3_column_int64(stmt, 0);
+        
+        sqlite3_finalize(stmt);
+    }
+    
+    return lastId;
+}
+
+/// @brief The connection's PRAGMA data_version, which moves when another connection commits to the file.
+static int readDataVersion(CSLDatabase *dbInfo) {
+    CSLItemFilter *filter = &dbInfo->itemFilter;
+    int version = 0;
+    
+    if (filter->stmt_data_version == NULL &&
+        sqlite3_prepare_v2(dbInfo->db, "PRAGMA data_version;", -1, &filter->stmt_data_version, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+        filter->stmt_data_version = NULL;
+        return 0;
+    }
+    
+    if (sqlite3_step(filter->stmt_data_version) == SQLITE_ROW) {
+        version = sqlite3_column_int(filter->stmt_data_version, 0);
+    }
+    
+    sqlite3_reset(filter->stmt_data_version);
+    
+    return version;
+}
+
+/// @brief Sizes the filter for twice the drive's current item count and refills it from the facts table.
+static void rebuildItemFilter(CSLDatabase *dbInfo) {
+    CSLItemFilter *filter = &dbInfo->itemFilter;
+    sqlite3_stmt *stmt;
+    
+    int rc = sqlite3_prepare_v2(dbInfo->db, "SELECT COUNT(DISTINCT itemId) FROM facts;", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+        return;
+    }
+    
+    uint64_t items = sqlite3_step(stmt) == SQLITE_ROW ? (uint64_t)sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+    
+    uint64_t bitCount = ITEM_FILTER_MIN_BITS;
+    while (bitCount < items * 2 * ITEM_FILTER_BITS_PER_ITEM && bitCount < (1u << 31)) {
+        bitCount <<= 1;
+    }
+    
+    free(filter->bits);
+    filter->bits = calloc(bitCount / 8, 1);
+    filter->bitCount = (uint32_t)bitCount;
+    filter->hashCount = ITEM_FILTER_HASH_COUNT;
+    filter->itemCount = 0;
+    
+    // Read before the scan, so rows committed during it are caught up later rather than missed
+    filter->dataVersion = readDataVersion(dbInfo);
+    filter->lastFactId = lastFactRowId(dbInfo);
+    
+    rc = sqlite3_prepare_v2(dbInfo->db, "SELECT DISTINCT itemId FROM facts;", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+        free(filter->bits);
+        filter->bits = NULL; // without a filter every drive is queried
+        return;
+    }
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        addToItemFilter(filter, (const char *)sqlite3_column_text(stmt, 0));
+    }
+    
+    sqlite3_finalize(stmt);
+}
+
+/// @brief Loads the persisted filter if it is still current (no facts written since it was saved), otherwise rebuilds it.
+static void loadItemFilter(CSLDatabase *dbInfo) {
+    CSLItemFilter *filter = &dbInfo->itemFilter;
+    
+    if (!dbInfo->inMemory) {
+        const char *create_sql = "CREATE TABLE IF NOT EXISTS item_filter ("
+        "id INTEGER PRIMARY KEY CHECK (id = 1),"
+        "lastFactId INTEGER NOT NULL,"
+        "hashCount INTEGER NOT NULL,"
+        "itemCount INTEGER NOT NULL,"
+        "bits BLOB NOT NULL"
+        ");";
+        
+        if (sqlite3_exec(dbInfo->db, create_sql, 0, 0, &dbInfo->error_message)) {
+            fprintf(stderr, "SQL error: %s\n", dbInfo->error_message);
+            sqlite3_free(dbInfo->error_message);
+        }
+        
+        sqlite3_stmt *stmt;
+        
+        if (sqlite3_prepare_v2(dbInfo->db, "SELECT lastFactId, hashCount, itemCount, bits FROM item_filter WHERE id = 1;", -1, &stmt, NULL) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int64(stmt, 0) == lastFactRowId(dbInfo)) {
+                int length = sqlite3_column_bytes(stmt, 3);
+                
+                // Only accept a power-of-two sized filter
+                if (length > 0 && (length & (length - 1)) == 0) {
+                    filter->bits = malloc(length);
+                    memcpy(filter->bits, sqlite3_column_blob(stmt, 3), length);
+                    filter->bitCount = (uint32_t)length * 8;
+                    filter->hashCount = (uint32_t)sqlite3_column_int(stmt, 1);
+                    filter->itemCount = (uint32_t)sqlite3_column_int(stmt, 2);
+                    filter->lastFactId = sqlite3_column_int64(stmt, 0);
+                    filter->dataVersion = readDataVersion(dbInfo);
+                }
+            }
+            
+            sqlite3_finalize(stmt);
+        }
+        
+        if (filter->bits != NULL) {
+            return;
+        }
+    }
+    
+    rebuildItemFilter(dbInfo);
+}
+
+/// @brief Adds the items written by other connections since the filter last looked.
+static void catchUpItemFilter(CSLDatabase *dbInfo) {
+    CSLItemFilter *filter = &dbInfo->itemFilter;
+    
+    // An in-memory drive has no other connections; an unchanged data_version means none committed
+    if (dbInfo->inMemory || filter->bits == NULL) {
+        return;
+    }
+    
+    int version = readDataVersion(dbInfo);
+    
+    if (version == filter->dataVersion) {
+        return;
+    }
+    
+    sqlite3_stmt *stmt;
+    
+    if (sqlite3_prepare_v2(dbInfo->db, "SELECT id, itemId FROM facts WHERE id > ? ORDER BY id;", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+        free(filter->bits);
+        filter->bits = NULL; // without a filter every drive is queried
+        return;
+    }
+    
+    filter->dataVersion = version;
+    sqlite3_bind_int64(stmt, 1, filter->lastFactId);
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        filter->lastFactId = sqlite3_column_int64(stmt, 0);
+        addToItemFilter(filter, (const char *)sqlite3_column_text(stmt, 1));
+    }
+    
+    sqlite3_finalize(stmt);
+    
+    if ((uint64_t)filter->itemCount * ITEM_FILTER_BITS_PER_ITEM > filter->bitCount) {
+        rebuildItemFilter(dbInfo);
+    }
+}
+
+static void saveItemFilter(CSLDatabase *dbInfo) {
+    CSLItemFilter *filter = &dbInfo->itemFilter;
+    
+    if (dbInfo->inMemory || filter->bits == NULL) {
+        return;
+    }
+    
+    // Saved as current up to the last fact, so take in other connections' items first
+    catchUpItemFilter(dbInfo);
+    
+    if (filter->bits == NULL) {
+        return;
+    }
+    
+    sqlite3_stmt *stmt;
+    const char *sql = "INSERT OR REPLACE INTO item_filter (id, lastFactId, hashCount, itemCount, bits) VALUES (1, ?, ?, ?, ?);";
+    
+    if (sqlite3_prepare_v2(dbInfo->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+        return;
+    }
+    
+    sqlite3_bind_int64(stmt, 1, lastFactRowId(dbInfo));
+    sqlite3_bind_int(stmt, 2, (int)filter->hashCount);
+    sqlite3_bind_int(stmt, 3, (int)filter->itemCount);
+    sqlite3_bind_blob(stmt, 4, filter->bits, (int)(filter->bitCount / 8), SQLITE_STATIC);
+    
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+    
+    sqlite3_finalize(stmt);
+}
+
+/// @brief Records a newly written itemId, growing the filter once it holds more items than it was sized for.
+static void noteItemWritten(CSLDatabase *dbInfo, const char *itemId) {
+    CSLItemFilter *filter = &dbInfo->itemFilter;
+    
+    if (filter->bits == NULL) {
+        return;
+    }
+    
+    addToItemFilter(filter, itemId);
+    
+    if ((uint64_t)filter->itemCount * ITEM_FILTER_BITS_PER_ITEM > filter->bitCount) {
+        rebuildItemFilter(dbInfo);
+    }
+}
+
+/// @brief Whether the drive may hold the item; a negative first catches up with writes from other connections.
+static bool driveMayContainItem(CSLDatabase *dbInfo, const char *itemId) {
+    if (itemFilterMayContain(&dbInfo->itemFilter, itemId)) {
+        return true;
+    }
+    
+    catchUpItemFilter(dbInfo);
+    
+    return itemFilterMayContain(&dbInfo->itemFilter, itemId);
+}
+
+bool csl_mayContainItem(CSLDatabase* db, const char* itemId) {
+    if (db == NULL || itemId == NULL) {
+        return true;
+    }
+    
+    if (db->shardCount > 0) {
+        int index = shardIndex(db, itemId);
+        
+        pthread_mutex_lock(&db->shardLocks[index]);
+        bool mayContain = driveMayContainItem(db->shards[index], itemId);
+        pthread_mutex_unlock(&db->shardLocks[index]);
+        
+        return mayContain;
+    }
+    
+    return driveMayContainItem(db, itemId);
+}
+
+// MARK: - Derived indexes
+//  Secondary structures (text, location) derived from the fact log and kept
+//  current by csl_insertFact. Items with a live "deleted" fact are listed in
+//  deleted_items so the derived indexes can leave them out of results.
+
+static bool prepareIndexStatement(CSLDatabase *dbInfo, const char *sql, sqlite3_stmt **stmt) {
+    int rc = sqlite3_prepare_v2(dbInfo->db, sql, -1, stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+        return false;
+    }
+    
+    return true;
+}
+
+static void stepIndexStatement(CSLDatabase *dbInfo, sqlite3_stmt *stmt) {
+    if (sqlite3_step(stmt) != SQLITE_DONE)
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+    
+    sqlite3_reset(stmt);
+}
+
+static bool tableExists(CSLDatabase *dbInfo, const char *name) {
+    sqlite3_stmt *stmt;
+    
+    if (!prepareIndexStatement(dbInfo, "SELECT 1 FROM sqlite_master WHERE name = ?;", &stmt)) {
+        return false;
+    }
+    
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    bool exists = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    
+    return exists;
+}
+
+static bool execIndexSQL(CSLDatabase *dbInfo, const char *sql) {
+    int rc = sqlite3_exec(dbInfo->db, sql, 0, 0, &dbInfo->error_message);
+    if (rc) {
+        fprintf(stderr, "SQL error: %s\n", dbInfo->error_message);
+        sqlite3_free(dbInfo->error_message);
+        return false;
+    }
+    
+    return true;
+}
+
+static void indexDeletedItem(CSLDatabase *dbInfo, const char *itemId, const char *attribute, int flags) {
+    if (strcmp(attribute, "deleted") != 0) {
+        return;
+    }
+    
+    sqlite3_stmt *stmt = (flags & 1) ? dbInfo->stmt_deleted_item_delete : dbInfo->stmt_deleted_item_insert;
+    sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+    stepIndexStatement(dbInfo, stmt);
+}
+
+static bool prepareDeletedItems(CSLDatabase *dbInfo) {
+    return
+    prepareIndexStatement(dbInfo, "INSERT OR IGNORE INTO deleted_items (itemId) VALUES (?);", &dbInfo->stmt_deleted_item_insert) &&
+    prepareIndexStatement(dbInfo, "DELETE FROM deleted_items WHERE itemId = ?;", &dbInfo->stmt_deleted_item_delete) &&
+    // The latest fact for an item attribute whose own latest row isn't flagged removed
+    prepareIndexStatement(dbInfo, "SELECT f.id, f.type, f.typedValue FROM facts f WHERE f.itemId = ?1 AND f.attribute = ?2 AND (f.flags & 1) = 0 "
+                          "AND f.id = (SELECT MAX(r.id) FROM facts r WHERE r.itemId = ?1 AND r.attribute = ?2 AND r.factId = f.factId) "
+                          "ORDER BY f.id DESC LIMIT 1;", &dbInfo->stmt_latest_live_fact);
+}
+
+static bool migrateDeletedItems(CSLDatabase *dbInfo) {
+    bool exists = tableExists(dbInfo, "deleted_items");
+    
+    if (!execIndexSQL(dbInfo, "CREATE TABLE IF NOT EXISTS deleted_items (itemId TEXT PRIMARY KEY) WITHOUT ROWID;")) {
+        return false;
+    }
+    
+    if (!exists) {
+        sqlite3_stmt *stmt;
+        
+        if (!needStatements(dbInfo, STATEMENTS_DELETED_ITEMS)) {
+            return false;
+        }
+        
+        if (prepareIndexStatement(dbInfo, "SELECT itemId, attribute, flags FROM facts WHERE attribute = 'deleted' ORDER BY id;", &stmt)) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                indexDeletedItem(dbInfo, (const char *)sqlite3_column_text(stmt, 0), (const char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
+            }
+            
+            sqlite3_finalize(stmt);
+        }
+    }
+    
+    return true;
+}
+
+// MARK: - Text index
+//  text_index is an external-content FTS5 table over facts.value: its rowids
+//  are facts.id, so only the current string fact of each item attribute
+//  (tracked in text_index_current) is indexed.
+
+static void indexFactText(CSLDatabase *dbInfo, sqlite3_int64 rowId, const char *itemId, const char *attribute, const char *type, int flags);
+
+/// @brief Re-indexes every fact in order; used to backfill drives created before the text index existed.
+static void backfillTextIndex(CSLDatabase *dbInfo) {
+    sqlite3_stmt *stmt;
+    
+    if (!prepareIndexStatement(dbInfo, "SELECT id, itemId, attribute, type, flags FROM facts ORDER BY id;", &stmt)) {
+        return;
+    }
+    
+    sqlite3_exec(dbInfo->db, "BEGIN;", 0, 0, NULL);
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        indexFactText(dbInfo,
+                      sqlite3_column_int64(stmt, 0),
+                      (const char *)sqlite3_column_text(stmt, 1),
+                      (const char *)sqlite3_column_text(stmt, 2),
+                      (const char *)sqlite3_column_text(stmt, 3),
+                      sqlite3_column_int(stmt, 4));
+    }
+    
+    sqlite3_exec(dbInfo->db, "COMMIT;", 0, 0, NULL);
+    sqlite3_finalize(stmt);
+}
+
+static bool prepareTextIndex(CSLDatabase *dbInfo) {
+    return
+    prepareIndexStatement(dbInfo, "SELECT factRowId FROM text_index_current WHERE itemId = ? AND attribute = ?;", &dbInfo->stmt_text_current) &&
+    prepareIndexStatement(dbInfo, "INSERT OR REPLACE INTO text_index_current (itemId, attribute, factRowId) VALUES (?, ?, ?);", &dbInfo->stmt_text_current_upsert) &&
+    prepareIndexStatement(dbInfo, "DELETE FROM text_index_current WHERE itemId = ? AND attribute = ?;", &dbInfo->stmt_text_current_delete) &&
+    prepareIndexStatement(dbInfo, "INSERT INTO text_index (rowid, value) SELECT id, fact_value(value) FROM facts WHERE id = ?;", &dbInfo->stmt_text_index_insert) &&
+    prepareIndexStatement(dbInfo, "INSERT INTO text_index (text_index, rowid, value) SELECT 'delete', id, fact_value(value) FROM facts WHERE id = ?;", &dbInfo->stmt_text_index_delete) &&
+    prepareIndexStatement(dbInfo, "SELECT itemId, attribute, MIN(score) FROM ("
+                          "SELECT f.itemId AS itemId, f.attribute AS attribute, text_index.rank AS score "
+                          "FROM text_index JOIN facts f ON f.id = text_index.rowid WHERE text_index MATCH ?1"
+                          ") WHERE itemId NOT IN (SELECT itemId FROM deleted_items) "
+                          "GROUP BY itemId ORDER BY MIN(score) LIMIT ?2;", &dbInfo->stmt_search_text);
+}
+
+static bool migrateTextIndex(CSLDatabase *dbInfo) {
+    bool exists = tableExists(dbInfo, "text_index");
+    
+    const char *create_sql =
+    "CREATE VIRTUAL TABLE IF NOT EXISTS text_index USING fts5("
+    "value, content='facts', content_rowid='id', tokenize='unicode61 remove_diacritics 2', prefix='2 3'"
+    ");"
+    "CREATE TABLE IF NOT EXISTS text_index_current ("
+    "itemId TEXT NOT NULL,"
+    "attribute TEXT NOT NULL,"
+    "factRowId INTEGER NOT NULL,"
+    "PRIMARY KEY (itemId, attribute)"
+    ") WITHOUT ROWID;";
+    
+    if (!execIndexSQL(dbInfo, create_sql)) {
+        return false;
+    }
+    
+    if (!exists) {
+        if (!needStatements(dbInfo, STATEMENTS_DELETED_ITEMS | STATEMENTS_TEXT)) {
+            return false;
+        }
+        
+        backfillTextIndex(dbInfo);
+    }
+    
+    return true;
+}
+
+/// @brief Points the index entry for an item attribute at a new facts row (or at nothing, when factRowId is 0).
+static void setCurrentText(CSLDatabase *dbInfo, const char *itemId, const char *attribute, sqlite3_int64 factRowId) {
+    sqlite3_stmt *stmt = dbInfo->stmt_text_current;
+    sqlite3_int64 currentRowId = 0;
+    
+    sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, attribute, -1, SQLITE_STATIC);
+    
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        currentRowId = sqlite3_column_int64(stmt, 0);
+    
+    sqlite3_reset(stmt);
+    
+    if (currentRowId == factRowId) {
+        return;
+    }
+    
+    if (currentRowId != 0) {
+        sqlite3_bind_int64(dbInfo->stmt_text_index_delete, 1, currentRowId);
+        stepIndexStatement(dbInfo, dbInfo->stmt_text_index_delete);
+    }
+    
+    if (factRowId != 0) {
+        sqlite3_bind_int64(dbInfo->stmt_text_index_insert, 1, factRowId);
+        stepIndexStatement(dbInfo, dbInfo->stmt_text_index_insert);
+        
+        sqlite3_bind_text(dbInfo->stmt_text_current_upsert, 1, itemId, -1, SQLITE_STATIC);
+        sqlite3_bind_text(dbInfo->stmt_text_current_upsert, 2, attribute, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(dbInfo->stmt_text_current_upsert, 3, factRowId);
+        stepIndexStatement(dbInfo, dbInfo->stmt_text_current_upsert);
+    }
+    else {
+        sqlite3_bind_text(dbInfo->stmt_text_current_delete, 1, itemId, -1, SQLITE_STATIC);
+        sqlite3_bind_text(dbInfo->stmt_text_current_delete, 2, attribute, -1, SQLITE_STATIC);
+        stepIndexStatement(dbInfo, dbInfo->stmt_text_current_delete);
+    }
+}
+
+static bool isStringType(const char *type) {
+    return type == NULL || strcmp(type, "string") == 0;
+}
+
+static void indexFactText(CSLDatabase *dbInfo, sqlite3_int64 rowId, const char *itemId, const char *attribute, const char *type, int flags) {
+    bool removed = (flags & 1) == 1;
+    
+    if (!removed) {
+        // The newest fact wins; a non-string value replaces any indexed text
+        setCurrentText(dbInfo, itemId, attribute, isStringType(type) ? rowId : 0);
+        return;
+    }
+    
+    // A fact was removed; fall back to the latest one for this attribute that's still live
+    sqlite3_stmt *stmt = dbInfo->stmt_latest_live_fact;
+    sqlite3_int64 liveRowId = 0;
+    
+    sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, attribute, -1, SQLITE_STATIC);
+    
+    if (sqlite3_step(stmt) == SQLITE_ROW && isStringType((const char *)sqlite3_column_text(stmt, 1)))
+        liveRowId = sqlite3_column_int64(stmt, 0);
+    
+    sqlite3_reset(stmt);
+    
+    setCurrentText(dbInfo, itemId, attribute, liveRowId);
+}
+
+/// @brief Builds an FTS5 query where every whitespace-separated term must match, quoting terms so user text can't inject syntax.
+static char* textMatchExpression(const char *text, bool prefix) {
+    size_t length = strlen(text);
+    char *expression = malloc(length * 2 + length * 4 + 1); // worst case: every char a quote, or a term per char
+    char *cursor = expression;
+    const char *c = text;
+    
+    while (*c) {
+        while (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') c++;
+        
+        if (!*c) break;
+        
+        if (cursor != expression) *cursor++ = ' ';
+        *cursor++ = '"';
+        
+        while (*c && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r') {
+            if (*c == '"') *cursor++ = '"';
+            *cursor++ = *c++;
+        }
+        
+        *cursor++ = '"';
+        if (prefix) *cursor++ = '*';
+    }
+    
+    *cursor = '\0';
+    
+    return expression;
+}
+
+CSearchResults* csl_searchText(CSLDatabase* db,
+                               const char* text,
+                               bool prefix,
+                               int limit) {
+    if (!unshardedDrive(db, "Search")) {
+        return NULL;
+    }
+    
+    switchDatabase(db);
+    
+    CSearchResults* results = malloc(sizeof(CSearchResults));
+    results->hits = NULL;
+    results->count = 0;
+    
+    if (text == NULL || !needStatements(currentDatabase, STATEMENTS_TEXT)) {
+        return results;
+    }
+    
+    char *expression = textMatchExpression(text, prefix);
+    
+    if (expression[0] == '\0') {
+        free(expression);
+        return results;
+    }
+    
+    sqlite3_stmt *stmt = currentDatabase->stmt_search_text;
+    uint64_t bytes = 0;
+    
+#ifdef STORE_STATS
+    uint64_t startedAt = monotonicNanoseconds();
+#endif
+    
+    sqlite3_bind_text(stmt, 1, expression, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, limit > 0 ? limit : -1);
+    
+    int rc;
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        results->hits = realloc(results->hits, (results->count + 1) * sizeof(CSearchHit));
+        
+        CSearchHit *hit = &results->hits[results->count++];
+        hit->itemId = copyColumnText(stmt, 0, &bytes);
+        hit->attribute = copyColumnText(stmt, 1, &bytes);
+        hit->score = sqlite3_column_double(stmt, 2);
+    }
+    
+    if (rc != SQLITE_DONE)
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+    
+    sqlite3_reset(stmt);
+    free(expression);
+    
+#ifdef STORE_STATS
+    recordStatement(currentDatabase, CSL_STMT_SEARCH_TEXT, (uint64_t)results->count, bytes, startedAt);
+#endif
+    
+    return results;
+}
+
+// MARK: - Location index
+//  location_items collects each item's current numeric latitude and longitude
+//  (either may arrive first); once both are known the point goes into the
+//  location_index R*-tree, keyed by the location_items row id.
+
+static void indexFactLocation(CSLDatabase *dbInfo, const char *itemId, const char *attribute, const char *type, int flags, double numericalValue) {
+    bool isLatitude = strcmp(attribute, "latitude") == 0;
+    
+    if (!isLatitude && strcmp(attribute, "longitude") != 0) {
+        return;
+    }
+    
+    bool hasValue = false;
+    double value = 0;
+    
+    if ((flags & 1) == 0) {
+        hasValue = type != NULL && strcmp(type, "number") == 0;
+        value = numericalValue;
+    }
+    else {
+        // A fact was removed; fall back to the latest one for this attribute that's still live
+        sqlite3_stmt *stmt = dbInfo->stmt_latest_live_fact;
+        
+        sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, attribute, -1, SQLITE_STATIC);
+        
+        if (sqlite3_step(stmt) == SQLITE_ROW && strcmp((const char *)sqlite3_column_text(stmt, 1), "number") == 0) {
+            hasValue = true;
+            value = sqlite3_column_double(stmt, 2);
+        }
+        
+        sqlite3_reset(stmt);
+    }
+    
+    sqlite3_stmt *set = isLatitude ? dbInfo->stmt_location_item_set_latitude : dbInfo->stmt_location_item_set_longitude;
+    sqlite3_bind_text(set, 1, itemId, -1, SQLITE_STATIC);
+    
+    if (hasValue)
+        sqlite3_bind_double(set, 2, value);
+    else
+        sqlite3_bind_null(set, 2);
+    
+    stepIndexStatement(dbInfo, set);
+    
+    sqlite3_stmt *stmt = dbInfo->stmt_location_item;
+    sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+    
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+        
+        if (sqlite3_column_type(stmt, 1) != SQLITE_NULL && sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+            double latitude = sqlite3_column_double(stmt, 1);
+            double longitude = sqlite3_column_double(stmt, 2);
+            
+            sqlite3_bind_int64(dbInfo->stmt_location_index_upsert, 1, id);
+            sqlite3_bind_double(dbInfo->stmt_location_index_upsert, 2, latitude);
+            sqlite3_bind_double(dbInfo->stmt_location_index_upsert, 3, longitude);
+            stepIndexStatement(dbInfo, dbInfo->stmt_location_index_upsert);
+        }
+        else {
+            sqlite3_bind_int64(dbInfo->stmt_location_index_delete, 1, id);
+            stepIndexStatement(dbInfo, dbInfo->stmt_location_index_delete);
+        }
+    }
+    
+    sqlite3_reset(stmt);
+}
+
+static bool prepareLocationIndex(CSLDatabase *dbInfo) {
+    return
+    prepareIndexStatement(dbInfo, "INSERT INTO location_items (itemId, latitude) VALUES (?1, ?2) ON CONFLICT (itemId) DO UPDATE SET latitude = ?2;", &dbInfo->stmt_location_item_set_latitude) &&
+    prepareIndexStatement(dbInfo, "INSERT INTO location_items (itemId, longitude) VALUES (?1, ?2) ON CONFLICT (itemId) DO UPDATE SET longitude = ?2;", &dbInfo->stmt_location_item_set_longitude) &&
+    prepareIndexStatement(dbInfo, "SELECT id, latitude, longitude FROM location_items WHERE itemId = ?;", &dbInfo->stmt_location_item) &&
+    prepareIndexStatement(dbInfo, "INSERT OR REPLACE INTO location_index (id, minLatitude, maxLatitude, minLongitude, maxLongitude) VALUES (?1, ?2, ?2, ?3, ?3);", &dbInfo->stmt_location_index_upsert) &&
+    prepareIndexStatement(dbInfo, "DELETE FROM location_index WHERE id = ?;", &dbInfo->stmt_location_index_delete) &&
+    // The R*-tree stores 32-bit bounds, so re-check the exact coordinates
+    prepareIndexStatement(dbInfo, "SELECT l.itemId, l.latitude, l.longitude FROM location_index r JOIN location_items l ON l.id = r.id "
+                          "WHERE r.maxLatitude >= ?1 AND r.minLatitude <= ?2 AND r.maxLongitude >= ?3 AND r.minLongitude <= ?4 "
+                          "AND l.latitude BETWEEN ?1 AND ?2 AND l.longitude BETWEEN ?3 AND ?4 "
+                          "AND l.itemId NOT IN (SELECT itemId FROM deleted_items) LIMIT ?5;", &dbInfo->stmt_fetch_items_in_box);
+}
+
+static bool migrateLocationIndex(CSLDatabase *dbInfo) {
+    bool exists = tableExists(dbInfo, "location_index");
+    
+    const char *create_sql =
+    "CREATE VIRTUAL TABLE IF NOT EXISTS location_index USING rtree(id, minLatitude, maxLatitude, minLongitude, maxLongitude);"
+    "CREATE TABLE IF NOT EXISTS location_items ("
+    "id INTEGER PRIMARY KEY,"
+    "itemId TEXT NOT NULL UNIQUE,"
+    "latitude REAL,"
+    "longitude REAL"
+    ");";
+    
+    if (!execIndexSQL(dbInfo, create_sql)) {
+        return false;
+    }
+    
+    if (!exists) {
+        if (!needStatements(dbInfo, STATEMENTS_DELETED_ITEMS | STATEMENTS_LOCATION)) {
+            return false;
+        }
+        
+        sqlite3_stmt *stmt;
+        
+        if (prepareIndexStatement(dbInfo, "SELECT itemId, attribute, type, flags, typedValue FROM facts WHERE attribute IN ('latitude', 'longitude') ORDER BY id;", &stmt)) {
+            sqlite3_exec(dbInfo->db, "BEGIN;", 0, 0, NULL);
+            
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                indexFactLocation(dbInfo,
+                                  (const char *)sqlite3_column_text(stmt, 0),
+                                  (const char *)sqlite3_column_text(stmt, 1),
+                                  (const char *)sqlite3_column_text(stmt, 2),
+                                  sqlite3_column_int(stmt, 3),
+                                  sqlite3_column_double(stmt, 4));
+            }
+            
+            sqlite3_exec(dbInfo->db, "COMMIT;", 0, 0, NULL);
+            sqlite3_finalize(stmt);
+        }
+    }
+    
+    return true;
+}
+
+static void appendLocationHit(CLocationResults *results, sqlite3_stmt *stmt, uint64_t *bytes) {
+    results->hits = realloc(results->hits, (results->count + 1) * sizeof(CLocationHit));
+    
+    CLocationHit *hit = &results->hits[results->count++];
+    hit->itemId = copyColumnText(stmt, 0, bytes);
+    hit->latitude = sqlite3_column_double(stmt, 1);
+    hit->longitude = sqlite3_column_double(stmt, 2);
+    hit->distanceKm = 0;
+}
+
+static void fetchItemsInLongitudeRange(CLocationResults *results, double minLatitude, double maxLatitude, double minLongitude, double maxLongitude, int limit) {
+    sqlite3_stmt *stmt = currentDatabase->stmt_fetch_items_in_box;
+    uint64_t bytes = 0;
+    int rc;
+    
+#ifdef STORE_STATS
+    uint64_t startedAt = monotonicNanoseconds();
+    int countBefore = results->count;
+#endif
+    
+    sqlite3_bind_double(stmt, 1, minLatitude);
+    sqlite3_bind_double(stmt, 2, maxLatitude);
+    sqlite3_bind_double(stmt, 3, minLongitude);
+    sqlite3_bind_double(stmt, 4, maxLongitude);
+    sqlite3_bind_int(stmt, 5, limit > 0 ? limit : -1);
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        appendLocationHit(results, stmt, &bytes);
+    }
+    
+    if (rc != SQLITE_DONE)
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+    
+    sqlite3_reset(stmt);
+    
+#ifdef STORE_STATS
+    recordStatement(currentDatabase, CSL_STMT_FETCH_ITEMS_IN_BOX, (uint64_t)(results->count - countBefore), bytes, startedAt);
+#endif
+}
+
+CLocationResults* csl_fetchItemsInBox(CSLDatabase* db,
+                                      double minLatitude,
+                                      double maxLatitude,
+                                      double minLongitude,
+                                      double maxLongitude,
+                                      int limit) {
+    if (!unshardedDrive(db, "Location")) {
+        return NULL;
+    }
+    
+    switchDatabase(db);
+    
+    CLocationResults* results = malloc(sizeof(CLocationResults));
+    results->hits = NULL;
+    results->count = 0;
+    
+    if (!needStatements(currentDatabase, STATEMENTS_LOCATION)) {
+        return results;
+    }
+    
+    if (minLongitude <= maxLongitude) {
+        fetchItemsInLongitudeRange(results, minLatitude, maxLatitude, minLongitude, maxLongitude, limit);
+    }
+    else {
+        // Wraps across the antimeridian
+        fetchItemsInLongitudeRange(results, minLatitude, maxLatitude, minLongitude, 180, limit);
+        
+        if (limit <= 0 || results->count < limit) {
+            fetchItemsInLongitudeRange(results, minLatitude, maxLatitude, -180, maxLongitude, limit > 0 ? limit - results->count : limit);
+        }
+    }
+    
+    return results;
+}
+
+#define EARTH_RADIUS_KM 6371.0088
+#define KM_PER_DEGREE_LATITUDE 111.195
+
+double csl_distanceKm(double latitude1, double longitude1, double latitude2, double longitude2) {
+    double toRadians = M_PI / 180.0;
+    double dLatitude = (latitude2 - latitude1) * toRadians;
+    double dLongitude = (longitude2 - longitude1) * toRadians;
+    
+    double a = sin(dLatitude / 2) * sin(dLatitude / 2) +
+    cos(latitude1 * toRadians) * cos(latitude2 * toRadians) * sin(dLongitude / 2) * sin(dLongitude / 2);
+    
+    return 2 * EARTH_RADIUS_KM * asin(fmin(1.0, sqrt(a)));
+}
+
+static int compareLocationHitDistance(const void *a, const void *b) {
+    double distanceA = ((const CLocationHit *)a)->distanceKm;
+    double distanceB = ((const CLocationHit *)b)->distanceKm;
+    
+    return (distanceA > distanceB) - (distanceA < distanceB);
+}
+
+CLocationResults* csl_fetchNearestItems(CSLDatabase* db,
+                                        double latitude,
+                                        double longitude,
+                                        int k,
+                                        double maxDistanceKm) {
+    if (!unshardedDrive(db, "Location")) {
+        return NULL;
+    }
+    
+    double maxRadius = maxDistanceKm > 0 ? maxDistanceKm : M_PI * EARTH_RADIUS_KM;
+    double radius = fmin(1.0, maxRadius);
+    
+    // Widen a bounding box around the point until it holds k items that are
+    // closer than the box's inscribed radius (so nothing outside can be nearer)
+    while (true) {
+        double latitudeDelta = radius / KM_PER_DEGREE_LATITUDE;
+        double minLatitude = fmax(-90, latitude - latitudeDelta);
+        double maxLatitude = fmin(90, latitude + latitudeDelta);
+        
+        double cosLatitude = cos(fmax(fabs(minLatitude), fabs(maxLatitude)) * M_PI / 180.0);
+        double longitudeDelta = cosLatitude > 1e-9 ? latitudeDelta / cosLatitude : 360;
+        
+        CLocationResults* results;
+        
+        if (longitudeDelta >= 180 || minLatitude <= -90 || maxLatitude >= 90) {
+            results = csl_fetchItemsInBox(db, minLatitude, maxLatitude, -180, 180, -1);
+        }
+        else {
+            double minLongitude = longitude - longitudeDelta;
+            double maxLongitude = longitude + longitudeDelta;
+            
+            if (minLongitude < -180) minLongitude += 360;
+            if (maxLongitude > 180) maxLongitude -= 360;
+            
+            results = csl_fetchItemsInBox(db, minLatitude, maxLatitude, minLongitude, maxLongitude, -1);
+        }
+        
+        int withinRadius = 0;
+        
+        for (int i = 0; i < results->count; i++) {
+            CLocationHit *hit = &results->hits[i];
+            hit->distanceKm = csl_distanceKm(latitude, longitude, hit->latitude, hit->longitude);
+            
+            if (hit->distanceKm <= radius) {
+                withinRadius++;
+            }
+        }
+        
+        if (withinRadius >= k || radius >= maxRadius) {
+            qsort(results->hits, results->count, sizeof(CLocationHit), compareLocationHitDistance);
+            
+            int keep = 0;
+            
+            while (keep < results->count && keep < k && results->hits[keep].distanceKm <= maxRadius) {
+                keep++;
+            }
+            
+            for (int i = keep; i < results->count; i++) {
+                free(results->hits[i].itemId);
+            }
+            
+            results->count = keep;
+            
+            return results;
+        }
+        
+        freeLocationResults(results);
+        radius = fmin(radius * 4, maxRadius);
+    }
+}
+
+// MARK: - Relationship edges
+//  relationship_edges holds each relationship item's current fromItemId,
+//  toItemId and type, so a graph walk is one indexed lookup per item rather
+//  than several attribute/value fetches per edge. Rows are recomputed from the
+//  relationship's live facts whenever one of those attributes changes.
+
+static bool isEdgeAttribute(const char *attribute) {
+    return strcmp(attribute, "fromItemId") == 0 || strcmp(attribute, "toItemId") == 0 ||
+    strcmp(attribute, "referenceType") == 0 || strcmp(attribute, "relationshipType") == 0;
+}
+
+static void indexRelationship(CSLDatabase *dbInfo, const char *itemId, const char *attribute) {
+    if (!isEdgeAttribute(attribute)) {
+        return;
+    }
+    
+    sqlite3_bind_text(dbInfo->stmt_edge_delete, 1, itemId, -1, SQLITE_STATIC);
+    stepIndexStatement(dbInfo, dbInfo->stmt_edge_delete);
+    
+    sqlite3_bind_text(dbInfo->stmt_edge_upsert, 1, itemId, -1, SQLITE_STATIC);
+    stepIndexStatement(dbInfo, dbInfo->stmt_edge_upsert);
+}
+
+/// @brief Recomputes the edges of relationships with edge facts from a row id on.
+static void catchUpRelationships(CSLDatabase *dbInfo, sqlite3_int64 fromRowId) {
+    sqlite3_stmt *stmt;
+    
+    if (!prepareIndexStatement(dbInfo, "SELECT DISTINCT itemId FROM facts WHERE id >= ? "
+                               "AND attribute IN ('fromItemId', 'toItemId', 'referenceType', 'relationshipType');", &stmt)) {
+        return;
+    }
+    
+    sqlite3_bind_int64(stmt, 1, fromRowId);
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        indexRelationship(dbInfo, (const char *)sqlite3_column_text(stmt, 0), "fromItemId");
+    }
+    
+    sqlite3_finalize(stmt);
+}
+
+static bool prepareRelationshipEdges(CSLDatabase *dbInfo) {
+    // The same live-fact rule as stmt_latest_live_fact, for every edge attribute at once
+    return
+    prepareIndexStatement(dbInfo, "DELETE FROM relationship_edges WHERE relationshipId = ?;", &dbInfo->stmt_edge_delete) &&
+    prepareIndexStatement(dbInfo, "WITH live AS (SELECT f.id, f.attribute, f.value FROM facts f WHERE f.itemId = ?1 "
+                          "AND f.attribute IN ('fromItemId', 'toItemId', 'referenceType', 'relationshipType') AND (f.flags & 1) = 0 "
+                          "AND f.id = (SELECT MAX(r.id) FROM facts r WHERE r.itemId = ?1 AND r.attribute = f.attribute AND r.factId = f.factId)), "
+                          "latest AS (SELECT attribute, value, MAX(id) AS id FROM live GROUP BY attribute) "
+                          "INSERT INTO relationship_edges (relationshipId, fromItemId, toItemId, relationshipType, lastRowId) "
+                          "SELECT ?1, f.value, t.value, COALESCE((SELECT value FROM latest WHERE attribute = 'referenceType'), "
+                          "(SELECT value FROM latest WHERE attribute = 'relationshipType'), ''), MAX(f.id, t.id) "
+                          "FROM latest f JOIN latest t ON f.attribute = 'fromItemId' AND t.attribute = 'toItemId';", &dbInfo->stmt_edge_upsert) &&
+    prepareIndexStatement(dbInfo, "SELECT relationshipId, fromItemId, toItemId, relationshipType FROM relationship_edges "
+                          "WHERE fromItemId = ?1 AND (?2 IS NULL OR relationshipType = ?2) "
+                          "AND relationshipId NOT IN (SELECT itemId FROM deleted_items) AND toItemId NOT IN (SELECT itemId FROM deleted_items) "
+                          "ORDER BY lastRowId;", &dbInfo->stmt_edges_from) &&
+    prepareIndexStatement(dbInfo, "SELECT relationshipId, fromItemId, toItemId, relationshipType FROM relationship_edges "
+                          "WHERE toItemId = ?1 AND (?2 IS NULL OR relationshipType = ?2) "
+                          "AND relationshipId NOT IN (SELECT itemId FROM deleted_items) AND fromItemId NOT IN (SELECT itemId FROM deleted_items) "
+                          "ORDER BY lastRowId;", &dbInfo->stmt_edges_to);
+}
+
+static bool migrateRelationshipEdges(CSLDatabase *dbInfo) {
+    bool exists = tableExists(dbInfo, "relationship_edges");
+    
+    const char *create_sql =
+    "CREATE TABLE IF NOT EXISTS relationship_edges ("
+    "relationshipId TEXT PRIMARY KEY,"
+    "fromItemId TEXT NOT NULL,"
+    "toItemId TEXT NOT NULL,"
+    "relationshipType TEXT NOT NULL,"
+    "lastRowId INTEGER NOT NULL" // the newest of its facts, so edges list in the order they were made
+    ") WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS idx_edges_from ON relationship_edges (fromItemId, relationshipType);"
+    "CREATE INDEX IF NOT EXISTS idx_edges_to ON relationship_edges (toItemId, relationshipType);";
+    
+    if (!execIndexSQL(dbInfo, create_sql)) {
+        return false;
+    }
+    
+    if (!exists) {
+        if (!needStatements(dbInfo, STATEMENTS_EDGES)) {
+            return false;
+        }
+        
+        sqlite3_exec(dbInfo->db, "BEGIN;", 0, 0, NULL);
+        catchUpRelationships(dbInfo, 0);
+        sqlite3_exec(dbInfo->db, "COMMIT;", 0, 0, NULL);
+    }
+    
+    return true;
+}
+
+int csl_fetchEdges(CSLDatabase* db, const char* itemId, const char* relationshipType, bool incoming, CGraph* graph) {
+    if (!unshardedDrive(db, "Edges")) {
+        return -1;
+    }
+    
+    switchDatabase(db);
+    
+    if (!needStatements(db, STATEMENTS_EDGES)) {
+        return 0;
+    }
+    
+    sqlite3_stmt *stmt = incoming ? db->stmt_edges_to : db->stmt_edges_from;
+    uint64_t bytes = 0;
+    int countBefore = graph->edgeCount;
+    int rc;
+    
+#ifdef STORE_STATS
+    uint64_t startedAt = monotonicNanoseconds();
+#endif
+    
+    sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, relationshipType, -1, SQLITE_STATIC);
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        graph->edges = realloc(graph->edges, (graph->edgeCount + 1) * sizeof(CGraphEdge));
+        
+        CGraphEdge *edge = &graph->edges[graph->edgeCount++];
+        edge->relationshipId = copyColumnText(stmt, 0, &bytes);
+        edge->fromItemId = copyColumnText(stmt, 1, &bytes);
+        edge->toItemId = copyColumnText(stmt, 2, &bytes);
+        edge->relationshipType = copyColumnText(stmt, 3, &bytes);
+    }
+    
+    if (rc != SQLITE_DONE)
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db->db));
+    
+    sqlite3_reset(stmt);
+    
+#ifdef STORE_STATS
+    recordStatement(db, CSL_STMT_FETCH_EDGES, (uint64_t)(graph->edgeCount - countBefore), bytes, startedAt);
+#endif
+    
+    return graph->edgeCount - countBefore;
+}
+
+// MARK: - As-of reconstruction
+//  A checkpoint records, for one item, the winning fact row of each attribute
+//  given every fact with timestamp <= asOf and id <= lastFactRowId (asOf is the
+//  item's latest timestamp when it's written). State as of T is the checkpoint
+//  plus the facts not covered by it, so the replay is bounded by the delta.
+
+static bool prepareCheckpoints(CSLDatabase *dbInfo) {
+    return
+    prepareIndexStatement(dbInfo, "SELECT id, asOf, lastFactRowId FROM item_checkpoints WHERE itemId = ? AND asOf <= ? ORDER BY asOf DESC, id DESC LIMIT 1;", &dbInfo->stmt_checkpoint_for_time) &&
+    prepareIndexStatement(dbInfo, "SELECT f.* FROM item_checkpoint_facts c JOIN facts f ON f.id = c.factRowId WHERE c.checkpointId = ?;", &dbInfo->stmt_checkpoint_facts) &&
+    // Two index ranges: facts newer than the checkpoint, and older facts inserted after it (e.g. synced)
+    prepareIndexStatement(dbInfo, "SELECT * FROM facts WHERE itemId = ?1 AND timestamp > ?3 AND timestamp <= ?2 "
+                          "UNION SELECT * FROM facts WHERE itemId = ?1 AND id > ?4 AND timestamp <= ?2;", &dbInfo->stmt_facts_since_checkpoint) &&
+    prepareIndexStatement(dbInfo, "SELECT * FROM facts f WHERE f.itemId = ?1 AND f.attribute = ?2 AND f.timestamp <= ?3 AND (f.flags & 1) = 0 "
+                          "AND f.id = (SELECT MAX(r.id) FROM facts r WHERE r.itemId = ?1 AND r.attribute = ?2 AND r.factId = f.factId AND r.timestamp <= ?3) "
+                          "ORDER BY f.id DESC LIMIT 1;", &dbInfo->stmt_attribute_as_of) &&
+    prepareIndexStatement(dbInfo, "SELECT COUNT(*) FROM facts WHERE itemId = ?1 AND id > IFNULL((SELECT MAX(lastFactRowId) FROM item_checkpoints WHERE itemId = ?1), 0);", &dbInfo->stmt_count_since_checkpoint) &&
+    prepareIndexStatement(dbInfo, "SELECT (SELECT MAX(timestamp) FROM facts WHERE itemId = ?1), (SELECT MAX(id) FROM facts WHERE itemId = ?1);", &dbInfo->stmt_item_latest) &&
+    prepareIndexStatement(dbInfo, "INSERT INTO item_checkpoints (itemId, asOf, lastFactRowId) VALUES (?, ?, ?);", &dbInfo->stmt_checkpoint_insert) &&
+    prepareIndexStatement(dbInfo, "INSERT INTO item_checkpoint_facts (checkpointId, attribute, factRowId) VALUES (?, ?, ?);", &dbInfo->stmt_checkpoint_fact_insert);
+}
+
+static bool migrateCheckpoints(CSLDatabase *dbInfo) {
+    const char *create_sql =
+    "CREATE INDEX IF NOT EXISTS idx_item_timestamp ON facts (itemId, timestamp);"
+    "CREATE TABLE IF NOT EXISTS item_checkpoints ("
+    "id INTEGER PRIMARY KEY,"
+    "itemId TEXT NOT NULL,"
+    "asOf TEXT NOT NULL,"
+    "lastFactRowId INTEGER NOT NULL"
+    ");"
+    "CREATE INDEX IF NOT EXISTS idx_checkpoint_item_as_of ON item_checkpoints (itemId, asOf);"
+    "CREATE INDEX IF NOT EXISTS idx_checkpoint_item_last_fact ON item_checkpoints (itemId, lastFactRowId);"
+    "CREATE TABLE IF NOT EXISTS item_checkpoint_facts ("
+    "checkpointId INTEGER NOT NULL,"
+    "attribute TEXT NOT NULL,"
+    "factRowId INTEGER NOT NULL,"
+    "PRIMARY KEY (checkpointId, attribute)"
+    ") WITHOUT ROWID;";
+    
+    return execIndexSQL(dbInfo, create_sql);
+}
+
+static int compareFactIdThenNewest(const void *a, const void *b) {
+    const CFact *factA = *(const CFact **)a;
+    const CFact *factB = *(const CFact **)b;
+    
+    int order = strcmp(factA->factId, factB->factId);
+    
+    return order != 0 ? order : (factB->uid > factA->uid) - (factB->uid < factA->uid);
+}
+
+static int compareAttributeThenNewest(const void *a, const void *b) {
+    const CFact *factA = *(const CFact **)a;
+    const CFact *factB = *(const CFact **)b;
+    
+    int order = strcmp(factA->attribute, factB->attribute);
+    
+    return order != 0 ? order : (factB->uid > factA->uid) - (factB->uid < factA->uid);
+}
+
+/// @brief Finds a fact id among the latest rows of the delta (sorted by factId).
+static CFact* findLatestRow(CFact **latest, int count, const char *factId) {
+    int low = 0, high = count - 1;
+    
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        int order = strcmp(latest[middle]->factId, factId);
+        
+        if (order == 0) return latest[middle];
+        if (order < 0) low = middle + 1;
+        else high = middle - 1;
+    }
+    
+    return NULL;
+}
+
+static bool containsAttribute(const char **attributes, int count, const char *attribute) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(attributes[i], attribute) == 0) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/// @brief Moves a fact into the collection, leaving the source empty so it isn't freed twice.
+static void moveFact(CFactsCollection *collection, CFact *fact) {
+    collection->facts = realloc(collection->facts, (collection->count + 1) * sizeof(CFact));
+    collection->facts[collection->count++] = *fact;
+    
+    initFact(fact);
+}
+
+static CFactsCollection* reconstructItem(CSLDatabase *dbInfo, const char *itemId, const char *asOf) {
+    if (!needStatements(dbInfo, STATEMENTS_CHECKPOINTS)) {
+        return emptyFactsCollection();
+    }
+    
+    sqlite3_int64 checkpointId = 0;
+    sqlite3_int64 checkpointLastRowId = 0;
+    char *checkpointAsOf = NULL;
+    
+    sqlite3_stmt *stmt = dbInfo->stmt_checkpoint_for_time;
+    sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, asOf, -1, SQLITE_STATIC);
+    
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        uint64_t bytes = 0;
+        checkpointId = sqlite3_column_int64(stmt, 0);
+        checkpointAsOf = copyColumnText(stmt, 1, &bytes);
+        checkpointLastRowId = sqlite3_column_int64(stmt, 2);
+    }
+    
+    sqlite3_reset(stmt);
+    
+    CFactsCollection base;
+    initFactsCollection(&base);
+    
+    if (checkpointId != 0) {
+        sqlite3_bind_int64(dbInfo->stmt_checkpoint_facts, 1, checkpointId);
+        runQuery(dbInfo->stmt_checkpoint_facts, CSL_STMT_FETCH_CHECKPOINT_FACTS, &base);
+        sqlite3_reset(dbInfo->stmt_checkpoint_facts);
+    }
+    
+    CFactsCollection delta;
+    initFactsCollection(&delta);
+    
+    stmt = dbInfo->stmt_facts_since_checkpoint;
+    sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, asOf, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, checkpointAsOf != NULL ? checkpointAsOf : TIMESTAMP_LOWEST, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, checkpointLastRowId);
+    runQuery(stmt, CSL_STMT_FETCH_FACTS_SINCE_CHECKPOINT, &delta);
+    sqlite3_reset(stmt);
+    
+    free(checkpointAsOf);
+    
+    // A fact's latest row decides whether it's live (a removal re-inserts it with flags bit 0 toggled)
+    CFact **latest = malloc((delta.count + 1) * sizeof(CFact *));
+    int latestCount = 0;
+    
+    for (int i = 0; i < delta.count; i++) {
+        latest[i] = &delta.facts[i];
+    }
+    
+    qsort(latest, delta.count, sizeof(CFact *), compareFactIdThenNewest);
+    
+    for (int i = 0; i < delta.count; i++) {
+        if (latestCount == 0 || strcmp(latest[latestCount - 1]->factId, latest[i]->factId) != 0) {
+            latest[latestCount++] = latest[i];
+        }
+    }
+    
+    CFact **candidates = malloc((latestCount + base.count + 1) * sizeof(CFact *));
+    int candidateCount = 0;
+    
+    const char **revealed = malloc((base.count + 1) * sizeof(char *));
+    int revealedCount = 0;
+    
+    for (int i = 0; i < latestCount; i++) {
+        if ((latest[i]->flags & 1) == 0) {
+            candidates[candidateCount++] = latest[i];
+        }
+    }
+    
+    for (int i = 0; i < base.count; i++) {
+        CFact *row = findLatestRow(latest, latestCount, base.facts[i].factId);
+        
+        if (row == NULL) {
+            candidates[candidateCount++] = &base.facts[i];
+        }
+        else if (row->flags & 1) {
+            // The checkpoint's winner was removed since; an older fact may now win
+            revealed[revealedCount++] = base.facts[i].attribute;
+        }
+    }
+    
+    qsort(candidates, candidateCount, sizeof(CFact *), compareAttributeThenNewest);
+    
+    CFactsCollection* result = malloc(sizeof(CFactsCollection));
+    initFactsCollection(result);
+    
+    for (int i = 0; i < candidateCount; i++) {
+        // Newest first within each attribute; candidates already moved are emptied, so compare with the result
+        if (result->count == 0 || strcmp(result->facts[result->count - 1].attribute, candidates[i]->attribute) != 0) {
+            moveFact(result, candidates[i]);
+        }
+    }
+    
+    // Facts from before the checkpoint aren't in the delta, so look those attributes up directly
+    for (int i = 0; i < revealedCount; i++) {
+        bool won = false;
+        
+        for (int j = 0; j < result->count && !won; j++) {
+            won = strcmp(result->facts[j].attribute, revealed[i]) == 0;
+        }
+        
+        if (!won && !containsAttribute(revealed, i, revealed[i])) {
+            stmt = dbInfo->stmt_attribute_as_of;
+            sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, revealed[i], -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, asOf, -1, SQLITE_STATIC);
+            runQuery(stmt, CSL_STMT_FETCH_ATTRIBUTE_AS_OF, result);
+            sqlite3_reset(stmt);
+        }
+    }
+    
+    if (revealedCount > 0) {
+        // Keep the attribute order
+        CFact **ordered = malloc(result->count * sizeof(CFact *));
+        CFact *facts = malloc(result->count * sizeof(CFact));
+        
+        for (int i = 0; i < result->count; i++) {
+            ordered[i] = &result->facts[i];
+        }
+        
+        qsort(ordered, result->count, sizeof(CFact *), compareAttributeThenNewest);
+        
+        for (int i = 0; i < result->count; i++) {
+            facts[i] = *ordered[i];
+        }
+        
+        free(result->facts);
+        free(ordered);
+        result->facts = facts;
+    }
+    
+    free(revealed);
+    free(candidates);
+    free(latest);
+    
+    // Frees whatever wasn't moved into the result
+    CFactsCollection *sources[] = { &base, &delta };
+    
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < sources[s]->count; i++) {
+            freeFact(&sources[s]->facts[i]);
+        }
+        
+        free(sources[s]->facts);
+    }
+    
+    return result;
+}
+
+static void writeCheckpoint(CSLDatabase *dbInfo, const char *itemId) {
+    sqlite3_stmt *stmt = dbInfo->stmt_item_latest;
+    sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+    
+    if (sqlite3_step(stmt) != SQLITE_ROW || sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+        sqlite3_reset(stmt);
+        return;
+    }
+    
+    uint64_t bytes = 0;
+    char *asOf = copyColumnText(stmt, 0, &bytes);
+    sqlite3_int64 lastFactRowId = sqlite3_column_int64(stmt, 1);
+    sqlite3_reset(stmt);
+    
+    CFactsCollection* state = reconstructItem(dbInfo, itemId, asOf);
+    
+    stmt = dbInfo->stmt_checkpoint_insert;
+    sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, asOf, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, lastFactRowId);
+    stepIndexStatement(dbInfo, stmt);
+    
+    sqlite3_int64 checkpointId = sqlite3_last_insert_rowid(dbInfo->db);
+    
+    for (int i = 0; i < state->count; i++) {
+        stmt = dbInfo->stmt_checkpoint_fact_insert;
+        sqlite3_bind_int64(stmt, 1, checkpointId);
+        sqlite3_bind_text(stmt, 2, state->facts[i].attribute, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, state->facts[i].uid);
+        stepIndexStatement(dbInfo, stmt);
+    }
+    
+    freeFactsCollection(state);
+    free(asOf);
+}
+
+static void noteCheckpointProgress(CSLDatabase *dbInfo, const char *itemId) {
+    sqlite3_stmt *stmt = dbInfo->stmt_count_since_checkpoint;
+    sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+    
+    int count = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+    sqlite3_reset(stmt);
+    
+    if (count >= CSL_CHECKPOINT_INTERVAL) {
+        writeCheckpoint(dbInfo, itemId);
+    }
+}
+
+CFactsCollection* csl_fetchItemAsOf(CSLDatabase* db, const char* itemId, const char* asOf) {
+    if (!unshardedDrive(db, "As-of")) {
+        return NULL;
+    }
+    
+    switchDatabase(db);
+    
+    if (!csl_mayContainItem(db, itemId)) {
+        return emptyFactsCollection();
+    }
+    
+    return reconstructItem(currentDatabase, itemId, asOf);
+}
+
+CFactsCollection* csl_fetchItemsAsOf(CSLDatabase* db, const char** itemIds, int count, const char* asOf) {
+    if (!unshardedDrive(db, "As-of")) {
+        return NULL;
+    }
+    
+    CFactsCollection* results = emptyFactsCollection();
+    
+    for (int i = 0; i < count; i++) {
+        results = combineFactsCollections(results, csl_fetchItemAsOf(db, itemIds[i], asOf));
+    }
+    
+    return results;
+}
+
+// MARK: - Compaction
+//  Moves history that the retention policy no longer needs into an archive
+//  (a facts_archive table, or facts in an attached archive file), a few items
+//  per transaction. An attribute's current fact is never archived.
+
+void csl_initCompactionProgress(CSLCompactionProgress *progress) {
+    progress->lastItemId = NULL;
+    progress->archivedFacts = 0;
+    progress->batches = 0;
+    progress->done = false;
+}
+
+void csl_freeCompactionProgress(CSLCompactionProgress *progress) {
+    free(progress->lastItemId);
+    progress->lastItemId = NULL;
+}
+
+static bool execCompactionSQL(CSLDatabase *dbInfo, const char *sql) {
+    int rc = sqlite3_exec(dbInfo->db, sql, 0, 0, &dbInfo->error_message);
+    if (rc) {
+        fprintf(stderr, "SQL error: %s\n", dbInfo->error_message);
+        sqlite3_free(dbInfo->error_message);
+        return false;
+    }
+    
+    return true;
+}
+
+static bool archiveAttached(CSLDatabase *dbInfo) {
+    sqlite3_stmt *stmt;
+    bool attached = false;
+    
+    if (sqlite3_prepare_v2(dbInfo->db, "SELECT 1 FROM pragma_database_list WHERE name = 'archive';", -1, &stmt, NULL) == SQLITE_OK) {
+        attached = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+    }
+    
+    return attached;
+}
+
+static const char* prepareArchive(CSLDatabase *dbInfo, const CRetentionPolicy *policy) {
+    if (policy->archivePath == NULL) {
+        bool created = execCompactionSQL(dbInfo, "CREATE TABLE IF NOT EXISTS main.facts_archive AS SELECT * FROM facts WHERE 0;") &&
+        addTypedValueColumn(dbInfo, "main.facts_archive");
+        return created ? "main.facts_archive" : NULL;
+    }
+    
+    bool attached = archiveAttached(dbInfo);
+    
+    if (!attached) {
+        char *sql = sqlite3_mprintf("ATTACH DATABASE %Q AS archive;", policy->archivePath);
+        attached = execCompactionSQL(dbInfo, sql);
+        sqlite3_free(sql);
+    }
+    
+    if (!attached || !execCompactionSQL(dbInfo, "CREATE TABLE IF NOT EXISTS archive.facts AS SELECT * FROM main.facts WHERE 0;") ||
+        !addTypedValueColumn(dbInfo, "archive.facts")) {
+        return NULL;
+    }
+    
+    // Sync and import check incoming facts against the archive, so remember where it is
+    char *sql = sqlite3_mprintf("INSERT OR REPLACE INTO main.drive_info (key, value) VALUES ('archivePath', %Q);", policy->archivePath);
+    bool recorded = execCompactionSQL(dbInfo, sql);
+    sqlite3_free(sql);
+    
+    return recorded ? "archive.facts" : NULL;
+}
+
+bool csl_compactStep(CSLDatabase *db, const CRetentionPolicy *policy, CSLCompactionProgress *progress) {
+    if (!unshardedDrive(db, "Compaction")) {
+        return false;
+    }
+    
+    switchDatabase(db);
+    
+    if (progress->done || !outsideReadSession(currentDatabase, "Compaction")) {
+        return false;
+    }
+    
+    const char *archive = prepareArchive(currentDatabase, policy);
+    if (archive == NULL) {
+        return false;
+    }
+    
+    // The next few items, walked in itemId order over idx_item_id
+    sqlite3_stmt *stmt;
+    char *upTo = NULL;
+    uint64_t bytes = 0;
+    
+    int rc = sqlite3_prepare_v2(currentDatabase->db, "SELECT MAX(itemId) FROM (SELECT DISTINCT itemId FROM facts WHERE itemId > ? ORDER BY itemId LIMIT ?);", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+        return false;
+    }
+    
+    sqlite3_bind_text(stmt, 1, progress->lastItemId != NULL ? progress->lastItemId : "", -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, policy->itemsPerBatch > 0 ? policy->itemsPerBatch : 64);
+    
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        upTo = copyColumnText(stmt, 0, &bytes);
+    }
+    
+    sqlite3_finalize(stmt);
+    
+    if (upTo == NULL) {
+        progress->done = true;
+        return false;
+    }
+    
+    // For the facts at or before the horizon: a fact's rows other than its latest,
+    // removed facts, and live values beyond the newest keepVersions of an attribute;
+    // never an attribute's current fact. A fact is its factId on one item's attribute,
+    // since a factId can be shared across items and attributes.
+    const char *select_sql =
+    "INSERT INTO temp.compact_batch (id) "
+    "WITH batch AS (SELECT id, factId, itemId, attribute, flags, timestamp FROM facts WHERE itemId > ?1 AND itemId <= ?2), "
+    "latestNow AS (SELECT MAX(id) AS latestId FROM batch GROUP BY factId, itemId, attribute), "
+    "current AS (SELECT MAX(b.id) AS id FROM batch b JOIN latestNow l ON l.latestId = b.id WHERE (b.flags & 1) = 0 GROUP BY b.itemId, b.attribute), "
+    "horizon AS (SELECT * FROM batch WHERE timestamp <= ?3), "
+    "latest AS (SELECT factId, itemId, attribute, MAX(id) AS latestId FROM horizon GROUP BY factId, itemId, attribute), "
+    "live AS (SELECT h.id, ROW_NUMBER() OVER (PARTITION BY h.itemId, h.attribute ORDER BY h.id DESC) AS version "
+    "FROM horizon h JOIN latest l ON l.latestId = h.id WHERE (h.flags & 1) = 0) "
+    "SELECT h.id FROM horizon h JOIN latest l ON l.factId = h.factId AND l.itemId = h.itemId AND l.attribute = h.attribute "
+    "WHERE (h.id <> l.latestId OR (h.flags & 1) = 1 OR h.id IN (SELECT id FROM live WHERE version > ?4)) "
+    "AND h.id NOT IN (SELECT id FROM current);";
+    
+    bool ok = execCompactionSQL(currentDatabase, "CREATE TEMP TABLE IF NOT EXISTS compact_batch (id INTEGER PRIMARY KEY);") &&
+    execCompactionSQL(currentDatabase, "BEGIN IMMEDIATE;");
+    
+    if (!ok) {
+        free(upTo);
+        return false;
+    }
+    
+    ok = execCompactionSQL(currentDatabase, "DELETE FROM temp.compact_batch;");
+    
+    if (ok && sqlite3_prepare_v2(currentDatabase->db, select_sql, -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, progress->lastItemId != NULL ? progress->lastItemId : "", -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, upTo, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, policy->keepAfter != NULL ? policy->keepAfter : TIMESTAMP_HIGHEST, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 4, policy->keepVersions > 0 ? policy->keepVersions : 1);
+        
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+    }
+    else {
+        ok = false;
+    }
+    
+    if (!ok) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+    }
+    
+    int archived = 0;
+    
+    if (ok) {
+        char *archive_sql = sqlite3_mprintf("INSERT INTO %s SELECT id, factId, itemId, attribute, fact_value(value), numericalValue, type, flags, timestamp, typedValue "
+                                            "FROM main.facts WHERE id IN (SELECT id FROM temp.compact_batch);", archive);
+        
+        // Checkpoints that point at archived rows can't be replayed from any more
+        ok = execCompactionSQL(currentDatabase, archive_sql) &&
+        execCompactionSQL(currentDatabase, "DELETE FROM main.facts WHERE id IN (SELECT id FROM temp.compact_batch);") &&
+        (archived = sqlite3_changes(currentDatabase->db), true) &&
+        execCompactionSQL(currentDatabase, "DELETE FROM item_checkpoints WHERE id IN (SELECT checkpointId FROM item_checkpoint_facts WHERE factRowId IN (SELECT id FROM temp.compact_batch));") &&
+        execCompactionSQL(currentDatabase, "DELETE FROM item_checkpoint_facts WHERE checkpointId NOT IN (SELECT id FROM item_checkpoints);") &&
+        execCompactionSQL(currentDatabase, "DELETE FROM sync_origins WHERE rowId IN (SELECT id FROM temp.compact_batch);");
+        
+        sqlite3_free(archive_sql);
+    }
+    
+    execCompactionSQL(currentDatabase, ok ? "COMMIT;" : "ROLLBACK;");
+    
+    if (!ok) {
+        free(upTo);
+        return false;
+    }
+    
+    free(progress->lastItemId);
+    progress->lastItemId = upTo;
+    progress->archivedFacts += archived;
+    progress->batches++;
+    
+    return true;
+}
+
+bool csl_enableIncrementalVacuum(CSLDatabase *db) {
+    if (!unshardedDrive(db, "Vacuum")) {
+        return false;
+    }
+    
+    switchDatabase(db);
+    
+    if (pragmaValue(currentDatabase, "PRAGMA auto_vacuum;") == 2) {
+        return true;
+    }
+    
+    // The mode only takes effect once VACUUM has rewritten the whole file
+    return outsideReadSession(currentDatabase, "Vacuum") &&
+    execCompactionSQL(currentDatabase, "PRAGMA auto_vacuum = INCREMENTAL;") &&
+    execCompactionSQL(currentDatabase, "VACUUM;");
+}
+
+void csl_incrementalVacuum(CSLDatabase *db, int pagesPerStep) {
+    if (!unshardedDrive(db, "Vacuum")) {
+        return;
+    }
+    
+    switchDatabase(db);
+    
+    // Drives created before incremental vacuum keep their free pages until csl_enableIncrementalVacuum
+    if (pragmaValue(currentDatabase, "PRAGMA auto_vacuum;") != 2) {
+        return;
+    }
+    
+    sqlite3_stmt *stmt;
+    char *sql = sqlite3_mprintf("PRAGMA incremental_vacuum(%d);", pagesPerStep > 0 ? pagesPerStep : 256);
+    
+    // Each step is its own short write, so readers get a turn in between
+    while (true) {
+        int freePages = 0;
+        
+        if (sqlite3_prepare_v2(currentDatabase->db, "PRAGMA freelist_count;", -1, &stmt, NULL) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                freePages = sqlite3_column_int(stmt, 0);
+            
+            sqlite3_finalize(stmt);
+        }
+        
+        if (freePages == 0 || !execCompactionSQL(currentDatabase, sql)) {
+            break;
+        }
+    }
+    
+    sqlite3_free(sql);
+}
+
+long long csl_compact(CSLDatabase *db, const CRetentionPolicy *policy) {
+    if (!unshardedDrive(db, "Compaction")) {
+        return -1;
+    }
+    
+    CSLCompactionProgress progress;
+    csl_initCompactionProgress(&progress);
+    
+    while (csl_compactStep(db, policy, &progress)) {}
+    
+    long long archived = progress.archivedFacts;
+    csl_freeCompactionProgress(&progress);
+    
+    if (archived > 0) {
+        csl_incrementalVacuum(db, 256);
+    }
+    
+    return archived;
+}
+
+// MARK: - Derived index maintenance
+
+static bool migrateDerivedIndexes(CSLDatabase *dbInfo) {
+    return migrateDeletedItems(dbInfo) &&
+    migrateTextIndex(dbInfo) &&
+    migrateLocationIndex(dbInfo) &&
+    migrateRelationshipEdges(dbInfo) &&
+    migrateCheckpoints(dbInfo);
+}
+
+static void indexFact(CSLDatabase *dbInfo, sqlite3_int64 rowId, const char *itemId, const char *attribute, const char *type, int flags, double numericalValue) {
+    if (!needStatements(dbInfo, STATEMENTS_DERIVED)) {
+        return;
+    }
+    
+    indexDeletedItem(dbInfo, itemId, attribute, flags);
+    indexFactText(dbInfo, rowId, itemId, attribute, type, flags);
+    indexFactLocation(dbInfo, itemId, attribute, type, flags, numericalValue);
+    indexRelationship(dbInfo, itemId, attribute);
+    noteCheckpointProgress(dbInfo, itemId);
+}
+
+/// @brief Brings the derived indexes up to date with facts rows written without them, from a row id on.
+static void catchUpDerivedIndexes(CSLDatabase *dbInfo, sqlite3_int64 fromRowId) {
+    sqlite3_stmt *stmt;
+    
+    if (!needStatements(dbInfo, STATEMENTS_DERIVED)) {
+        return;
+    }
+    
+    // Deleted items and locations replay their (few) facts in order
+    if (prepareIndexStatement(dbInfo, "SELECT itemId, attribute, type, flags, typedValue FROM facts "
+                              "WHERE id >= ? AND attribute IN ('deleted', 'latitude', 'longitude') ORDER BY id;", &stmt)) {
+        sqlite3_bind_int64(stmt, 1, fromRowId);
+        
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *itemId = (const char *)sqlite3_column_text(stmt, 0);
+            const char *attribute = (const char *)sqlite3_column_text(stmt, 1);
+            
+            indexDeletedItem(dbInfo, itemId, attribute, sqlite3_column_int(stmt, 3));
+            indexFactLocation(dbInfo, itemId, attribute, (const char *)sqlite3_column_text(stmt, 2), sqlite3_column_int(stmt, 3), sqlite3_column_double(stmt, 4));
+        }
+        
+        sqlite3_finalize(stmt);
+    }
+    
+    // Text only needs each touched item attribute's final value, not every one in between
+    if (prepareIndexStatement(dbInfo, "SELECT DISTINCT itemId, attribute FROM facts WHERE id >= ?;", &stmt)) {
+        sqlite3_bind_int64(stmt, 1, fromRowId);
+        
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *itemId = (const char *)sqlite3_column_text(stmt, 0);
+            const char *attribute = (const char *)sqlite3_column_text(stmt, 1);
+            sqlite3_int64 liveRowId = 0;
+            
+            sqlite3_bind_text(dbInfo->stmt_latest_live_fact, 1, itemId, -1, SQLITE_STATIC);
+            sqlite3_bind_text(dbInfo->stmt_latest_live_fact, 2, attribute, -1, SQLITE_STATIC);
+            
+            if (sqlite3_step(dbInfo->stmt_latest_live_fact) == SQLITE_ROW && isStringType((const char *)sqlite3_column_text(dbInfo->stmt_latest_live_fact, 1)))
+                liveRowId = sqlite3_column_int64(dbInfo->stmt_latest_live_fact, 0);
+            
+            sqlite3_reset(dbInfo->stmt_latest_live_fact);
+            
+            setCurrentText(dbInfo, itemId, attribute, liveRowId);
+        }
+        
+        sqlite3_finalize(stmt);
+    }
+    
+    // Edges, like text, only need each relationship's final state
+    catchUpRelationships(dbInfo, fromRowId);
+    
+    // One checkpoint per item that's gone past the interval, at its latest state
+    if (prepareIndexStatement(dbInfo, "SELECT DISTINCT itemId FROM facts WHERE id >= ?;", &stmt)) {
+        sqlite3_bind_int64(stmt, 1, fromRowId);
+        
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            noteCheckpointProgress(dbInfo, (const char *)sqlite3_column_text(stmt, 0));
+        }
+        
+        sqlite3_finalize(stmt);
+    }
+}
+
+static CFactsCollection* emptyFactsCollection(void) {
+    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
+    initFactsCollection(collection);
+    
+    return collection;
+}
+
+// MARK: - Insert
+
+/// @brief Inserts a fact into the current database along with its derived index entries.
+/// @return The new row's id, or 0 if it couldn't be inserted.
+static sqlite3_int64 insertFactRow(const char *factId,
+                                   const char *itemId,
+                                   const char *attribute,
+                                   const char *value,
+                                   double numericalValue,
+                                   const char *type,
+                                   int flags,
+                                   const char *timestamp) {
+    sqlite3_int64 rowId = 0;
+    
+    if (!needStatements(currentDatabase, STATEMENTS_CORE | STATEMENTS_VALUE_BLOBS)) {
+        return 0;
+    }
+    
+    int rc = sqlite3_reset(currentDatabase->stmt_insert_fact);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+        return 0;
+    }
+    
+#ifdef STORE_LOG
+    printf("Insert fact %s %s %s %f\n", itemId, attribute, value, numericalValue);
+#endif
+    
+    sqlite3_bind_text(currentDatabase->stmt_insert_fact, 1, factId, -1, SQLITE_STATIC);
+    sqlite3_bind_text(currentDatabase->stmt_insert_fact, 2, itemId, -1, SQLITE_STATIC);
+    sqlite3_bind_text(currentDatabase->stmt_insert_fact, 3, attribute, -1, SQLITE_STATIC);
+    bindTypedValue(currentDatabase->stmt_insert_fact, 4, 5, 9, type, value, numericalValue);
+    
+    if (type != NULL)
+        sqlite3_bind_text(currentDatabase->stmt_insert_fact, 6, type, -1, SQLITE_STATIC);
+    else
+        sqlite3_bind_text(currentDatabase->stmt_insert_fact, 6, "string", -1, SQLITE_STATIC);
+    
+    sqlite3_bind_int(currentDatabase->stmt_insert_fact, 7, flags);
+    
+    if (timestamp != NULL)
+        sqlite3_bind_text(currentDatabase->stmt_insert_fact, 8, timestamp, -1, SQLITE_STATIC);
+    else {
+        char currentDateTime[CURRENT_DATE_TIME_LENGTH];
+        sqlite3_bind_text(currentDatabase->stmt_insert_fact, 8, formatCurrentDateTime(currentDateTime), -1, SQLITE_TRANSIENT);
+    }
+    
+#ifdef STORE_STATS
+    uint64_t startedAt = monotonicNanoseconds();
+#endif
+    
+    if (currentDatabase->bulkLoad.active) {
+        // Derived indexes catch up when the load ends
+        if (!bindStoredValue(currentDatabase, currentDatabase->stmt_insert_fact, 4, type, value))
+            rc = SQLITE_ERROR;
+        else if ((rc = sqlite3_step(currentDatabase->stmt_insert_fact)) != SQLITE_DONE)
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+        else {
+            rowId = sqlite3_last_insert_rowid(currentDatabase->db);
+            noteBulkRow(currentDatabase, itemId);
+        }
+    }
+    else {
+        // Keep the fact and its derived index entries in step
+        sqlite3_exec(currentDatabase->db, "SAVEPOINT insert_fact;", 0, 0, NULL);
+        
+        // A long value's blob goes in with the fact
+        if (!bindStoredValue(currentDatabase, currentDatabase->stmt_insert_fact, 4, type, value))
+            rc = SQLITE_ERROR;
+        else if ((rc = sqlite3_step(currentDatabase->stmt_insert_fact)) != SQLITE_DONE)
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+        else {
+            rowId = sqlite3_last_insert_rowid(currentDatabase->db);
+            noteItemWritten(currentDatabase, itemId);
+            indexFact(currentDatabase, rowId, itemId, attribute, type, flags, numericalValue);
+        }
+        
+        sqlite3_exec(currentDatabase->db, "RELEASE insert_fact;", 0, 0, NULL);
+    }
+    
+    // A failed step leaves the statement active, which would hold up a read session's COMMIT
+    sqlite3_reset(currentDatabase->stmt_insert_fact);
+    
+#ifdef STORE_STATS
+    recordStatement(currentDatabase, CSL_STMT_INSERT_FACT, 0, 0, startedAt);
+#endif
+    
+    return rowId;
+}
+
+bool csl_insertFact(CSLDatabase *db,
+                    const char *factId,
+                    const char *itemId,
+                    const char *attribute,
+                    const char *value,
+                    double numericalValue,
+                    const char *type,
+                    int flags,
+                    const char *timestamp) {
+    if (db->shardCount > 0) {
+        return insertShardFact(db, factId, itemId, attribute, value, numericalValue, type, flags, timestamp);
+    }
+    
+    switchDatabase(db);
+    
+    if (insertFactRow(factId, itemId, attribute, value, numericalValue, type, flags, timestamp) == 0) {
+        // The session's snapshot can't take the write lock once another connection has moved past it
+        if (currentDatabase->readSessionDepth > 0 && (sqlite3_extended_errcode(currentDatabase->db) & 0xff) == SQLITE_BUSY) {
+            fprintf(stderr, "Insert error: drive changed since its read session began; end the session and insert again\n");
+        }
+        
+        return false;
+    }
+    
+    // A bulk load notifies once, when it ends
+    if (updateFn != NULL && !currentDatabase->bulkLoad.active) {
+        updateFn();
+    }
+    
+    return true;
+}
+
+// MARK: - Insert batches
+
+bool csl_beginInsertBatch(CSLDatabase *db) {
+    if (!unshardedDrive(db, "Insert batch")) {
+        return false;
+    }
+    
+    switchDatabase(db);
+    
+    // Sessions and bulk loads already gather inserts into their own transactions
+    if (currentDatabase->insertBatch || currentDatabase->readSessionDepth > 0 || currentDatabase->bulkLoad.active) {
+        return false;
+    }
+    
+    // IMMEDIATE takes the write lock up front, so no insert in the batch can find it gone
+    if (!execIndexSQL(currentDatabase, "BEGIN IMMEDIATE;")) {
+        return false;
+    }
+    
+    currentDatabase->insertBatch = true;
+    
+    return true;
+}
+
+bool csl_endInsertBatch(CSLDatabase *db) {
+    if (!unshardedDrive(db, "Insert batch") || !db->insertBatch) {
+        return false;
+    }
+    
+    switchDatabase(db);
+    
+    currentDatabase->insertBatch = false;
+    
+    if (!execIndexSQL(currentDatabase, "COMMIT;")) {
+        sqlite3_exec(currentDatabase->db, "ROLLBACK;", 0, 0, NULL);
+        return false;
+    }
+    
+    return true;
+}
+
+long long csl_factRowCount(CSLDatabase *db) {
+    if (!unshardedDrive(db, "Fact count")) {
+        return -1;
+    }
+    
+    switchDatabase(db);
+    
+    return lastFactRowId(currentDatabase);
+}
+
+
+// MARK: - Bulk load
+//  The secondary indexes on facts are dropped for the load and recorded in
+//  drive_info ('bulkLoadIndex.<name>' holds each one's SQL), along with the
+//  first row id the load wrote ('bulkLoadFrom'), so a load that never ended
+//  can be finished when the drive is next opened.
+
+static int pragmaValue(CSLDatabase *dbInfo, const char *sql) {
+    sqlite3_stmt *stmt;
+    int value = 0;
+    
+    if (sqlite3_prepare_v2(dbInfo->db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+            value = sqlite3_column_int(stmt, 0);
+        
+        sqlite3_finalize(stmt);
+    }
+    
+    return value;
+}
+
+/// @brief Runs the SQL text produced by a query (e.g. generated DROP or CREATE statements).
+static bool execGeneratedSQL(CSLDatabase *dbInfo, const char *query) {
+    sqlite3_stmt *stmt;
+    char *sql = NULL;
+    
+    if (!prepareIndexStatement(dbInfo, query, &stmt)) {
+        return false;
+    }
+    
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        uint64_t bytes = 0;
+        sql = copyColumnText(stmt, 0, &bytes);
+    }
+    
+    sqlite3_finalize(stmt);
+    
+    bool ok = sql == NULL || execIndexSQL(dbInfo, sql);
+    free(sql);
+    
+    return ok;
+}
+
+static void noteBulkRow(CSLDatabase *dbInfo, const char *itemId) {
+    // No resizing mid-load; the filter is rebuilt when the load ends
+    if (dbInfo->itemFilter.bits != NULL) {
+        addToItemFilter(&dbInfo->itemFilter, itemId);
+    }
+    
+    if (++dbInfo->bulkLoad.rowsInTransaction >= CSL_BULK_LOAD_TRANSACTION_ROWS) {
+        sqlite3_exec(dbInfo->db, "COMMIT; BEGIN;", 0, 0, NULL);
+        dbInfo->bulkLoad.rowsInTransaction = 0;
+    }
+}
+
+bool csl_beginBulkLoad(CSLDatabase *db) {
+    if (db->shardCount > 0) {
+        return beginShardBulkLoad(db);
+    }
+    
+    switchDatabase(db);
+    
+    if (currentDatabase->bulkLoad.active || !outsideReadSession(currentDatabase, "Bulk load")) {
+        return false;
+    }
+    
+    sqlite3_exec(currentDatabase->db, "BEGIN IMMEDIATE;", 0, 0, NULL);
+    
+    sqlite3_stmt *stmt;
+    bool ok = prepareIndexStatement(currentDatabase, "INSERT OR REPLACE INTO drive_info (key, value) VALUES ('bulkLoadFrom', ?);", &stmt);
+    
+    if (ok) {
+        sqlite3_bind_int64(stmt, 1, lastFactRowId(currentDatabase) + 1);
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+    }
+    
+    ok = ok &&
+    execIndexSQL(currentDatabase, "INSERT OR REPLACE INTO drive_info (key, value) SELECT 'bulkLoadIndex.' || name, sql FROM sqlite_master "
+                 "WHERE type = 'index' AND tbl_name = 'facts' AND sql IS NOT NULL;") &&
+    execGeneratedSQL(currentDatabase, "SELECT group_concat(printf('DROP INDEX IF EXISTS \"%w\";', substr(key, 15)), '') FROM drive_info "
+                     "WHERE key LIKE 'bulkLoadIndex.%';");
+    
+    sqlite3_exec(currentDatabase->db, ok ? "COMMIT;" : "ROLLBACK;", 0, 0, NULL);
+    
+    if (!ok) {
+        return false;
+    }
+    
+    CSLBulkLoad *load = &currentDatabase->bulkLoad;
+    load->firstRowId = lastFactRowId(currentDatabase) + 1;
+    load->rowsInTransaction = 0;
+    load->previousSynchronous = pragmaValue(currentDatabase, "PRAGMA synchronous;");
+    load->previousCacheSize = pragmaValue(currentDatabase, "PRAGMA cache_size;");
+    
+    // Nothing from the load is durable until it ends anyway
+    sqlite3_exec(currentDatabase->db, "PRAGMA synchronous = OFF; PRAGMA cache_size = -65536; BEGIN;", 0, 0, NULL);
+    load->active = true;
+    
+    return true;
+}
+
+/// @brief Recreates the dropped indexes and catches the derived ones up, if a bulk load was recorded.
+static void finishBulkLoad(CSLDatabase *dbInfo) {
+    sqlite3_stmt *stmt;
+    sqlite3_int64 firstRowId = 0;
+    
+    if (!prepareIndexStatement(dbInfo, "SELECT value FROM drive_info WHERE key = 'bulkLoadFrom';", &stmt)) {
+        return;
+    }
+    
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        firstRowId = sqlite3_column_int64(stmt, 0);
+    
+    sqlite3_finalize(stmt);
+    
+    if (firstRowId == 0) {
+        return;
+    }
+    
+    sqlite3_exec(dbInfo->db, "BEGIN IMMEDIATE;", 0, 0, NULL);
+    
+    // openDatabase may have recreated the built-in indexes already
+    bool ok = execGeneratedSQL(dbInfo, "SELECT group_concat(value, ';') FROM drive_info WHERE key LIKE 'bulkLoadIndex.%' "
+                               "AND substr(key, 15) NOT IN (SELECT name FROM sqlite_master WHERE type = 'index');");
+    
+    if (ok) {
+        catchUpDerivedIndexes(dbInfo, firstRowId);
+        ok = execIndexSQL(dbInfo, "DELETE FROM drive_info WHERE key = 'bulkLoadFrom' OR key LIKE 'bulkLoadIndex.%';");
+    }
+    
+    sqlite3_exec(dbInfo->db, ok ? "COMMIT;" : "ROLLBACK;", 0, 0, NULL);
+    
+    if (ok) {
+        execIndexSQL(dbInfo, "ANALYZE;");
+    }
+}
+
+static bool endBulkLoad(CSLDatabase *dbInfo) {
+    if (!dbInfo->bulkLoad.active) {
+        return false;
+    }
+    
+    switchDatabase(dbInfo);
+    
+    CSLBulkLoad *load = &currentDatabase->bulkLoad;
+    
+    sqlite3_exec(currentDatabase->db, "COMMIT;", 0, 0, NULL);
+    sqlite3_finalize(load->stmt_parse_json);
+    load->stmt_parse_json = NULL;
+    load->active = false;
+    
+    finishBulkLoad(currentDatabase);
+    rebuildItemFilter(currentDatabase);
+    
+    char *sql = sqlite3_mprintf("PRAGMA synchronous = %d; PRAGMA cache_size = %d;", load->previousSynchronous, load->previousCacheSize);
+    sqlite3_exec(currentDatabase->db, sql, 0, 0, NULL);
+    sqlite3_free(sql);
+    
+    return true;
+}
+
+bool csl_endBulkLoad(CSLDatabase *db) {
+    if (db == NULL || !db->bulkLoad.active) {
+        return false;
+    }
+    
+    // The shards rebuild their indexes at once
+    if (db->shardCount > 0) {
+        forEachShard(db, endShardBulkLoad, NULL);
+        db->bulkLoad.active = false;
+    }
+    else if (!endBulkLoad(db)) {
+        return false;
+    }
+    
+    if (updateFn != NULL) {
+        updateFn();
+    }
+    
+    return true;
+}
+
+long long csl_bulkInsertFacts(CSLDatabase *db, const CFact *facts, int count) {
+    if (db->shardCount > 0) {
+        return bulkInsertShardFacts(db, facts, count);
+    }
+    
+    bool ownsLoad = csl_beginBulkLoad(db);
+    long long inserted = 0;
+    
+    switchDatabase(db);
+    
+    for (int i = 0; i < count; i++) {
+        const CFact *fact = &facts[i];
+        
+        if (insertFactRow(fact->factId, fact->itemId, fact->attribute, fact->value, fact->numericalValue, fact->type, fact->flags, fact->timestamp) != 0) {
+            inserted++;
+        }
+    }
+    
+    if (ownsLoad) {
+        csl_endBulkLoad(db);
+    }
+    
+    return inserted;
+}
+
+long long csl_bulkLoadFacts(CSLDatabase *db, FILE *in) {
+    FactDecoder decoder;
+    
+    if (!initFactDecoder(&decoder, in)) {
+        fprintf(stderr, "Bulk load error: not a fact stream\n");
+        freeFactDecoder(&decoder);
+        return -1;
+    }
+    
+    bool ownsLoad = csl_beginBulkLoad(db);
+    long long inserted = 0;
+    int result;
+    CFact fact;
+    
+    switchDatabase(db);
+    
+    while ((result = decodeNextFact(&decoder, &fact)) == 1) {
+        int shard = db->shardCount > 0 ? shardIndex(db, fact.itemId) : -1;
+        
+        if (shard >= 0) {
+            pthread_mutex_lock(&db->shardLocks[shard]);
+            switchDatabase(db->shards[shard]);
+        }
+        
+        if (insertFactRow(fact.factId, fact.itemId, fact.attribute, fact.value, fact.numericalValue, fact.type, fact.flags, fact.timestamp) != 0) {
+            inserted++;
+        }
+        
+        if (shard >= 0)
+            pthread_mutex_unlock(&db->shardLocks[shard]);
+    }
+    
+    // Facts before a truncation stay loaded; the stream can't say how many are missing
+    if (result < 0) {
+        fprintf(stderr, "Bulk load error: truncated fact stream after %lld facts\n", inserted);
+    }
+    
+    if (ownsLoad) {
+        csl_endBulkLoad(db);
+    }
+    
+    freeFactDecoder(&decoder);
+    
+    return inserted;
+}
+
+long long csl_bulkLoadJSONL(CSLDatabase *db, FILE *in) {
+    if (db->shardCount > 0) {
+        fprintf(stderr, "Bulk load error: JSONL loads go to a single drive, not a sharded one\n");
+        return -1;
+    }
+    
+    bool ownsLoad = csl_beginBulkLoad(db);
+    
+    switchDatabase(db);
+    
+    if (!currentDatabase->bulkLoad.active) {
+        return -1;
+    }
+    
+    CSLBulkLoad *load = &currentDatabase->bulkLoad;
+    
+    // SQLite parses each line; the fields then go through the usual insert
+    if (load->stmt_parse_json == NULL &&
+        !prepareIndexStatement(currentDatabase, "SELECT json_extract(?1, '$.factId'), json_extract(?1, '$.itemId'), json_extract(?1, '$.attribute'), "
+                               "json_extract(?1, '$.value'), json_extract(?1, '$.numericalValue'), json_extract(?1, '$.type'), "
+                               "json_extract(?1, '$.flags'), json_extract(?1, '$.timestamp');", &load->stmt_parse_json)) {
+        if (ownsLoad) {
+            csl_endBulkLoad(db);
+        }
+        
+        return -1;
+    }
+    
+    sqlite3_stmt *stmt = load->stmt_parse_json;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    long long lineNumber = 0, inserted = 0;
+    
+    while ((length = getline(&line, &capacity, in)) != -1) {
+        lineNumber++;
+        
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        
+        if (length == 0) {
+            continue;
+        }
+        
+        sqlite3_bind_text(stmt, 1, line, (int)length, SQLITE_STATIC);
+        
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            fprintf(stderr, "Bulk load error: line %lld: %s\n", lineNumber, sqlite3_errmsg(currentDatabase->db));
+        }
+        else if (sqlite3_column_type(stmt, 0) == SQLITE_NULL || sqlite3_column_type(stmt, 1) == SQLITE_NULL ||
+                 sqlite3_column_type(stmt, 2) == SQLITE_NULL || sqlite3_column_type(stmt, 3) == SQLITE_NULL) {
+            fprintf(stderr, "Bulk load error: line %lld: factId, itemId, attribute and value are required\n", lineNumber);
+        }
+        else if (insertFactRow((const char *)sqlite3_column_text(stmt, 0),
+                               (const char *)sqlite3_column_text(stmt, 1),
+                               (const char *)sqlite3_column_text(stmt, 2),
+                               (const char *)sqlite3_column_text(stmt, 3),
+                               sqlite3_column_double(stmt, 4),
+                               (const char *)sqlite3_column_text(stmt, 5),
+                               sqlite3_column_int(stmt, 6),
+                               (const char *)sqlite3_column_text(stmt, 7)) != 0) {
+            inserted++;
+        }
+        
+        sqlite3_reset(stmt);
+    }
+    
+    (free)(line); // getline allocated it, outside the store's allocation counters
+    
+    if (ownsLoad) {
+        csl_endBulkLoad(db);
+    }
+    
+    return inserted;
+}
+
+// MARK: - Read sessions
+
+bool csl_beginRead(CSLDatabase *db) {
+    if (db->shardCount > 0) {
+        return beginShardRead(db);
+    }
+    
+    switchDatabase(db);
+    
+    // Everything in a bulk load or insert batch already shares its transaction
+    if (currentDatabase->bulkLoad.active || currentDatabase->insertBatch) {
+        return false;
+    }
+    
+    if (currentDatabase->readSessionDepth > 0) {
+        currentDatabase->readSessionDepth++;
+        return true;
+    }
+    
+    // BEGIN only takes the snapshot at the first read, so read straight away
+    if (!execIndexSQL(currentDatabase, "BEGIN; SELECT 1 FROM facts LIMIT 1;")) {
+        sqlite3_exec(currentDatabase->db, "ROLLBACK;", 0, 0, NULL);
+        return false;
+    }
+    
+    currentDatabase->readSessionDepth = 1;
+    
+    return true;
+}
+
+bool csl_endRead(CSLDatabase *db) {
+    if (db == NULL || db->readSessionDepth == 0) {
+        return false;
+    }
+    
+    if (db->shardCount > 0) {
+        return endShardRead(db);
+    }
+    
+    switchDatabase(db);
+    
+    if (--currentDatabase->readSessionDepth > 0) {
+        return true;
+    }
+    
+    if (!execIndexSQL(currentDatabase, "COMMIT;")) {
+        sqlite3_exec(currentDatabase->db, "ROLLBACK;", 0, 0, NULL);
+        return false;
+    }
+    
+    return true;
+}
+
+/// @brief Whether the drive can run a transaction of its own: not in a read session or insert batch, whose transaction its COMMIT would end.
+static bool outsideReadSession(CSLDatabase *dbInfo, const char *operation) {
+    if (dbInfo->readSessionDepth > 0) {
+        fprintf(stderr, "%s error: drive is in a read session\n", operation);
+        return false;
+    }
+    
+    if (dbInfo->insertBatch) {
+        fprintf(stderr, "%s error: drive is in an insert batch\n", operation);
+        return false;
+    }
+    
+    return true;
+}
+
+// MARK: - Attribute indexes
+//  Hot attributes can be given their own partial indexes (WHERE attribute =
+//  '<attribute>'), recorded per drive in attribute_indexes. SQLite only uses a
+//  partial index when the query names the same literal, so each indexed
+//  attribute gets statements with the attribute inlined rather than bound.
+
+#define ATTRIBUTE_INDEX_KIND_COUNT 3
+#define ATTRIBUTE_INDEX_ALL_KINDS (CATTRIBUTE_INDEX_VALUE | CATTRIBUTE_INDEX_TYPED_VALUE | CATTRIBUTE_INDEX_ITEMS)
+
+static const char *attributeIndexKindNames[ATTRIBUTE_INDEX_KIND_COUNT] = { "value", "typed_value", "items" };
+static const char *attributeIndexDefinitions[ATTRIBUTE_INDEX_KIND_COUNT] = {
+    "(value) WHERE attribute = %Q",
+    "(typedValue) WHERE attribute = %Q AND typedValue IS NOT NULL",
+    "(timestamp DESC, itemId) WHERE attribute = %Q"
+};
+
+/// @brief The index's name; attributes may hold any characters, so it's named by a hash.
+static char* attributeIndexName(const char *attribute, int kind) {
+    uint64_t hash, unused;
+    itemFilterHashes(attribute, &hash, &unused);
+    
+    return sqlite3_mprintf("idx_attribute_%s_%016llx", attributeIndexKindNames[kind], (unsigned long long)hash);
+}
+
+static void finalizeAttributeIndex(CSLAttributeIndex *index) {
+    sqlite3_finalize(index->stmt_by_value);
+    sqlite3_finalize(index->stmt_by_typed_range);
+    sqlite3_finalize(index->stmt_by_attribute);
+    index->stmt_by_value = NULL;
+    index->stmt_by_typed_range = NULL;
+    index->stmt_by_attribute = NULL;
+}
+
+static bool prepareAttributeIndexStatement(CSLDatabase *dbInfo, const char *format, const char *attribute, sqlite3_stmt **stmt) {
+    char *sql = sqlite3_mprintf(format, attribute);
+    bool prepared = sqlite3_prepare_v3(dbInfo->db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL) == SQLITE_OK;
+    
+    if (!prepared)
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(dbInfo->db));
+    
+    sqlite3_free(sql);
+    
+    return prepared;
+}
+
+/// @brief Whole-attribute scans name their index: without statistics the planner prefers idx_timestamp's full scan.
+static bool prepareAttributeScan(CSLDatabase *dbInfo, CSLAttributeIndex *index) {
+    char *name = attributeIndexName(index->attribute, 2);
+    char *format = sqlite3_mprintf("SELECT * FROM facts INDEXED BY \"%w\" WHERE attribute = %%Q ORDER BY timestamp DESC;", name);
+    bool prepared = prepareAttributeIndexStatement(dbInfo, format, index->attribute, &index->stmt_by_attribute);
+    
+    sqlite3_free(format);
+    sqlite3_free(name);
+    
+    return prepared;
+}
+
+/// @brief Builds the kinds an attribute doesn't have an index for yet and prepares its statements.
+static bool loadAttributeIndex(CSLDatabase *dbInfo, CSLAttributeIndex *index) {
+    for (int kind = 0; kind < ATTRIBUTE_INDEX_KIND_COUNT; kind++) {
+        if (!(index->kinds & (1 << kind))) {
+            continue;
+        }
+        
+        char *name = attributeIndexName(index->attribute, kind);
+        char *definition = sqlite3_mprintf(attributeIndexDefinitions[kind], index->attribute);
+        char *sql = sqlite3_mprintf("CREATE INDEX IF NOT EXISTS \"%w\" ON facts %s;", name, definition);
+        bool built = execIndexSQL(dbInfo, sql);
+        
+        sqlite3_free(sql);
+        sqlite3_free(definition);
+        sqlite3_free(name);
+        
+        if (!built) {
+            return false;
+        }
+    }
+    
+    finalizeAttributeIndex(index);
+    
+    return
+    (!(index->kinds & CATTRIBUTE_INDEX_VALUE) ||
+     prepareAttributeIndexStatement(dbInfo, "SELECT * FROM facts WHERE attribute = %Q AND value = ?1 "
+                                    "AND (?2 IS NULL OR itemId = ?2) ORDER BY timestamp DESC;", index->attribute, &index->stmt_by_value)) &&
+    (!(index->kinds & CATTRIBUTE_INDEX_TYPED_VALUE) ||
+     prepareAttributeIndexStatement(dbInfo, "SELECT * FROM facts WHERE attribute = %Q AND typedValue >= ?1 AND typedValue <= ?2 "
+                                    "AND (type = 'boolean') = ?4 AND (?3 IS NULL OR itemId = ?3) ORDER BY timestamp DESC;", index->attribute, &index->stmt_by_typed_range)) &&
+    (!(index->kinds & CATTRIBUTE_INDEX_ITEMS) || prepareAttributeScan(dbInfo, index));
+}
+
+static CSLAttributeIndex* findAttributeIndex(CSLDatabase *dbInfo, const char *attribute) {
+    for (int i = 0; i < dbInfo->attributeIndexCount; i++) {
+        if (strcmp(dbInfo->attributeIndexes[i].attribute, attribute) == 0) {
+            return &dbInfo->attributeIndexes[i];
+        }
+    }
+    
+    return NULL;
+}
+
+static bool prepareAttributeIndexes(CSLDatabase *dbInfo) {
+    if (!execIndexSQL(dbInfo, "CREATE TABLE IF NOT EXISTS attribute_indexes (attribute TEXT PRIMARY KEY, kinds INTEGER NOT NULL) WITHOUT ROWID;")) {
+        return false;
+    }
+    
+    sqlite3_stmt *stmt;
+    
+    if (!prepareIndexStatement(dbInfo, "SELECT attribute, kinds FROM attribute_indexes;", &stmt)) {
+        return false;
+    }
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        dbInfo->attributeIndexes = realloc(dbInfo->attributeIndexes, (dbInfo->attributeIndexCount + 1) * sizeof(CSLAttributeIndex));
+        
+        CSLAttributeIndex *index = &dbInfo->attributeIndexes[dbInfo->attributeIndexCount++];
+        index->attribute = strdup((const char *)sqlite3_column_text(stmt, 0));
+        index->kinds = sqlite3_column_int(stmt, 1) & ATTRIBUTE_INDEX_ALL_KINDS;
+        index->stmt_by_value = NULL;
+        index->stmt_by_typed_range = NULL;
+        index->stmt_by_attribute = NULL;
+    }
+    
+    sqlite3_finalize(stmt);
+    
+    // Rebuilds any index that's gone missing, e.g. when a bulk load was cut short
+    for (int i = 0; i < dbInfo->attributeIndexCount; i++) {
+        if (!loadAttributeIndex(dbInfo, &dbInfo->attributeIndexes[i])) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+static void freeAttributeIndexes(CSLDatabase *dbInfo) {
+    for (int i = 0; i < dbInfo->attributeIndexCount; i++) {
+        finalizeAttributeIndex(&dbInfo->attributeIndexes[i]);
+        free(dbInfo->attributeIndexes[i].attribute);
+    }
+    
+    free(dbInfo->attributeIndexes);
+    dbInfo->attributeIndexes = NULL;
+    dbInfo->attributeIndexCount = 0;
+}
+
+bool csl_createAttributeIndex(CSLDatabase *db, const char *attribute, int kinds) {
+    if (!unshardedDrive(db, "Attribute index")) {
+        return false;
+    }
+    
+    switchDatabase(db);
+    
+    kinds &= ATTRIBUTE_INDEX_ALL_KINDS;
+    
+    // Indexes are built after a bulk load, not during one
+    if (attribute == NULL || kinds == 0 || db->bulkLoad.active || !outsideReadSession(db, "Attribute index")) {
+        return false;
+    }
+    
+    CSLAttributeIndex *index = findAttributeIndex(db, attribute);
+    
+    if (index == NULL) {
+        db->attributeIndexes = realloc(db->attributeIndexes, (db->attributeIndexCount + 1) * sizeof(CSLAttributeIndex));
+        
+        index = &db->attributeIndexes[db->attributeIndexCount++];
+        index->attribute = strdup(attribute);
+        index->kinds = 0;
+        index->stmt_by_value = NULL;
+        index->stmt_by_typed_range = NULL;
+        index->stmt_by_attribute = NULL;
+    }
+    
+    int previousKinds = index->kinds;
+    index->kinds |= kinds;
+    
+    // The registry only names indexes that were built
+    sqlite3_exec(db->db, "BEGIN IMMEDIATE;", 0, 0, NULL);
+    
+    char *sql = sqlite3_mprintf("INSERT INTO attribute_indexes (attribute, kinds) VALUES (%Q, %d) "
+                                "ON CONFLICT (attribute) DO UPDATE SET kinds = excluded.kinds;", attribute, index->kinds);
+    bool ok = loadAttributeIndex(db, index) && execIndexSQL(db, sql);
+    sqlite3_free(sql);
+    
+    sqlite3_exec(db->db, ok ? "COMMIT;" : "ROLLBACK;", 0, 0, NULL);
+    
+    if (!ok) {
+        index->kinds = previousKinds;
+        loadAttributeIndex(db, index);
+    }
+    
+    return ok;
+}
+
+bool csl_dropAttributeIndex(CSLDatabase *db, const char *attribute, int kinds) {
+    if (!unshardedDrive(db, "Attribute index")) {
+        return false;
+    }
+    
+    switchDatabase(db);
+    
+    // A bulk load recreates the indexes it recorded when it finishes, so drops wait for it too
+    if (attribute == NULL || db->bulkLoad.active || !outsideReadSession(db, "Attribute index")) {
+        return false;
+    }
+    
+    CSLAttributeIndex *index = findAttributeIndex(db, attribute);
+    
+    if (index == NULL) {
+        return false;
+    }
+    
+    kinds &= index->kinds;
+    int remainingKinds = index->kinds & ~kinds;
+    
+    // The indexes and their registry entry go together
+    sqlite3_exec(db->db, "BEGIN IMMEDIATE;", 0, 0, NULL);
+    
+    bool ok = true;
+    
+    for (int kind = 0; kind < ATTRIBUTE_INDEX_KIND_COUNT && ok; kind++) {
+        if (kinds & (1 << kind)) {
+            char *name = attributeIndexName(attribute, kind);
+            char *sql = sqlite3_mprintf("DROP INDEX IF EXISTS \"%w\";", name);
+            ok = execIndexSQL(db, sql);
+            sqlite3_free(sql);
+            sqlite3_free(name);
+        }
+    }
+    
+    char *sql = remainingKinds != 0
+    ? sqlite3_mprintf("UPDATE attribute_indexes SET kinds = %d WHERE attribute = %Q;", remainingKinds, attribute)
+    : sqlite3_mprintf("DELETE FROM attribute_indexes WHERE attribute = %Q;", attribute);
+    ok = ok && execIndexSQL(db, sql);
+    sqlite3_free(sql);
+    
+    sqlite3_exec(db->db, ok ? "COMMIT;" : "ROLLBACK;", 0, 0, NULL);
+    
+    if (!ok) {
+        return false;
+    }
+    
+    index->kinds = remainingKinds;
+    
+    if (index->kinds != 0) {
+        return loadAttributeIndex(db, index);
+    }
+    
+    finalizeAttributeIndex(index);
+    free(index->attribute);
+    *index = db->attributeIndexes[--db->attributeIndexCount];
+    
+    return true;
+}
+
+int csl_attributeIndexKinds(CSLDatabase *db, const char *attribute) {
+    CSLAttributeIndex *index = attribute != NULL ? findAttributeIndex(db, attribute) : NULL;
+    
+    return index != NULL ? index->kinds : 0;
+}
+
+static CFactsCollection* fetchFactsByAttributeIndex(sqlite3_stmt *stmt) {
+    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
+    initFactsCollection(collection);
+    
+    runQuery(stmt, CSL_STMT_FETCH_BY_ATTRIBUTE_INDEX, collection);
+    sqlite3_reset(stmt);
+    
+    return collection;
+}
+
+// MARK: - Fetch
+
+CFactsCollection* csl_queryFacts(CSLDatabase *db, const CSLFactsQuery *query) {
+    if (db->shardCount > 0) {
+        return queryShardFacts(db, query);
+    }
+    
+    switchDatabase(db);
+    
+    if (query->itemId != NULL && !csl_mayContainItem(db, query->itemId)) {
+        return emptyFactsCollection();
+    }
+    
+    int shape = factsQueryShape(query);
+    
+    // Declared attribute indexes serve their shapes, itemId or not, except during a bulk load,
+    // which drops them (and the attribute scan names its index)
+    CSLAttributeIndex* index = query->attribute != NULL && !db->bulkLoad.active ? findAttributeIndex(db, query->attribute) : NULL;
+    int constraints = shape & ~(FACTS_SHAPE_ITEM_ID | FACTS_SHAPE_ATTRIBUTE);
+    
+    if (index != NULL && constraints == FACTS_SHAPE_VALUE && index->stmt_by_value != NULL) {
+        bindValueText(db, index->stmt_by_value, 1, query->value);
+        sqlite3_bind_text(index->stmt_by_value, 2, query->itemId, -1, SQLITE_STATIC);
+        return fetchFactsByAttributeIndex(index->stmt_by_value);
+    }
+    
+    if (index != NULL && constraints == FACTS_SHAPE_VALUE_RANGE && index->stmt_by_typed_range != NULL) {
+        bindFactValue(index->stmt_by_typed_range, 1, query->valueAtOrAbove);
+        bindFactValue(index->stmt_by_typed_range, 2, query->valueAtOrBelow);
+        sqlite3_bind_text(index->stmt_by_typed_range, 3, query->itemId, -1, SQLITE_STATIC);
+        bindBooleanRange(index->stmt_by_typed_range, 4, query->valueAtOrAbove, query->valueAtOrBelow);
+        return fetchFactsByAttributeIndex(index->stmt_by_typed_range);
+    }
+    
+    if (index != NULL && shape == FACTS_SHAPE_ATTRIBUTE && index->stmt_by_attribute != NULL) {
+        return fetchFactsByAttributeIndex(index->stmt_by_attribute);
+    }
+    
+    sqlite3_stmt *stmt = cachedFactsQuery(db, shape);
+    
+    if (stmt == NULL) {
+        return NULL;
+    }
+    
+    bindFactsQuery(stmt, query);
+    
+    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
+    initFactsCollection(collection);
+    
+    runQuery(stmt, factsQueryKind(shape), collection);
+    
+    // Cached statements stay prepared; don't let them hold a read transaction open
+    sqlite3_reset(stmt);
+    
+    return collection;
+}
+
+CFactsCollection* csl_fetchFacts(CSLDatabase* db,
+                                 const char* itemId,
+                                 const char* attribute,
+                                 const char* value) {
+    CSLFactsQuery query = { .itemId = itemId, .attribute = attribute, .value = value };
+    
+    // Everything, as the debug dump lists it
+    if (itemId == NULL && attribute == NULL && value == NULL) {
+        query.order = CSL_FACTS_LAST_INSERTED_FIRST;
+    }
+    
+    return csl_queryFacts(db, &query);
+}
+
+CFactsCollection* csl_fetchFactsByValueRange(CSLDatabase* db,
+                                             const char* itemId,
+                                             const char* attribute,
+                                             double valueAtOrAbove,
+                                             double valueAtOrBelow) {
+    CFactValue low = { .kind = CFACT_VALUE_NUMBER, .number = valueAtOrAbove };
+    CFactValue high = { .kind = CFACT_VALUE_NUMBER, .number = valueAtOrBelow };
+    
+    return csl_fetchFactsByTypedRange(db, itemId, attribute, &low, &high);
+}
+
+CFactsCollection* csl_fetchFactsByTypedRange(CSLDatabase* db,
+                                             const char* itemId,
+                                             const char* attribute,
+                                             const CFactValue* valueAtOrAbove,
+                                             const CFactValue* valueAtOrBelow) {
+    CSLFactsQuery query = {
+        .itemId = itemId,
+        .attribute = attribute,
+        .valueAtOrAbove = valueAtOrAbove,
+        .valueAtOrBelow = valueAtOrBelow
+    };
+    
+    return csl_queryFacts(db, &query);
+}
+
+// MARK: - Prepared queries
+
+CSLPreparedQuery* csl_prepareQuery(CSLDatabase *db, int fields) {
+    if (!unshardedDrive(db, "Prepared query")) {
+        return NULL;
+    }
+    
+    if ((fields & CFACTS_QUERY_VALUE) && (fields & CFACTS_QUERY_VALUE_RANGE)) {
+        fprintf(stderr, "A prepared query can't match both a value and a value range\n");
+        return NULL;
+    }
+    
+    // The same SQL (and parameter numbers) as csl_queryFacts, in a statement of the query's own
+    int shape = (fields & (CFACTS_QUERY_ITEM_ID | CFACTS_QUERY_ATTRIBUTE | CFACTS_QUERY_VALUE)) |
+    (fields & CFACTS_QUERY_VALUE_RANGE ? FACTS_SHAPE_VALUE_RANGE : 0);
+    sqlite3_stmt *stmt = prepareFactsQueryShape(db, shape);
+    
+    if (stmt == NULL) {
+        return NULL;
+    }
+    
+    CSLPreparedQuery *query = malloc(sizeof(CSLPreparedQuery));
+    query->db = db;
+    query->stmt = stmt;
+    query->fields = fields;
+    query->next = db->preparedQueries;
+    db->preparedQueries = query;
+    
+    return query;
+}
+
+bool csl_bindPreparedQuery(CSLPreparedQuery *query,
+                           const char *itemId,
+                           const char *attribute,
+                           const char *value,
+                           const CFactValue *valueAtOrAbove,
+                           const CFactValue *valueAtOrBelow) {
+    if (query->db == NULL) {
+        return false;
+    }
+    
+    sqlite3_stmt *stmt = query->stmt;
+    sqlite3_reset(stmt);
+    
+    if (query->fields & CFACTS_QUERY_ITEM_ID) {
+        if (itemId == NULL || !csl_mayContainItem(query->db, itemId)) {
+            return false;
+        }
+        
+        sqlite3_bind_text(stmt, 1, itemId, -1, SQLITE_STATIC);
+    }
+    
+    if (query->fields & CFACTS_QUERY_ATTRIBUTE) {
+        sqlite3_bind_text(stmt, 2, attribute, -1, SQLITE_STATIC);
+    }
+    
+    if (query->fields & CFACTS_QUERY_VALUE) {
+        bindValueText(query->db, stmt, 3, value);
+    }
+    
+    if (query->fields & CFACTS_QUERY_VALUE_RANGE) {
+        if (valueAtOrAbove == NULL || valueAtOrBelow == NULL) {
+            return false;
+        }
+        
+        bindFactValue(stmt, 4, valueAtOrAbove);
+        bindFactValue(stmt, 5, valueAtOrBelow);
+        bindBooleanRange(stmt, 9, valueAtOrAbove, valueAtOrBelow);
+    }
+    
+    return true;
+}
+
+bool csl_nextPreparedFact(CSLPreparedQuery *query, CFact *fact) {
+    if (query->db == NULL || sqlite3_step(query->stmt) != SQLITE_ROW) {
+        return false;
+    }
+    
+    uint64_t bytes = 0;
+    readFact(query->db, query->stmt, fact, &bytes);
+    
+    return true;
+}
+
+CFactsCollection* csl_runPreparedQuery(CSLPreparedQuery *query,
+                                       const char *itemId,
+                                       const char *attribute,
+                                       const char *value,
+                                       const CFactValue *valueAtOrAbove,
+                                       const CFactValue *valueAtOrBelow) {
+    if (!csl_bindPreparedQuery(query, itemId, attribute, value, valueAtOrAbove, valueAtOrBelow)) {
+        return query->db != NULL ? emptyFactsCollection() : NULL;
+    }
+    
+    switchDatabase(query->db);
+    
+    CFactsCollection* collection = malloc(sizeof(CFactsCollection));
+    initFactsCollection(collection);
+    
+    runQuery(query->stmt, CSL_STMT_PREPARED_QUERY, collection);
+    
+    // Don't hold a read transaction open between runs
+    sqlite3_reset(query->stmt);
+    
+    return collection;
+}
+
+void csl_freePreparedQuery(CSLPreparedQuery *query) {
+    if (query == NULL) {
+        return;
+    }
+    
+    if (query->db != NULL) {
+        CSLPreparedQuery **link = &query->db->preparedQueries;
+        
+        while (*link != query) {
+            link = &(*link)->next;
+        }
+        
+        *link = query->next;
+        sqlite3_finalize(query->stmt);
+    }
+    
+    free(query);
+}
+
+CFactsCollection* csl_fetchFactsByDate(CSLDatabase *db,
+                                       const char* createdAtOrAfter,
+                                       const char* createdAtOrBefore) {
+    if (createdAtOrAfter == NULL && createdAtOrBefore == NULL) {
+        return NULL;
+    }
+    
+    // Open ends are bound to sentinels so every range shares one (pinned) shape
+    CSLFactsQuery query = {
+        .createdAtOrAfter = createdAtOrAfter != NULL ? createdAtOrAfter : TIMESTAMP_LOWEST,
+        .createdAtOrBefore = createdAtOrBefore != NULL ? createdAtOrBefore : TIMESTAMP_HIGHEST,
+        .order = CSL_FACTS_UNORDERED
+    };
+    
+    return csl_queryFacts(db, &query);
+}
+
+/// @brief The length of the timestamp prefix that identifies a bucket ("YYYY-MM-DD HH:MM:SS").
+static int activityBucketLength(CActivityBucketSize size) {
+    switch (size) {
+        case CACTIVITY_BUCKET_SECOND: return 19;
+        case CACTIVITY_BUCKET_MINUTE: return 16;
+        case CACTIVITY_BUCKET_HOUR: return 13;
+        case CACTIVITY_BUCKET_DAY: return 10;
+    }
+    
+    return 19;
+}
+
+CActivityBuckets* csl_fetchActivityBuckets(CSLDatabase *db,
+                                           const char* createdAtOrAfter,
+                                           const char* createdAtOrBefore,
+                                           CActivityBucketSize size) {
+    if (!unshardedDrive(db, "Activity")) {
+        return NULL;
+    }
+    
+    switchDatabase(db);
+    
+    if (!needStatements(currentDatabase, STATEMENTS_CORE)) {
+        return calloc(1, sizeof(CActivityBuckets));
+    }
+    
+    sqlite3_stmt *stmt = currentDatabase->stmt_fetch_activity_buckets;
+    uint64_t bytes = 0;
+    uint64_t rows = 0;
+    int rc;
+    
+#ifdef STORE_STATS
+    uint64_t startedAt = monotonicNanoseconds();
+#endif
+    
+    sqlite3_bind_text(stmt, 1, createdAtOrAfter != NULL ? createdAtOrAfter : TIMESTAMP_LOWEST, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, createdAtOrBefore != NULL ? createdAtOrBefore : TIMESTAMP_HIGHEST, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 3, activityBucketLength(size));
+    
+    CActivityBuckets* buckets = malloc(sizeof(CActivityBuckets));
+    buckets->buckets = NULL;
+    buckets->count = 0;
+    
+    // Rows arrive grouped by bucket, then by item
+    CActivityBucket* bucket = NULL;
+    CActivityItem* item = NULL;
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        rows++;
+        
+        const char *bucketKey = (const char *)sqlite3_column_text(stmt, 0);
+        
+        if (bucket == NULL || strcmp(bucket->bucket, bucketKey) != 0) {
+            buckets->buckets = realloc(buckets->buckets, (buckets->count + 1) * sizeof(CActivityBucket));
+            bucket = &buckets->buckets[buckets->count++];
+            bucket->bucket = copyColumnText(stmt, 0, &bytes);
+            bucket->factCount = 0;
+            bucket->items = NULL;
+            bucket->itemCount = 0;
+            item = NULL;
+        }
+        
+        const char *itemId = (const char *)sqlite3_column_text(stmt, 1);
+        
+        if (item == NULL || strcmp(item->itemId, itemId) != 0) {
+            bucket->items = realloc(bucket->items, (bucket->itemCount + 1) * sizeof(CActivityItem));
+            item = &bucket->items[bucket->itemCount++];
+            item->itemId = copyColumnText(stmt, 1, &bytes);
+            item->firstTimestamp = copyColumnText(stmt, 4, &bytes);
+            item->itemType = sqlite3_column_type(stmt, 5) != SQLITE_NULL ? copyColumnText(stmt, 5, &bytes) : NULL;
+            item->factCount = 0;
+            item->attributes = NULL;
+            item->attributeCount = 0;
+        }
+        else {
+            char *first = copyColumnText(stmt, 4, &bytes);
+            
+            if (strcmp(first, item->firstTimestamp) < 0) {
+                free(item->firstTimestamp);
+                item->firstTimestamp = first;
+            }
+            else {
+                free(first);
+            }
+        }
+        
+        int count = sqlite3_column_int(stmt, 3);
+        
+        item->attributes = realloc(item->attributes, (item->attributeCount + 1) * sizeof(CAttributeCount));
+        item->attributes[item->attributeCount].attribute = copyColumnText(stmt, 2, &bytes);
+        item->attributes[item->attributeCount].count = count;
+        item->attributeCount++;
+        
+        item->factCount += count;
+        bucket->factCount += count;
+    }
+    
+    if (rc != SQLITE_DONE)
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+    
+    sqlite3_reset(stmt);
+    
+#ifdef STORE_STATS
+    recordStatement(currentDatabase, CSL_STMT_FETCH_ACTIVITY_BUCKETS, rows, bytes, startedAt);
+#endif
+    
+    return buckets;
+}
+
+// MARK: - Aggregates
+
+// Numbers live in typedValue for typed rows; booleans are stored as integers there but aren't numbers
+#define AGGREGATE_NUMBER_SQL "CASE WHEN typeof(typedValue) IN ('integer', 'real') AND type <> 'boolean' THEN typedValue END"
+
+static const char* aggregateGroupColumn(CAggregateGroup group) {
+    switch (group) {
+        case CAGGREGATE_GROUP_ATTRIBUTE: return "attribute";
+        case CAGGREGATE_GROUP_TYPE: return "type";
+        case CAGGREGATE_GROUP_VALUE: return "value";
+        case CAGGREGATE_GROUP_NONE: break;
+    }
+    
+    return NULL;
+}
+
+/// @brief The WHERE clause for an aggregate's filters (and a group key, as ?5).
+/// The attribute is inlined, so the partial indexes declared for it apply.
+static char* aggregateWhereSQL(const CAggregateQuery *query, const char *keyColumn) {
+    char *attribute = query->attribute != NULL ? sqlite3_mprintf(" AND attribute = %Q", query->attribute) : NULL;
+    char *key = keyColumn != NULL ? sqlite3_mprintf(" AND %s = ?5", keyColumn) : NULL;
+    
+    char *sql = sqlite3_mprintf("WHERE 1%s%s%s%s%s",
+                                query->itemId != NULL ? " AND itemId = ?1" : "",
+                                attribute != NULL ? attribute : "",
+                                query->value != NULL ? " AND value = ?3" : "",
+                                query->type != NULL ? " AND type = ?4" : "",
+                                key != NULL ? key : "");
+    
+    sqlite3_free(attribute);
+    sqlite3_free(key);
+    
+    return sql;
+}
+
+static sqlite3_stmt* prepareAggregateStatement(const CAggregateQuery *query, const char *sql, const char *key) {
+    sqlite3_stmt *stmt;
+    
+    if (sqlite3_prepare_v2(currentDatabase->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+        return NULL;
+    }
+    
+    if (query->itemId != NULL) sqlite3_bind_text(stmt, 1, query->itemId, -1, SQLITE_STATIC);
+    if (query->value != NULL) bindValueText(currentDatabase, stmt, 3, query->value);
+    if (query->type != NULL) sqlite3_bind_text(stmt, 4, query->type, -1, SQLITE_STATIC);
+    if (key != NULL && query->groupBy == CAGGREGATE_GROUP_VALUE)
+        bindValueText(currentDatabase, stmt, 5, key);
+    else if (key != NULL)
+        sqlite3_bind_text(stmt, 5, key, -1, SQLITE_STATIC);
+    
+    return stmt;
+}
+
+CAggregates* csl_aggregateFacts(CSLDatabase *db, const CAggregateQuery *query) {
+    if (!unshardedDrive(db, "Aggregate")) {
+        return NULL;
+    }
+    
+    switchDatabase(db);
+    
+    CAggregates* aggregates = malloc(sizeof(CAggregates));
+    aggregates->rows = NULL;
+    aggregates->count = 0;
+    
+    const char *column = aggregateGroupColumn(query->groupBy);
+    bool mayMatch = query->itemId == NULL || csl_mayContainItem(db, query->itemId);
+    
+    if (!mayMatch) {
+        if (column == NULL) {
+            aggregates->rows = calloc(1, sizeof(CAggregateRow));
+            aggregates->count = 1;
+        }
+        
+        return aggregates;
+    }
+    
+    uint64_t bytes = 0;
+    int rc;
+    
+#ifdef STORE_STATS
+    uint64_t startedAt = monotonicNanoseconds();
+#endif
+    
+    char *where = aggregateWhereSQL(query, NULL);
+    char *sql;
+    
+    if (column != NULL) {
+        sql = sqlite3_mprintf("SELECT %s, COUNT(*), COUNT(DISTINCT itemId), COUNT(n), TOTAL(n), MIN(n), MAX(n) "
+                              "FROM (SELECT *, " AGGREGATE_NUMBER_SQL " AS n FROM facts %s) "
+                              "GROUP BY %s ORDER BY %s;", column, where, column, column);
+    }
+    else {
+        sql = sqlite3_mprintf("SELECT NULL, COUNT(*), COUNT(DISTINCT itemId), COUNT(n), TOTAL(n), MIN(n), MAX(n) "
+                              "FROM (SELECT *, " AGGREGATE_NUMBER_SQL " AS n FROM facts %s);", where);
+    }
+    
+    sqlite3_stmt *stmt = prepareAggregateStatement(query, sql, NULL);
+    sqlite3_free(where);
+    sqlite3_free(sql);
+    
+    if (stmt == NULL) {
+        freeAggregates(aggregates);
+        return NULL;
+    }
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        aggregates->rows = realloc(aggregates->rows, (aggregates->count + 1) * sizeof(CAggregateRow));
+        CAggregateRow *row = &aggregates->rows[aggregates->count++];
+        
+        if (column == NULL)
+            row->key = NULL;
+        else if (sqlite3_column_type(stmt, 0) == SQLITE_BLOB)
+            row->key = loadValueBlob(currentDatabase, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0), &bytes); // a long value
+        else
+            row->key = copyColumnText(stmt, 0, &bytes);
+        row->count = sqlite3_column_int64(stmt, 1);
+        row->distinctItems = sqlite3_column_int64(stmt, 2);
+        row->numberCount = sqlite3_column_int64(stmt, 3);
+        row->sum = sqlite3_column_double(stmt, 4);
+        row->min = sqlite3_column_double(stmt, 5);
+        row->max = sqlite3_column_double(stmt, 6);
+    }
+    
+    if (rc != SQLITE_DONE)
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+    
+    sqlite3_finalize(stmt);
+    
+#ifdef STORE_STATS
+    recordStatement(currentDatabase, CSL_STMT_AGGREGATE, (uint64_t)aggregates->count, bytes, startedAt);
+#endif
+    
+    return aggregates;
+}
+
+char** csl_fetchDistinctItemIds(CSLDatabase *db, const CAggregateQuery *query, const char *key, int *count) {
+    if (!unshardedDrive(db, "Aggregate")) {
+        *count = 0;
+        return NULL;
+    }
+    
+    switchDatabase(db);
+    
+    *count = 0;
+    
+    if (query->itemId != NULL && !csl_mayContainItem(db, query->itemId)) {
+        return NULL;
+    }
+    
+    uint64_t bytes = 0;
+    int rc;
+    
+#ifdef STORE_STATS
+    uint64_t startedAt = monotonicNanoseconds();
+#endif
+    
+    const char *column = aggregateGroupColumn(query->groupBy);
+    char *where = aggregateWhereSQL(query, key != NULL ? column : NULL);
+    char *sql = sqlite3_mprintf("SELECT DISTINCT itemId FROM facts %s;", where);
+    
+    sqlite3_stmt *stmt = prepareAggregateStatement(query, sql, column != NULL ? key : NULL);
+    sqlite3_free(where);
+    sqlite3_free(sql);
+    
+    if (stmt == NULL) {
+        return NULL;
+    }
+    
+    char **itemIds = NULL;
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        itemIds = realloc(itemIds, (*count + 1) * sizeof(char *));
+        itemIds[(*count)++] = copyColumnText(stmt, 0, &bytes);
+    }
+    
+    if (rc != SQLITE_DONE)
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(currentDatabase->db));
+    
+    sqlite3_finalize(stmt);
+    
+#ifdef STORE_STATS
+    recordStatement(currentDatabase, CSL_STMT_AGGREGATE, (uint64_t)*count, bytes, startedAt);
+#endif
+    
+    return itemIds;
+}
+
+// MARK: - Sync
+//  Drive-to-drive delta replication. The receiving drive keeps a high-watermark
+//  per peer (the last of the peer's fact row ids it has applied) and asks for
+//  facts after it; batches are a compact binary stream, so they can go through
+//  a file or a pipe. Applying is idempotent: a fact with the same factId, itemId,
+//  attribute, timestamp and flags is never inserted twice. Rows applied from a peer are
+//  remembered so they aren't shipped straight back to it.
+//
+//  Stream: "WSYN", version varint, source driveId (varint length + bytes), a
+//  fact codec stream (see factcodec.h), then a varint with the highest source
+//  row id the batch covers.
+
+#define SYNC_MAGIC "WSYN"
+#define SYNC_VERSION 2
+
+static bool migrateSync(CSLDatabase *dbInfo) {
+    const char *create_sql =
+    "CREATE TABLE IF NOT EXISTS drive_info (key TEXT PRIMARY KEY, value TEXT NOT NULL) WITHOUT ROWID;"
+    "INSERT OR IGNORE INTO drive_info (key, value) VALUES ('driveId', lower(hex(randomblob(16))));"
+    "CREATE TABLE IF NOT EXISTS sync_peers (peerId TEXT PRIMARY KEY, receivedThrough INTEGER NOT NULL) WITHOUT ROWID;"
+    "CREATE TABLE IF NOT EXISTS sync_origins (rowId INTEGER PRIMARY KEY, peerId TEXT NOT NULL);"
+    "DROP INDEX IF EXISTS idx_fact_id;" // the earlier key, without itemId and attribute
+    "DELETE FROM drive_info WHERE key = 'bulkLoadIndex.idx_fact_id';"
+    "CREATE INDEX IF NOT EXISTS idx_fact_key ON facts (factId, itemId, attribute, timestamp, flags);";
+    
+    return execIndexSQL(dbInfo, create_sql);
+}
+
+static bool prepareSync(CSLDatabase *dbInfo) {
+    sqlite3_stmt *stmt;
+    
+    if (prepareIndexStatement(dbInfo, "SELECT value FROM drive_info WHERE key = 'driveId';", &stmt)) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            uint64_t bytes = 0;
+            dbInfo->driveId = copyColumnText(stmt, 0, &bytes);
+        }
+        
+        sqlite3_finalize(stmt);
+    }
+    
+    return dbInfo->driveId != NULL &&
+    prepareIndexStatement(dbInfo, "SELECT 1 FROM facts WHERE factId = ? AND itemId = ? AND attribute = ? AND timestamp = ? AND flags = ? LIMIT 1;", &dbInfo->stmt_sync_fact_exists) &&
+    prepareIndexStatement(dbInfo, "INSERT OR REPLACE INTO sync_origins (rowId, peerId) VALUES (?, ?);", &dbInfo->stmt_sync_origin_insert) &&
+    prepareIndexStatement(dbInfo, "SELECT receivedThrough FROM sync_peers WHERE peerId = ?;", &dbInfo->stmt_sync_watermark) &&
+    prepareIndexStatement(dbInfo, "INSERT INTO sync_peers (peerId, receivedThrough) VALUES (?1, ?2) "
+                          "ON CONFLICT (peerId) DO UPDATE SET receivedThrough = MAX(receivedThrough, ?2);", &dbInfo->stmt_sync_watermark_upsert) &&
+    prepareIndexStatement(dbInfo, "SELECT f.*, o.peerId FROM facts f LEFT JOIN sync_origins o ON o.rowId = f.id WHERE f.id > ? ORDER BY f.id LIMIT ?;", &dbInfo->stmt_sync_facts_after);
+}
+
+const char* csl_driveId(CSLDatabase *db) {
+    if (!unshardedDrive(db, "Sync")) {
+        return NULL;
+    }
+    
+    return needStatements(db, STATEMENTS_SYNC) ? db->driveId : NULL;
+}
+
+long long csl_peerWatermark(CSLDatabase *db, const char *peerId) {
+    if (!unshardedDrive(db, "Sync")) {
+        return -1;
+    }
+    
+    switchDatabase(db);
+    
+    if (!needStatements(currentDatabase, STATEMENTS_SYNC)) {
+        return 0;
+    }
+    
+    sqlite3_stmt *stmt = currentDatabase->stmt_sync_watermark;
+    sqlite3_bind_text(stmt, 1, peerId, -1, SQLITE_STATIC);
+    
+    long long watermark = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_reset(stmt);
+    
+    return watermark;
+}
+
+static char* readSyncString(FILE *in) {
+    uint64_t length;
+    
+    if (!readFactCodecVarint(in, &length) || length > 4096) {
+        return NULL;
+    }
+    
+    char *text = malloc((size_t)length + 1);
+    
+    if (text == NULL || fread(text, 1, length, in) != length) {
+        free(text);
+        return NULL;
+    }
+    
+    text[length] = '\0';
+    return text;
+}
+
+/// @brief Encodes facts after a row id, in row order, skipping ones that came from `skipOrigin`.
+/// @return The number of rows scanned; `through` is set to the last row id scanned.
+static int encodeFactsAfter(FactEncoder *encoder, long long afterRowId, int maxFacts, const char *skipOrigin, long long *through) {
+    sqlite3_stmt *stmt = currentDatabase->stmt_sync_facts_after;
+    sqlite3_bind_int64(stmt, 1, afterRowId);
+    sqlite3_bind_int(stmt, 2, maxFacts);
+    
+    *through = afterRowId;
+    int scanned = 0;
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        scanned++;
+        *through = sqlite3_column_int64(stmt, 0);
+        
+        const char *origin = (const char *)sqlite3_column_text(stmt, 10);
+        
+        if (origin != NULL && skipOrigin != NULL && strcmp(origin, skipOrigin) == 0) {
+            continue;
+        }
+        
+        encodeFact(encoder,
+                   (const char *)sqlite3_column_text(stmt, 1),
+                   (const char *)sqlite3_column_text(stmt, 2),
+                   (const char *)sqlite3_column_text(stmt, 3),
+                   storedValueText(currentDatabase, stmt),
+                   storedNumericalValue(stmt),
+                   (const char *)sqlite3_column_text(stmt, 6),
+                   sqlite3_column_int(stmt, 7),
+                   (const char *)sqlite3_column_text(stmt, 8));
+    }
+    
+    sqlite3_reset(stmt);
+    
+    return scanned;
+}
+
+int csl_writeSyncBatch(CSLDatabase *db, const char *peerId, long long afterRowId, int maxFacts, FILE *out) {
+    if (!unshardedDrive(db, "Sync")) {
+        return -1;
+    }
+    
+    switchDatabase(db);
+    
+    if (!needStatements(currentDatabase, STATEMENTS_SYNC)) {
+        return -1;
+    }
+    
+    fwrite(SYNC_MAGIC, 1, 4, out);
+    writeFactCodecVarint(out, SYNC_VERSION);
+    writeFactCodecVarint(out, strlen(currentDatabase->driveId));
+    fwrite(currentDatabase->driveId, 1, strlen(currentDatabase->driveId), out);
+    
+    // Skip facts that came from the peer in the first place
+    FactEncoder encoder;
+    long long through;
+    
+    initFactEncoder(&encoder, out);
+    int scanned = encodeFactsAfter(&encoder, afterRowId, maxFacts > 0 ? maxFacts : 1000, peerId, &through);
+    finishFactEncoder(&encoder);
+    freeFactEncoder(&encoder);
+    
+    writeFactCodecVarint(out, (uint64_t)through);
+    fflush(out);
+    
+    return scanned;
+}
+
+static bool syncFactExists(CSLDatabase *dbInfo, sqlite3_stmt *const archiveStmts[2], const CFact *fact) {
+    sqlite3_stmt *stmts[] = { dbInfo->stmt_sync_fact_exists, archiveStmts[0], archiveStmts[1] };
+    bool exists = false;
+    
+    for (int i = 0; i < 3 && !exists; i++) {
+        if (stmts[i] == NULL) {
+            continue;
+        }
+        
+        sqlite3_bind_text(stmts[i], 1, fact->factId, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmts[i], 2, fact->itemId, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmts[i], 3, fact->attribute, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmts[i], 4, fact->timestamp, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmts[i], 5, fact->flags);
+        
+        exists = sqlite3_step(stmts[i]) == SQLITE_ROW;
+        sqlite3_reset(stmts[i]);
+    }
+    
+    return exists;
+}
+
+/// @brief Attaches the archive file compaction last wrote to, if it isn't attached already.
+/// Runs before the caller's transaction, since ATTACH can't run inside one.
+static void attachRecordedArchive(CSLDatabase *dbInfo) {
+    if (archiveAttached(dbInfo)) {
+        return;
+    }
+    
+    sqlite3_stmt *stmt;
+    char *path = NULL;
+    uint64_t bytes = 0;
+    
+    if (!prepareIndexStatement(dbInfo, "SELECT value FROM drive_info WHERE key = 'archivePath';", &stmt)) {
+        return;
+    }
+    
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        path = copyColumnText(stmt, 0, &bytes);
+    
+    sqlite3_finalize(stmt);
+    
+    // ATTACH would create a missing file; an archive that's been moved away has nothing to check
+    if (path != NULL && access(path, F_OK) == 0) {
+        char *sql = sqlite3_mprintf("ATTACH DATABASE %Q AS archive;", path);
+        execIndexSQL(dbInfo, sql);
+        sqlite3_free(sql);
+    }
+    
+    free(path);
+}
+
+/// @brief Inserts each decoded fact that the drive doesn't already have, inside the caller's transaction.
+/// @param sourceId The peer the facts came from, recorded per row; NULL for imports.
+/// @return The number of facts inserted, or -1 if the stream is malformed or truncated.
+static int applyDecodedFacts(FactDecoder *decoder, const char *sourceId) {
+    if (!needStatements(currentDatabase, STATEMENTS_SYNC)) {
+        return -1;
+    }
+    
+    // Facts archived by compaction count as already applied, whether it archived into
+    // facts_archive or an archive file (attached by the caller); a policy may have used both
+    sqlite3_stmt *archiveStmts[2] = { NULL, NULL };
+    
+    if (tableExists(currentDatabase, "facts_archive"))
+        prepareIndexStatement(currentDatabase, "SELECT 1 FROM main.facts_archive WHERE factId = ? AND itemId = ? AND attribute = ? AND timestamp = ? AND flags = ? LIMIT 1;", &archiveStmts[0]);
+    
+    if (archiveAttached(currentDatabase))
+        prepareIndexStatement(currentDatabase, "SELECT 1 FROM archive.facts WHERE factId = ? AND itemId = ? AND attribute = ? AND timestamp = ? AND flags = ? LIMIT 1;", &archiveStmts[1]);
+    
+    int applied = 0;
+    int result;
+    CFact fact;
+    
+    while ((result = decodeNextFact(decoder, &fact)) == 1) {
+        if (syncFactExists(currentDatabase, archiveStmts, &fact)) {
+            continue;
+        }
+        
+        sqlite3_int64 localRowId = insertFactRow(fact.factId, fact.itemId, fact.attribute, fact.value, fact.numericalValue, fact.type, fact.flags, fact.timestamp);
+        
+        if (localRowId == 0) {
+            continue;
+        }
+        
+        if (sourceId != NULL) {
+            sqlite3_bind_int64(currentDatabase->stmt_sync_origin_insert, 1, localRowId);
+            sqlite3_bind_text(currentDatabase->stmt_sync_origin_insert, 2, sourceId, -1, SQLITE_STATIC);
+            stepIndexStatement(currentDatabase, currentDatabase->stmt_sync_origin_insert);
+        }
+        
+        applied++;
+    }
+    
+    sqlite3_finalize(archiveStmts[0]);
+    sqlite3_finalize(archiveStmts[1]);
+    
+    return result == 0 ? applied : -1;
+}
+
+int csl_applySyncBatch(CSLDatabase *db, FILE *in) {
+    if (!unshardedDrive(db, "Sync")) {
+        return -1;
+    }
+    
+    switchDatabase(db);
+    
+    // Applying runs its own transaction, which a bulk load's would swallow
+    if (currentDatabase->bulkLoad.active) {
+        fprintf(stderr, "Sync error: drive is bulk loading\n");
+        return -1;
+    }
+    
+    if (!outsideReadSession(currentDatabase, "Sync")) {
+        return -1;
+    }
+    
+    char magic[5] = { 0 };
+    uint64_t version;
+    
+    if (fread(magic, 1, 4, in) != 4 || strcmp(magic, SYNC_MAGIC) != 0 ||
+        !readFactCodecVarint(in, &version) || version != SYNC_VERSION) {
+        fprintf(stderr, "Sync error: not a sync batch\n");
+        return -1;
+    }
+    
+    char *sourceId = readSyncString(in);
+    FactDecoder decoder;
+    
+    if (sourceId == NULL || !initFactDecoder(&decoder, in)) {
+        fprintf(stderr, "Sync error: truncated batch\n");
+        free(sourceId);
+        return -1;
+    }
+    
+    attachRecordedArchive(currentDatabase);
+    sqlite3_exec(currentDatabase->db, "BEGIN IMMEDIATE;", 0, 0, NULL);
+    
+    int applied = applyDecodedFacts(&decoder, sourceId);
+    uint64_t through;
+    bool ok = applied >= 0 && readFactCodecVarint(in, &through);
+    
+    if (ok) {
+        sqlite3_bind_text(currentDatabase->stmt_sync_watermark_upsert, 1, sourceId, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(currentDatabase->stmt_sync_watermark_upsert, 2, (sqlite3_int64)through);
+        stepIndexStatement(currentDatabase, currentDatabase->stmt_sync_watermark_upsert);
+    }
+    
+    // A truncated batch is rolled back whole; its watermark never moved, so it's simply re-sent
+    sqlite3_exec(currentDatabase->db, ok ? "COMMIT;" : "ROLLBACK;", 0, 0, NULL);
+    
+    freeFactDecoder(&decoder);
+    free(sourceId);
+    
+    if (!ok) {
+        fprintf(stderr, "Sync error: truncated batch\n");
+        return -1;
+    }
+    
+    if (applied > 0 && updateFn != NULL) {
+        updateFn();
+    }
+    
+    return applied;
+}
+
+int csl_syncDrives(CSLDatabase *from, CSLDatabase *to, int batchSize) {
+    if (!unshardedDrive(from, "Sync") || !unshardedDrive(to, "Sync")) {
+        return -1;
+    }
+    
+    int total = 0;
+    
+    while (true) {
+        FILE *batch = tmpfile();
+        if (batch == NULL) {
+            return -1;
+        }
+        
+        long long watermark = csl_peerWatermark(to, csl_driveId(from));
+        int scanned = csl_writeSyncBatch(from, csl_driveId(to), watermark, batchSize, batch);
+        
+        rewind(batch);
+        int applied = scanned > 0 ? csl_applySyncBatch(to, batch) : 0;
+        fclose(batch);
+        
+        if (scanned < 0 || applied < 0) {
+            return -1;
+        }
+        
+        total += applied;
+        
+        if (scanned == 0) {
+            return total;
+        }
+    }
+}
+
+// MARK: - Export / Import
+//  Whole-drive dumps in the fact codec format. Importing is idempotent in the
+//  same way applying a sync batch is, so a dump can be loaded into a drive
+//  that already holds some of its facts.
+
+long long csl_exportFacts(CSLDatabase *db, FILE *out) {
+    if (!unshardedDrive(db, "Export")) {
+        return -1;
+    }
+    
+    switchDatabase(db);
+    
+    if (!needStatements(currentDatabase, STATEMENTS_SYNC)) {
+        return -1;
+    }
+    
+    FactEncoder encoder;
+    long long through;
+    
+    initFactEncoder(&encoder, out);
+    encodeFactsAfter(&encoder, 0, -1, NULL, &through);
+    finishFactEncoder(&encoder);
+    
+    long long exported = (long long)encoder.factCount;
+    freeFactEncoder(&encoder);
+    
+    return ferror(out) ? -1 : exported;
+}
+
+long long csl_importFacts(CSLDatabase *db, FILE *in) {
+    if (!unshardedDrive(db, "Import")) {
+        return -1;
+    }
+    
+    switchDatabase(db);
+    
+    if (currentDatabase->bulkLoad.active) {
+        fprintf(stderr, "Import error: drive is bulk loading\n");
+        return -1;
+    }
+    
+    if (!outsideReadSession(currentDatabase, "Import")) {
+        return -1;
+    }
+    
+    FactDecoder decoder;
+    
+    if (!initFactDecoder(&decoder, in)) {
+        fprintf(stderr, "Import error: not a fact stream\n");
+        freeFactDecoder(&decoder);
+        return -1;
+    }
+    
+    attachRecordedArchive(currentDatabase);
+    sqlite3_exec(currentDatabase->db, "BEGIN IMMEDIATE;", 0, 0, NULL);
+    
+    int imported = applyDecodedFacts(&decoder, NULL);
+    
+    sqlite3_exec(currentDatabase->db, imported >= 0 ? "COMMIT;" : "ROLLBACK;", 0, 0, NULL);
+    freeFactDecoder(&decoder);
+    
+    if (imported < 0) {
+        fprintf(stderr, "Import error: truncated fact stream\n");
+        return -1;
+    }
+    
+    if (imported > 0 && updateFn != NULL) {
+        updateFn();
+    }
+    
+    return imported;
+}
+
+// MARK: - Sharding
+//  A sharded drive spreads facts over several drives (shard files) by a hash
+//  of their itemId, each with its own connection and so its own writer. Calls
+//  scoped to an item go to its shard; the rest fan out over the drive's worker
+//  threads, one per shard after the first, which the calling thread takes.
+//  Each shard's lock keeps two threads off one connection's statements.
+
+static int shardIndex(CSLDatabase *sharded, const char *itemId) {
+    uint64_t h1, h2;
+    itemFilterHashes(itemId, &h1, &h2);
+    
+    // The high, well-mixed bits of the second hash: the item filters probe with the low bits
+    return (int)((h2 >> 32) % (uint64_t)sharded->shardCount);
+}
+
+CSLDatabase* csl_shardForItem(CSLDatabase *db, const char *itemId) {
+    return db->shardCount > 0 ? db->shards[shardIndex(db, itemId)] : db;
+}
+
+/// @brief Whether the drive holds facts itself. A sharded drive has no connection of its own, so
+/// calls that don't route to its shards fail on it rather than run on a NULL handle.
+static bool unshardedDrive(CSLDatabase *dbInfo, const char *operation) {
+    if (dbInfo->shardCount > 0) {
+        fprintf(stderr, "%s error: drive is sharded; take a shard with csl_shardForItem\n", operation);
+        return false;
+    }
+    
+    return true;
+}
+
+typedef void (*CSLShardWork)(CSLDatabase *shard, int index, void *context);
+
+typedef struct {
+    CSLDatabase *sharded;
+    int index;
+    CSLShardWork work;
+    void *context;
+} CSLShardTask;
+
+static void runShardTask(CSLShardTask *task) {
+    pthread_mutex_lock(&task->sharded->shardLocks[task->index]);
+    task->work(task->sharded->shards[task->index], task->index, task->context);
+    pthread_mutex_unlock(&task->sharded->shardLocks[task->index]);
+}
+
+// Starting threads for every fan-out cost more than a small query, so each
+// sharded drive keeps a worker per shard after the first. A fan-out hands
+// them its work under a new generation and waits until none is pending.
+typedef struct CSLShardPool {
+    pthread_t *threads;
+    bool *started; // per shard; a shard without a worker runs on the calling thread
+    CSLShardTask *tasks;
+    pthread_mutex_t lock;
+    pthread_cond_t workReady;
+    pthread_cond_t workDone;
+    pthread_mutex_t fanOutLock; // one fan-out at a time
+    uint64_t generation;
+    int pending;
+    bool stopping;
+} CSLShardPool;
+
+static void* runShardWorker(void *argument) {
+    CSLShardTask *task = argument;
+    CSLShardPool *pool = task->sharded->shardPool;
+    uint64_t generation = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    while (true) {
+        while (pool->generation == generation && !pool->stopping) {
+            pthread_cond_wait(&pool->workReady, &pool->lock);
+        }
+        
+        if (pool->stopping) {
+            break;
+        }
+        
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        
+        runShardTask(task);
+        
+        pthread_mutex_lock(&pool->lock);
+        
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->workDone);
+        }
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+    
+    return NULL;
+}
+
+static void startShardPool(CSLDatabase *sharded) {
+    int count = sharded->shardCount;
+    CSLShardPool *pool = calloc(1, sizeof(CSLShardPool));
+    
+    pool->threads = malloc(count * sizeof(pthread_t));
+    pool->started = calloc(count, sizeof(bool));
+    pool->tasks = calloc(count, sizeof(CSLShardTask));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->workReady, NULL);
+    pthread_cond_init(&pool->workDone, NULL);
+    pthread_mutex_init(&pool->fanOutLock, NULL);
+    sharded->shardPool = pool;
+    
+    for (int i = 0; i < count; i++) {
+        pool->tasks[i] = (CSLShardTask){ sharded, i, NULL, NULL };
+    }
+    
+    for (int i = 1; i < count; i++) {
+        pool->started[i] = pthread_create(&pool->threads[i], NULL, runShardWorker, &pool->tasks[i]) == 0;
+    }
+}
+
+static void stopShardPool(CSLDatabase *sharded) {
+    CSLShardPool *pool = sharded->shardPool;
+    
+    if (pool == NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->workReady);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (int i = 1; i < sharded->shardCount; i++) {
+        if (pool->started[i])
+            pthread_join(pool->threads[i], NULL);
+    }
+    
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->workReady);
+    pthread_cond_destroy(&pool->workDone);
+    pthread_mutex_destroy(&pool->fanOutLock);
+    free(pool->threads);
+    free(pool->started);
+    free(pool->tasks);
+    free(pool);
+    sharded->shardPool = NULL;
+}
+
+/// @brief Runs the work on every shard at once (the first on this thread) and waits for it all.
+static void forEachShard(CSLDatabase *sharded, CSLShardWork work, void *context) {
+    CSLShardPool *pool = sharded->shardPool;
+    int count = sharded->shardCount;
+    
+    pthread_mutex_lock(&pool->fanOutLock);
+    pthread_mutex_lock(&pool->lock);
+    
+    for (int i = 0; i < count; i++) {
+        pool->tasks[i].work = work;
+        pool->tasks[i].context = context;
+        
+        if (pool->started[i])
+            pool->pending++;
+    }
+    
+    pool->generation++;
+    pthread_cond_broadcast(&pool->workReady);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (int i = 0; i < count; i++) {
+        if (!pool->started[i])
+            runShardTask(&pool->tasks[i]); // the first, and any without a worker
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->workDone, &pool->lock);
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->fanOutLock);
+}
+
+/// @brief Records the shard's place in drive_info, or checks it against the one recorded: items are routed by the shard count, so it can't change.
+static bool claimShard(CSLDatabase *shard, int index, int count) {
+    char place[32];
+    snprintf(place, sizeof(place), "%d/%d", index, count);
+    
+    char *sql = sqlite3_mprintf("INSERT OR IGNORE INTO drive_info (key, value) VALUES ('shard', %Q);", place);
+    bool claimed = execIndexSQL(shard, sql);
+    sqlite3_free(sql);
+    
+    sqlite3_stmt *stmt;
+    
+    if (claimed && prepareIndexStatement(shard, "SELECT value FROM drive_info WHERE key = 'shard';", &stmt)) {
+        claimed = sqlite3_step(stmt) == SQLITE_ROW && strcmp((const char *)sqlite3_column_text(stmt, 0), place) == 0;
+        
+        if (!claimed)
+            fprintf(stderr, "Shard error: expected shard %s\n", place);
+        
+        sqlite3_finalize(stmt);
+    }
+    
+    return claimed;
+}
+
+CSLDatabase* openShardedDatabase(const char *sourceId, bool inMemory, int shardCount, CSLDriveProfile profile) {
+    if (shardCount < 1) {
+        return NULL;
+    }
+    
+    CSLDatabase *sharded = calloc(1, sizeof(CSLDatabase));
+    if (!sharded) {
+        fprintf(stderr, "Memory allocation error\n");
+        return NULL;
+    }
+    
+    uint64_t openedAt = monotonicNanoseconds();
+    
+    sharded->inMemory = inMemory || sourceId == NULL;
+    sharded->profile = profile;
+    sharded->shardCount = shardCount;
+    sharded->shards = calloc(shardCount, sizeof(CSLDatabase *));
+    sharded->shardLocks = malloc(shardCount * sizeof(pthread_mutex_t));
+    
+    for (int i = 0; i < shardCount; i++) {
+        pthread_mutex_init(&sharded->shardLocks[i], NULL);
+    }
+    
+    for (int i = 0; i < shardCount; i++) {
+        char name[255];
+        
+        if (!sharded->inMemory)
+            snprintf(name, sizeof(name), "%s.shard%d", sourceId, i);
+        
+        sharded->shards[i] = openDatabaseWithProfile(sharded->inMemory ? NULL : name, sharded->inMemory, profile);
+        
+        if (sharded->shards[i] == NULL || !claimShard(sharded->shards[i], i, shardCount)) {
+            closeDatabase(sharded);
+            return NULL;
+        }
+    }
+    
+    startShardPool(sharded);
+    sharded->openTimings.totalNanoseconds = monotonicNanoseconds() - openedAt;
+    
+    return sharded;
+}
+
+static void closeShards(CSLDatabase *sharded) {
+    stopShardPool(sharded);
+    
+    for (int i = 0; i < sharded->shardCount; i++) {
+        if (sharded->shards[i] != NULL)
+            closeDatabase(sharded->shards[i]);
+        
+        pthread_mutex_destroy(&sharded->shardLocks[i]);
+    }
+    
+    free(sharded->shards);
+    free(sharded->shardLocks);
+    free(sharded);
+}
+
+static bool insertShardFact(CSLDatabase *sharded,
+                            const char *factId,
+                            const char *itemId,
+                            const char *attribute,
+                            const char *value,
+                            double numericalValue,
+                            const char *type,
+                            int flags,
+                            const char *timestamp) {
+    int index = shardIndex(sharded, itemId);
+    
+    pthread_mutex_lock(&sharded->shardLocks[index]);
+    bool inserted = csl_insertFact(sharded->shards[index], factId, itemId, attribute, value, numericalValue, type, flags, timestamp);
+    pthread_mutex_unlock(&sharded->shardLocks[index]);
+    
+    return inserted;
+}
+
+/// @brief Stable merge sort of facts by timestamp, across both timestamp forms.
+static void sortFactsByTimestamp(CFact *facts, CFact *scratch, int count, int direction) {
+    if (count < 2) {
+        return;
+    }
+    
+    int half = count / 2;
+    
+    sortFactsByTimestamp(facts, scratch, half, direction);
+    sortFactsByTimestamp(facts + half, scratch, count - half, direction);
+    
+    int left = 0, right = half, out = 0;
+    
+    while (left < half && right < count) {
+        bool takeRight = direction * compareTimestamps(facts[right].timestamp, facts[left].timestamp) < 0;
+        scratch[out++] = facts[takeRight ? right++ : left++];
+    }
+    
+    while (left < half) {
+        scratch[out++] = facts[left++];
+    }
+    
+    memcpy(facts, scratch, right * sizeof(CFact));
+}
+
+/// @brief Merges each shard's facts, already in the query's order, into one collection, releasing theirs.
+static CFactsCollection* mergeShardFacts(CFactsCollection **results, int count, CSLFactsOrder order, int limit) {
+    CFactsCollection* merged = emptyFactsCollection();
+    int *next = calloc(count, sizeof(int));
+    int total = 0;
+    
+    for (int i = 0; i < count; i++) {
+        total += results[i] != NULL ? results[i]->count : 0;
+    }
+    
+    if (limit > 0 && total > limit) {
+        total = limit;
+    }
+    
+    // Across shards, the newest timestamp stands in for the last inserted
+    int direction = order == CSL_FACTS_OLDEST_FIRST ? 1 : -1;
+    
+    // SQLite orders ISO8601 ("...T...") timestamps apart from SQLite ones ("... ..."), so each
+    // shard's facts are put in the order the merge compares them in first
+    if (order != CSL_FACTS_UNORDERED) {
+        for (int i = 0; i < count; i++) {
+            if (results[i] == NULL || results[i]->count < 2) {
+                continue;
+            }
+            
+            CFact *scratch = malloc(results[i]->count * sizeof(CFact));
+            sortFactsByTimestamp(results[i]->facts, scratch, results[i]->count, direction);
+            free(scratch);
+        }
+    }
+    
+    merged->facts = total > 0 ? malloc(total * sizeof(CFact)) : NULL;
+    
+    while (merged->count < total) {
+        int best = -1;
+        
+        for (int i = 0; i < count; i++) {
+            if (results[i] == NULL || next[i] == results[i]->count) {
+                continue;
+            }
+            
+            if (best < 0 || direction * compareTimestamps(results[i]->facts[next[i]].timestamp, results[best]->facts[next[best]].timestamp) < 0) {
+                best = i;
+            }
+        }
+        
+        // Moved, so emptied in the shard's collection
+        merged->facts[merged->count++] = results[best]->facts[next[best]];
+        initFact(&results[best]->facts[next[best]++]);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        freeFactsCollection(results[i]);
+    }
+    
+    free(next);
+    
+    return merged;
+}
+
+typedef struct {
+    const CSLFactsQuery *query;
+    CFactsCollection **results;
+} CSLShardQuery;
+
+static void queryShard(CSLDatabase *shard, int index, void *context) {
+    CSLShardQuery *shardQuery = context;
+    shardQuery->results[index] = csl_queryFacts(shard, shardQuery->query);
+}
+
+static CFactsCollection* queryShardFacts(CSLDatabase *sharded, const CSLFactsQuery *query) {
+    if (query->itemId != NULL) {
+        int index = shardIndex(sharded, query->itemId);
+        
+        pthread_mutex_lock(&sharded->shardLocks[index]);
+        CFactsCollection* collection = csl_queryFacts(sharded->shards[index], query);
+        pthread_mutex_unlock(&sharded->shardLocks[index]);
+        
+        return collection;
+    }
+    
+    CSLShardQuery shardQuery = { query, calloc(sharded->shardCount, sizeof(CFactsCollection *)) };
+    
+    forEachShard(sharded, queryShard, &shardQuery);
+    
+    CFactsCollection* merged = mergeShardFacts(shardQuery.results, sharded->shardCount, query->order, query->limit);
+    free(shardQuery.results);
+    
+    return merged;
+}
+
+typedef struct {
+    const CFact *facts;
+    const int *shardOf; // each fact's shard
+    int count;
+    long long *inserted; // per shard
+} CSLShardLoad;
+
+static void loadShard(CSLDatabase *shard, int index, void *context) {
+    CSLShardLoad *load = context;
+    
+    switchDatabase(shard);
+    
+    for (int i = 0; i < load->count; i++) {
+        const CFact *fact = &load->facts[i];
+        
+        if (load->shardOf[i] == index &&
+            insertFactRow(fact->factId, fact->itemId, fact->attribute, fact->value, fact->numericalValue, fact->type, fact->flags, fact->timestamp) != 0) {
+            load->inserted[index]++;
+        }
+    }
+}
+
+static long long bulkInsertShardFacts(CSLDatabase *sharded, const CFact *facts, int count) {
+    bool ownsLoad = csl_beginBulkLoad(sharded);
+    
+    CSLShardLoad load = { facts, malloc((count > 0 ? count : 1) * sizeof(int)), count, calloc(sharded->shardCount, sizeof(long long)) };
+    int *shardOf = (int *)load.shardOf;
+    
+    for (int i = 0; i < count; i++) {
+        shardOf[i] = shardIndex(sharded, facts[i].itemId);
+    }
+    
+    forEachShard(sharded, loadShard, &load);
+    
+    long long inserted = 0;
+    
+    for (int i = 0; i < sharded->shardCount; i++) {
+        inserted += load.inserted[i];
+    }
+    
+    free(shardOf);
+    free(load.inserted);
+    
+    if (ownsLoad) {
+        csl_endBulkLoad(sharded);
+    }
+    
+    return inserted;
+}
+
+static bool beginShardBulkLoad(CSLDatabase *sharded) {
+    if (sharded->bulkLoad.active) {
+        return false;
+    }
+    
+    for (int i = 0; i < sharded->shardCount; i++) {
+        pthread_mutex_lock(&sharded->shardLocks[i]);
+        bool begun = csl_beginBulkLoad(sharded->shards[i]);
+        pthread_mutex_unlock(&sharded->shardLocks[i]);
+        
+        if (!begun) {
+            while (--i >= 0) {
+                pthread_mutex_lock(&sharded->shardLocks[i]);
+                endBulkLoad(sharded->shards[i]);
+                pthread_mutex_unlock(&sharded->shardLocks[i]);
+            }
+            
+            return false;
+        }
+    }
+    
+    sharded->bulkLoad.active = true;
+    
+    return true;
+}
+
+static void endShardBulkLoad(CSLDatabase *shard, int index, void *context) {
+    (void)index;
+    (void)context;
+    
+    endBulkLoad(shard);
+}
+
+static bool beginShardRead(CSLDatabase *sharded) {
+    for (int i = 0; i < sharded->shardCount; i++) {
+        pthread_mutex_lock(&sharded->shardLocks[i]);
+        bool begun = csl_beginRead(sharded->shards[i]);
+        pthread_mutex_unlock(&sharded->shardLocks[i]);
+        
+        if (!begun) {
+            while (--i >= 0) {
+                pthread_mutex_lock(&sharded->shardLocks[i]);
+                csl_endRead(sharded->shards[i]);
+                pthread_mutex_unlock(&sharded->shardLocks[i]);
+            }
+            
+            return false;
+        }
+    }
+    
+    sharded->readSessionDepth++;
+    
+    return true;
+}
+
+static bool endShardRead(CSLDatabase *sharded) {
+    bool ended = true;
+    
+    for (int i = 0; i < sharded->shardCount; i++) {
+        pthread_mutex_lock(&sharded->shardLocks[i]);
+        ended = csl_endRead(sharded->shards[i]) && ended;
+        pthread_mutex_unlock(&sharded->shardLocks[i]);
+    }
+    
+    sharded->readSessionDepth--;
+    
+    return ended;
+}
+
+static bool checkpointShards(CSLDatabase *sharded) {
+    bool checkpointed = true;
+    
+    for (int i = 0; i < sharded->shardCount; i++) {
+        pthread_mutex_lock(&sharded->shardLocks[i]);
+        checkpointed = csl_checkpoint(sharded->shards[i]) && checkpointed;
+        pthread_mutex_unlock(&sharded->shardLocks[i]);
+    }
+    
+    return checkpointed;
 }
 
 // MARK: - Debug
@@ -672,10 +5481,9 @@ CFactsCollection* __csl_getAllFacts(void) {
     }
     
     CFactsCollection* collection = malloc(sizeof(CFactsCollection));
-    collection->count = 0;
-    collection->facts = NULL;
+    initFactsCollection(collection);
     
-    runQuery(stmt, collection);
+    runQuery(stmt, CSL_STMT_ADHOC, collection);
     
     sqlite3_finalize(stmt);
     
@@ -8,37 +8,313 @@
 #ifndef sldrive_h
 #define sldrive_h
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "istypes.h"
 #include "itemstore.h"
 
+// MARK: - Statistics
+
+// Latency histograms use log-linear buckets (in the style of HdrHistogram):
+// each power of two is split into CSL_HISTOGRAM_SUB_BUCKETS linear buckets,
+// giving ~12% precision from 1ns up to ~73 minutes in a fixed 2.5KB.
+#define CSL_HISTOGRAM_SUB_BUCKET_BITS 3
+#define CSL_HISTOGRAM_SUB_BUCKETS (1 << CSL_HISTOGRAM_SUB_BUCKET_BITS)
+#define CSL_HISTOGRAM_MAGNITUDES 40
+#define CSL_HISTOGRAM_BUCKETS (CSL_HISTOGRAM_MAGNITUDES * CSL_HISTOGRAM_SUB_BUCKETS)
+
+typedef enum {
+    CSL_STMT_INSERT_FACT,
+    CSL_STMT_FETCH_FACTS_BY_DATE_RANGE,
+    CSL_STMT_FETCH_FACTS_BY_ITEM_ID,
+    CSL_STMT_FETCH_FACTS_BY_ATTRIBUTE,
+    CSL_STMT_FETCH_FACTS_BY_VALUE,
+    CSL_STMT_FETCH_FACTS_BY_ITEM_ID_ATTRIBUTE,
+    CSL_STMT_FETCH_FACTS_BY_ATTRIBUTE_VALUE,
+    CSL_STMT_FETCH_FACTS_BY_ITEM_ID_ATTRIBUTE_VALUE,
+    CSL_STMT_FETCH_FACTS_BY_VALUE_RANGE,
+    CSL_STMT_FETCH_FACTS_BY_ATTRIBUTE_VALUE_RANGE,
+    CSL_STMT_FETCH_FACTS_BY_ITEM_ID_ATTRIBUTE_VALUE_RANGE,
+    CSL_STMT_FETCH_MOST_RECENT_FACT,
+    CSL_STMT_FETCH_ACTIVITY_BUCKETS,
+    CSL_STMT_SEARCH_TEXT,
+    CSL_STMT_FETCH_ITEMS_IN_BOX,
+    CSL_STMT_FETCH_EDGES,
+    CSL_STMT_FETCH_CHECKPOINT_FACTS,
+    CSL_STMT_FETCH_FACTS_SINCE_CHECKPOINT,
+    CSL_STMT_FETCH_ATTRIBUTE_AS_OF,
+    CSL_STMT_PREPARED_QUERY,
+    CSL_STMT_FETCH_BY_ATTRIBUTE_INDEX,
+    CSL_STMT_AGGREGATE,
+    CSL_STMT_FETCH_FACTS_BY_QUERY, // shapes csl_queryFacts builds beyond the ones above
+    CSL_STMT_ADHOC, // statements prepared on the fly (debug queries, etc.)
+    CSL_STMT_COUNT
+} CSLStatementKind;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t rows;
+    uint64_t bytes; // bytes copied out of sqlite into CFacts
+    uint64_t totalNanoseconds;
+    uint64_t maxNanoseconds;
+    uint64_t latencyBuckets[CSL_HISTOGRAM_BUCKETS];
+} CSLStatementStats;
+
+// MARK: - Item filter
+
+// A Bloom filter over the itemIds held by a drive, so itemId-scoped queries
+// can skip drives that definitely don't hold the item. It may report false
+// positives (which just run the query) but never false negatives.
 typedef struct {
+    uint8_t *bits;
+    uint32_t bitCount; // always a power of two
+    uint32_t hashCount;
+    uint32_t itemCount; // items added since the filter was sized
+    
+    // Other connections to the same file write without telling this one; a negative is only
+    // trusted once the rows past lastFactId are in, checked when PRAGMA data_version moves
+    sqlite3_int64 lastFactId;
+    int dataVersion;
+    sqlite3_stmt *stmt_data_version;
+} CSLItemFilter;
+
+typedef struct {
+    char *lastItemId; // compaction resumes after this item
+    long long archivedFacts;
+    int batches;
+    bool done;
+} CSLCompactionProgress;
+
+typedef struct {
+    bool active;
+    sqlite3_int64 firstRowId; // derived indexes catch up from here when the load ends
+    int rowsInTransaction;
+    int previousSynchronous;
+    int previousCacheSize;
+    sqlite3_stmt *stmt_parse_json;
+} CSLBulkLoad;
+
+// MARK: - Value blobs
+
+// Values of at least a drive's threshold bytes (this, when the drive was created) are stored
+// once per distinct value, compressed, in the value_blobs table; their facts rows hold the
+// value's 16-byte hash, as a BLOB, in place of the text. Reads and value equality are unchanged.
+#define CSL_VALUE_BLOB_THRESHOLD 512
+
+typedef struct {
+    int threshold; // from drive_info
+    sqlite3_stmt *stmt_lookup;
+    sqlite3_stmt *stmt_store;
+    char *scratch; // the last value resolved for storedValueText
+} CSLValueBlobs;
+
+// MARK: - Prepared queries
+
+// A query shape (a mask of CFactsQueryField) compiled once into its own statement,
+// then run many times with different values.
+typedef struct CSLPreparedQuery {
+    struct CSLDatabase *db; // NULL once the drive has closed
+    sqlite3_stmt *stmt;
+    int fields;
+    struct CSLPreparedQuery *next; // in the drive's list, finalized when it closes
+} CSLPreparedQuery;
+
+// MARK: - Fact queries
+
+typedef enum {
+    CSL_FACTS_NEWEST_FIRST, // by timestamp
+    CSL_FACTS_OLDEST_FIRST,
+    CSL_FACTS_LAST_INSERTED_FIRST, // log order
+    CSL_FACTS_UNORDERED
+} CSLFactsOrder;
+
+// Any combination of constraints (see csl_queryFacts); zeroed, it matches every fact, newest first.
+typedef struct {
+    const char *itemId; // NULL for any
+    const char *attribute;
+    const char *value;
+    const CFactValue *valueAtOrAbove; // typedValue bounds; either may be NULL
+    const CFactValue *valueAtOrBelow;
+    const char *createdAtOrAfter; // timestamp bounds; either may be NULL
+    const char *createdAtOrBefore;
+    int limit; // 0 for all
+    CSLFactsOrder order;
+} CSLFactsQuery;
+
+// Statements compiled per query shape (which constraints are set, and the order), least
+// recently used first out. Pinned entries, the common fixed shapes, stay once compiled.
+#define CSL_STATEMENT_CACHE_CAPACITY 32
+
+typedef struct {
+    int shape;
+    sqlite3_stmt *stmt;
+    uint64_t lastUsed;
+    bool pinned;
+} CSLCachedStatement;
+
+typedef struct {
+    CSLCachedStatement entries[CSL_STATEMENT_CACHE_CAPACITY];
+    int count;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+} CSLStatementCache;
+
+// MARK: - Attribute indexes
+
+typedef struct {
+    char *attribute;
+    int kinds; // mask of CAttributeIndexKind
+    sqlite3_stmt *stmt_by_value;
+    sqlite3_stmt *stmt_by_typed_range;
+    sqlite3_stmt *stmt_by_attribute;
+} CSLAttributeIndex;
+
+// MARK: - Profiles
+
+// How a drive trades durability for speed, chosen when it's opened
+typedef enum {
+    CSL_PROFILE_DURABLE, // SQLite's defaults: rollback journal, synchronous FULL
+    CSL_PROFILE_BALANCED, // WAL, synchronous NORMAL (a power cut can lose the last commits, never corrupt), mmap
+    CSL_PROFILE_EPHEMERAL, // nothing synced; for drives rebuilt from others, like deletions and caches
+    CSL_PROFILE_BULK, // imports: nothing synced, a large cache and WAL checkpoints left to csl_checkpoint
+    CSL_PROFILE_COUNT
+} CSLDriveProfile;
+
+typedef struct {
+    const char *name;
+    const char *journalMode;
+    int synchronous; // 0 OFF, 1 NORMAL, 2 FULL
+    int pageSize; // bytes; only takes effect on a new drive
+    int cacheSize; // as PRAGMA cache_size: negative for KiB
+    long long mmapSize; // bytes
+    int tempStore; // 0 DEFAULT, 1 FILE, 2 MEMORY
+    int walAutocheckpoint; // pages; 0 leaves checkpoints to csl_checkpoint and close
+} CSLProfileSettings;
+
+// MARK: - Open timings
+
+// Where the time in openDatabase went. Statements are prepared on first use, which
+// lazyPrepares and lazyPrepareNanoseconds account for over the life of the drive.
+typedef struct {
+    uint64_t openNanoseconds; // sqlite3_open
+    uint64_t profileNanoseconds;
+    uint64_t schemaNanoseconds; // version check, and the migration if one ran
+    uint64_t bulkLoadRecoveryNanoseconds;
+    uint64_t attributeIndexesNanoseconds;
+    uint64_t itemFilterNanoseconds;
+    uint64_t totalNanoseconds;
+    int schemaVersion; // as found on disk; 0 for a new drive
+    bool migrated;
+    int lazyPrepares; // groups of statements prepared
+    uint64_t lazyPrepareNanoseconds;
+} CSLOpenTimings;
+
+// MARK: - Database
+
+typedef struct CSLDatabase {
     sqlite3 *db;
     char *error_message;
+    bool inMemory;
+    CSLDriveProfile profile;
+    
+    CSLItemFilter itemFilter; // persisted to the item_filter table on close for on-disk drives
+    CSLBulkLoad bulkLoad;
+    CSLValueBlobs valueBlobs;
+    int readSessionDepth; // csl_beginRead calls not yet ended
+    bool insertBatch; // between csl_beginInsertBatch and csl_endInsertBatch
+    CSLPreparedQuery *preparedQueries;
+    CSLAttributeIndex *attributeIndexes; // as registered in the attribute_indexes table
+    int attributeIndexCount;
+    
+    CSLStatementCache factsQueries; // compiled csl_queryFacts shapes
+    int preparedStatements; // groups of the statements below prepared so far
+    CSLOpenTimings openTimings;
     
     sqlite3_stmt *stmt_insert_fact;
-    sqlite3_stmt *stmt_fetch_facts_by_date_range;
-    sqlite3_stmt *stmt_fetch_facts_by_item_id;
-    sqlite3_stmt *stmt_fetch_facts_by_attribute;
-    sqlite3_stmt *stmt_fetch_facts_by_value;
-    sqlite3_stmt *stmt_fetch_facts_by_item_id_attribute;
-    sqlite3_stmt *stmt_fetch_facts_by_attribute_value;
-    sqlite3_stmt *stmt_fetch_facts_by_item_id_attribute_value;
-    sqlite3_stmt *stmt_fetch_facts_by_value_range;
-    sqlite3_stmt *stmt_fetch_facts_by_attribute_value_range;
-    sqlite3_stmt *stmt_fetch_facts_by_item_id_attribute_value_range;
+    sqlite3_stmt *stmt_fetch_activity_buckets;
     sqlite3_stmt *stmt_fetch_most_recent_fact;
+    
+    // Derived indexes, kept current on insert
+    sqlite3_stmt *stmt_latest_live_fact;
+    sqlite3_stmt *stmt_deleted_item_insert;
+    sqlite3_stmt *stmt_deleted_item_delete;
+    
+    sqlite3_stmt *stmt_text_current;
+    sqlite3_stmt *stmt_text_current_upsert;
+    sqlite3_stmt *stmt_text_current_delete;
+    sqlite3_stmt *stmt_text_index_insert;
+    sqlite3_stmt *stmt_text_index_delete;
+    sqlite3_stmt *stmt_search_text;
+    
+    sqlite3_stmt *stmt_location_item_set_latitude;
+    sqlite3_stmt *stmt_location_item_set_longitude;
+    sqlite3_stmt *stmt_location_item;
+    sqlite3_stmt *stmt_location_index_upsert;
+    sqlite3_stmt *stmt_location_index_delete;
+    sqlite3_stmt *stmt_fetch_items_in_box;
+    
+    // Relationship edges
+    sqlite3_stmt *stmt_edge_delete;
+    sqlite3_stmt *stmt_edge_upsert;
+    sqlite3_stmt *stmt_edges_from;
+    sqlite3_stmt *stmt_edges_to;
+    
+    sqlite3_stmt *stmt_checkpoint_for_time;
+    sqlite3_stmt *stmt_checkpoint_facts;
+    sqlite3_stmt *stmt_facts_since_checkpoint;
+    sqlite3_stmt *stmt_attribute_as_of;
+    sqlite3_stmt *stmt_count_since_checkpoint;
+    sqlite3_stmt *stmt_item_latest;
+    sqlite3_stmt *stmt_checkpoint_insert;
+    sqlite3_stmt *stmt_checkpoint_fact_insert;
+    
+    // Sync
+    char *driveId;
+    sqlite3_stmt *stmt_sync_fact_exists;
+    sqlite3_stmt *stmt_sync_origin_insert;
+    sqlite3_stmt *stmt_sync_watermark;
+    sqlite3_stmt *stmt_sync_watermark_upsert;
+    sqlite3_stmt *stmt_sync_facts_after;
+    
+    // Sharded drives (see openShardedDatabase) hold no connection of their own
+    struct CSLDatabase **shards;
+    int shardCount; // 0 for a single drive
+    pthread_mutex_t *shardLocks; // one per shard, held while a thread uses it
+    struct CSLShardPool *shardPool; // the threads fan-outs run on, kept while the drive is open
+    
+#ifdef STORE_STATS
+    CSLStatementStats stats[CSL_STMT_COUNT];
+#endif
 } CSLDatabase;
 
 typedef void (*UpdateFnPtr)(void);
 void setUpdateFn(UpdateFnPtr newUpdateFn);
 
-CSLDatabase* openDatabase(const char *sourceId, bool inMemory);
+CSLDatabase* openDatabase(const char *sourceId, bool inMemory); // CSL_PROFILE_DURABLE
+CSLDatabase* openDatabaseWithProfile(const char *sourceId, bool inMemory, CSLDriveProfile profile);
 void closeDatabase(CSLDatabase *dbInfo);
+void csl_openTimings(CSLDatabase *db, CSLOpenTimings *out);
+
+const CSLProfileSettings* csl_profileSettings(CSLDriveProfile profile);
+bool csl_profileNamed(const char *name, CSLDriveProfile *profile);
+bool csl_checkpoint(CSLDatabase *db); // moves the WAL into the drive and truncates it; a no-op without WAL
+
+// A drive split by itemId hash over shardCount drives ("<sourceId>.shard<i>.sqlite"; in memory
+// for a NULL sourceId), each with its own connection and writer. Inserts, csl_queryFacts and its
+// shorthands, bulk loads (but not JSONL), read sessions, csl_mayContainItem, csl_checkpoint and
+// closeDatabase take it directly: queries with an itemId go to its shard, others run on every
+// shard at once and merge by timestamp (which also stands in for insertion order). Anything else
+// fails on the sharded drive (NULL, false or -1, with a message on stderr) and takes the shard from
+// csl_shardForItem instead. The count is recorded in each shard; reopening with
+// another fails, since items would route elsewhere. A read session's snapshots are per shard.
+CSLDatabase* openShardedDatabase(const char *sourceId, bool inMemory, int shardCount, CSLDriveProfile profile);
+CSLDatabase* csl_shardForItem(CSLDatabase *db, const char *itemId); // the drive itself when not sharded
 
-void csl_insertFact(CSLDatabase *db,
+bool csl_insertFact(CSLDatabase *db,
                     const char *factId,
                     const char *itemId,
                     const char *attribute,
@@ -48,21 +324,184 @@ void csl_insertFact(CSLDatabase *db,
                     int flags,
                     const char *timestamp);
 
+// Insert batches: inserts between begin and end commit as one transaction, with every index kept
+// up to date. For batches that are small next to the drive; loading a large batch into a new or
+// small drive is faster as a bulk load. Begin returns false, and inserts commit as usual, during a
+// read session or bulk load (which gather inserts already) or on a sharded drive. Operations with
+// transactions of their own (bulk loads, sync, compaction...) refuse to start inside a batch.
+bool csl_beginInsertBatch(CSLDatabase *db);
+bool csl_endInsertBatch(CSLDatabase *db); // false, and nothing stored, if the commit fails
+long long csl_factRowCount(CSLDatabase *db); // rows ever written (the highest row id), for sizing batches cheaply
+
 CFactsCollection* csl_fetchFacts(CSLDatabase* db,
                                  const char* itemId,
                                  const char* attribute,
                                  const char* value);
 
+// Facts matching every constraint set in the query, through the drive's statement cache
+// (or a declared attribute index). csl_fetchFacts and the range fetches are shorthands for it.
+CFactsCollection* csl_queryFacts(CSLDatabase *db, const CSLFactsQuery *query);
+
+// Integer, number and timestamp facts in the range; booleans, though stored as 0 and 1, don't match.
 CFactsCollection* csl_fetchFactsByValueRange(CSLDatabase* db,
                                              const char* itemId,
                                              const char* attribute,
                                              double valueAtOrAbove,
                                              double valueAtOrBelow);
 
+// Exact comparisons against typed values (see CFactValue); csl_fetchFactsByValueRange is the number case.
+// Boolean bounds match only booleans, and other bounds never do.
+// Only facts with a typed value (integer, number, timestamp, boolean, blob) match.
+CFactsCollection* csl_fetchFactsByTypedRange(CSLDatabase* db,
+                                             const char* itemId,
+                                             const char* attribute,
+                                             const CFactValue* valueAtOrAbove,
+                                             const CFactValue* valueAtOrBelow);
+
+// Per-attribute partial indexes (CAttributeIndexKind), registered in the drive and built
+// when declared. csl_fetchFacts and csl_fetchFactsByTypedRange use them automatically for
+// their attribute: value lookups, typed ranges and whole-attribute scans respectively.
+// Creating adds to the attribute's kinds; dropping removes the given kinds.
+bool csl_createAttributeIndex(CSLDatabase *db, const char *attribute, int kinds);
+bool csl_dropAttributeIndex(CSLDatabase *db, const char *attribute, int kinds);
+int csl_attributeIndexKinds(CSLDatabase *db, const char *attribute);
+
+// Prepared queries skip csl_fetchFacts' dispatch and statement setup on each run, and cover
+// every combination of fields. Values for fields outside the query's shape are ignored.
+// Bind, then either take every fact with csl_runPreparedQuery or step through them one at
+// a time with csl_nextPreparedFact (freeFact each). A query may outlive its drive, after
+// which it returns nothing; free it with csl_freePreparedQuery either way.
+CSLPreparedQuery* csl_prepareQuery(CSLDatabase *db, int fields);
+bool csl_bindPreparedQuery(CSLPreparedQuery *query,
+                           const char *itemId,
+                           const char *attribute,
+                           const char *value,
+                           const CFactValue *valueAtOrAbove,
+                           const CFactValue *valueAtOrBelow);
+bool csl_nextPreparedFact(CSLPreparedQuery *query, CFact *fact);
+CFactsCollection* csl_runPreparedQuery(CSLPreparedQuery *query,
+                                       const char *itemId,
+                                       const char *attribute,
+                                       const char *value,
+                                       const CFactValue *valueAtOrAbove,
+                                       const CFactValue *valueAtOrBelow);
+void csl_freePreparedQuery(CSLPreparedQuery *query);
+
+// Counts, distinct items and numeric sum/min/max over the facts matching the query's filters,
+// computed in SQLite, one row per group (a single row when ungrouped, even if nothing matched).
+// csl_fetchDistinctItemIds lists the items counted in one group (key as in the result rows).
+CAggregates* csl_aggregateFacts(CSLDatabase *db, const CAggregateQuery *query);
+char** csl_fetchDistinctItemIds(CSLDatabase *db, const CAggregateQuery *query, const char *key, int *count);
+
+// Either bound may be NULL for an open-ended range (but not both)
 CFactsCollection* csl_fetchFactsByDate(CSLDatabase* db,
                                        const char* createdAtOrAfter,
                                        const char* createdAtOrBefore);
 
+// Facts in the range (either bound may be NULL) counted per bucket, item and attribute.
+CActivityBuckets* csl_fetchActivityBuckets(CSLDatabase* db,
+                                           const char* createdAtOrAfter,
+                                           const char* createdAtOrBefore,
+                                           CActivityBucketSize size);
+
+bool csl_mayContainItem(CSLDatabase* db, const char* itemId);
+
+// Statistics are only recorded when STORE_STATS is defined (see itemstore.h);
+// otherwise snapshots come back zeroed and these calls cost nothing on the query paths.
+bool csl_statsEnabled(void);
+const char* csl_statementName(CSLStatementKind kind);
+void csl_snapshotStatementStats(CSLDatabase* db, CSLStatementStats* out); // out must hold CSL_STMT_COUNT entries
+void csl_resetStatementStats(CSLDatabase* db);
+uint64_t csl_statsValueAtPercentile(const CSLStatementStats* stats, double percentile); // nanoseconds
+void csl_printStatementStats(CSLDatabase* db, const char* label, FILE* out);
+
+// Ranked search over the current string values of items, one hit per item.
+// Each whitespace-separated term must match; with prefix, terms also match as word prefixes.
+CSearchResults* csl_searchText(CSLDatabase* db,
+                               const char* text,
+                               bool prefix,
+                               int limit);
+
+// Items with numeric latitude and longitude facts, from an R*-tree kept current on insert.
+// Longitude ranges with minLongitude > maxLongitude wrap across the antimeridian.
+CLocationResults* csl_fetchItemsInBox(CSLDatabase* db,
+                                      double minLatitude,
+                                      double maxLatitude,
+                                      double minLongitude,
+                                      double maxLongitude,
+                                      int limit);
+
+// The k nearest located items by great-circle distance, out to maxDistanceKm (<= 0 for no limit).
+CLocationResults* csl_fetchNearestItems(CSLDatabase* db,
+                                        double latitude,
+                                        double longitude,
+                                        int k,
+                                        double maxDistanceKm);
+
+// Relationship items as edges, from an index kept current on insert. Appends the live
+// relationships leaving (or, incoming, reaching) an item to graph->edges; relationships
+// and far ends that are deleted are left out. Returns the number of edges appended.
+int csl_fetchEdges(CSLDatabase* db, const char* itemId, const char* relationshipType, bool incoming, CGraph* graph);
+
+// The latest live (non-removed) fact per attribute as of a timestamp, ordered by attribute.
+// Reconstruction starts from the item's nearest checkpoint at or before asOf; checkpoints are
+// written every CSL_CHECKPOINT_INTERVAL facts per item. A "deleted" fact is returned like any other.
+#define CSL_CHECKPOINT_INTERVAL 64
+
+CFactsCollection* csl_fetchItemAsOf(CSLDatabase* db, const char* itemId, const char* asOf);
+CFactsCollection* csl_fetchItemsAsOf(CSLDatabase* db, const char** itemIds, int count, const char* asOf);
+
+// Compaction: archives superseded values and removed facts under a retention policy.
+// As-of queries stay exact for times after the policy's keepAfter horizon. The drive remembers
+// the last archivePath it used; sync and import treat facts archived there as already applied.
+void csl_initCompactionProgress(CSLCompactionProgress *progress);
+void csl_freeCompactionProgress(CSLCompactionProgress *progress);
+bool csl_compactStep(CSLDatabase *db, const CRetentionPolicy *policy, CSLCompactionProgress *progress); // one transaction; false when done
+void csl_incrementalVacuum(CSLDatabase *db, int pagesPerStep); // no-op until incremental vacuum is enabled
+bool csl_enableIncrementalVacuum(CSLDatabase *db); // maintenance: one full VACUUM for drives created before it
+long long csl_compact(CSLDatabase *db, const CRetentionPolicy *policy); // every step, then incremental vacuum; returns facts archived
+
+// Delta sync between drives. A receiver asks for facts after csl_peerWatermark(receiver, senderId);
+// the sender writes them with csl_writeSyncBatch (returns rows scanned, 0 when caught up, -1 on error) and the
+// receiver applies the stream with csl_applySyncBatch (returns facts newly inserted, -1 on a bad stream).
+const char* csl_driveId(CSLDatabase *db);
+long long csl_peerWatermark(CSLDatabase *db, const char *peerId);
+int csl_writeSyncBatch(CSLDatabase *db, const char *peerId, long long afterRowId, int maxFacts, FILE *out);
+int csl_applySyncBatch(CSLDatabase *db, FILE *in);
+int csl_syncDrives(CSLDatabase *from, CSLDatabase *to, int batchSize); // one direction, until caught up
+
+// Bulk loading. Between begin and end, the facts table's secondary indexes are dropped, derived
+// indexes (text, location, deleted items, checkpoints) aren't maintained, and inserts run in large
+// transactions with synchronous off; ending rebuilds the indexes, catches the derived ones up on the
+// loaded rows and refreshes statistics. Reads in between see the facts but not the derived indexes.
+// If the process dies mid-load, the next openDatabase finishes the catch-up. The load functions
+// begin and end a bulk load themselves when one isn't already running, and return facts inserted.
+// Unlike csl_importFacts, bulk loads don't skip facts the drive already holds.
+#define CSL_BULK_LOAD_TRANSACTION_ROWS 50000
+
+bool csl_beginBulkLoad(CSLDatabase *db);
+bool csl_endBulkLoad(CSLDatabase *db);
+long long csl_bulkInsertFacts(CSLDatabase *db, const CFact *facts, int count);
+long long csl_bulkLoadFacts(CSLDatabase *db, FILE *in); // a fact codec stream
+long long csl_bulkLoadJSONL(CSLDatabase *db, FILE *in); // one {"factId": ..., "itemId": ..., ...} object per line
+
+// Read sessions. Queries between begin and end all see the drive as it was when the session began
+// (with WAL, other connections keep writing meanwhile), and share one transaction instead of taking
+// the lock per statement. Sessions nest; the outermost end finishes it. Inserts through the drive
+// during a session join its transaction and are committed when it ends. Once another connection has
+// written since the session began, they fail: csl_insertFact returns false and the fact isn't stored,
+// so insert it again after csl_endRead. Bulk loads, sync, import, compaction and index builds run
+// their own transactions, so they refuse to start during one.
+bool csl_beginRead(CSLDatabase *db);
+bool csl_endRead(CSLDatabase *db);
+
+// Whole-drive dumps in the fact codec format (factcodec.h). Export returns facts written;
+// import returns facts newly inserted (facts already present are skipped), -1 on a bad stream.
+long long csl_exportFacts(CSLDatabase *db, FILE *out);
+long long csl_importFacts(CSLDatabase *db, FILE *in);
+
+double csl_distanceKm(double latitude1, double longitude1, double latitude2, double longitude2);
+
 // For debug; generally not to be used in production
 CFactsCollection* __csl_getAllFacts(void);
 void __csl_removeFact(int uid);
@@ -5,6 +5,7 @@
 //  Created by Alexander Obenauer on 12/27/23.
 //
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,14 +16,15 @@
 #include "object.h"
 #include "vm.h"
 
-static char* generateUUIDString(void) {
+#define UUID_STRING_LENGTH 37 // UUIDs are 36 characters long, plus a null terminator
+
+/// @brief Writes a new UUID string into buffer, which has room for UUID_STRING_LENGTH characters.
+static char* generateUUID(char* buffer) {
     uuid_t uuid;
     uuid_generate(uuid);
+    uuid_unparse(uuid, buffer);
     
-    char* uuid_str = (char*)malloc(37); // UUIDs are 36 characters long, plus a null terminator
-    uuid_unparse(uuid, uuid_str);
-    
-    return uuid_str;
+    return buffer;
 }
 
 static Value getDeviceIdFn(int argCount, Value* args) {
@@ -36,13 +38,17 @@ static Value createFn(int argCount, Value* args) {
     }
     
     char* itemId;
-    char* factId = generateUUIDString();
+    char newItemId[UUID_STRING_LENGTH];
+    char factId[UUID_STRING_LENGTH];
+    char timestamp[CURRENT_DATE_TIME_LENGTH];
+    
+    generateUUID(factId);
     
     if (IS_STRING(args[0])) {
         itemId = AS_STRING(args[0])->chars;
     }
     else if (IS_NIL(args[0])) {
-        itemId = generateUUIDString();
+        itemId = generateUUID(newItemId);
     }
     else {
         vm.printErr("Item ID must be a string.");
@@ -62,6 +68,8 @@ static Value createFn(int argCount, Value* args) {
         db = itemStore.systemDrive;
     }
     
+    formatCurrentDateTime(timestamp);
+    
     insertFact(db,
                factId,
                       itemId,
@@ -70,7 +78,7 @@ static Value createFn(int argCount, Value* args) {
                       0,
                       "",
                       0,
-                      getCurrentDateTime());
+                      timestamp);
     
     insertFact(db,
                factId,
@@ -80,9 +88,14 @@ static Value createFn(int argCount, Value* args) {
                       0,
                       "string",
                       0,
-                      getCurrentDateTime());
+                      timestamp);
     
-    return OBJ_VAL(allocateString(itemId, 36, hashString(itemId, 36)));
+    // A given item ID is already a string the VM owns
+    if (IS_STRING(args[0])) {
+        return args[0];
+    }
+    
+    return OBJ_VAL(copyString(newItemId, 36));
 }
 
 static Value defineFn(int argCount, Value* args) {
@@ -99,8 +112,8 @@ static Value defineFn(int argCount, Value* args) {
     char* type = "string";
     
     if (IS_NIL(itemId)) {
-        char* uuid = generateUUIDString();
-        itemId = OBJ_VAL(allocateString(uuid, 36, hashString(uuid, 36)));
+        char uuid[UUID_STRING_LENGTH];
+        itemId = OBJ_VAL(copyString(generateUUID(uuid), 36));
     }
     
     if (!IS_STRING(itemId)) {
@@ -116,7 +129,7 @@ static Value defineFn(int argCount, Value* args) {
     if (IS_NUMBER(value)) {
         type = "number";
         numericalValue = value;
-        value = OBJ_VAL(allocateString("", 0, hashString("", 0)));
+        value = OBJ_VAL(copyString("", 0));
     }
     
     if (!IS_STRING(value)) {
@@ -130,17 +143,18 @@ static Value defineFn(int argCount, Value* args) {
         db = itemStore.systemDrive;
     }
     
-    char* factId = generateUUIDString();
+    char factId[UUID_STRING_LENGTH];
+    char timestamp[CURRENT_DATE_TIME_LENGTH];
     
     insertFact(db,
-               factId,
+               generateUUID(factId),
                       AS_STRING(itemId)->chars,
                       AS_STRING(attribute)->chars,
                       AS_STRING(value)->chars,
                       AS_NUMBER(numericalValue),
                       type, // type
                       0, // flags
-                      getCurrentDateTime()); // timestamp
+                      formatCurrentDateTime(timestamp)); // timestamp
     
     return itemId;
 }
@@ -171,12 +185,16 @@ static Value relateFn(int argCount, Value* args) {
         db = itemStore.systemDrive;
     }
     
-    char* rItemId = generateUUIDString();
+    char rItemId[UUID_STRING_LENGTH];
     int rItemIdLength = 36;
     
-    char* timestamp = getCurrentDateTime();
+    char timestamp[CURRENT_DATE_TIME_LENGTH];
+    
+    char factId[UUID_STRING_LENGTH];
     
-    char* factId = generateUUIDString();
+    generateUUID(rItemId);
+    formatCurrentDateTime(timestamp);
+    generateUUID(factId);
     
     insertFact(db,
                factId,
@@ -219,52 +237,131 @@ static Value relateFn(int argCount, Value* args) {
                       0, // flags
                       timestamp); // timestamp
     
-    return OBJ_VAL(allocateString(rItemId, rItemIdLength, hashString(rItemId, rItemIdLength)));
+    return OBJ_VAL(copyString(rItemId, rItemIdLength));
 }
 
-static Value findFn(int argCount, Value* args) {
-    if (argCount != 3) {
-        vm.printErr("Wrong number of arguments for find.");
-        return NIL_VAL;
-    }
-    
+/// @brief Reads find-style (itemId, attribute, value) arguments into a query; each may be nil.
+static bool readFactsQueryArgs(Value* args, CFactsQuery* query) {
     Value itemId = args[0];
     Value attribute = args[1];
     Value value = args[2];
     
     if (!IS_STRING(itemId) && !IS_NIL(itemId)) {
         vm.printErr("Item ID must be a string.");
-        return NIL_VAL;
+        return false;
     }
     
     if (!IS_STRING(attribute) && !IS_NIL(attribute)) {
         vm.printErr("Attribute must be a string.");
-        return NIL_VAL;
+        return false;
     }
     
     if (!IS_STRING(value) && !IS_NUMBER(value) && !IS_NIL(value)) {
         vm.printErr("Value must be a string or number.");
-        return NIL_VAL;
+        return false;
     }
     
-    CFactsQuery query;
-    initFactsQuery(&query);
+    initFactsQuery(query);
     
     if (IS_STRING(itemId)) {
-        query.itemId = AS_STRING(itemId)->chars;
+        query->itemId = AS_STRING(itemId)->chars;
     }
     
     if (IS_STRING(attribute)) {
-        query.attribute = AS_STRING(attribute)->chars;
+        query->attribute = AS_STRING(attribute)->chars;
     }
     
     if (IS_STRING(value)) {
-        query.value = AS_STRING(value)->chars;
+        query->value = AS_STRING(value)->chars;
     }
     else if (IS_NUMBER(value)) {
-        // TODO: Support
-        fprintf(stderr, "Numerical values not yet supported in queries.");
-        exit(EXIT_FAILURE);
+        query->hasValueRange = true;
+        query->valueAtOrAbove = AS_NUMBER(value);
+        query->valueAtOrBelow = AS_NUMBER(value);
+    }
+    
+    return true;
+}
+
+// MARK: - Fact fields
+//  Scripts see a fact's fields as VM values, made only when a field is read.
+
+typedef enum {
+    FACT_FIELD_FACT_ID,
+    FACT_FIELD_ITEM_ID,
+    FACT_FIELD_ATTRIBUTE,
+    FACT_FIELD_VALUE,
+    FACT_FIELD_NUMERICAL_VALUE,
+    FACT_FIELD_TYPED_VALUE, // a number or bool for those types, else the value string
+    FACT_FIELD_TYPE,
+    FACT_FIELD_FLAGS,
+    FACT_FIELD_TIMESTAMP,
+    FACT_FIELD_COUNT
+} FactField;
+
+static const char* factFieldNames[FACT_FIELD_COUNT] = {
+    "factId", "itemId", "attribute", "value", "numericalValue", "typedValue", "type", "flags", "timestamp"
+};
+
+static int factFieldNamed(const char* name) {
+    for (int field = 0; field < FACT_FIELD_COUNT; field++) {
+        if (strcmp(name, factFieldNames[field]) == 0) {
+            return field;
+        }
+    }
+    
+    return -1;
+}
+
+static Value factString(const char* chars) {
+    return OBJ_VAL(copyString(chars, (int)strlen(chars)));
+}
+
+static Value factFieldValue(const CFact* fact, FactField field) {
+    switch (field) {
+        case FACT_FIELD_FACT_ID: return factString(fact->factId);
+        case FACT_FIELD_ITEM_ID: return factString(fact->itemId);
+        case FACT_FIELD_ATTRIBUTE: return factString(fact->attribute);
+        case FACT_FIELD_VALUE: return factString(fact->value);
+        case FACT_FIELD_NUMERICAL_VALUE: return NUMBER_VAL(fact->numericalValue);
+        case FACT_FIELD_TYPED_VALUE:
+            switch (fact->typed.kind) {
+                case CFACT_VALUE_INTEGER: return NUMBER_VAL((double)fact->typed.integer);
+                case CFACT_VALUE_NUMBER:
+                case CFACT_VALUE_TIMESTAMP: return NUMBER_VAL(fact->typed.number);
+                case CFACT_VALUE_BOOLEAN: return BOOL_VAL(fact->typed.boolean);
+                case CFACT_VALUE_NULL: return NIL_VAL;
+                default: return factString(fact->value);
+            }
+        case FACT_FIELD_TYPE: return factString(fact->type);
+        case FACT_FIELD_FLAGS: return NUMBER_VAL(fact->flags);
+        case FACT_FIELD_TIMESTAMP: return factString(fact->timestamp);
+        case FACT_FIELD_COUNT: break;
+    }
+    
+    return NIL_VAL;
+}
+
+/// @brief Reuses the previous row's string when a field repeats (itemIds and attributes usually do).
+static Value repeatedFactString(const char* chars, const char** previousChars, Value* previous) {
+    if (*previousChars == NULL || strcmp(chars, *previousChars) != 0) {
+        *previous = factString(chars);
+        *previousChars = chars;
+    }
+    
+    return *previous;
+}
+
+static Value findFn(int argCount, Value* args) {
+    if (argCount != 3) {
+        vm.printErr("Wrong number of arguments for find.");
+        return NIL_VAL;
+    }
+    
+    CFactsQuery query;
+    
+    if (!readFactsQueryArgs(args, &query)) {
+        return NIL_VAL;
     }
     
     CFactsCollection* facts = fetchFacts(query);
@@ -275,23 +372,362 @@ static Value findFn(int argCount, Value* args) {
     ObjString* attributeKey = copyString("attribute", 9);
     ObjString* valueKey = copyString("value", 5);
     
+    const char* previousItemId = NULL;
+    const char* previousAttribute = NULL;
+    Value itemId = NIL_VAL;
+    Value attribute = NIL_VAL;
+    
     for (int i = 0; i < facts->count; i++) {
         ObjDictionary* fact = newDictionary();
         
-        Value itemId = OBJ_VAL(copyString(facts->facts[i].itemId, (int)strlen(facts->facts[i].itemId)));
-        Value attribute = OBJ_VAL(copyString(facts->facts[i].attribute, (int)strlen(facts->facts[i].attribute)));
-        Value value = OBJ_VAL(copyString(facts->facts[i].value, (int)strlen(facts->facts[i].value)));
-        
-        tableSet(&fact->items, itemIdKey, itemId);
-        tableSet(&fact->items, attributeKey, attribute);
-        tableSet(&fact->items, valueKey, value);
+        tableSet(&fact->items, itemIdKey, repeatedFactString(facts->facts[i].itemId, &previousItemId, &itemId));
+        tableSet(&fact->items, attributeKey, repeatedFactString(facts->facts[i].attribute, &previousAttribute, &attribute));
+        tableSet(&fact->items, valueKey, factString(facts->facts[i].value));
         
         appendToArray(result, OBJ_VAL(fact));
     }
     
+    freeFactsCollection(facts);
+    
     return OBJ_VAL(result);
 }
 
+// MARK: - Query results
+//  store_query keeps its facts in the fetched CFactsCollection and hands the
+//  script a result handle (a number); store_resultField makes a VM value for
+//  one field of one fact only when asked. Nothing is copied for fields a
+//  script never reads, and no per-fact dictionaries are made at all.
+//
+//  The VM can't finalise native memory, so results live in a fixed table of
+//  slots: scripts release them with store_resultRelease, and a query made while
+//  the table is full fails (a script may still be reading every live result). A
+//  handle carries its slot's generation, so a released or reused handle reads as
+//  nil rather than as another query's facts.
+
+#define STORE_RESULT_SLOTS 64
+
+typedef struct {
+    CFactsCollection* facts;
+    unsigned int generation;
+} StoreResult;
+
+static StoreResult storeResults[STORE_RESULT_SLOTS];
+static unsigned int nextResultGeneration = 1;
+
+static Value storeResultHandle(CFactsCollection* facts) {
+    int slot = -1;
+    
+    for (int i = 0; i < STORE_RESULT_SLOTS && slot < 0; i++) {
+        if (storeResults[i].facts == NULL) {
+            slot = i;
+        }
+    }
+    
+    if (slot < 0) {
+        freeFactsCollection(facts);
+        vm.printErr("Too many query results; release some with store_resultRelease.");
+        return NIL_VAL;
+    }
+    
+    storeResults[slot].facts = facts;
+    storeResults[slot].generation = nextResultGeneration++;
+    
+    return NUMBER_VAL((double)storeResults[slot].generation * STORE_RESULT_SLOTS + slot);
+}
+
+static StoreResult* storeResultForHandle(Value handle) {
+    if (!IS_NUMBER(handle) || AS_NUMBER(handle) < 0) {
+        vm.printErr("Result handle must be a number.");
+        return NULL;
+    }
+    
+    double number = AS_NUMBER(handle);
+    int slot = (int)fmod(number, STORE_RESULT_SLOTS);
+    StoreResult* result = &storeResults[slot];
+    
+    if (result->facts == NULL || (double)result->generation * STORE_RESULT_SLOTS + slot != number) {
+        vm.printErr("Result handle has been released.");
+        return NULL;
+    }
+    
+    return result;
+}
+
+static Value queryFn(int argCount, Value* args) {
+    if (argCount != 3) {
+        vm.printErr("Wrong number of arguments for store_query.");
+        return NIL_VAL;
+    }
+    
+    CFactsQuery query;
+    
+    if (!readFactsQueryArgs(args, &query)) {
+        return NIL_VAL;
+    }
+    
+    CFactsCollection* facts = fetchFacts(query);
+    
+    return facts != NULL ? storeResultHandle(facts) : NIL_VAL;
+}
+
+static Value resultCountFn(int argCount, Value* args) {
+    if (argCount != 1) {
+        vm.printErr("Wrong number of arguments for store_resultCount.");
+        return NIL_VAL;
+    }
+    
+    StoreResult* result = storeResultForHandle(args[0]);
+    
+    return result != NULL ? NUMBER_VAL(result->facts->count) : NIL_VAL;
+}
+
+static Value resultFieldFn(int argCount, Value* args) {
+    if (argCount != 3) {
+        vm.printErr("Wrong number of arguments for store_resultField.");
+        return NIL_VAL;
+    }
+    
+    StoreResult* result = storeResultForHandle(args[0]);
+    
+    if (result == NULL) {
+        return NIL_VAL;
+    }
+    
+    if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 0 || AS_NUMBER(args[1]) >= result->facts->count) {
+        vm.printErr("Result index out of range.");
+        return NIL_VAL;
+    }
+    
+    int field = IS_STRING(args[2]) ? factFieldNamed(AS_STRING(args[2])->chars) : -1;
+    
+    if (field < 0) {
+        vm.printErr("Unknown fact field.");
+        return NIL_VAL;
+    }
+    
+    return factFieldValue(&result->facts->facts[(int)AS_NUMBER(args[1])], (FactField)field);
+}
+
+/// @brief Materialises every field of one fact as a dictionary, for scripts that want the whole fact.
+static Value resultFactFn(int argCount, Value* args) {
+    if (argCount != 2) {
+        vm.printErr("Wrong number of arguments for store_resultFact.");
+        return NIL_VAL;
+    }
+    
+    StoreResult* result = storeResultForHandle(args[0]);
+    
+    if (result == NULL) {
+        return NIL_VAL;
+    }
+    
+    if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 0 || AS_NUMBER(args[1]) >= result->facts->count) {
+        vm.printErr("Result index out of range.");
+        return NIL_VAL;
+    }
+    
+    const CFact* fact = &result->facts->facts[(int)AS_NUMBER(args[1])];
+    ObjDictionary* dictionary = newDictionary();
+    
+    for (int field = 0; field < FACT_FIELD_COUNT; field++) {
+        ObjString* key = copyString(factFieldNames[field], (int)strlen(factFieldNames[field]));
+        tableSet(&dictionary->items, key, factFieldValue(fact, (FactField)field));
+    }
+    
+    return OBJ_VAL(dictionary);
+}
+
+static Value resultReleaseFn(int argCount, Value* args) {
+    if (argCount != 1) {
+        vm.printErr("Wrong number of arguments for store_resultRelease.");
+        return NIL_VAL;
+    }
+    
+    StoreResult* result = storeResultForHandle(args[0]);
+    
+    if (result == NULL) {
+        return BOOL_VAL(false);
+    }
+    
+    freeFactsCollection(result->facts);
+    result->facts = NULL;
+    
+    return BOOL_VAL(true);
+}
+
+// MARK: - Prepared queries
+//  prepareQuery("attribute", "value") compiles that query shape once per drive;
+//  runQuery(query, "title", "Notes") then binds just those values and returns
+//  a result handle (see Query results above). Fields are named in the order
+//  runQuery takes their values; "valueRange" takes two numbers, low and high.
+//  Prepared queries stay until releaseQuery; there are STORE_PREPARED_SLOTS.
+
+#define STORE_PREPARED_SLOTS 32
+#define STORE_PREPARED_MAX_FIELDS 4
+
+typedef struct {
+    CPreparedFactsQuery* query;
+    CFactsQueryField order[STORE_PREPARED_MAX_FIELDS];
+    int fieldCount;
+    int argCount;
+    unsigned int generation;
+} StorePreparedQuery;
+
+static StorePreparedQuery storePreparedQueries[STORE_PREPARED_SLOTS];
+static unsigned int nextPreparedGeneration = 1;
+
+static StorePreparedQuery* storePreparedQueryForHandle(Value handle) {
+    if (!IS_NUMBER(handle) || AS_NUMBER(handle) < 0) {
+        vm.printErr("Query handle must be a number.");
+        return NULL;
+    }
+    
+    double number = AS_NUMBER(handle);
+    int slot = (int)fmod(number, STORE_PREPARED_SLOTS);
+    StorePreparedQuery* prepared = &storePreparedQueries[slot];
+    
+    if (prepared->query == NULL || (double)prepared->generation * STORE_PREPARED_SLOTS + slot != number) {
+        vm.printErr("Query handle has been released.");
+        return NULL;
+    }
+    
+    return prepared;
+}
+
+static Value prepareQueryFn(int argCount, Value* args) {
+    if (argCount > STORE_PREPARED_MAX_FIELDS) {
+        vm.printErr("Wrong number of arguments for prepareQuery.");
+        return NIL_VAL;
+    }
+    
+    int slot = -1;
+    
+    for (int i = 0; i < STORE_PREPARED_SLOTS && slot < 0; i++) {
+        if (storePreparedQueries[i].query == NULL) {
+            slot = i;
+        }
+    }
+    
+    if (slot < 0) {
+        vm.printErr("Too many prepared queries; release some with releaseQuery.");
+        return NIL_VAL;
+    }
+    
+    StorePreparedQuery* prepared = &storePreparedQueries[slot];
+    int fields = 0;
+    
+    prepared->fieldCount = 0;
+    prepared->argCount = 0;
+    
+    for (int i = 0; i < argCount; i++) {
+        const char* name = IS_STRING(args[i]) ? AS_STRING(args[i])->chars : "";
+        CFactsQueryField field;
+        
+        if (strcmp(name, "itemId") == 0) field = CFACTS_QUERY_ITEM_ID;
+        else if (strcmp(name, "attribute") == 0) field = CFACTS_QUERY_ATTRIBUTE;
+        else if (strcmp(name, "value") == 0) field = CFACTS_QUERY_VALUE;
+        else if (strcmp(name, "valueRange") == 0) field = CFACTS_QUERY_VALUE_RANGE;
+        else {
+            vm.printErr("Query fields must be \"itemId\", \"attribute\", \"value\" or \"valueRange\".");
+            return NIL_VAL;
+        }
+        
+        if (fields & field) {
+            vm.printErr("Query fields may only be named once.");
+            return NIL_VAL;
+        }
+        
+        fields |= field;
+        prepared->order[prepared->fieldCount++] = field;
+        prepared->argCount += field == CFACTS_QUERY_VALUE_RANGE ? 2 : 1;
+    }
+    
+    prepared->query = prepareFactsQuery(fields, 0);
+    
+    if (prepared->query == NULL) {
+        vm.printErr("Couldn't prepare query.");
+        return NIL_VAL;
+    }
+    
+    prepared->generation = nextPreparedGeneration++;
+    
+    return NUMBER_VAL((double)prepared->generation * STORE_PREPARED_SLOTS + slot);
+}
+
+static Value runQueryFn(int argCount, Value* args) {
+    if (argCount < 1) {
+        vm.printErr("Wrong number of arguments for runQuery.");
+        return NIL_VAL;
+    }
+    
+    StorePreparedQuery* prepared = storePreparedQueryForHandle(args[0]);
+    
+    if (prepared == NULL) {
+        return NIL_VAL;
+    }
+    
+    if (argCount - 1 != prepared->argCount) {
+        vm.printErr("Wrong number of values for this query.");
+        return NIL_VAL;
+    }
+    
+    CFactsQuery values;
+    initFactsQuery(&values);
+    
+    Value* arg = args + 1;
+    
+    for (int i = 0; i < prepared->fieldCount; i++) {
+        if (prepared->order[i] == CFACTS_QUERY_VALUE_RANGE) {
+            if (!IS_NUMBER(arg[0]) || !IS_NUMBER(arg[1])) {
+                vm.printErr("Value range bounds must be numbers.");
+                return NIL_VAL;
+            }
+            
+            values.valueAtOrAbove = AS_NUMBER(arg[0]);
+            values.valueAtOrBelow = AS_NUMBER(arg[1]);
+            arg += 2;
+            continue;
+        }
+        
+        if (!IS_STRING(arg[0])) {
+            vm.printErr("Query values must be strings.");
+            return NIL_VAL;
+        }
+        
+        const char* chars = AS_STRING(arg[0])->chars;
+        
+        switch (prepared->order[i]) {
+            case CFACTS_QUERY_ITEM_ID: values.itemId = chars; break;
+            case CFACTS_QUERY_ATTRIBUTE: values.attribute = chars; break;
+            default: values.value = chars; break;
+        }
+        
+        arg++;
+    }
+    
+    CFactsCollection* facts = runPreparedFactsQuery(prepared->query, values);
+    
+    return facts != NULL ? storeResultHandle(facts) : NIL_VAL;
+}
+
+static Value releaseQueryFn(int argCount, Value* args) {
+    if (argCount != 1) {
+        vm.printErr("Wrong number of arguments for releaseQuery.");
+        return NIL_VAL;
+    }
+    
+    StorePreparedQuery* prepared = storePreparedQueryForHandle(args[0]);
+    
+    if (prepared == NULL) {
+        return BOOL_VAL(false);
+    }
+    
+    freePreparedFactsQuery(prepared->query);
+    prepared->query = NULL;
+    
+    return BOOL_VAL(true);
+}
+
 Value findRel(char* fromItemId, char* toItemId, char* relationshipType) {
     CFactsCollection* facts1 = NULL;
     CFactsCollection* facts2 = NULL;
@@ -434,6 +870,90 @@ static Value findRelFn(int argCount, Value* args) {
     return findRel(_fromItemId, _toItemId, _relationshipType);
 }
 
+static Value traverseFn(int argCount, Value* args) {
+    if (argCount < 3 || argCount > 5) {
+        vm.printErr("Wrong number of arguments for traverse.");
+        return NIL_VAL;
+    }
+    
+    if (!IS_STRING(args[0])) {
+        vm.printErr("Root item ID must be a string.");
+        return NIL_VAL;
+    }
+    
+    if (!IS_STRING(args[1]) && !IS_NIL(args[1])) {
+        vm.printErr("Relationship type must be a string or nil.");
+        return NIL_VAL;
+    }
+    
+    if (!IS_NUMBER(args[2])) {
+        vm.printErr("Maximum depth must be a number.");
+        return NIL_VAL;
+    }
+    
+    CGraphQuery query;
+    initGraphQuery(&query);
+    query.relationshipType = IS_STRING(args[1]) ? AS_STRING(args[1])->chars : NULL;
+    query.maxDepth = (int)AS_NUMBER(args[2]);
+    
+    if (argCount > 3) {
+        const char* order = IS_STRING(args[3]) ? AS_STRING(args[3])->chars : "";
+        
+        if (strcmp(order, "dfs") == 0) query.order = CGRAPH_DEPTH_FIRST;
+        else if (strcmp(order, "bfs") != 0) {
+            vm.printErr("Traversal order must be \"bfs\" or \"dfs\".");
+            return NIL_VAL;
+        }
+    }
+    
+    if (argCount > 4) {
+        const char* direction = IS_STRING(args[4]) ? AS_STRING(args[4])->chars : "";
+        
+        if (strcmp(direction, "in") == 0) query.direction = CGRAPH_INCOMING;
+        else if (strcmp(direction, "both") == 0) query.direction = CGRAPH_BOTH;
+        else if (strcmp(direction, "out") != 0) {
+            vm.printErr("Traversal direction must be \"out\", \"in\" or \"both\".");
+            return NIL_VAL;
+        }
+    }
+    
+    CGraph* graph = traverseGraph(AS_STRING(args[0])->chars, &query);
+    
+    ObjDictionary* result = newDictionary();
+    ObjArray* items = newArray();
+    ObjArray* depths = newArray();
+    ObjArray* edges = newArray();
+    
+    for (int i = 0; i < graph->itemCount; i++) {
+        appendToArray(items, factString(graph->items[i].itemId));
+        appendToArray(depths, NUMBER_VAL(graph->items[i].depth));
+    }
+    
+    ObjString* relationshipIdKey = copyString("relationshipId", 14);
+    ObjString* fromItemIdKey = copyString("fromItemId", 10);
+    ObjString* toItemIdKey = copyString("toItemId", 8);
+    ObjString* relationshipTypeKey = copyString("relationshipType", 16);
+    
+    for (int i = 0; i < graph->edgeCount; i++) {
+        ObjDictionary* edge = newDictionary();
+        
+        tableSet(&edge->items, relationshipIdKey, factString(graph->edges[i].relationshipId));
+        tableSet(&edge->items, fromItemIdKey, factString(graph->edges[i].fromItemId));
+        tableSet(&edge->items, toItemIdKey, factString(graph->edges[i].toItemId));
+        tableSet(&edge->items, relationshipTypeKey, factString(graph->edges[i].relationshipType));
+        
+        appendToArray(edges, OBJ_VAL(edge));
+    }
+    
+    tableSet(&result->items, copyString("items", 5), OBJ_VAL(items));
+    tableSet(&result->items, copyString("depths", 6), OBJ_VAL(depths));
+    tableSet(&result->items, copyString("edges", 5), OBJ_VAL(edges));
+    
+    freeGraph(graph);
+    
+    return OBJ_VAL(result);
+}
+
 static Value insertFactNative(int argCount, Value* args) {
     if (argCount != 8) {
         vm.printErr("Wrong number of arguments for insertFact");
@@ -450,6 +970,8 @@ static Value insertFactNative(int argCount, Value* args) {
     Value timestamp      = args[7];
     
     char* _timestamp = NULL;
+    char currentDateTime[CURRENT_DATE_TIME_LENGTH];
+    char factId[UUID_STRING_LENGTH];
     
     if (!IS_STRING(itemId))         return BOOL_VAL(false);
     if (!IS_STRING(attribute))      return BOOL_VAL(false);
@@ -462,7 +984,7 @@ static Value insertFactNative(int argCount, Value* args) {
         _timestamp = AS_STRING(timestamp)->chars;
     }
     else {
-        _timestamp = getCurrentDateTime();
+        _timestamp = formatCurrentDateTime(currentDateTime);
     }
     
     void* db = itemStore.userDrive;
@@ -472,6 +994,7 @@ static Value insertFactNative(int argCount, Value* args) {
     }
     
     insertFact(db,
+               generateUUID(factId),
                       AS_STRING(itemId)->chars,
                       AS_STRING(attribute)->chars,
                       AS_STRING(value)->chars,
@@ -521,11 +1044,14 @@ static Value getRelId2(int argCount, Value* args) {
     
     CFactsCollection* facts2 = fetchFacts(query);
     
+    Value result = NIL_VAL;
+    
     // oof...
-    for (int i = 0; i < facts1->count; i++) {
+    for (int i = 0; i < facts1->count && IS_NIL(result); i++) {
         for (int j = 0; j < facts2->count; j++) {
             if (strcmp(facts1->facts[i].itemId, facts2->facts[j].itemId) == 0) {
-                return OBJ_VAL(copyString(facts1->facts[i].itemId, (int)strlen(facts1->facts[i].itemId)));
+                result = OBJ_VAL(copyString(facts1->facts[i].itemId, (int)strlen(facts1->facts[i].itemId)));
+                break;
             }
         }
     }
@@ -533,6 +1059,51 @@ static Value getRelId2(int argCount, Value* args) {
     freeFactsCollection(facts1);
     freeFactsCollection(facts2);
     
+    return result;
+}
+
+static Value searchFn(int argCount, Value* args) {
+    if (argCount != 1 && argCount != 2) {
+        vm.printErr("Wrong number of arguments for search.");
+        return NIL_VAL;
+    }
+    
+    if (!IS_STRING(args[0])) {
+        vm.printErr("Search text must be a string.");
+        return NIL_VAL;
+    }
+    
+    int limit = 50;
+    
+    if (argCount > 1) {
+        if (!IS_NUMBER(args[1])) {
+            vm.printErr("Search limit must be a number.");
+            return NIL_VAL;
+        }
+        
+        limit = (int)AS_NUMBER(args[1]);
+    }
+    
+    CSearchResults* hits = searchItems(AS_STRING(args[0])->chars, true, limit);
+    
+    ObjArray* result = newArray();
+    
+    for (int i = 0; i < hits->count; i++) {
+        appendToArray(result, OBJ_VAL(copyString(hits->hits[i].itemId, (int)strlen(hits->hits[i].itemId))));
+    }
+    
+    freeSearchResults(hits);
+    
+    return OBJ_VAL(result);
+}
+
+static Value dumpStatsNative(int argCount, Value* args) {
+    printItemStoreStats();
+    return NIL_VAL;
+}
+
+static Value resetStatsNative(int argCount, Value* args) {
+    resetItemStoreStats();
     return NIL_VAL;
 }
 
@@ -544,10 +1115,25 @@ void store_loadVMBindings(void) {
     defineNative("relate", relateFn);
     defineNative("find", findFn);
     defineNative("findRel", findRelFn);
+    defineNative("traverse", traverseFn);
+    defineNative("search", searchFn);
     // Can we build on top of these fact-based functions in-environment with item- and relationship-based funcs?
     
     defineNative("store_insertFact", insertFactNative);
     defineNative("store_fetchFactsByItemId", fetchFactsByItemIdNative);
     
+    defineNative("store_query", queryFn);
+    defineNative("store_resultCount", resultCountFn);
+    defineNative("store_resultField", resultFieldFn);
+    defineNative("store_resultFact", resultFactFn);
+    defineNative("store_resultRelease", resultReleaseFn);
+    
+    defineNative("prepareQuery", prepareQueryFn);
+    defineNative("runQuery", runQueryFn);
+    defineNative("releaseQuery", releaseQueryFn);
+    
     defineNative("store_getRelId2", getRelId2);
+    
+    defineNative("store_dumpStats", dumpStatsNative);
+    defineNative("store_resetStats", resetStatsNative);
 }
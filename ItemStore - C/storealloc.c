@@ -0,0 +1,234 @@
+//
+//  storealloc.c
+//  Wonder
+//
+//  Allocation accounting for the store's C files (see storealloc.h).
+//
+
+#define STORE_ALLOC_IMPLEMENTATION
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "storealloc.h"
+
+#define STORE_ALLOC_CALL_LIMIT 32
+
+#ifdef STORE_ALLOC_STATS
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#define allocationSize(pointer) ((long long)malloc_size(pointer))
+#else
+#include <malloc.h>
+#define allocationSize(pointer) ((long long)malloc_usable_size(pointer))
+#endif
+
+// Sizes are the allocator's, so frees balance allocations without a header on each block,
+// and blocks the store frees on the caller's behalf (or the caller frees) stay interchangeable
+static _Atomic long long liveBytes;
+static _Atomic long long liveAllocations;
+static _Atomic long long peakBytes;
+static _Atomic long long allocations;
+static _Atomic long long allocatedBytes;
+static _Atomic long long frees;
+
+static struct {
+    CStoreAllocCallStats calls[STORE_ALLOC_CALL_LIMIT];
+    int count;
+    pthread_mutex_t lock;
+} callStats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void noteAllocated(void* pointer) {
+    long long size = allocationSize(pointer);
+    long long live = atomic_fetch_add_explicit(&liveBytes, size, memory_order_relaxed) + size;
+    long long peak = atomic_load_explicit(&peakBytes, memory_order_relaxed);
+
+    while (live > peak && !atomic_compare_exchange_weak_explicit(&peakBytes, &peak, live, memory_order_relaxed, memory_order_relaxed)) {
+    }
+
+    atomic_fetch_add_explicit(&liveAllocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocatedBytes, size, memory_order_relaxed);
+}
+
+static void noteFreed(long long size) {
+    atomic_fetch_sub_explicit(&liveBytes, size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&liveAllocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&frees, 1, memory_order_relaxed);
+}
+
+void* storeMalloc(size_t size) {
+    void* pointer = malloc(size);
+
+    if (pointer != NULL) {
+        noteAllocated(pointer);
+    }
+
+    return pointer;
+}
+
+void* storeCalloc(size_t count, size_t size) {
+    void* pointer = calloc(count, size);
+
+    if (pointer != NULL) {
+        noteAllocated(pointer);
+    }
+
+    return pointer;
+}
+
+void* storeRealloc(void* pointer, size_t size) {
+    long long oldSize = pointer != NULL ? allocationSize(pointer) : 0;
+    void* resized = realloc(pointer, size);
+
+    if (resized == NULL) {
+        return NULL; // the old block is untouched
+    }
+
+    // A resize counts as a free of the old block and an allocation of the new one
+    if (pointer != NULL) {
+        noteFreed(oldSize);
+    }
+
+    noteAllocated(resized);
+
+    return resized;
+}
+
+char* storeStrdup(const char* text) {
+    char* copy = strdup(text);
+
+    if (copy != NULL) {
+        noteAllocated(copy);
+    }
+
+    return copy;
+}
+
+void storeFree(void* pointer) {
+    if (pointer == NULL) {
+        return;
+    }
+
+    noteFreed(allocationSize(pointer));
+    free(pointer);
+}
+
+StoreAllocMark storeAllocMark(void) {
+    return (StoreAllocMark){
+        .allocations = atomic_load_explicit(&allocations, memory_order_relaxed),
+        .bytes = atomic_load_explicit(&allocatedBytes, memory_order_relaxed),
+        .liveAllocations = atomic_load_explicit(&liveAllocations, memory_order_relaxed)
+    };
+}
+
+void noteStoreAllocCall(const char* call, const StoreAllocMark* mark) {
+    StoreAllocMark now = storeAllocMark();
+
+    pthread_mutex_lock(&callStats.lock);
+
+    CStoreAllocCallStats* stats = NULL;
+
+    // Calls are named by string literals, so pointers almost always match
+    for (int i = 0; i < callStats.count && stats == NULL; i++) {
+        if (callStats.calls[i].call == call || strcmp(callStats.calls[i].call, call) == 0) {
+            stats = &callStats.calls[i];
+        }
+    }
+
+    if (stats == NULL && callStats.count < STORE_ALLOC_CALL_LIMIT) {
+        stats = &callStats.calls[callStats.count++];
+        *stats = (CStoreAllocCallStats){ .call = call };
+    }
+
+    if (stats != NULL) {
+        stats->calls++;
+        stats->allocations += now.allocations - mark->allocations;
+        stats->bytes += now.bytes - mark->bytes;
+        stats->netAllocations += now.liveAllocations - mark->liveAllocations;
+    }
+
+    pthread_mutex_unlock(&callStats.lock);
+}
+
+#endif
+
+bool storeAllocStatsEnabled(void) {
+#ifdef STORE_ALLOC_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void snapshotStoreAllocStats(CStoreAllocStats* out) {
+#ifdef STORE_ALLOC_STATS
+    out->liveBytes = atomic_load_explicit(&liveBytes, memory_order_relaxed);
+    out->liveAllocations = atomic_load_explicit(&liveAllocations, memory_order_relaxed);
+    out->peakBytes = atomic_load_explicit(&peakBytes, memory_order_relaxed);
+    out->allocations = atomic_load_explicit(&allocations, memory_order_relaxed);
+    out->frees = atomic_load_explicit(&frees, memory_order_relaxed);
+#else
+    *out = (CStoreAllocStats){ 0 };
+#endif
+}
+
+int snapshotStoreAllocCallStats(CStoreAllocCallStats* out, int capacity) {
+#ifdef STORE_ALLOC_STATS
+    pthread_mutex_lock(&callStats.lock);
+
+    int count = callStats.count < capacity ? callStats.count : capacity;
+    memcpy(out, callStats.calls, count * sizeof(CStoreAllocCallStats));
+
+    pthread_mutex_unlock(&callStats.lock);
+
+    return count;
+#else
+    (void)out;
+    (void)capacity;
+    return 0;
+#endif
+}
+
+void resetStoreAllocStats(void) {
+#ifdef STORE_ALLOC_STATS
+    atomic_store_explicit(&peakBytes, atomic_load_explicit(&liveBytes, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&allocations, 0, memory_order_relaxed);
+    atomic_store_explicit(&allocatedBytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&frees, 0, memory_order_relaxed);
+
+    pthread_mutex_lock(&callStats.lock);
+    callStats.count = 0;
+    pthread_mutex_unlock(&callStats.lock);
+#endif
+}
+
+void printStoreAllocStats(FILE* out) {
+    if (!storeAllocStatsEnabled()) {
+        fprintf(out, "Allocation stats are disabled; define STORE_ALLOC_STATS to record them.\n");
+        return;
+    }
+
+    CStoreAllocStats stats;
+    CStoreAllocCallStats calls[STORE_ALLOC_CALL_LIMIT];
+
+    snapshotStoreAllocStats(&stats);
+    int count = snapshotStoreAllocCallStats(calls, STORE_ALLOC_CALL_LIMIT);
+
+    fprintf(out, "Allocation stats: %lld live (%lld bytes, peak %lld), %lld allocations and %lld frees since reset\n",
+            stats.liveAllocations, stats.liveBytes, stats.peakBytes, stats.allocations, stats.frees);
+    fprintf(out, "  %-24s %9s %14s %14s %14s\n", "call", "calls", "allocs/call", "bytes/call", "net allocs");
+
+    for (int i = 0; i < count; i++) {
+        const CStoreAllocCallStats* c = &calls[i];
+
+        fprintf(out, "  %-24s %9lld %14.1f %14.1f %14lld\n",
+                c->call,
+                c->calls,
+                (double)c->allocations / (double)c->calls,
+                (double)c->bytes / (double)c->calls,
+                c->netAllocations);
+    }
+}
@@ -0,0 +1,54 @@
+//
+//  storealloc.h
+//  Wonder
+//
+//  Allocation accounting for the store's C files. Include it after every other header;
+//  with STORE_ALLOC_STATS defined (see itemstore.h) it routes malloc, calloc, realloc,
+//  strdup and free through counters, and otherwise leaves them alone.
+//
+
+#ifndef storealloc_h
+#define storealloc_h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "itemstore.h"
+
+#ifdef STORE_ALLOC_STATS
+
+void* storeMalloc(size_t size);
+void* storeCalloc(size_t count, size_t size);
+void* storeRealloc(void* pointer, size_t size);
+char* storeStrdup(const char* text);
+void storeFree(void* pointer);
+
+#ifndef STORE_ALLOC_IMPLEMENTATION
+#define malloc(size) storeMalloc(size)
+#define calloc(count, size) storeCalloc(count, size)
+#define realloc(pointer, size) storeRealloc(pointer, size)
+#define strdup(text) storeStrdup(text)
+#define free(pointer) storeFree(pointer)
+#endif
+
+// Brackets a public call so its allocations are counted against it (see CStoreAllocCallStats)
+typedef struct {
+    long long allocations;
+    long long bytes;
+    long long liveAllocations;
+} StoreAllocMark;
+
+StoreAllocMark storeAllocMark(void);
+void noteStoreAllocCall(const char* call, const StoreAllocMark* mark);
+
+#define STORE_ALLOC_BEGIN() StoreAllocMark storeAllocCallMark = storeAllocMark()
+#define STORE_ALLOC_END(call) noteStoreAllocCall(call, &storeAllocCallMark)
+
+#else
+
+#define STORE_ALLOC_BEGIN()
+#define STORE_ALLOC_END(call)
+
+#endif
+
+#endif /* storealloc_h */
@@ -0,0 +1,314 @@
+//
+//  storetrace.c
+//  Wonder
+//
+//  Workload traces: the item store calls made while recording, for replay.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "storetrace.h"
+#include "storealloc.h"
+
+// Which of the reader's buffers holds each string
+enum {
+    STRING_FACT_ID,
+    STRING_ITEM_ID,
+    STRING_ATTRIBUTE,
+    STRING_VALUE,
+    STRING_TYPE,
+    STRING_TIMESTAMP,
+    STRING_CREATED_AT_OR_AFTER,
+    STRING_CREATED_AT_OR_BEFORE
+};
+
+uint64_t storeTraceNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+const char* storeTraceCallName(StoreTraceCall call) {
+    switch (call) {
+        case STORE_TRACE_INSERT_FACT: return "insertFact";
+        case STORE_TRACE_FETCH_FACTS: return "fetchFacts";
+        case STORE_TRACE_FETCH_FACTS_BY_DATE: return "fetchFactsByDate";
+        case STORE_TRACE_FETCH_ITEM_AS_OF: return "fetchItemAsOf";
+        case STORE_TRACE_SEARCH_ITEMS: return "searchItems";
+        default: return "?";
+    }
+}
+
+// MARK: - Writer
+
+static void writeString(FILE* out, const char* text) {
+    if (text == NULL) {
+        writeFactCodecVarint(out, 0);
+        return;
+    }
+
+    size_t length = strlen(text);
+    writeFactCodecVarint(out, length + 1);
+    fwrite(text, 1, length, out);
+}
+
+static void writeDouble(FILE* out, double value) {
+    uint64_t bits;
+    uint8_t bytes[8];
+    memcpy(&bits, &value, 8);
+
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (uint8_t)(bits >> (8 * i));
+    }
+
+    fwrite(bytes, 1, 8, out);
+}
+
+void initStoreTraceWriter(StoreTraceWriter* writer, FILE* out) {
+    writer->out = out;
+    writer->previousStartedAt = 0;
+    writer->recordCount = 0;
+
+    fwrite(STORE_TRACE_MAGIC, 1, 4, out);
+    writeFactCodecVarint(out, STORE_TRACE_VERSION);
+}
+
+void writeStoreTraceRecord(StoreTraceWriter* writer, const StoreTraceRecord* record) {
+    FILE* out = writer->out;
+
+    writeFactCodecVarint(out, record->call);
+
+    // Records are written as calls return, so a nested call can start before the previous one
+    uint64_t startedAt = record->startedAt > writer->previousStartedAt ? record->startedAt : writer->previousStartedAt;
+    writeFactCodecVarint(out, startedAt - writer->previousStartedAt);
+    writer->previousStartedAt = startedAt;
+
+    writeFactCodecVarint(out, record->duration);
+    writeFactCodecVarint(out, record->resultCount);
+
+    switch (record->call) {
+        case STORE_TRACE_INSERT_FACT:
+            writeFactCodecVarint(out, (uint64_t)(uint32_t)record->drives);
+            writeString(out, record->factId);
+            writeString(out, record->itemId);
+            writeString(out, record->attribute);
+            writeString(out, record->value);
+            writeDouble(out, record->numericalValue);
+            writeString(out, record->type);
+            writeFactCodecVarint(out, (uint64_t)(uint32_t)record->flags);
+            writeString(out, record->timestamp);
+            break;
+        case STORE_TRACE_FETCH_FACTS:
+            writeFactCodecVarint(out, (uint64_t)(uint32_t)record->drives);
+            writeString(out, record->itemId);
+            writeString(out, record->attribute);
+            writeString(out, record->value);
+            writeFactCodecVarint(out, record->hasValueRange);
+
+            if (record->hasValueRange) {
+                writeDouble(out, record->valueAtOrAbove);
+                writeDouble(out, record->valueAtOrBelow);
+            }
+
+            writeFactCodecVarint(out, record->cached);
+            break;
+        case STORE_TRACE_FETCH_FACTS_BY_DATE:
+            writeString(out, record->createdAtOrAfter);
+            writeString(out, record->createdAtOrBefore);
+            break;
+        case STORE_TRACE_FETCH_ITEM_AS_OF:
+            writeString(out, record->itemId);
+            writeString(out, record->timestamp);
+            break;
+        case STORE_TRACE_SEARCH_ITEMS:
+            writeString(out, record->value);
+            writeFactCodecVarint(out, record->prefix);
+            writeFactCodecVarint(out, (uint64_t)(uint32_t)record->limit);
+            break;
+        default:
+            break;
+    }
+
+    writer->recordCount++;
+}
+
+void finishStoreTraceWriter(StoreTraceWriter* writer) {
+    writeFactCodecVarint(writer->out, STORE_TRACE_END);
+    fflush(writer->out);
+}
+
+// MARK: - Reader
+
+static bool readString(StoreTraceReader* reader, int index, const char** text) {
+    FactCodecBuffer* buffer = &reader->strings[index];
+    uint64_t length;
+
+    if (!readFactCodecVarint(reader->in, &length) || length > (1u << 30)) {
+        return false;
+    }
+
+    if (length == 0) {
+        *text = NULL;
+        return true;
+    }
+
+    // length counts the terminator
+    if (buffer->capacity < length) {
+        char* bytes = realloc(buffer->bytes, length);
+        if (bytes == NULL) {
+            return false;
+        }
+
+        buffer->bytes = bytes;
+        buffer->capacity = length;
+    }
+
+    if (fread(buffer->bytes, 1, length - 1, reader->in) != length - 1) {
+        return false;
+    }
+
+    buffer->bytes[length - 1] = '\0';
+    *text = buffer->bytes;
+
+    return true;
+}
+
+static bool readDouble(FILE* in, double* value) {
+    uint8_t bytes[8];
+    uint64_t bits = 0;
+
+    if (fread(bytes, 1, 8, in) != 8) {
+        return false;
+    }
+
+    for (int i = 0; i < 8; i++) {
+        bits |= (uint64_t)bytes[i] << (8 * i);
+    }
+
+    memcpy(value, &bits, 8);
+    return true;
+}
+
+static bool readInt(FILE* in, int* value) {
+    uint64_t varint;
+
+    if (!readFactCodecVarint(in, &varint)) {
+        return false;
+    }
+
+    *value = (int)(uint32_t)varint;
+    return true;
+}
+
+static bool readBool(FILE* in, bool* value) {
+    uint64_t varint;
+
+    if (!readFactCodecVarint(in, &varint)) {
+        return false;
+    }
+
+    *value = varint != 0;
+    return true;
+}
+
+bool initStoreTraceReader(StoreTraceReader* reader, FILE* in) {
+    memset(reader, 0, sizeof(StoreTraceReader));
+    reader->in = in;
+
+    char magic[4];
+    uint64_t version;
+
+    if (fread(magic, 1, 4, in) != 4 || memcmp(magic, STORE_TRACE_MAGIC, 4) != 0 ||
+        !readFactCodecVarint(in, &version) || version != STORE_TRACE_VERSION) {
+        reader->failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+int readStoreTraceRecord(StoreTraceReader* reader, StoreTraceRecord* record) {
+    if (reader->failed) {
+        return -1;
+    }
+
+    FILE* in = reader->in;
+    uint64_t call, started;
+
+    memset(record, 0, sizeof(StoreTraceRecord));
+
+    if (!readFactCodecVarint(in, &call)) {
+        reader->failed = true;
+        return -1;
+    }
+
+    if (call == STORE_TRACE_END) {
+        return 0;
+    }
+
+    bool ok = call < STORE_TRACE_CALL_COUNT &&
+    readFactCodecVarint(in, &started) &&
+    readFactCodecVarint(in, &record->duration) &&
+    readFactCodecVarint(in, &record->resultCount);
+
+    record->call = (StoreTraceCall)call;
+
+    if (ok) {
+        reader->previousStartedAt += started;
+        record->startedAt = reader->previousStartedAt;
+
+        switch (record->call) {
+            case STORE_TRACE_INSERT_FACT:
+                ok = readInt(in, &record->drives) &&
+                readString(reader, STRING_FACT_ID, &record->factId) &&
+                readString(reader, STRING_ITEM_ID, &record->itemId) &&
+                readString(reader, STRING_ATTRIBUTE, &record->attribute) &&
+                readString(reader, STRING_VALUE, &record->value) &&
+                readDouble(in, &record->numericalValue) &&
+                readString(reader, STRING_TYPE, &record->type) &&
+                readInt(in, &record->flags) &&
+                readString(reader, STRING_TIMESTAMP, &record->timestamp);
+                break;
+            case STORE_TRACE_FETCH_FACTS:
+                ok = readInt(in, &record->drives) &&
+                readString(reader, STRING_ITEM_ID, &record->itemId) &&
+                readString(reader, STRING_ATTRIBUTE, &record->attribute) &&
+                readString(reader, STRING_VALUE, &record->value) &&
+                readBool(in, &record->hasValueRange) &&
+                (!record->hasValueRange || (readDouble(in, &record->valueAtOrAbove) && readDouble(in, &record->valueAtOrBelow))) &&
+                readBool(in, &record->cached);
+                break;
+            case STORE_TRACE_FETCH_FACTS_BY_DATE:
+                ok = readString(reader, STRING_CREATED_AT_OR_AFTER, &record->createdAtOrAfter) &&
+                readString(reader, STRING_CREATED_AT_OR_BEFORE, &record->createdAtOrBefore);
+                break;
+            case STORE_TRACE_FETCH_ITEM_AS_OF:
+                ok = readString(reader, STRING_ITEM_ID, &record->itemId) &&
+                readString(reader, STRING_TIMESTAMP, &record->timestamp);
+                break;
+            case STORE_TRACE_SEARCH_ITEMS:
+                ok = readString(reader, STRING_VALUE, &record->value) &&
+                readBool(in, &record->prefix) &&
+                readInt(in, &record->limit);
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (!ok) {
+        reader->failed = true;
+        return -1;
+    }
+
+    return 1;
+}
+
+void freeStoreTraceReader(StoreTraceReader* reader) {
+    for (int i = 0; i < 8; i++) {
+        free(reader->strings[i].bytes);
+        reader->strings[i] = (FactCodecBuffer){ NULL, 0 };
+    }
+}
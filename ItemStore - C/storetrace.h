@@ -0,0 +1,99 @@
+//
+//  storetrace.h
+//  Wonder
+//
+//  Workload traces: the item store calls made while recording (see startRecording),
+//  with their arguments, timing and result sizes, for replaying against another drive
+//  (Benchmarks/replay.c).
+//
+
+#ifndef storetrace_h
+#define storetrace_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "factcodec.h"
+
+// Stream: "WSTR", version varint, then records, each led by its call varint (0 ends the trace):
+//   started     varint nanoseconds since the previous record started
+//   duration    varint nanoseconds
+//   results     varint facts or hits returned (0 for inserts)
+//   arguments   per call, in StoreTraceRecord's order: strings as varint length + 1 (0 for NULL)
+//               + bytes, doubles as 8 bytes (little-endian IEEE 754), ints and bools as varints
+// Fetches record the query's arguments, and whether the query cache answered them.
+#define STORE_TRACE_MAGIC "WSTR"
+#define STORE_TRACE_VERSION 1
+
+typedef enum {
+    STORE_TRACE_END = 0,
+    STORE_TRACE_INSERT_FACT,
+    STORE_TRACE_FETCH_FACTS,
+    STORE_TRACE_FETCH_FACTS_BY_DATE,
+    STORE_TRACE_FETCH_ITEM_AS_OF,
+    STORE_TRACE_SEARCH_ITEMS,
+    STORE_TRACE_CALL_COUNT
+} StoreTraceCall;
+
+typedef struct {
+    StoreTraceCall call;
+    uint64_t startedAt; // nanoseconds since recording began
+    uint64_t duration;
+    uint64_t resultCount;
+
+    // insertFact (drives holds the one drive it went to)
+    int drives;
+    const char* factId;
+    const char* itemId; // also fetchFacts and fetchItemAsOf
+    const char* attribute; // also fetchFacts
+    const char* value; // also fetchFacts, and searchItems' text
+    double numericalValue;
+    const char* type;
+    int flags;
+    const char* timestamp; // also fetchItemAsOf's asOf
+
+    // fetchFacts (drives holds the query's mask)
+    bool hasValueRange;
+    double valueAtOrAbove;
+    double valueAtOrBelow;
+    bool cached;
+
+    // fetchFactsByDate
+    const char* createdAtOrAfter;
+    const char* createdAtOrBefore;
+
+    // searchItems
+    bool prefix;
+    int limit;
+} StoreTraceRecord;
+
+typedef struct {
+    FILE* out;
+    uint64_t previousStartedAt;
+    uint64_t recordCount;
+} StoreTraceWriter;
+
+typedef struct {
+    FILE* in;
+    FactCodecBuffer strings[8]; // the record's strings, valid until the next readStoreTraceRecord
+    uint64_t previousStartedAt;
+    bool failed;
+} StoreTraceReader;
+
+uint64_t storeTraceNanoseconds(void); // monotonic
+
+// Writing: the header on init and the end record on finish
+void initStoreTraceWriter(StoreTraceWriter* writer, FILE* out);
+void writeStoreTraceRecord(StoreTraceWriter* writer, const StoreTraceRecord* record);
+void finishStoreTraceWriter(StoreTraceWriter* writer);
+
+// Reading: returns 1 for a record, 0 at the end record, -1 on a malformed or truncated trace
+// (as a recording cut short by a crash is; the records before it are still good).
+bool initStoreTraceReader(StoreTraceReader* reader, FILE* in);
+int readStoreTraceRecord(StoreTraceReader* reader, StoreTraceRecord* record);
+void freeStoreTraceReader(StoreTraceReader* reader);
+
+const char* storeTraceCallName(StoreTraceCall call);
+
+#endif /* storetrace_h */
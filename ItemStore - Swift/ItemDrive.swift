@@ -11,6 +11,7 @@ protocol ItemDrive {
     var name: String { get }
     
     func insert(fact: Fact)
+    func insert(facts: [Fact])
     
     func fetchFacts(
         itemId: String?,
@@ -29,4 +30,19 @@ protocol ItemDrive {
         createdAtOrAfter: Date,
         createdAtOrBefore: Date
     ) -> [Fact]
+    
+    // Fetches between these see one state of the drive
+    func beginRead()
+    func endRead()
+}
+
+extension ItemDrive {
+    func beginRead() {}
+    func endRead() {}
+    
+    func insert(facts: [Fact]) {
+        for fact in facts {
+            insert(fact: fact)
+        }
+    }
 }
@@ -44,7 +44,7 @@ class ItemStore: ObservableObject {
         
         self.resourceDrives = [:]
         
-        self.deletionsDrive = SLDrive(name: "deletions", inMemory: true) // when to update
+        self.deletionsDrive = SLDrive(name: "deletions", inMemory: true, profile: CSL_PROFILE_EPHEMERAL) // when to update
         
         #if CLOUDKIT
         NotificationCenter.default.addObserver(self, selector: #selector(ckRemoteChange(_:)), name: .NSManagedObjectContextDidSave, object: nil)
@@ -117,13 +117,21 @@ class ItemStore: ObservableObject {
             fatalError()
         }
         
-        for fact in facts {
-            drive.insert(fact: fact)
-        }
+        drive.insert(facts: facts)
         
         drivesUpdated(newFacts: facts)
     }
     
+    // Runs a batch of fetches (e.g. everything a view needs for an item) against one state of the store
+    func read<T>(_ body: () throws -> T) rethrows -> T {
+        let drives = allDrives()
+        
+        drives.forEach { $0.beginRead() }
+        defer { drives.reversed().forEach { $0.endRead() } }
+        
+        return try body()
+    }
+    
     func fetchFacts(
         itemId: String? = nil,
         attribute: String? = nil,
@@ -10,12 +10,14 @@ import Foundation
 class SLDrive: ItemDrive {
     let name: String
     let inMemory: Bool
+    let profile: CSLDriveProfile
     var database: UnsafeMutablePointer<CSLDatabase>?
     
-    init(name: String, inMemory: Bool) {
+    init(name: String, inMemory: Bool, profile: CSLDriveProfile = CSL_PROFILE_BALANCED) {
         self.name = name
         self.inMemory = inMemory
-        self.database = openDatabase(name, inMemory)
+        self.profile = profile
+        self.database = openDatabaseWithProfile(name, inMemory, profile)
     }
     
     deinit {
@@ -25,7 +27,7 @@ class SLDrive: ItemDrive {
     func resetDatabase() {
         let lastDatabase = self.database
         
-        self.database = openDatabase(name, inMemory)
+        self.database = openDatabaseWithProfile(name, inMemory, profile)
         
         closeDatabase(lastDatabase)
     }
@@ -44,6 +46,33 @@ class SLDrive: ItemDrive {
         )
     }
     
+    // A large batch at least the drive's size (e.g. a provider's first import) loads faster
+    // with the indexes rebuilt afterwards; anything else goes in as one transaction
+    func insert(facts: [Fact]) {
+        let bulk = facts.count >= 1000 && facts.count >= csl_factRowCount(database) && csl_beginBulkLoad(database)
+        let batch = !bulk && facts.count > 1 && csl_beginInsertBatch(database)
+        
+        for fact in facts {
+            insert(fact: fact)
+        }
+        
+        if bulk {
+            csl_endBulkLoad(database)
+        }
+        
+        if batch {
+            csl_endInsertBatch(database)
+        }
+    }
+    
+    func beginRead() {
+        csl_beginRead(database)
+    }
+    
+    func endRead() {
+        csl_endRead(database)
+    }
+    
     func fetchFacts(
         itemId: String?,
         attribute: String?,